@@ -0,0 +1,1236 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+/* Block device frontend. Serves a disk image with simulated bad sectors over
+ * the NBD protocol, either to NBD clients on a TCP or unix socket or straight
+ * to a kernel /dev/nbd device, so guests and storage stacks get a real block
+ * device without a file system and loop device in between. The bad sectors
+ * behave exactly as through the FUSE frontend, both use libbadsector */
+
+/* For accept4() */
+#define _GNU_SOURCE
+
+#include "badsector.h"
+#include "event_log.h"
+#include "sector_list.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_LINUX_NBD_H
+#include <linux/nbd.h>
+#endif
+
+/* Handshake, from the NBD protocol document. Only the fixed newstyle
+ * handshake is spoken */
+#define HANDSHAKE_MAGIC         0x4e42444d41474943ULL   /* "NBDMAGIC" */
+#define OPTION_MAGIC            0x49484156454f5054ULL   /* "IHAVEOPT" */
+#define OPTION_REPLY_MAGIC      0x0003e889045565a9ULL
+#define HANDSHAKE_FIXED_NEWSTYLE    (1 << 0)
+#define HANDSHAKE_NO_ZEROES         (1 << 1)
+
+#define OPTION_EXPORT_NAME  1
+#define OPTION_ABORT        2
+#define OPTION_LIST         3
+#define OPTION_INFO         6
+#define OPTION_GO           7
+
+#define REPLY_ACK           1
+#define REPLY_SERVER        2
+#define REPLY_INFO          3
+#define REPLY_ERROR_UNSUPPORTED (0x80000000 | 1)
+#define REPLY_ERROR_INVALID     (0x80000000 | 3)
+#define REPLY_ERROR_UNKNOWN     (0x80000000 | 6)
+
+#define INFO_EXPORT         0
+#define INFO_BLOCK_SIZE     3
+
+/* Transmission */
+#define REQUEST_MAGIC       0x25609513
+#define SIMPLE_REPLY_MAGIC  0x67446698
+
+#define TRANSMISSION_HAS_FLAGS      (1 << 0)
+#define TRANSMISSION_SEND_FLUSH     (1 << 2)
+#define TRANSMISSION_SEND_FUA       (1 << 3)
+#define TRANSMISSION_CAN_MULTI_CONN (1 << 8)
+
+#define COMMAND_READ        0
+#define COMMAND_WRITE       1
+#define COMMAND_DISCONNECT  2
+#define COMMAND_FLUSH       3
+#define COMMAND_FLAG_FUA    (1 << 0)
+
+/* Largest request served, the limit the protocol asks clients to stay
+ * within */
+#define MAX_REQUEST_SIZE (32 * 1024 * 1024)
+
+/* Largest option a client may send during the handshake */
+#define MAX_OPTION_SIZE 4096
+
+/* Default NBD port */
+#define DEFAULT_LISTEN ":10809"
+
+/* Request header, as sent on the wire in network byte order */
+struct request_header {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+/* Simple reply header, followed by the data for a successful read */
+struct reply_header {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__((packed));
+
+/* Connection to a client. The kernel device gets one per socket pair it was
+ * given */
+struct connection {
+    int fd;
+    int negotiate;          /* Nonzero to start with the handshake, zero
+                             * for the kernel, which skips it */
+    pthread_t thread;
+    int done;               /* Set by the thread once it has finished */
+    char *buffer;           /* Data of the current request */
+    size_t capacity;
+};
+
+/* Command-line arguments */
+static struct {
+    const char *disk_image;
+    const char *bad_sector_list;
+    const char *bad_sector_file;
+    const char *reserve_sectors;
+    const char *disk_size;
+    const char *sector_size;
+    const char *physical_sector_size;
+    const char *journal;
+    const char *trace;
+    const char *export_name;
+    const char *listen;
+    const char *device;
+    const char *connections;
+    const char *log_destination;
+    const char *log_rate;
+} options;
+
+static struct badsector faults;     /* Bad sectors of the disk */
+static int image_fd = -1;           /* File descriptor to the image file */
+static size_t disk_size;            /* Size of the disk in bytes */
+static size_t sector_size = 512;
+static size_t physical_sector_size;
+static const char *export_name;     /* Name of the disk clients ask for */
+static const uint16_t transmission_flags = TRANSMISSION_HAS_FLAGS |
+        TRANSMISSION_SEND_FLUSH | TRANSMISSION_SEND_FUA |
+        TRANSMISSION_CAN_MULTI_CONN;
+
+/* Connections being served */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct connection **connections = NULL;
+static size_t connection_count = 0;
+
+static pthread_t main_thread;
+
+/* Read exactly size bytes from a socket */
+/* Returns 0 on success and nonzero on error or end of file */
+static int read_full(int fd, void *data, size_t size)
+{
+    char *cursor = data;
+
+    while (size > 0)
+    {
+        ssize_t ret = read(fd, cursor, size);
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret <= 0)
+            return -1;
+        cursor += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/* Write exactly size bytes to a socket */
+/* Returns 0 on success and nonzero on error */
+static int write_full(int fd, const void *data, size_t size)
+{
+    const char *cursor = data;
+
+    while (size > 0)
+    {
+        ssize_t ret = send(fd, cursor, size, MSG_NOSIGNAL);
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret <= 0)
+            return -1;
+        cursor += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/* Make sure the buffer of a connection holds at least size bytes */
+/* Returns 0 on success and nonzero on allocation failure */
+static int reserve_buffer(struct connection *connection, size_t size)
+{
+    if (size <= connection->capacity)
+        return 0;
+
+    char *resized = realloc(connection->buffer, size);
+    if (NULL == resized)
+        return -1;
+
+    connection->buffer = resized;
+    connection->capacity = size;
+    return 0;
+}
+
+/* Queue an event about a request for the event log */
+static void log_request_event(enum event_kind kind, enum event_op op,
+        off_t offset, size_t size, off_t sector, uint64_t sector_count,
+        int error, uint64_t start)
+{
+    struct event event;
+
+    memset(&event, 0, sizeof(struct event));
+    event.kind = kind;
+    event.op = op;
+    event.offset = offset;
+    event.size = size;
+    event.sector = sector;
+    event.sector_count = sector_count;
+    event.error = error;
+    event.latency = event_clock() - start;
+    event.disk = export_name;
+
+    event_log_record(&event);
+}
+
+/* Check a request against the bad sectors and log what happened. A block
+ * device can't return part of a request, so a read is failed as a whole */
+/* Returns 0 if the request may be passed through to the image and nonzero if
+ * it has to fail with an I/O error */
+static int check_request(enum event_op op, size_t size, off_t offset,
+        uint64_t start)
+{
+    struct badsector_result result;
+    enum badsector_verdict verdict = badsector_check(&faults,
+            EVENT_OP_WRITE == op ? STATS_OP_WRITE : STATS_OP_READ, offset,
+            &size, &result);
+
+    if (0 != result.reallocated)
+        log_request_event(EVENT_REALLOCATED, op, offset, size,
+                result.reallocated_sector, result.reallocated, 0, start);
+
+    if (BADSECTOR_PASS == verdict)
+        return 0;
+
+    log_request_event(EVENT_IO_ERROR, op, offset, size, result.bad_sector,
+            faults.sectors_per_physical, EIO, start);
+    return -1;
+}
+
+/* Send a reply to an option during the handshake */
+/* Returns 0 on success and nonzero on error */
+static int send_option_reply(int fd, uint32_t option, uint32_t type,
+        const void *data, uint32_t length)
+{
+    struct {
+        uint64_t magic;
+        uint32_t option;
+        uint32_t type;
+        uint32_t length;
+    } __attribute__((packed)) header = {
+        htobe64(OPTION_REPLY_MAGIC), htobe32(option), htobe32(type),
+        htobe32(length)
+    };
+
+    if (0 != write_full(fd, &header, sizeof(header)))
+        return -1;
+    return 0 == length ? 0 : write_full(fd, data, length);
+}
+
+/* Answer NBD_OPT_INFO and NBD_OPT_GO, which name the export and list the
+ * information the client wants */
+/* Returns 0 on success, 1 if the client asked for an export that doesn't
+ * exist or sent a malformed option, and -1 on error */
+static int send_info(int fd, uint32_t option, const char *data,
+        uint32_t length)
+{
+    uint32_t name_length;
+    uint16_t request_count;
+
+    if (length < sizeof(uint32_t) + sizeof(uint16_t))
+        goto invalid;
+    memcpy(&name_length, data, sizeof(uint32_t));
+    name_length = be32toh(name_length);
+    if (name_length > length - sizeof(uint32_t) - sizeof(uint16_t))
+        goto invalid;
+
+    const char *name = data + sizeof(uint32_t);
+    memcpy(&request_count, name + name_length, sizeof(uint16_t));
+    request_count = be16toh(request_count);
+    if (length != sizeof(uint32_t) + name_length + sizeof(uint16_t) +
+            request_count * sizeof(uint16_t))
+        goto invalid;
+
+    /* An empty name asks for the default export */
+    if (0 != name_length && (strlen(export_name) != name_length ||
+            0 != memcmp(name, export_name, name_length)))
+    {
+        if (0 != send_option_reply(fd, option, REPLY_ERROR_UNKNOWN, NULL, 0))
+            return -1;
+        return 1;
+    }
+
+    struct {
+        uint16_t type;
+        uint64_t size;
+        uint16_t flags;
+    } __attribute__((packed)) export_info = {
+        htobe16(INFO_EXPORT), htobe64(disk_size), htobe16(transmission_flags)
+    };
+    if (0 != send_option_reply(fd, option, REPLY_INFO, &export_info,
+            sizeof(export_info)))
+        return -1;
+
+    /* Any alignment works, but physical sectors go bad as a whole */
+    struct {
+        uint16_t type;
+        uint32_t minimum;
+        uint32_t preferred;
+        uint32_t maximum;
+    } __attribute__((packed)) block_size_info = {
+        htobe16(INFO_BLOCK_SIZE), htobe32(1), htobe32(physical_sector_size),
+        htobe32(MAX_REQUEST_SIZE)
+    };
+    if (0 != send_option_reply(fd, option, REPLY_INFO, &block_size_info,
+            sizeof(block_size_info)))
+        return -1;
+
+    return 0 == send_option_reply(fd, option, REPLY_ACK, NULL, 0) ? 0 : -1;
+
+invalid:
+    if (0 != send_option_reply(fd, option, REPLY_ERROR_INVALID, NULL, 0))
+        return -1;
+    return 1;
+}
+
+/* Take a client through the fixed newstyle handshake up to the transmission
+ * phase */
+/* Returns 0 once the client has picked the export and nonzero if it gave up
+ * or the connection failed */
+static int negotiate(struct connection *connection)
+{
+    int fd = connection->fd;
+    struct {
+        uint64_t magic;
+        uint64_t option_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting = {
+        htobe64(HANDSHAKE_MAGIC), htobe64(OPTION_MAGIC),
+        htobe16(HANDSHAKE_FIXED_NEWSTYLE | HANDSHAKE_NO_ZEROES)
+    };
+    uint32_t client_flags;
+    char data[MAX_OPTION_SIZE];
+
+    if (0 != write_full(fd, &greeting, sizeof(greeting)) ||
+            0 != read_full(fd, &client_flags, sizeof(client_flags)))
+        return -1;
+
+    client_flags = be32toh(client_flags);
+    if (0 != (client_flags &
+            ~(uint32_t)(HANDSHAKE_FIXED_NEWSTYLE | HANDSHAKE_NO_ZEROES)))
+        return -1;
+
+    for (;;)
+    {
+        struct {
+            uint64_t magic;
+            uint32_t option;
+            uint32_t length;
+        } __attribute__((packed)) header;
+
+        if (0 != read_full(fd, &header, sizeof(header)) ||
+                OPTION_MAGIC != be64toh(header.magic))
+            return -1;
+
+        uint32_t option = be32toh(header.option);
+        uint32_t length = be32toh(header.length);
+        if (length > sizeof(data) || 0 != read_full(fd, data, length))
+            return -1;
+
+        switch (option)
+        {
+        case OPTION_EXPORT_NAME:
+        {
+            /* There is no way to refuse the name here but to hang up */
+            if (0 != length && (strlen(export_name) != length ||
+                    0 != memcmp(data, export_name, length)))
+                return -1;
+
+            struct {
+                uint64_t size;
+                uint16_t flags;
+                char zeroes[124];
+            } __attribute__((packed)) reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.size = htobe64(disk_size);
+            reply.flags = htobe16(transmission_flags);
+            return write_full(fd, &reply, client_flags & HANDSHAKE_NO_ZEROES
+                    ? sizeof(reply) - sizeof(reply.zeroes) : sizeof(reply));
+        }
+
+        case OPTION_ABORT:
+            send_option_reply(fd, option, REPLY_ACK, NULL, 0);
+            return -1;
+
+        case OPTION_LIST:
+        {
+            uint32_t name_length = strlen(export_name);
+            uint32_t wire_length = htobe32(name_length);
+            char server[sizeof(uint32_t) + MAX_OPTION_SIZE];
+
+            if (0 != length)
+            {
+                if (0 != send_option_reply(fd, option, REPLY_ERROR_INVALID,
+                        NULL, 0))
+                    return -1;
+                break;
+            }
+
+            memcpy(server, &wire_length, sizeof(uint32_t));
+            memcpy(server + sizeof(uint32_t), export_name, name_length);
+            if (0 != send_option_reply(fd, option, REPLY_SERVER, server,
+                    sizeof(uint32_t) + name_length) ||
+                    0 != send_option_reply(fd, option, REPLY_ACK, NULL, 0))
+                return -1;
+            break;
+        }
+
+        case OPTION_INFO:
+        case OPTION_GO:
+        {
+            int ret = send_info(fd, option, data, length);
+            if (ret < 0)
+                return -1;
+            if (0 == ret && OPTION_GO == option)
+                return 0;
+            break;
+        }
+
+        default:
+            if (0 != send_option_reply(fd, option, REPLY_ERROR_UNSUPPORTED,
+                    NULL, 0))
+                return -1;
+        }
+    }
+}
+
+/* Read the data of a request from the image into the buffer of a
+ * connection. error is set to the errno value to fail the request with, or
+ * 0 */
+static void serve_read(struct connection *connection, size_t size,
+        off_t offset, uint64_t start, int *error)
+{
+    if (0 != check_request(EVENT_OP_READ, size, offset, start))
+    {
+        *error = EIO;
+        return;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t ret = pread(image_fd, connection->buffer + done, size - done,
+                offset + done);
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret < 0)
+        {
+            *error = EIO;
+            return;
+        }
+
+        /* Past the end of a file smaller than the disk reads as zeroes */
+        if (0 == ret)
+        {
+            memset(connection->buffer + done, 0, size - done);
+            break;
+        }
+        done += ret;
+    }
+}
+
+/* Write the data of a request from the buffer of a connection to the image.
+ * error is set to the errno value to fail the request with, or 0 */
+static void serve_write(struct connection *connection, size_t size,
+        off_t offset, int fua, uint64_t start, int *error)
+{
+    if (0 != check_request(EVENT_OP_WRITE, size, offset, start))
+    {
+        *error = EIO;
+        return;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t ret = pwrite(image_fd, connection->buffer + done, size - done,
+                offset + done);
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret <= 0)
+        {
+            *error = ret < 0 && ENOSPC == errno ? ENOSPC : EIO;
+            return;
+        }
+        done += ret;
+    }
+
+    if (fua && 0 != fdatasync(image_fd))
+        *error = EIO;
+}
+
+/* Serve the requests of a connection in the transmission phase until the
+ * client disconnects. Errors are sent back as Linux errno values, which the
+ * protocol shares for the few it defines */
+static void serve(struct connection *connection)
+{
+    int fd = connection->fd;
+
+    for (;;)
+    {
+        struct request_header request;
+        struct reply_header reply;
+        int error = 0;
+
+        if (0 != read_full(fd, &request, sizeof(request)) ||
+                REQUEST_MAGIC != be32toh(request.magic))
+            return;
+
+        uint64_t start = event_clock();
+        uint16_t type = be16toh(request.type);
+        uint16_t flags = be16toh(request.flags);
+        uint64_t offset = be64toh(request.offset);
+        size_t size = be32toh(request.length);
+        int in_range = offset <= disk_size && size <= disk_size - offset;
+
+        if (COMMAND_DISCONNECT == type)
+            return;
+
+        /* The data of a write has to be read even if it is refused, or the
+         * stream gets out of step */
+        if ((COMMAND_READ == type || COMMAND_WRITE == type) &&
+                (size > MAX_REQUEST_SIZE || 0 != reserve_buffer(connection,
+                size)))
+            return;
+
+        switch (type)
+        {
+        case COMMAND_READ:
+            if (!in_range)
+                error = EINVAL;
+            else
+                serve_read(connection, size, offset, start, &error);
+            stats_record(&faults.stats, STATS_OP_READ, error ? 0 : size,
+                    event_clock() - start, error);
+            break;
+
+        case COMMAND_WRITE:
+            if (0 != read_full(fd, connection->buffer, size))
+                return;
+            if (!in_range)
+                error = ENOSPC;
+            else
+                serve_write(connection, size, offset,
+                        flags & COMMAND_FLAG_FUA, start, &error);
+            stats_record(&faults.stats, STATS_OP_WRITE, error ? 0 : size,
+                    event_clock() - start, error);
+            break;
+
+        case COMMAND_FLUSH:
+            if (0 != fdatasync(image_fd))
+                error = EIO;
+            break;
+
+        default:
+            error = EINVAL;
+        }
+
+        reply.magic = htobe32(SIMPLE_REPLY_MAGIC);
+        reply.error = htobe32(error);
+        reply.handle = request.handle;
+
+        if (0 != write_full(fd, &reply, sizeof(reply)))
+            return;
+        if (COMMAND_READ == type && 0 == error &&
+                0 != write_full(fd, connection->buffer, size))
+            return;
+    }
+}
+
+/* Thread serving one connection */
+static void *connection_main(void *data)
+{
+    struct connection *connection = data;
+
+    if (!connection->negotiate || 0 == negotiate(connection))
+        serve(connection);
+
+    /* Let the other end see the hang-up now, the descriptor is only closed
+     * once the thread has been joined */
+    shutdown(connection->fd, SHUT_RDWR);
+    __atomic_store_n(&connection->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Start a thread serving a client on fd, which the connection takes over */
+/* Returns 0 on success and nonzero on error */
+static int add_connection(int fd, int negotiate)
+{
+    struct connection *connection = calloc(1, sizeof(struct connection));
+    if (NULL == connection)
+    {
+        close(fd);
+        return -1;
+    }
+    connection->fd = fd;
+    connection->negotiate = negotiate;
+
+    pthread_mutex_lock(&connections_lock);
+
+    /* Reap connections that have finished */
+    size_t kept = 0;
+    for (size_t i = 0; i < connection_count; i++)
+    {
+        struct connection *old = connections[i];
+        if (__atomic_load_n(&old->done, __ATOMIC_ACQUIRE))
+        {
+            pthread_join(old->thread, NULL);
+            close(old->fd);
+            free(old->buffer);
+            free(old);
+        }
+        else
+            connections[kept++] = old;
+    }
+    connection_count = kept;
+
+    struct connection **resized = realloc(connections,
+            (connection_count + 1) * sizeof(struct connection *));
+    if (NULL == resized ||
+            0 != pthread_create(&connection->thread, NULL, connection_main,
+            connection))
+    {
+        if (NULL != resized)
+            connections = resized;
+        pthread_mutex_unlock(&connections_lock);
+        close(fd);
+        free(connection);
+        return -1;
+    }
+    connections = resized;
+    connections[connection_count++] = connection;
+
+    pthread_mutex_unlock(&connections_lock);
+    return 0;
+}
+
+/* Hang up on every client and wait for their threads */
+static void close_connections(void)
+{
+    pthread_mutex_lock(&connections_lock);
+    for (size_t i = 0; i < connection_count; i++)
+        shutdown(connections[i]->fd, SHUT_RDWR);
+    for (size_t i = 0; i < connection_count; i++)
+    {
+        pthread_join(connections[i]->thread, NULL);
+        close(connections[i]->fd);
+        free(connections[i]->buffer);
+        free(connections[i]);
+    }
+    free(connections);
+    connections = NULL;
+    connection_count = 0;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/* Open a listening socket on a unix socket path, or on [HOST]:PORT */
+/* Returns the socket, or -1 on error */
+static int open_listener(const char *address)
+{
+    int fd;
+
+    if ('/' == address[0] || '.' == address[0])
+    {
+        struct sockaddr_un local;
+
+        if (strlen(address) >= sizeof(local.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, address);
+
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (-1 == fd)
+            return -1;
+        if (0 != bind(fd, (struct sockaddr *)&local, sizeof(local)) ||
+                0 != listen(fd, 16))
+        {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    const char *colon = strrchr(address, ':');
+    if (NULL == colon)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char host[256];
+    size_t host_length = colon - address;
+    if (host_length >= sizeof(host))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+
+    /* Allow [::1]:PORT for IPv6 addresses */
+    char *name = host;
+    if ('[' == host[0] && host_length > 1 && ']' == host[host_length - 1])
+    {
+        host[host_length - 1] = '\0';
+        name++;
+    }
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int ret = getaddrinfo('\0' == *name ? NULL : name, colon + 1, &hints,
+            &addresses);
+    if (0 != ret)
+    {
+        fprintf(stderr, "Failed to resolve %s: %s\n", address,
+                gai_strerror(ret));
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = -1;
+    for (struct addrinfo *ai = addresses; NULL != ai; ai = ai->ai_next)
+    {
+        int one = 1;
+
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                ai->ai_protocol);
+        if (-1 == fd)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (0 == bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+                0 == listen(fd, 16))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+
+    return fd;
+}
+
+/* Thread accepting clients until the listening socket is shut down */
+static void *accept_main(void *data)
+{
+    int listener = *(int *)data;
+
+    for (;;)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (-1 == fd)
+        {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            break;
+        }
+
+        /* Requests and replies are small, don't hold them back */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        add_connection(fd, 1);
+    }
+
+    pthread_kill(main_thread, SIGTERM);
+    return NULL;
+}
+
+#ifdef HAVE_LINUX_NBD_H
+/* Thread handing the kernel device its sockets until it disconnects */
+static void *device_main(void *data)
+{
+    ioctl(*(int *)data, NBD_DO_IT);
+    pthread_kill(main_thread, SIGTERM);
+    return NULL;
+}
+
+/* Attach the disk to a kernel NBD device, with one socket pair per
+ * connection so that the kernel sends requests down several queues */
+/* Returns the device, or -1 on error */
+static int open_device(const char *path, unsigned int count)
+{
+    int device = open(path, O_RDWR | O_CLOEXEC);
+    if (-1 == device)
+        return -1;
+
+    ioctl(device, NBD_CLEAR_SOCK);
+    if (0 != ioctl(device, NBD_SET_BLKSIZE, (unsigned long)sector_size) ||
+            0 != ioctl(device, NBD_SET_SIZE_BLOCKS,
+            (unsigned long)(disk_size / sector_size)) ||
+            0 != ioctl(device, NBD_SET_FLAGS,
+            (unsigned long)transmission_flags))
+        goto fail;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        int pair[2];
+
+        if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair))
+            goto fail;
+        if (0 != ioctl(device, NBD_SET_SOCK, (unsigned long)pair[0]))
+        {
+            int error = errno;
+            close(pair[0]);
+            close(pair[1]);
+            errno = error;
+            goto fail;
+        }
+
+        /* The kernel holds its own reference to its end */
+        close(pair[0]);
+        if (0 != add_connection(pair[1], 0))
+            goto fail;
+    }
+
+    return device;
+
+fail:
+    {
+        int error = errno;
+        ioctl(device, NBD_CLEAR_SOCK);
+        close(device);
+        errno = error;
+    }
+    return -1;
+}
+#endif
+
+/* Open the image and set up the bad sectors from the options */
+/* Returns 0 on success and nonzero on error */
+static int setup_disk(void)
+{
+    struct extent_list list = {NULL, 0, 0};
+    uint64_t reserve_sectors = 0;
+    struct stat stat;
+
+    if (NULL != options.sector_size &&
+            0 != parse_sector_size(options.sector_size, 512, &sector_size))
+    {
+        fprintf(stderr, "Invalid sector size: %s\n", options.sector_size);
+        return -1;
+    }
+
+    physical_sector_size = sector_size;
+    if (NULL != options.physical_sector_size &&
+            0 != parse_sector_size(options.physical_sector_size, sector_size,
+            &physical_sector_size))
+    {
+        fprintf(stderr, "Invalid physical sector size: %s\n",
+                options.physical_sector_size);
+        return -1;
+    }
+
+    image_fd = open(options.disk_image, O_RDWR | O_CLOEXEC);
+    if (-1 == image_fd || 0 != fstat(image_fd, &stat))
+    {
+        fprintf(stderr, "Failed to open disk image %s: %s\n",
+                options.disk_image, strerror(errno));
+        return -1;
+    }
+
+    /* The size comes from the size option if given. Block devices report a
+     * st_size of 0, so ask the device itself */
+    if (NULL != options.disk_size)
+    {
+        if (0 != parse_disk_size(options.disk_size, &disk_size))
+        {
+            fprintf(stderr, "Invalid disk size: %s\n", options.disk_size);
+            return -1;
+        }
+    }
+#ifdef BLKGETSIZE64
+    else if (S_ISBLK(stat.st_mode))
+    {
+        uint64_t size;
+        if (0 != ioctl(image_fd, BLKGETSIZE64, &size))
+        {
+            fprintf(stderr, "Failed to get the size of %s: %s\n",
+                    options.disk_image, strerror(errno));
+            return -1;
+        }
+        disk_size = size;
+    }
+#endif
+    else
+        disk_size = stat.st_size;
+
+    if (NULL != options.reserve_sectors)
+    {
+        const char *value = options.reserve_sectors;
+        char *end;
+
+        /* strtoull() would take a sign and wrap a negative number around */
+        errno = 0;
+        reserve_sectors = strtoull(value, &end, 10);
+        if (0 != errno || '0' > *value || '9' < *value || '\0' != *end)
+        {
+            fprintf(stderr, "Invalid number of reserve sectors: %s\n", value);
+            return -1;
+        }
+    }
+
+    if (NULL != options.bad_sector_list &&
+            0 != parse_sector_list(options.bad_sector_list,
+            strlen(options.bad_sector_list), &list))
+    {
+        fprintf(stderr, "Invalid bad sector list: %s\n",
+                options.bad_sector_list);
+        free(list.extents);
+        return -1;
+    }
+
+    if (NULL != options.bad_sector_file &&
+            0 != load_sector_file(options.bad_sector_file, &list))
+    {
+        fprintf(stderr, "Failed to load bad sector file %s\n",
+                options.bad_sector_file);
+        free(list.extents);
+        return -1;
+    }
+
+    if (0 != badsector_init(&faults, sector_size, physical_sector_size, &list,
+            reserve_sectors, options.journal))
+    {
+        if (NULL != options.journal)
+            fprintf(stderr, "Failed to open journal %s: %s\n",
+                    options.journal, strerror(errno));
+        else
+            fprintf(stderr, "Failed to allocate bad sector map\n");
+        return -1;
+    }
+
+    if (NULL != options.trace && 0 != badsector_trace(&faults, options.trace))
+    {
+        fprintf(stderr, "Failed to open trace file %s: %s\n", options.trace,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Documents supported command-line arguments */
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+"Usage: %s -i IMAGE [options]\n"
+"\n"
+"Serves a disk image with bad sectors as an NBD block device\n"
+"\n"
+"Options:\n"
+"    -h   --help            print help\n"
+"    -i   --diskimage       path to disk image to serve\n"
+"    -s   --badsectors      list of bad sectors, use , to delimit and - for ranges []\n"
+"         --badsectors-file file with a list of bad sectors, as text or binary []\n"
+"    -r   --reservesectors  number of reserve sectors for reallocation [0]\n"
+"         --size            size of the disk in bytes, K/M/G/T suffixes allowed\n"
+"                           [size of the image file or block device]\n"
+"         --sector-size     logical sector size in bytes, which sector numbers\n"
+"                           count in [512]\n"
+"         --physical-sector-size\n"
+"                           physical sector size in bytes, the unit sectors go\n"
+"                           bad and are reallocated in [sector size]\n"
+"         --journal         file keeping the bad sectors across restarts []\n"
+"         --trace           file recording every request checked against the\n"
+"                           bad sectors, for badsector-replay []\n"
+"         --export          export name clients ask for [image file name]\n"
+"         --listen          where to listen for clients, a unix socket path or\n"
+"                           [HOST]:PORT [" DEFAULT_LISTEN "]\n"
+"         --device          attach to a kernel NBD device such as /dev/nbd0\n"
+"                           instead of listening []\n"
+"         --connections     sockets to give the kernel device [4]\n"
+"         --log             where to log events to, a file, - for stdout,\n"
+"                           syslog or none [-]\n"
+"         --log-rate        events logged per second at most, 0 for no limit [100]\n"
+"\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"diskimage", required_argument, NULL, 'i'},
+        {"badsectors", required_argument, NULL, 's'},
+        {"badsectors-file", required_argument, NULL, 'B'},
+        {"reservesectors", required_argument, NULL, 'r'},
+        {"size", required_argument, NULL, 'S'},
+        {"sector-size", required_argument, NULL, 'z'},
+        {"physical-sector-size", required_argument, NULL, 'Z'},
+        {"journal", required_argument, NULL, 'j'},
+        {"trace", required_argument, NULL, 'T'},
+        {"export", required_argument, NULL, 'e'},
+        {"listen", required_argument, NULL, 'l'},
+        {"device", required_argument, NULL, 'd'},
+        {"connections", required_argument, NULL, 'c'},
+        {"log", required_argument, NULL, 'L'},
+        {"log-rate", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0}
+    };
+    unsigned int connection_count = 4;
+    unsigned int log_rate = 100;
+    int listener = -1;
+    int device = -1;
+    pthread_t thread;
+    sigset_t signals;
+    int caught;
+    int opt;
+    int ret = 1;
+
+    options.listen = DEFAULT_LISTEN;
+    options.log_destination = "-";
+    while (-1 != (opt = getopt_long(argc, argv, "hi:s:r:", long_options,
+            NULL)))
+    {
+        switch (opt)
+        {
+        case 'i': options.disk_image = optarg; break;
+        case 's': options.bad_sector_list = optarg; break;
+        case 'B': options.bad_sector_file = optarg; break;
+        case 'r': options.reserve_sectors = optarg; break;
+        case 'S': options.disk_size = optarg; break;
+        case 'z': options.sector_size = optarg; break;
+        case 'Z': options.physical_sector_size = optarg; break;
+        case 'j': options.journal = optarg; break;
+        case 'T': options.trace = optarg; break;
+        case 'e': options.export_name = optarg; break;
+        case 'l': options.listen = optarg; break;
+        case 'd': options.device = optarg; break;
+        case 'c': options.connections = optarg; break;
+        case 'L': options.log_destination = optarg; break;
+        case 'R': options.log_rate = optarg; break;
+        default:
+            usage(argv[0]);
+            exit('h' == opt ? 0 : 1);
+        }
+    }
+
+    if (NULL == options.disk_image || optind != argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (NULL != options.connections)
+    {
+        char *end;
+        unsigned long value = strtoul(options.connections, &end, 10);
+        if ('\0' != *end || 0 == value || value > 64)
+        {
+            fprintf(stderr, "Invalid connection count: %s\n",
+                    options.connections);
+            exit(1);
+        }
+        connection_count = value;
+    }
+
+    if (NULL != options.log_rate)
+    {
+        char *end;
+        unsigned long value = strtoul(options.log_rate, &end, 10);
+        if ('\0' != *end)
+        {
+            fprintf(stderr, "Invalid log rate: %s\n", options.log_rate);
+            exit(1);
+        }
+        log_rate = value;
+    }
+
+    export_name = options.export_name;
+    if (NULL == export_name)
+    {
+        const char *slash = strrchr(options.disk_image, '/');
+        export_name = NULL != slash ? slash + 1 : options.disk_image;
+    }
+    if (strlen(export_name) > MAX_OPTION_SIZE - 64)
+    {
+        fprintf(stderr, "Export name too long: %s\n", export_name);
+        exit(1);
+    }
+
+    faults.journal.fd = -1;
+    faults.trace.fd = -1;
+    if (0 != setup_disk())
+        goto out;
+
+    if (0 != event_log_start(options.log_destination, log_rate))
+    {
+        fprintf(stderr, "Failed to open event log %s: %s\n",
+                options.log_destination, strerror(errno));
+        goto out;
+    }
+
+    /* Signals are taken by the main thread with sigwait(), the threads
+     * serving the disk inherit the mask */
+    main_thread = pthread_self();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (NULL != options.device)
+    {
+#ifdef HAVE_LINUX_NBD_H
+        if (0 != disk_size % sector_size)
+        {
+            fprintf(stderr, "Disk size is not a multiple of the sector "
+                    "size\n");
+            goto out_log;
+        }
+
+        device = open_device(options.device, connection_count);
+        if (-1 == device)
+        {
+            fprintf(stderr, "Failed to attach %s: %s\n", options.device,
+                    strerror(errno));
+            goto out_connections;
+        }
+        if (0 != pthread_create(&thread, NULL, device_main, &device))
+        {
+            fprintf(stderr, "Failed to start device thread\n");
+            goto out_device;
+        }
+#else
+        fprintf(stderr, "Kernel NBD devices are not supported by this "
+                "build\n");
+        goto out_log;
+#endif
+    }
+    else
+    {
+        listener = open_listener(options.listen);
+        if (-1 == listener)
+        {
+            fprintf(stderr, "Failed to listen on %s: %s\n", options.listen,
+                    strerror(errno));
+            goto out_log;
+        }
+        if (0 != pthread_create(&thread, NULL, accept_main, &listener))
+        {
+            fprintf(stderr, "Failed to start accept thread\n");
+            goto out_listener;
+        }
+    }
+
+    sigwait(&signals, &caught);
+    ret = 0;
+
+    /* Stop taking requests, then hang up on the clients */
+    if (-1 != listener)
+        shutdown(listener, SHUT_RDWR);
+#ifdef HAVE_LINUX_NBD_H
+    if (-1 != device)
+        ioctl(device, NBD_DISCONNECT);
+#endif
+    pthread_join(thread, NULL);
+
+#ifdef HAVE_LINUX_NBD_H
+out_device:
+    if (-1 != device)
+    {
+        ioctl(device, NBD_CLEAR_SOCK);
+        close(device);
+    }
+out_connections:
+#endif
+    close_connections();
+out_listener:
+    if (-1 != listener)
+    {
+        close(listener);
+        if ('/' == options.listen[0] || '.' == options.listen[0])
+            unlink(options.listen);
+    }
+out_log:
+    event_log_stop();
+out:
+    badsector_destroy(&faults);
+    if (0 != faults.trace.dropped || faults.trace.failed)
+        fprintf(stderr, "Trace file %s of %s is incomplete, %llu records "
+                "were dropped%s\n", options.trace, options.disk_image,
+                (unsigned long long)faults.trace.dropped,
+                faults.trace.failed ? " and writing it failed" : "");
+    if (-1 != image_fd)
+    {
+        fsync(image_fd);
+        close(image_fd);
+    }
+
+    return ret;
+}
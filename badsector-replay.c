@@ -0,0 +1,240 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+/* Replays a trace recorded with --trace against a fresh fault engine, as
+ * fast as the engine goes with no image and no frontend, and checks that
+ * every request gets the result it got when it was recorded. This makes a
+ * run that went wrong reproducible, and times the fault engine on a real
+ * workload */
+
+#include "badsector.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Counts of one pass over a trace */
+struct replay_counts {
+    uint64_t requests;
+    uint64_t failed;
+    uint64_t short_reads;
+    uint64_t mismatches;
+};
+
+/* Documents supported command-line arguments */
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+"Usage: %s [options] TRACE\n"
+"\n"
+"Replays a trace recorded by fuse-badsector-simulator or badsector-nbd\n"
+"with --trace against the fault engine alone, as fast as it goes\n"
+"\n"
+"Options:\n"
+"    -h   --help            print help\n"
+"    -n   --repeat          number of times to replay the trace [1]\n"
+"         --show            requests with another result than recorded to\n"
+"                           print, 0 for none [10]\n"
+"         --check           exit with status 2 if any request got another\n"
+"                           result than recorded\n"
+"\n", progname);
+}
+
+/* Replay the records of a trace once against a new engine, printing the
+ * first *show requests that get another result than recorded */
+/* Returns 0 on success and nonzero if the engine couldn't be set up */
+static int replay_trace(const struct trace_log *log,
+        struct replay_counts *counts, unsigned long *show)
+{
+    struct extent_list empty = {NULL, 0, 0};
+    struct badsector faults;
+
+    if (0 != badsector_init(&faults, log->sector_size,
+            log->physical_sector_size, &empty, 0, NULL))
+    {
+        fprintf(stderr, "Failed to allocate bad sector map\n");
+        return -1;
+    }
+    faults.partial_reads = log->partial_reads;
+
+    for (size_t i = 0; i < log->count; i++)
+    {
+        const struct trace_record *record = log->records + i;
+        struct sector_extent *extents;
+
+        switch (record->kind)
+        {
+        case TRACE_READ:
+        case TRACE_WRITE:
+        {
+            size_t size = record->size;
+            enum badsector_verdict verdict = badsector_check(&faults,
+                    TRACE_WRITE == record->kind ? STATS_OP_WRITE :
+                    STATS_OP_READ, record->offset, &size, NULL);
+            int64_t result = BADSECTOR_FAIL == verdict ? -EIO :
+                    (int64_t)size;
+
+            counts->requests++;
+            if (BADSECTOR_FAIL == verdict)
+                counts->failed++;
+            else if (BADSECTOR_SHORT == verdict)
+                counts->short_reads++;
+
+            if (result != record->result)
+            {
+                counts->mismatches++;
+                if (0 != *show)
+                {
+                    (*show)--;
+                    printf("Mismatch at %llu.%09llu s: %s offset=%llu "
+                            "size=%llu recorded=%lld replayed=%lld\n",
+                            (unsigned long long)(record->time / 1000000000),
+                            (unsigned long long)(record->time % 1000000000),
+                            TRACE_WRITE == record->kind ? "write" : "read",
+                            (unsigned long long)record->offset,
+                            (unsigned long long)record->size,
+                            (long long)record->result, (long long)result);
+                }
+            }
+            break;
+        }
+        case TRACE_INJECT:
+        case TRACE_CLEAR:
+        {
+            extents = log->extents + record->offset;
+            struct fault_map_change change = {TRACE_CLEAR == record->kind,
+                    {extents, record->size, record->size}};
+
+            if (0 != fault_map_update(&faults.map, &change, 1))
+            {
+                fprintf(stderr, "Failed to allocate bad sector map\n");
+                badsector_destroy(&faults);
+                return -1;
+            }
+            break;
+        }
+        case TRACE_REPAIR:
+            extents = log->extents + record->offset;
+            for (uint64_t j = 0; j < record->size; j++)
+                fault_map_repair(&faults.map, extents[j].first,
+                        extents[j].last, NULL, NULL);
+            break;
+        case TRACE_RESERVE_SET:
+        case TRACE_RESERVE_ADD:
+            badsector_change_reserve(&faults,
+                    TRACE_RESERVE_SET == record->kind, record->size);
+            break;
+        }
+    }
+
+    badsector_destroy(&faults);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"repeat", required_argument, NULL, 'n'},
+        {"show", required_argument, NULL, 'S'},
+        {"check", no_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
+    struct replay_counts counts;
+    struct trace_log log;
+    unsigned long repeat = 1;
+    unsigned long show = 10;
+    int check = 0;
+    char *end;
+    int opt;
+
+    while (-1 != (opt = getopt_long(argc, argv, "hn:", long_options, NULL)))
+    {
+        switch (opt)
+        {
+        case 'n':
+            repeat = strtoul(optarg, &end, 10);
+            if ('\0' == *optarg || '\0' != *end || 0 == repeat)
+            {
+                fprintf(stderr, "Invalid repeat count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            show = strtoul(optarg, &end, 10);
+            if ('\0' == *optarg || '\0' != *end)
+            {
+                fprintf(stderr, "Invalid number of mismatches to show: %s\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case 'C': check = 1; break;
+        default:
+            usage(argv[0]);
+            exit('h' == opt ? 0 : 1);
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (0 != trace_load(argv[optind], &log))
+    {
+        fprintf(stderr, "Failed to load trace %s: %s\n", argv[optind],
+                strerror(errno));
+        exit(1);
+    }
+
+    if (0 == log.sector_size || 0 == log.physical_sector_size ||
+            0 != log.physical_sector_size % log.sector_size)
+    {
+        fprintf(stderr, "Invalid sector sizes in trace %s\n", argv[optind]);
+        trace_log_free(&log);
+        exit(1);
+    }
+
+    memset(&counts, 0, sizeof(struct replay_counts));
+    uint64_t start = trace_clock();
+    for (unsigned long i = 0; i < repeat; i++)
+        if (0 != replay_trace(&log, &counts, &show))
+        {
+            trace_log_free(&log);
+            exit(1);
+        }
+    uint64_t elapsed = trace_clock() - start;
+
+    printf("records=%llu requests=%llu failed=%llu short=%llu "
+            "mismatches=%llu\n",
+            (unsigned long long)(log.count * repeat),
+            (unsigned long long)counts.requests,
+            (unsigned long long)counts.failed,
+            (unsigned long long)counts.short_reads,
+            (unsigned long long)counts.mismatches);
+    printf("elapsed=%.3f s requests_per_second=%.0f ns_per_request=%.1f\n",
+            elapsed / 1e9,
+            0 != elapsed ? counts.requests * 1e9 / elapsed : 0.0,
+            0 != counts.requests ? (double)elapsed / counts.requests : 0.0);
+
+    trace_log_free(&log);
+    return check && 0 != counts.mismatches ? 2 : 0;
+}
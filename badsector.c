@@ -0,0 +1,315 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "badsector.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Convert extents of logical sectors to the physical sectors that hold them,
+ * in place */
+static void to_physical_sectors(const struct badsector *faults,
+        struct extent_list *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        list->extents[i].first /= faults->sectors_per_physical;
+        list->extents[i].last /= faults->sectors_per_physical;
+    }
+}
+
+/* Convert the extents of physical sectors in a list from start on to the
+ * logical sectors they cover, in place */
+static void to_logical_sectors(const struct badsector *faults,
+        struct extent_list *list, size_t start)
+{
+    for (size_t i = start; i < list->count; i++)
+    {
+        list->extents[i].first *= faults->sectors_per_physical;
+        list->extents[i].last = list->extents[i].last *
+                faults->sectors_per_physical +
+                faults->sectors_per_physical - 1;
+    }
+}
+
+int badsector_init(struct badsector *faults, size_t sector_size,
+        size_t physical_sector_size, struct extent_list *list,
+        uint64_t reserve_sectors, const char *journal_path)
+{
+    int replayed;
+
+    memset(faults, 0, sizeof(struct badsector));
+    faults->sector_size = sector_size;
+    faults->physical_sector_size = physical_sector_size;
+    faults->sectors_per_physical = physical_sector_size / sector_size;
+    faults->journal.fd = -1;
+    faults->trace.fd = -1;
+
+    if (0 != stats_init(&faults->stats))
+    {
+        free(list->extents);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    to_physical_sectors(faults, list);
+    if (NULL == journal_path)
+    {
+        if (0 != fault_map_init(&faults->map, list, reserve_sectors))
+        {
+            stats_destroy(&faults->stats);
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (0 != journal_open(&faults->journal, journal_path,
+            physical_sector_size, &faults->map, list, reserve_sectors,
+            &replayed))
+    {
+        int error = errno;
+        free(list->extents);
+        stats_destroy(&faults->stats);
+        errno = error;
+        return -1;
+    }
+
+    /* The journal holds the state left by the last mount */
+    if (replayed)
+        free(list->extents);
+
+    return 0;
+}
+
+int badsector_trace(struct badsector *faults, const char *path)
+{
+    return trace_open(&faults->trace, path, &faults->map,
+            faults->sector_size, faults->physical_sector_size,
+            faults->partial_reads);
+}
+
+void badsector_destroy(struct badsector *faults)
+{
+    trace_close(&faults->trace);
+    journal_close(&faults->journal);
+    fault_map_destroy(&faults->map);
+    stats_destroy(&faults->stats);
+}
+
+/* Check a request against the bad sectors as badsector_check() does,
+ * appending the extents of physical sectors a write reallocated to list if
+ * that is not NULL */
+/* Returns the verdict */
+static enum badsector_verdict check_request(struct badsector *faults,
+        enum stats_op op, off_t offset, size_t *size,
+        struct badsector_result *result, struct extent_list *list)
+{
+    off_t first_sector = offset / faults->physical_sector_size;
+    off_t last_sector = (offset + *size - 1) / faults->physical_sector_size;
+    struct badsector_result ignored;
+    off_t bad_sector;
+
+    if (NULL == result)
+        result = &ignored;
+    memset(result, 0, sizeof(struct badsector_result));
+
+    if (0 == *size ||
+            !fault_map_find(&faults->map, first_sector, last_sector,
+            &bad_sector))
+        return BADSECTOR_PASS;
+
+    /* Reallocate each bad sector in the request, lowest first */
+    if (STATS_OP_WRITE == op)
+    {
+        uint64_t repaired;
+        int ret = fault_map_repair(&faults->map, first_sector, last_sector,
+                &repaired, list);
+
+        stats_record_reallocated(&faults->stats, repaired);
+        result->reallocated_sector = bad_sector * faults->sectors_per_physical;
+        result->reallocated = repaired * faults->sectors_per_physical;
+
+        /* A reallocation must be on disk before the data written to the
+         * sectors is, or a crash could bring back a bad sector that was
+         * written to */
+        if (0 != repaired && 0 != journal_sync(&faults->journal))
+            ret = -1;
+        else if (0 == ret)
+            return BADSECTOR_PASS;
+
+        fault_map_find(&faults->map, first_sector, last_sector, &bad_sector);
+    }
+
+    result->bad_sector = bad_sector * faults->sectors_per_physical;
+
+    /* A disk returns the sectors it managed to read before the bad one */
+    if (STATS_OP_READ == op && faults->partial_reads &&
+            bad_sector != first_sector)
+    {
+        *size = bad_sector * faults->physical_sector_size - offset;
+        return BADSECTOR_SHORT;
+    }
+
+    return BADSECTOR_FAIL;
+}
+
+/* Check a request as check_request() does and trace it */
+/* Returns the verdict */
+static enum badsector_verdict trace_check(struct badsector *faults,
+        enum stats_op op, off_t offset, size_t *size,
+        struct badsector_result *result, struct extent_list *list)
+{
+    enum badsector_verdict verdict;
+    size_t requested = *size;
+    uint64_t start;
+
+    if (-1 == faults->trace.fd)
+        return check_request(faults, op, offset, size, result, list);
+
+    start = trace_clock();
+    verdict = check_request(faults, op, offset, size, result, list);
+    trace_request(&faults->trace, STATS_OP_WRITE == op, offset, requested,
+            BADSECTOR_FAIL == verdict ? -EIO : (int64_t)*size, start);
+
+    return verdict;
+}
+
+enum badsector_verdict badsector_check(struct badsector *faults,
+        enum stats_op op, off_t offset, size_t *size,
+        struct badsector_result *result)
+{
+    return trace_check(faults, op, offset, size, result, NULL);
+}
+
+enum badsector_verdict badsector_check_write(struct badsector *faults,
+        off_t offset, size_t *size, struct badsector_result *result,
+        struct extent_list *list)
+{
+    size_t start = list->count;
+    enum badsector_verdict verdict = trace_check(faults, STATS_OP_WRITE,
+            offset, size, result, list);
+
+    to_logical_sectors(faults, list, start);
+    return verdict;
+}
+
+int badsector_find(struct badsector *faults, off_t first_sector,
+        off_t last_sector, off_t *bad_sector)
+{
+    off_t sector;
+
+    if (!fault_map_find(&faults->map,
+            first_sector / faults->sectors_per_physical,
+            last_sector / faults->sectors_per_physical, &sector))
+        return 0;
+
+    if (NULL != bad_sector)
+        *bad_sector = sector * faults->sectors_per_physical;
+
+    return 1;
+}
+
+int badsector_repair(struct badsector *faults, off_t first_sector,
+        off_t last_sector, uint64_t *repaired)
+{
+    struct extent_list list = {NULL, 0, 0};
+    uint64_t sectors;
+
+    /* A replay has to repair the same sectors, which depend on the bad
+     * sectors and reserve sectors there are now */
+    int ret = fault_map_repair(&faults->map,
+            first_sector / faults->sectors_per_physical,
+            last_sector / faults->sectors_per_physical, &sectors,
+            -1 != faults->trace.fd ? &list : NULL);
+
+    stats_record_reallocated(&faults->stats, sectors);
+    trace_repair(&faults->trace, list.extents, list.count);
+    free(list.extents);
+    if (NULL != repaired)
+        *repaired = sectors * faults->sectors_per_physical;
+
+    return ret;
+}
+
+int badsector_update(struct badsector *faults,
+        struct fault_map_change *changes, size_t change_count)
+{
+    for (size_t i = 0; i < change_count; i++)
+        to_physical_sectors(faults, &changes[i].extents);
+
+    return fault_map_update(&faults->map, changes, change_count);
+}
+
+/* Apply a single inject or clear of one extent */
+/* Returns 0 on success and nonzero on allocation failure */
+static int update_extent(struct badsector *faults, int clear,
+        off_t first_sector, off_t last_sector)
+{
+    struct sector_extent extent = {first_sector, last_sector};
+    struct fault_map_change change = {clear, {&extent, 1, 1}};
+
+    return badsector_update(faults, &change, 1);
+}
+
+int badsector_inject(struct badsector *faults, off_t first_sector,
+        off_t last_sector)
+{
+    return update_extent(faults, 0, first_sector, last_sector);
+}
+
+int badsector_clear(struct badsector *faults, off_t first_sector,
+        off_t last_sector)
+{
+    return update_extent(faults, 1, first_sector, last_sector);
+}
+
+int badsector_snapshot(struct badsector *faults, struct extent_list *list)
+{
+    size_t start = list->count;
+
+    if (0 != fault_map_snapshot(&faults->map, list))
+        return -1;
+
+    to_logical_sectors(faults, list, start);
+    return 0;
+}
+
+uint64_t badsector_reserve_sectors(struct badsector *faults)
+{
+    return fault_map_reserve_sectors(&faults->map);
+}
+
+void badsector_change_reserve(struct badsector *faults, int set,
+        uint64_t value)
+{
+    if (set)
+        fault_map_set_reserve_sectors(&faults->map, value);
+    else
+        fault_map_add_reserve_sectors(&faults->map, value);
+}
+
+int badsector_sync(struct badsector *faults)
+{
+    return journal_sync(&faults->journal);
+}
+
+char *badsector_stats_json(struct badsector *faults, size_t *length)
+{
+    return stats_to_json(&faults->stats,
+            fault_map_reserve_sectors(&faults->map), length);
+}
@@ -0,0 +1,160 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef BADSECTOR_H
+#define BADSECTOR_H
+
+#include "fault_map.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sector fault engine of one disk: its bad sectors and reserve sectors, the
+ * journal keeping them across remounts and its request statistics, with none
+ * of the frontend that serves the disk. Requests are checked by byte offset
+ * and size, and every other call counts in logical sectors, which go bad and
+ * are reallocated a physical sector at a time. This is the API of the
+ * libbadsector library, which the FUSE daemon and other tools share */
+struct badsector {
+    size_t sector_size;             /* Logical sector size in bytes */
+    size_t physical_sector_size;    /* Physical sector size in bytes */
+    off_t sectors_per_physical;
+    int partial_reads;              /* Nonzero to cut reads short before a
+                                     * bad sector instead of failing them,
+                                     * cleared by badsector_init() */
+    struct fault_map map;           /* Bad physical sectors */
+    struct journal journal;         /* Records every change to the map, if
+                                     * the disk has one */
+    struct stats stats;
+    struct trace trace;             /* Records every request checked and
+                                     * every change to the map, if the disk
+                                     * is traced */
+};
+
+/* Outcome of checking a request against the bad sectors */
+enum badsector_verdict {
+    BADSECTOR_PASS,         /* The whole request may go to the image */
+    BADSECTOR_SHORT,        /* Only the start of the read may */
+    BADSECTOR_FAIL          /* The request fails with an I/O error */
+};
+
+/* Details of a checked request, in logical sectors */
+struct badsector_result {
+    off_t bad_sector;           /* First sector of the bad physical sector
+                                 * the request failed or stopped at */
+    off_t reallocated_sector;   /* First sector reallocated by a write */
+    uint64_t reallocated;       /* Number of sectors reallocated */
+};
+
+/* Set up the engine of a disk with the given sector sizes, the physical one
+ * a power of two multiple of the logical one. The bad sectors are taken from
+ * the extents of logical sectors in list, which the engine takes over. If
+ * journal_path is not NULL the state is loaded from the journal there
+ * instead when it holds one, and every change is recorded to it. errno is
+ * set on failure */
+/* Returns 0 on success and nonzero on error */
+int badsector_init(struct badsector *faults, size_t sector_size,
+        size_t physical_sector_size, struct extent_list *list,
+        uint64_t reserve_sectors, const char *journal_path);
+
+/* Start tracing the engine to a new trace file at path, beginning with the
+ * bad sectors and reserve sectors it has now. Must be called before the
+ * engine is shared between threads, and after partial_reads is set. errno
+ * is set on failure */
+/* Returns 0 on success and nonzero on error */
+int badsector_trace(struct badsector *faults, const char *path);
+
+/* Free everything held by the engine */
+void badsector_destroy(struct badsector *faults);
+
+/* Check a request of size bytes at offset, which must lie within the disk.
+ * Bad sectors under a write are reallocated while there are reserve sectors
+ * left, and the reallocation is on disk in the journal before this returns.
+ * With partial reads a read that hits a bad sector after its first sector is
+ * cut short, and *size is set to the bytes before the bad sector */
+/* Returns the verdict, with the details stored in *result if that is not
+ * NULL */
+enum badsector_verdict badsector_check(struct badsector *faults,
+        enum stats_op op, off_t offset, size_t *size,
+        struct badsector_result *result);
+
+/* Check a write as badsector_check() does, appending the extents of logical
+ * sectors it reallocated to list, each covering whole physical sectors. A
+ * write fails if list can't grow */
+/* Returns the verdict, with the details stored in *result if that is not
+ * NULL */
+enum badsector_verdict badsector_check_write(struct badsector *faults,
+        off_t offset, size_t *size, struct badsector_result *result,
+        struct extent_list *list);
+
+/* Check whether [first_sector, last_sector] overlaps any bad sector */
+/* Returns nonzero if it does and stores the first sector of the lowest bad
+ * physical sector in *bad_sector if that is not NULL */
+int badsector_find(struct badsector *faults, off_t first_sector,
+        off_t last_sector, off_t *bad_sector);
+
+/* Repair every bad sector in [first_sector, last_sector] using up one
+ * reserve sector per physical sector. The number of logical sectors
+ * repaired is stored in *repaired if that is not NULL */
+/* Returns 0 on success and nonzero if the reserve sectors ran out first, or
+ * if a traced engine ran out of memory recording the repair */
+int badsector_repair(struct badsector *faults, off_t first_sector,
+        off_t last_sector, uint64_t *repaired);
+
+/* Apply a batch of changes with extents of logical sectors, which are
+ * converted to physical sectors in place, and publish them as a whole */
+/* Returns 0 on success and nonzero on allocation failure, in which case none
+ * of the changes are applied */
+int badsector_update(struct badsector *faults,
+        struct fault_map_change *changes, size_t change_count);
+
+/* Mark [first_sector, last_sector] bad */
+/* Returns 0 on success and nonzero on allocation failure */
+int badsector_inject(struct badsector *faults, off_t first_sector,
+        off_t last_sector);
+
+/* Mark [first_sector, last_sector] good without using reserve sectors */
+/* Returns 0 on success and nonzero on allocation failure */
+int badsector_clear(struct badsector *faults, off_t first_sector,
+        off_t last_sector);
+
+/* Append the bad sector extents, sorted and coalesced and covering whole
+ * physical sectors, to a list */
+/* Returns 0 on success and nonzero on allocation failure */
+int badsector_snapshot(struct badsector *faults, struct extent_list *list);
+
+/* Return the number of reserve sectors left */
+uint64_t badsector_reserve_sectors(struct badsector *faults);
+
+/* Set the number of reserve sectors left if set is nonzero, otherwise add
+ * value to them */
+void badsector_change_reserve(struct badsector *faults, int set,
+        uint64_t value);
+
+/* Wait until every change made so far is in the journal on disk */
+/* Returns 0 on success and nonzero if the journal couldn't be written */
+int badsector_sync(struct badsector *faults);
+
+/* Format the request statistics and the reserve sectors left as JSON */
+/* Returns a string to be freed by the caller, with its length in *length, or
+ * NULL on allocation failure */
+char *badsector_stats_json(struct badsector *faults, size_t *length);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+/* Microbenchmarks of the bad sector paths every request goes through:
+ * looking a request up in the fault map, parsing bad sector lists and
+ * repairing sectors on write, over fault maps of 0 to 10M extents.
+ *
+ * Usage: fault_map_bench [max extents]
+ *
+ * Each result is the mean time per operation in nanoseconds, where parsing
+ * counts one operation per extent */
+
+#include "fault_map.h"
+#include "sector_list.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Sectors between the starts of neighbouring bad extents */
+#define EXTENT_STRIDE 64
+
+/* Operations timed per measurement */
+#define LOOKUPS 1000000
+#define REPAIRS 100000
+
+/* Sizes of the fault maps to measure */
+static const size_t extent_counts[] = {
+    0, 1, 10, 1000, 100000, 1000000, 10000000
+};
+
+/* Request sizes in 512-byte sectors, from 4 KiB to 1 MiB */
+static const off_t request_sectors[] = {8, 128, 2048};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+/* xorshift64* */
+static uint64_t next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dull;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Build a list of count extents of 1 to 4 sectors, one every EXTENT_STRIDE
+ * sectors */
+static int build_list(size_t count, struct extent_list *list)
+{
+    memset(list, 0, sizeof(struct extent_list));
+    for (size_t i = 0; i < count; i++)
+    {
+        off_t first = (off_t)i * EXTENT_STRIDE;
+        if (0 != extent_list_append(list, first, first + next_random() % 4))
+            return -1;
+    }
+    return 0;
+}
+
+/* Write the extents of a list out in the --badsectors format */
+/* Returns the text, to be freed, or NULL on allocation failure */
+static char *format_list(const struct extent_list *list, size_t *length)
+{
+    char *text = malloc(list->count * 48 + 1);
+    size_t used = 0;
+
+    if (NULL == text)
+        return NULL;
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const struct sector_extent *extent = list->extents + i;
+        if (extent->first == extent->last)
+            used += sprintf(text + used, "%lld,", (long long)extent->first);
+        else
+            used += sprintf(text + used, "%lld-%lld,",
+                    (long long)extent->first, (long long)extent->last);
+    }
+
+    *length = used;
+    return text;
+}
+
+/* Time lookups of random requests of each size */
+static void bench_lookup(struct fault_map *map, size_t count)
+{
+    off_t disk_sectors = (count ? count : 1) * EXTENT_STRIDE;
+    volatile int hits = 0;
+
+    for (size_t i = 0; i < sizeof(request_sectors) /
+            sizeof(request_sectors[0]); i++)
+    {
+        off_t sectors = request_sectors[i];
+        uint64_t start = now_ns();
+
+        for (int j = 0; j < LOOKUPS; j++)
+        {
+            off_t first = next_random() % disk_sectors;
+            hits += fault_map_find(map, first, first + sectors - 1, NULL);
+        }
+
+        printf(" %10.1f", (double)(now_ns() - start) / LOOKUPS);
+    }
+}
+
+/* Time parsing the list in the --badsectors format */
+static int bench_parse(const struct extent_list *list)
+{
+    struct extent_list parsed = {NULL, 0, 0};
+    size_t length = 0;
+    char *text = format_list(list, &length);
+
+    if (NULL == text)
+        return -1;
+
+    uint64_t start = now_ns();
+    int ret = parse_sector_list(text, length, &parsed);
+    uint64_t elapsed = now_ns() - start;
+
+    if (0 == ret && parsed.count != list->count)
+        ret = -1;
+    printf(" %10.1f", list->count ? (double)elapsed / list->count : 0.0);
+
+    free(parsed.extents);
+    free(text);
+    return ret;
+}
+
+/* Time repairing random bad sectors, which splits extents and so reshapes
+ * the list */
+static void bench_repair(struct fault_map *map, size_t count)
+{
+    if (0 == count)
+    {
+        printf(" %10s", "-");
+        return;
+    }
+
+    fault_map_set_reserve_sectors(map, REPAIRS);
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < REPAIRS; i++)
+    {
+        off_t first = (off_t)(next_random() % count) * EXTENT_STRIDE;
+        fault_map_repair(map, first, first, NULL, NULL);
+    }
+
+    printf(" %10.1f", (double)(now_ns() - start) / REPAIRS);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_count = argc > 1 ? strtoull(argv[1], NULL, 10) : SIZE_MAX;
+
+    printf("%10s %10s %10s %10s %10s %10s\n", "extents", "parse",
+            "lookup 4K", "lookup 64K", "lookup 1M", "repair");
+
+    for (size_t i = 0; i < sizeof(extent_counts) / sizeof(extent_counts[0]);
+            i++)
+    {
+        size_t count = extent_counts[i];
+        struct extent_list list;
+        struct fault_map map;
+
+        if (count > max_count)
+            break;
+
+        if (0 != build_list(count, &list))
+        {
+            fprintf(stderr, "Out of memory building %zu extents\n", count);
+            return 1;
+        }
+
+        printf("%10zu", count);
+        if (0 != bench_parse(&list))
+        {
+            fprintf(stderr, "\nFailed to parse %zu extents\n", count);
+            return 1;
+        }
+
+        /* fault_map_init() takes over the list */
+        if (0 != fault_map_init(&map, &list, 0))
+        {
+            fprintf(stderr, "\nOut of memory loading %zu extents\n", count);
+            return 1;
+        }
+
+        bench_lookup(&map, count);
+        bench_repair(&map, count);
+        printf("\n");
+        fflush(stdout);
+
+        fault_map_destroy(&map);
+    }
+
+    return 0;
+}
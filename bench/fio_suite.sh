@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Run a matrix of fio workloads against a raw image and against the same
+# image mirrored by the simulator, and report the overhead of going through
+# the mount.
+#
+# Usage: fio_suite.sh SIMULATOR [SIMULATOR OPTIONS...]
+#
+# Settings are taken from the environment:
+#   BENCH_DIR      directory for the image and the mount point [/tmp]
+#   BENCH_SIZE     size of the image [1G]
+#   BENCH_RUNTIME  seconds each workload runs for [10]
+#   BENCH_RW       workloads [read write randread randwrite]
+#   BENCH_BS       block sizes [4k 64k 1m]
+#   BENCH_QD       queue depths [1 16 64]
+#   BENCH_DIRECT   1 to bypass the page cache with O_DIRECT [1]
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 SIMULATOR [SIMULATOR OPTIONS...]" >&2
+    exit 1
+fi
+simulator=$1
+shift
+
+command -v fio >/dev/null || { echo "fio is not installed" >&2; exit 1; }
+
+dir=${BENCH_DIR:-/tmp}
+size=${BENCH_SIZE:-1G}
+runtime=${BENCH_RUNTIME:-10}
+workloads=${BENCH_RW:-read write randread randwrite}
+block_sizes=${BENCH_BS:-4k 64k 1m}
+queue_depths=${BENCH_QD:-1 16 64}
+direct=${BENCH_DIRECT:-1}
+
+image=$dir/fio-bench.img
+mount=$dir/fio-bench.mnt
+
+cleanup() {
+    fusermount3 -u "$mount" 2>/dev/null || fusermount -u "$mount" 2>/dev/null \
+        || true
+    rmdir "$mount" 2>/dev/null || true
+    rm -f "$image"
+}
+trap cleanup EXIT INT TERM
+
+# Fill the image so reads hit real blocks rather than holes
+mkdir -p "$mount"
+fio --name=fill --filename="$image" --size="$size" --rw=write --bs=1m \
+    --ioengine=psync --end_fsync=1 --output=/dev/null
+
+"$simulator" "$mount" -i "$image" --log=none "$@"
+i=0
+until [ -e "$mount/$(basename "$image")" ]; do
+    i=$((i + 1))
+    [ $i -lt 50 ] || { echo "Mount did not come up" >&2; exit 1; }
+    sleep 0.1
+done
+
+# Run one workload and print its IOPS, from fio's terse output: field 8 is
+# the read IOPS and field 49 the write IOPS
+run() {
+    fio --name=bench --filename="$1" --size="$size" --rw="$2" --bs="$3" \
+        --iodepth="$4" --ioengine=libaio --direct="$direct" --time_based \
+        --runtime="$runtime" --ramp_time=1 --numjobs=1 --group_reporting \
+        --minimal |
+        awk -F';' '{ print $8 + $49 }'
+}
+
+printf '%-10s %5s %3s %12s %12s %9s\n' workload bs qd raw_iops fuse_iops \
+    overhead
+for rw in $workloads; do
+    for bs in $block_sizes; do
+        for qd in $queue_depths; do
+            raw=$(run "$image" "$rw" "$bs" "$qd")
+            fuse=$(run "$mount/$(basename "$image")" "$rw" "$bs" "$qd")
+            awk -v rw="$rw" -v bs="$bs" -v qd="$qd" -v raw="$raw" \
+                -v fuse="$fuse" 'BEGIN {
+                    overhead = raw > 0 ? (1 - fuse / raw) * 100 : 0
+                    printf "%-10s %5s %3s %12d %12d %8.1f%%\n",
+                        rw, bs, qd, raw, fuse, overhead
+                }'
+        done
+    done
+done
@@ -0,0 +1,545 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "cache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Buffers passed to one write back at most, the IOV_MAX of Linux */
+#define CACHE_MAX_IOV 1024
+
+/* What a frame holds */
+enum page_state {
+    PAGE_FREE,              /* Nothing */
+    PAGE_FILLING,           /* A page being brought in, not in the hash
+                             * table yet */
+    PAGE_CLEAN,             /* A page as it is on the disk */
+    PAGE_DIRTY              /* A page written since it was last on the
+                             * disk */
+};
+
+/* Frame of a shard */
+struct cache_page {
+    uint64_t index;             /* Page of the disk held, CACHE_PAGE_SIZE
+                                 * bytes each */
+    struct cache_page *next;    /* Next page in the same hash bucket */
+    char *data;
+    unsigned char state;
+    unsigned char referenced;   /* Set when the page is used, cleared as the
+                                 * clock passes */
+};
+
+/* Return the shard a page belongs to. Stripes are spread over the shards so
+ * that sequential requests don't all contend for the same lock */
+static struct cache_shard *page_shard(struct cache *cache, uint64_t index)
+{
+    uint64_t stripe = index / CACHE_STRIPE_PAGES;
+
+    return cache->shards +
+            (stripe * 0x9e3779b97f4a7c15ULL >> 32) % CACHE_SHARDS;
+}
+
+/* Return the hash bucket of a page in its shard */
+static struct cache_page **page_bucket(struct cache_shard *shard,
+        uint64_t index)
+{
+    return shard->buckets +
+            ((index * 0x9e3779b97f4a7c15ULL >> 32) & shard->bucket_mask);
+}
+
+/* Return the number of bytes of a page within the disk */
+static size_t page_length(const struct cache *cache, uint64_t index)
+{
+    size_t left = cache->size - index * CACHE_PAGE_SIZE;
+
+    return left < CACHE_PAGE_SIZE ? left : CACHE_PAGE_SIZE;
+}
+
+/* Look up a page in its shard, which must be locked */
+/* Returns the page, or NULL if it isn't cached */
+static struct cache_page *find_page(struct cache_shard *shard,
+        uint64_t index)
+{
+    struct cache_page *page = *page_bucket(shard, index);
+
+    while (NULL != page && index != page->index)
+        page = page->next;
+
+    return page;
+}
+
+/* Take a page out of the hash table of its shard */
+static void unlink_page(struct cache_shard *shard, struct cache_page *page)
+{
+    struct cache_page **link = page_bucket(shard, page->index);
+
+    while (page != *link)
+        link = &(*link)->next;
+    *link = page->next;
+}
+
+/* Write back count dirty pages that follow on from each other */
+/* Returns 0 on success and -1 with errno set on error */
+static int write_pages(struct cache *cache, struct cache_page **pages,
+        size_t count)
+{
+    struct iovec iov[CACHE_MAX_IOV];
+    size_t size = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        iov[i].iov_base = pages[i]->data;
+        iov[i].iov_len = page_length(cache, pages[i]->index);
+        size += iov[i].iov_len;
+    }
+
+    ssize_t res = cache->writev(cache->context, iov, count,
+            pages[0]->index * CACHE_PAGE_SIZE);
+    if (res >= 0 && size != (size_t)res)
+        errno = EIO;
+    if (size != (size_t)res)
+        return -1;
+
+    for (size_t i = 0; i < count; i++)
+        pages[i]->state = PAGE_CLEAN;
+    return 0;
+}
+
+/* Write back a dirty page that is about to be evicted, along with the dirty
+ * pages around it in the same shard, which must be locked */
+/* Returns 0 on success and -1 with errno set on error */
+static int write_back(struct cache *cache, struct cache_shard *shard,
+        struct cache_page *page)
+{
+    struct cache_page *run[CACHE_MAX_IOV];
+    struct cache_page *other;
+    uint64_t first = page->index;
+    size_t count = 0;
+
+    while (first > 0 && page->index - first < CACHE_MAX_IOV / 2 &&
+            NULL != (other = find_page(shard, first - 1)) &&
+            PAGE_DIRTY == other->state)
+        first--;
+
+    for (uint64_t index = first; count < CACHE_MAX_IOV &&
+            NULL != (other = find_page(shard, index)) &&
+            PAGE_DIRTY == other->state; index++)
+        run[count++] = other;
+
+    return write_pages(cache, run, count);
+}
+
+/* Take a frame for a new page, evicting the first page the clock finds
+ * unused since it last passed. The shard must be locked and have a frame
+ * that isn't being filled */
+/* Returns the frame, now filling, or NULL with errno set if the page it
+ * held couldn't be written back */
+static struct cache_page *claim_page(struct cache *cache,
+        struct cache_shard *shard)
+{
+    for (;;)
+    {
+        struct cache_page *page = shard->pages + shard->hand;
+        shard->hand = (shard->hand + 1) % shard->page_count;
+
+        if (PAGE_FILLING == page->state)
+            continue;
+        if (PAGE_FREE != page->state && page->referenced)
+        {
+            page->referenced = 0;
+            continue;
+        }
+
+        if (PAGE_DIRTY == page->state && 0 != write_back(cache, shard, page))
+            return NULL;
+        if (PAGE_FREE != page->state)
+            unlink_page(shard, page);
+
+        page->state = PAGE_FILLING;
+        return page;
+    }
+}
+
+/* Publish a filled page in its shard, which must be locked */
+static void add_page(struct cache_shard *shard, struct cache_page *page,
+        uint64_t index, enum page_state state)
+{
+    struct cache_page **bucket = page_bucket(shard, index);
+
+    page->index = index;
+    page->state = state;
+    page->referenced = 1;
+    page->next = *bucket;
+    *bucket = page;
+}
+
+/* Bring in the page at index and the pages after it up to last_index that
+ * aren't cached either and fall into the same stripe, with one read. The
+ * shard must be locked */
+/* Returns the page at index, or NULL with errno set on error */
+static struct cache_page *read_pages(struct cache *cache,
+        struct cache_shard *shard, uint64_t index, uint64_t last_index)
+{
+    struct cache_page *pages[CACHE_STRIPE_PAGES];
+    struct iovec iov[CACHE_STRIPE_PAGES];
+    size_t limit = shard->page_count / 2;
+    size_t count = 0;
+
+    if (limit > CACHE_STRIPE_PAGES - index % CACHE_STRIPE_PAGES)
+        limit = CACHE_STRIPE_PAGES - index % CACHE_STRIPE_PAGES;
+    if (limit > last_index - index + 1)
+        limit = last_index - index + 1;
+
+    /* Frames being filled are never evicted, so there is always one left to
+     * claim */
+    int claimed = 1;
+    do
+    {
+        struct cache_page *page = claim_page(cache, shard);
+        if (NULL == page)
+        {
+            claimed = 0;
+            break;
+        }
+        pages[count] = page;
+        iov[count].iov_base = page->data;
+        iov[count].iov_len = page_length(cache, index + count);
+        count++;
+    }
+    while (count < limit && NULL == find_page(shard, index + count));
+
+    ssize_t res = -1;
+    if (claimed)
+        res = cache->readv(cache->context, iov, count,
+                index * CACHE_PAGE_SIZE);
+    if (res < 0)
+    {
+        for (size_t i = 0; i < count; i++)
+            pages[i]->state = PAGE_FREE;
+        return NULL;
+    }
+
+    /* The image can end before the disk does */
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t start = i * CACHE_PAGE_SIZE;
+        size_t filled = (size_t)res > start ? (size_t)res - start : 0;
+
+        if (filled < iov[i].iov_len)
+            memset((char *)iov[i].iov_base + filled, 0,
+                    iov[i].iov_len - filled);
+        add_page(shard, pages[i], index + i, PAGE_CLEAN);
+    }
+
+    return pages[0];
+}
+
+/* Drop every page of a shard, which must be locked */
+static void clear_shard(struct cache_shard *shard)
+{
+    for (size_t i = 0; i < shard->page_count; i++)
+        shard->pages[i].state = PAGE_FREE;
+    memset(shard->buckets, 0,
+            (shard->bucket_mask + 1) * sizeof(struct cache_page *));
+    shard->hand = 0;
+}
+
+/* Free the first count shards of a cache */
+static void free_shards(struct cache *cache, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        struct cache_shard *shard = cache->shards + i;
+
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->pages);
+        free(shard->data);
+        free(shard->buckets);
+        free(shard->dirty);
+    }
+}
+
+int cache_init(struct cache *cache, enum cache_mode mode, size_t capacity,
+        size_t size,
+        ssize_t (*readv)(void *context, const struct iovec *iov, int count,
+            off_t offset),
+        ssize_t (*writev)(void *context, const struct iovec *iov, int count,
+            off_t offset),
+        void *context)
+{
+    memset(cache, 0, sizeof(struct cache));
+    cache->mode = mode;
+    cache->size = size;
+    cache->readv = readv;
+    cache->writev = writev;
+    cache->context = context;
+    if (CACHE_NONE == mode)
+        return 0;
+
+    /* Every shard needs a frame to spare while another is being filled */
+    size_t page_count = capacity / CACHE_PAGE_SIZE / CACHE_SHARDS;
+    if (page_count < 2)
+        page_count = 2;
+    size_t bucket_count = 1;
+    while (bucket_count < page_count)
+        bucket_count *= 2;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *shard = cache->shards + i;
+        void *data = NULL;
+
+        if (0 != pthread_mutex_init(&shard->lock, NULL))
+        {
+            free_shards(cache, i);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        shard->page_count = page_count;
+        shard->bucket_mask = bucket_count - 1;
+        shard->pages = calloc(page_count, sizeof(struct cache_page));
+        shard->buckets = calloc(bucket_count, sizeof(struct cache_page *));
+        shard->dirty = malloc(page_count * sizeof(struct cache_page *));
+        if (0 == posix_memalign(&data, CACHE_PAGE_SIZE,
+                page_count * CACHE_PAGE_SIZE))
+            shard->data = data;
+        if (NULL == shard->pages || NULL == shard->buckets ||
+                NULL == shard->dirty || NULL == shard->data)
+        {
+            free_shards(cache, i + 1);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for (size_t j = 0; j < page_count; j++)
+            shard->pages[j].data = shard->data + j * CACHE_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+void cache_destroy(struct cache *cache)
+{
+    if (CACHE_NONE == cache->mode)
+        return;
+
+    cache_flush(cache);
+    free_shards(cache, CACHE_SHARDS);
+    cache->mode = CACHE_NONE;
+}
+
+ssize_t cache_read(struct cache *cache, void *buf, size_t size, off_t offset)
+{
+    uint64_t last_index = (offset + size - 1) / CACHE_PAGE_SIZE;
+    size_t length;
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        uint64_t index = (offset + done) / CACHE_PAGE_SIZE;
+        size_t in_page = (offset + done) % CACHE_PAGE_SIZE;
+        struct cache_shard *shard = page_shard(cache, index);
+
+        length = CACHE_PAGE_SIZE - in_page;
+        if (length > size - done)
+            length = size - done;
+
+        pthread_mutex_lock(&shard->lock);
+        struct cache_page *page = find_page(shard, index);
+        if (NULL == page)
+            page = read_pages(cache, shard, index, last_index);
+        if (NULL == page)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return 0 != done ? (ssize_t)done : -1;
+        }
+
+        memcpy((char *)buf + done, page->data + in_page, length);
+        page->referenced = 1;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return size;
+}
+
+/* Bring the cached pages of a stripe up to date with size bytes written to
+ * the disk at offset. The shard of the stripe must be locked */
+static void update_pages(struct cache *cache, struct cache_shard *shard,
+        const char *buf, size_t size, off_t offset)
+{
+    size_t length;
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        uint64_t index = (offset + done) / CACHE_PAGE_SIZE;
+        size_t in_page = (offset + done) % CACHE_PAGE_SIZE;
+        struct cache_page *page = find_page(shard, index);
+
+        length = CACHE_PAGE_SIZE - in_page;
+        if (length > size - done)
+            length = size - done;
+
+        if (NULL != page)
+        {
+            memcpy(page->data + in_page, buf + done, length);
+            page->referenced = 1;
+        }
+    }
+}
+
+/* Write to the disk a stripe at a time, holding the lock of its shard while
+ * the stripe is written and its cached pages are updated, so that writes
+ * that overlap leave the same data in the cache as on the disk */
+/* Returns the number of bytes written, or -1 with errno set */
+static ssize_t write_through(struct cache *cache, const void *buf,
+        size_t size, off_t offset)
+{
+    size_t length;
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        uint64_t index = (offset + done) / CACHE_PAGE_SIZE;
+        off_t stripe_end = (off_t)(index / CACHE_STRIPE_PAGES + 1) *
+                CACHE_STRIPE_PAGES * CACHE_PAGE_SIZE;
+        struct cache_shard *shard = page_shard(cache, index);
+
+        length = stripe_end - (offset + done);
+        if (length > size - done)
+            length = size - done;
+
+        struct iovec iov = {(char *)buf + done, length};
+        pthread_mutex_lock(&shard->lock);
+        ssize_t res = cache->writev(cache->context, &iov, 1, offset + done);
+        if (res > 0)
+            update_pages(cache, shard, (const char *)buf + done, res,
+                    offset + done);
+        pthread_mutex_unlock(&shard->lock);
+
+        if (res < 0)
+            return 0 != done ? (ssize_t)done : -1;
+        if ((size_t)res < length)
+            return done + res;
+    }
+
+    return size;
+}
+
+ssize_t cache_write(struct cache *cache, const void *buf, size_t size,
+        off_t offset)
+{
+    size_t length;
+
+    if (CACHE_WRITE_THROUGH == cache->mode)
+        return write_through(cache, buf, size, offset);
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        uint64_t index = (offset + done) / CACHE_PAGE_SIZE;
+        size_t in_page = (offset + done) % CACHE_PAGE_SIZE;
+        struct cache_shard *shard = page_shard(cache, index);
+
+        length = CACHE_PAGE_SIZE - in_page;
+        if (length > size - done)
+            length = size - done;
+
+        pthread_mutex_lock(&shard->lock);
+        struct cache_page *page = find_page(shard, index);
+
+        /* A write that covers a whole page needn't read it first */
+        if (NULL == page)
+        {
+            if (0 != in_page || length != page_length(cache, index))
+                page = read_pages(cache, shard, index, index);
+            else if (NULL != (page = claim_page(cache, shard)))
+                add_page(shard, page, index, PAGE_CLEAN);
+
+            if (NULL == page)
+            {
+                pthread_mutex_unlock(&shard->lock);
+                return 0 != done ? (ssize_t)done : -1;
+            }
+        }
+
+        memcpy(page->data + in_page, (const char *)buf + done, length);
+        page->referenced = 1;
+        page->state = PAGE_DIRTY;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return size;
+}
+
+/* Order pages by their index */
+static int compare_pages(const void *a, const void *b)
+{
+    uint64_t first = (*(struct cache_page *const *)a)->index;
+    uint64_t second = (*(struct cache_page *const *)b)->index;
+
+    return first < second ? -1 : first > second;
+}
+
+int cache_flush(struct cache *cache)
+{
+    int saved_errno = 0;
+
+    if (CACHE_WRITE_BACK != cache->mode)
+        return 0;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *shard = cache->shards + i;
+        size_t count = 0;
+
+        pthread_mutex_lock(&shard->lock);
+
+        for (size_t j = 0; j < shard->page_count; j++)
+            if (PAGE_DIRTY == shard->pages[j].state)
+                shard->dirty[count++] = shard->pages + j;
+        qsort(shard->dirty, count, sizeof(struct cache_page *),
+                compare_pages);
+
+        for (size_t first = 0, last; first < count; first = last)
+        {
+            for (last = first + 1; last < count &&
+                    last - first < CACHE_MAX_IOV &&
+                    shard->dirty[last - 1]->index + 1 ==
+                    shard->dirty[last]->index; last++)
+                ;
+            if (0 != write_pages(cache, shard->dirty + first, last - first))
+                saved_errno = errno;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    errno = saved_errno;
+    return 0 == saved_errno ? 0 : -1;
+}
+
+void cache_invalidate(struct cache *cache)
+{
+    if (CACHE_NONE == cache->mode)
+        return;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        clear_shard(cache->shards + i);
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
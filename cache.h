@@ -0,0 +1,118 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Size in bytes of the pages the cache holds */
+#define CACHE_PAGE_SIZE 4096
+
+/* Pages in a row that belong to the same shard, so that runs of dirty pages
+ * can be written back with one call */
+#define CACHE_STRIPE_PAGES 64
+
+/* Shards the cache is split into, each with its own lock */
+#define CACHE_SHARDS 16
+
+/* How writes go through the cache */
+enum cache_mode {
+    CACHE_NONE,             /* There is no cache */
+    CACHE_WRITE_THROUGH,    /* Writes reach the disk before they return, and
+                             * update the pages already cached */
+    CACHE_WRITE_BACK        /* Writes only dirty the pages, which reach the
+                             * disk once they are evicted or flushed */
+};
+
+struct cache_page;
+
+/* Part of the cache, holding the pages of its stripes. Pages are looked up
+ * through a hash table and evicted by the CLOCK algorithm. The lock is held
+ * across the reads and write backs of the pages, so a page is never seen
+ * half filled, and across writes through to its stripes, so the pages match
+ * the disk */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_page *pages;       /* Frames of the shard */
+    size_t page_count;
+    char *data;                     /* Data of the frames, one page each */
+    struct cache_page **buckets;    /* Hash table of the pages in use */
+    size_t bucket_mask;
+    size_t hand;                    /* Next frame the clock looks at */
+    struct cache_page **dirty;      /* Room to sort the dirty pages of the
+                                     * shard when flushing */
+};
+
+/* Sharded page cache in front of a disk. Pages past the end of the disk are
+ * never cached, and the last page only holds the part within the disk.
+ *
+ * Without a cache every request goes to the disk */
+struct cache {
+    enum cache_mode mode;
+    size_t size;                    /* Size of the disk in bytes */
+
+    /* Read or write count buffers that follow on from each other at offset
+     * of the disk. Both return the number of bytes transferred, or -1 with
+     * errno set */
+    ssize_t (*readv)(void *context, const struct iovec *iov, int count,
+            off_t offset);
+    ssize_t (*writev)(void *context, const struct iovec *iov, int count,
+            off_t offset);
+    void *context;
+
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+/* Set up a cache of capacity bytes in the given mode for a disk of size
+ * bytes, which it reads and writes through readv and writev with context.
+ * If mode is CACHE_NONE there is no cache */
+/* Returns 0 on success and nonzero on allocation failure */
+int cache_init(struct cache *cache, enum cache_mode mode, size_t capacity,
+        size_t size,
+        ssize_t (*readv)(void *context, const struct iovec *iov, int count,
+            off_t offset),
+        ssize_t (*writev)(void *context, const struct iovec *iov, int count,
+            off_t offset),
+        void *context);
+
+/* Write back the dirty pages and free the cache */
+void cache_destroy(struct cache *cache);
+
+/* Read from the disk, bringing the pages that aren't cached in first. The
+ * range must lie within the disk */
+/* Returns the number of bytes read, or -1 with errno set */
+ssize_t cache_read(struct cache *cache, void *buf, size_t size, off_t offset);
+
+/* Write to the disk as the mode of the cache has it. The range must lie
+ * within the disk */
+/* Returns the number of bytes written, or -1 with errno set */
+ssize_t cache_write(struct cache *cache, const void *buf, size_t size,
+        off_t offset);
+
+/* Write back every dirty page, each run of adjacent ones with one call */
+/* Returns 0 on success and -1 with errno set on error, in which case the
+ * pages that couldn't be written stay dirty */
+int cache_flush(struct cache *cache);
+
+/* Drop every page, dirty or not, so the next reads come from the disk */
+void cache_invalidate(struct cache *cache);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "degrade.h"
+#include "event_log.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Most bytes a thread counts before checking the write schedule */
+#define DEGRADE_FLUSH_BYTES (1024 * 1024)
+
+/* Most defects added to the fault map in one update, so a long stall (such
+ * as a suspended host) doesn't turn into one huge update */
+#define DEGRADE_BATCH_MAX 1024
+
+/* Bytes written by this thread that haven't been added to the engine yet */
+static __thread struct degrade *local_degrade = NULL;
+static __thread uint64_t local_written = 0;
+
+/* Return the next number from a splitmix64 random stream */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Return a random number in [0, 1) */
+static double random_fraction(uint64_t *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Return a random gap between the events of a Poisson process with the given
+ * mean gap */
+static double random_gap(uint64_t *state, double mean)
+{
+    return -log(1.0 - random_fraction(state)) * mean;
+}
+
+/* Pick the sectors for a new defect */
+static void place_defect(struct degrade *degrade, struct sector_extent *defect)
+{
+    const struct degrade_model *model = &degrade->model;
+    uint64_t *random = &degrade->place_random;
+    uint64_t size = model->min_sectors +
+            next_random(random) % (model->max_sectors - model->min_sectors + 1);
+    struct sector_extent neighbour;
+    off_t first;
+
+    if ((uint64_t)degrade->sector_count < size)
+        size = degrade->sector_count;
+
+    /* Grow next to an existing extent, on either side of it, or anywhere if
+     * there are none */
+    if (random_fraction(random) < model->cluster &&
+            fault_map_pick(degrade->map, next_random(random), &neighbour))
+    {
+        off_t gap = 1 + next_random(random) % model->spread;
+
+        if (next_random(random) & 1)
+            first = neighbour.last > degrade->sector_count - gap ?
+                    degrade->sector_count : neighbour.last + gap;
+        else
+            first = neighbour.first - gap - (off_t)size + 1;
+    }
+    else
+        first = next_random(random) % degrade->sector_count;
+
+    /* Keep the defect on the disk */
+    if (first < 0)
+        first = 0;
+    if (first > degrade->sector_count - (off_t)size)
+        first = degrade->sector_count - size;
+
+    defect->first = first;
+    defect->last = first + size - 1;
+}
+
+/* Add the defects that are due to the fault map and log them */
+static void grow_defects(struct degrade *degrade, size_t count)
+{
+    struct fault_map_change change;
+
+    memset(&change, 0, sizeof(struct fault_map_change));
+    for (size_t i = 0; i < count; i++)
+    {
+        struct sector_extent defect;
+
+        place_defect(degrade, &defect);
+        if (0 != extent_list_append(&change.extents, defect.first,
+                defect.last))
+            break;
+    }
+
+    if (0 == fault_map_update(degrade->map, &change, 1))
+        for (size_t i = 0; i < change.extents.count; i++)
+        {
+            struct event event;
+
+            memset(&event, 0, sizeof(struct event));
+            event.kind = EVENT_GROWN;
+            event.disk = degrade->disk_name;
+            event.sector = change.extents.extents[i].first *
+                    degrade->sector_scale;
+            event.sector_count = (change.extents.extents[i].last -
+                    change.extents.extents[i].first + 1) *
+                    degrade->sector_scale;
+            event_log_record(&event);
+        }
+
+    free(change.extents.extents);
+}
+
+/* Background thread. Sleeps until the next time-driven defect is due or a
+ * writer reports that the next write-driven one is */
+static void *degrade_main(void *data)
+{
+    struct degrade *degrade = data;
+    const struct degrade_model *model = &degrade->model;
+
+    pthread_mutex_lock(&degrade->lock);
+    while (degrade->running)
+    {
+        uint64_t now = event_clock();
+        size_t due = 0;
+
+        while (0 != model->defects_per_second && degrade->next_time <= now &&
+                due < DEGRADE_BATCH_MAX)
+        {
+            degrade->next_time += 1e9 * random_gap(&degrade->time_random,
+                    1.0 / model->defects_per_second);
+            due++;
+        }
+
+        while (0 != model->bytes_per_defect && due < DEGRADE_BATCH_MAX &&
+                __atomic_load_n(&degrade->written, __ATOMIC_RELAXED) >=
+                degrade->write_threshold)
+        {
+            uint64_t gap = random_gap(&degrade->write_random,
+                    model->bytes_per_defect);
+            __atomic_store_n(&degrade->write_threshold,
+                    degrade->write_threshold + (gap ? gap : 1),
+                    __ATOMIC_RELAXED);
+            due++;
+        }
+
+        if (0 != due)
+        {
+            pthread_mutex_unlock(&degrade->lock);
+            grow_defects(degrade, due);
+            pthread_mutex_lock(&degrade->lock);
+            continue;
+        }
+
+        if (0 == model->defects_per_second)
+            pthread_cond_wait(&degrade->wake, &degrade->lock);
+        else
+        {
+            struct timespec deadline;
+            deadline.tv_sec = degrade->next_time / 1000000000;
+            deadline.tv_nsec = degrade->next_time % 1000000000;
+            pthread_cond_timedwait(&degrade->wake, &degrade->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&degrade->lock);
+
+    return NULL;
+}
+
+int degrade_start(struct degrade *degrade, const struct degrade_model *model,
+        struct fault_map *map, off_t sector_count, off_t sector_scale,
+        const char *disk_name)
+{
+    pthread_condattr_t attr;
+    uint64_t seed = model->seed;
+
+    memset(degrade, 0, sizeof(struct degrade));
+    degrade->model = *model;
+    if (0 == degrade->model.spread)
+        degrade->model.spread = 1;
+    if (0 == degrade->model.min_sectors)
+        degrade->model.min_sectors = 1;
+    if (degrade->model.max_sectors < degrade->model.min_sectors)
+        degrade->model.max_sectors = degrade->model.min_sectors;
+    degrade->map = map;
+    degrade->sector_count = sector_count;
+    degrade->sector_scale = sector_scale;
+    degrade->disk_name = disk_name;
+    degrade->write_threshold = UINT64_MAX;
+
+    if ((0 == model->defects_per_second && 0 == model->bytes_per_defect) ||
+            0 == sector_count)
+        return 0;
+
+    degrade->time_random = next_random(&seed);
+    degrade->write_random = next_random(&seed);
+    degrade->place_random = next_random(&seed);
+
+    if (0 != model->defects_per_second)
+        degrade->next_time = event_clock() + 1e9 * random_gap(
+                &degrade->time_random, 1.0 / model->defects_per_second);
+
+    if (0 != model->bytes_per_defect)
+    {
+        /* Check often enough that a defect isn't late by much more than
+         * a few percent of the mean gap */
+        double flush_bytes = model->bytes_per_defect / 16;
+        degrade->flush_bytes = flush_bytes < DEGRADE_FLUSH_BYTES ?
+                (flush_bytes < 1 ? 1 : flush_bytes) : DEGRADE_FLUSH_BYTES;
+        degrade->write_threshold = random_gap(&degrade->write_random,
+                model->bytes_per_defect);
+    }
+
+    /* The deadlines come from CLOCK_MONOTONIC, so wait on it too */
+    if (0 != pthread_condattr_init(&attr))
+        return -1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&degrade->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (0 != ret)
+        return -1;
+
+    if (0 != pthread_mutex_init(&degrade->lock, NULL))
+    {
+        pthread_cond_destroy(&degrade->wake);
+        return -1;
+    }
+
+    degrade->running = 1;
+    if (0 != pthread_create(&degrade->thread, NULL, degrade_main, degrade))
+    {
+        pthread_mutex_destroy(&degrade->lock);
+        pthread_cond_destroy(&degrade->wake);
+        return -1;
+    }
+    degrade->started = 1;
+
+    return 0;
+}
+
+void degrade_stop(struct degrade *degrade)
+{
+    if (!degrade->started)
+        return;
+
+    pthread_mutex_lock(&degrade->lock);
+    degrade->running = 0;
+    pthread_cond_signal(&degrade->wake);
+    pthread_mutex_unlock(&degrade->lock);
+
+    pthread_join(degrade->thread, NULL);
+    pthread_mutex_destroy(&degrade->lock);
+    pthread_cond_destroy(&degrade->wake);
+    degrade->started = 0;
+}
+
+void degrade_count_written(struct degrade *degrade, uint64_t bytes)
+{
+    if (0 == degrade->flush_bytes)
+        return;
+
+    if (local_degrade != degrade)
+    {
+        local_degrade = degrade;
+        local_written = 0;
+    }
+
+    local_written += bytes;
+    if (local_written < degrade->flush_bytes)
+        return;
+
+    uint64_t written = __atomic_add_fetch(&degrade->written, local_written,
+            __ATOMIC_RELAXED);
+    local_written = 0;
+
+    if (written >= __atomic_load_n(&degrade->write_threshold,
+            __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&degrade->lock);
+        pthread_cond_signal(&degrade->wake);
+        pthread_mutex_unlock(&degrade->lock);
+    }
+}
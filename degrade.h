@@ -0,0 +1,89 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef DEGRADE_H
+#define DEGRADE_H
+
+#include "fault_map.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* How new bad sectors appear. Defects arrive as Poisson processes, one driven
+ * by time and one by the number of bytes written, either of which may be
+ * disabled by leaving its rate at 0 */
+struct degrade_model {
+    double defects_per_second;  /* Mean rate of defects over time */
+    double bytes_per_defect;    /* Mean bytes written between defects */
+    double cluster;             /* Chance that a defect grows next to an
+                                 * existing bad extent rather than at a
+                                 * random sector */
+    uint64_t spread;            /* Largest gap in sectors between a
+                                 * clustered defect and its neighbour */
+    uint64_t min_sectors;       /* Size range of a defect in sectors */
+    uint64_t max_sectors;
+    uint64_t seed;              /* Seed for the random number generators */
+};
+
+/* Degradation engine. A background thread adds the defects to the fault map
+ * as they fall due, so requests only pay for counting bytes written */
+struct degrade {
+    struct degrade_model model;
+    struct fault_map *map;
+    off_t sector_count;         /* Number of sectors on the disk */
+    off_t sector_scale;         /* Logical sectors per fault map sector,
+                                 * for reporting defects */
+    const char *disk_name;      /* Name of the disk, for reporting defects */
+
+    /* Separate random streams for the two schedules and for placing defects,
+     * so a seed reproduces the same defects for the same workload */
+    uint64_t time_random;
+    uint64_t write_random;
+    uint64_t place_random;
+
+    uint64_t flush_bytes;       /* Bytes a thread counts before adding them
+                                 * to written */
+    uint64_t written;           /* Bytes written, updated atomically */
+    uint64_t write_threshold;   /* Value of written at which the next
+                                 * write-driven defect is due */
+    uint64_t next_time;         /* CLOCK_MONOTONIC nanoseconds at which the
+                                 * next time-driven defect is due */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int started;
+};
+
+/* Start growing defects in a fault map covering sector_count sectors, each of
+ * which is sector_scale logical sectors. Sizes in the model count fault map
+ * sectors. Defects are logged as belonging to disk_name, which must outlive
+ * the event log. Does nothing if the model has neither rate set */
+/* Returns 0 on success and nonzero on error */
+int degrade_start(struct degrade *degrade, const struct degrade_model *model,
+        struct fault_map *map, off_t sector_count, off_t sector_scale,
+        const char *disk_name);
+
+/* Stop the background thread */
+void degrade_stop(struct degrade *degrade);
+
+/* Count bytes written to the disk. Bytes are added up per thread and only
+ * checked against the schedule every flush_bytes */
+void degrade_count_written(struct degrade *degrade, uint64_t bytes);
+
+#endif
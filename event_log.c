@@ -0,0 +1,271 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "event_log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+/* Number of events the queue holds, must be a power of two */
+#define EVENT_QUEUE_SIZE 4096
+
+/* Milliseconds the writer thread sleeps between draining the queue */
+#define EVENT_DRAIN_INTERVAL_MS 50
+
+/* Queue slot. The sequence number tells producers and the consumer whose turn
+ * it is to use the slot, as in Dmitry Vyukov's bounded MPMC queue */
+struct event_slot {
+    uint64_t sequence;
+    struct event event;
+};
+
+/* Lock-free multiple-producer, single-consumer event queue. Request threads
+ * claim slots with a compare-and-swap on the enqueue position, and the writer
+ * thread consumes them in order */
+static struct event_slot event_queue[EVENT_QUEUE_SIZE];
+static uint64_t enqueue_position = 0;
+static uint64_t dequeue_position = 0;
+static uint64_t dropped_events = 0;     /* Events lost to a full queue */
+
+static FILE *log_file = NULL;           /* NULL when logging to syslog */
+static int log_to_syslog = 0;
+static unsigned int log_rate = 0;       /* Events per second, 0 for no
+                                         * limit */
+static pthread_t writer_thread;
+static int writer_running = 0;          /* Cleared to stop the writer */
+static int writer_started = 0;
+
+static const char *const op_names[] = {"none", "read", "write"};
+static const char *const kind_names[] = {
+    "past_end", "truncated", "io_error", "reallocated", "unknown_file",
+    "unmount", "grown", "short_read"
+};
+
+uint64_t event_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void event_log_record(struct event *event)
+{
+    struct timespec now;
+    uint64_t position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    struct event_slot *slot;
+
+    if (!__atomic_load_n(&writer_running, __ATOMIC_RELAXED))
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    event->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    for (;;)
+    {
+        slot = event_queue + (position & (EVENT_QUEUE_SIZE - 1));
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t)(sequence - position);
+
+        if (0 == difference)
+        {
+            if (__atomic_compare_exchange_n(&enqueue_position, &position,
+                    position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (difference < 0)
+        {
+            /* The writer hasn't caught up, drop the event */
+            __atomic_fetch_add(&dropped_events, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    }
+
+    slot->event = *event;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/* Write a line to the log destination */
+static void write_line(int priority, const char *line)
+{
+    if (log_to_syslog)
+        syslog(priority, "%s", line);
+    else
+        fprintf(log_file, "%s\n", line);
+}
+
+/* Format an event as a line of key=value pairs and write it out */
+static void write_event(const struct event *event)
+{
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+            "time=%llu.%09llu event=%s op=%s",
+            (unsigned long long)(event->time / 1000000000),
+            (unsigned long long)(event->time % 1000000000),
+            kind_names[event->kind], op_names[event->op]);
+
+    if (NULL != event->disk)
+        len += snprintf(line + len, sizeof(line) - len, " disk=%s",
+                event->disk);
+
+    if (EVENT_OP_NONE != event->op)
+        len += snprintf(line + len, sizeof(line) - len,
+                " offset=%lld size=%llu", (long long)event->offset,
+                (unsigned long long)event->size);
+
+    if (0 != event->sector_count)
+        len += snprintf(line + len, sizeof(line) - len,
+                " sector=%lld sectors=%llu", (long long)event->sector,
+                (unsigned long long)event->sector_count);
+
+    if (0 != event->error)
+        len += snprintf(line + len, sizeof(line) - len, " error=%s",
+                strerror(event->error));
+
+    if (EVENT_OP_NONE != event->op)
+        snprintf(line + len, sizeof(line) - len, " latency_us=%.3f",
+                event->latency / 1000.0);
+
+    write_line(EVENT_IO_ERROR == event->kind ? LOG_WARNING : LOG_INFO, line);
+}
+
+/* Write out the queued events, dropping those over the rate limit. tokens
+ * holds the number of events that may still be written */
+static void drain_queue(double *tokens, uint64_t *suppressed)
+{
+    int written = 0;
+
+    for (;;)
+    {
+        struct event_slot *slot = event_queue +
+                (dequeue_position & (EVENT_QUEUE_SIZE - 1));
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE)
+                != dequeue_position + 1)
+            break;
+
+        if (0 == log_rate || *tokens >= 1.0)
+        {
+            write_event(&slot->event);
+            *tokens -= 1.0;
+            written = 1;
+        }
+        else
+            (*suppressed)++;
+
+        /* Hand the slot back to the producers one lap later */
+        __atomic_store_n(&slot->sequence, dequeue_position + EVENT_QUEUE_SIZE,
+                __ATOMIC_RELEASE);
+        dequeue_position++;
+    }
+
+    if (written && !log_to_syslog)
+        fflush(log_file);
+}
+
+/* Writer thread. Drains the queue every EVENT_DRAIN_INTERVAL_MS and refills
+ * the rate limit token bucket, which holds at most one second of events */
+static void *writer_main(void *data)
+{
+    const struct timespec interval = {0, EVENT_DRAIN_INTERVAL_MS * 1000000};
+    double tokens = log_rate;
+    uint64_t suppressed = 0;
+    uint64_t last_refill = event_clock();
+    int running;
+
+    do
+    {
+        running = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+
+        uint64_t now = event_clock();
+        tokens += (now - last_refill) / 1e9 * log_rate;
+        if (tokens > log_rate)
+            tokens = log_rate;
+        last_refill = now;
+
+        drain_queue(&tokens, &suppressed);
+
+        /* Report what the rate limit and a full queue threw away */
+        uint64_t dropped = __atomic_exchange_n(&dropped_events, 0,
+                __ATOMIC_RELAXED);
+        if (0 != suppressed || 0 != dropped)
+        {
+            char line[128];
+            snprintf(line, sizeof(line),
+                    "event=suppressed rate_limited=%llu queue_full=%llu",
+                    (unsigned long long)suppressed,
+                    (unsigned long long)dropped);
+            write_line(LOG_WARNING, line);
+            if (!log_to_syslog)
+                fflush(log_file);
+            suppressed = 0;
+        }
+
+        if (running)
+            nanosleep(&interval, NULL);
+    } while (running);
+
+    return NULL;
+}
+
+int event_log_start(const char *destination, unsigned int rate)
+{
+    for (uint64_t i = 0; i < EVENT_QUEUE_SIZE; i++)
+        event_queue[i].sequence = i;
+    enqueue_position = dequeue_position = 0;
+
+    if (0 == strcmp(destination, "none"))
+        return 0;
+    else if (0 == strcmp(destination, "syslog"))
+    {
+        log_to_syslog = 1;
+        openlog("fuse-badsector-simulator", LOG_PID, LOG_DAEMON);
+    }
+    else if (0 == strcmp(destination, "-"))
+        log_file = stdout;
+    else if (NULL == (log_file = fopen(destination, "a")))
+        return -1;
+
+    log_rate = rate;
+    writer_running = 1;
+    if (0 != pthread_create(&writer_thread, NULL, writer_main, NULL))
+    {
+        writer_running = 0;
+        return -1;
+    }
+    writer_started = 1;
+
+    return 0;
+}
+
+void event_log_stop(void)
+{
+    if (!writer_started)
+        return;
+
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    writer_started = 0;
+
+    if (log_to_syslog)
+        closelog();
+    else if (stdout != log_file)
+        fclose(log_file);
+    log_file = NULL;
+}
@@ -0,0 +1,74 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Operation an event happened during */
+enum event_op {
+    EVENT_OP_NONE,
+    EVENT_OP_READ,
+    EVENT_OP_WRITE
+};
+
+/* What happened */
+enum event_kind {
+    EVENT_PAST_END,     /* Request started after the end of the disk */
+    EVENT_TRUNCATED,    /* Request was truncated at the end of the disk */
+    EVENT_IO_ERROR,     /* Request failed because of a bad sector */
+    EVENT_REALLOCATED,  /* Bad sectors were reallocated by a write */
+    EVENT_UNKNOWN_FILE, /* Request was for a file other than the image */
+    EVENT_UNMOUNT,      /* File system is being unmounted */
+    EVENT_GROWN,        /* New bad sectors appeared */
+    EVENT_SHORT_READ    /* Read was cut short before a bad sector */
+};
+
+/* A single log event. Unused fields are left 0 */
+struct event {
+    uint64_t time;          /* Wall clock time in nanoseconds, filled in by
+                             * event_log_record() */
+    uint64_t latency;       /* Nanoseconds from the start of the request */
+    off_t offset;           /* Offset of the request in bytes */
+    uint64_t size;          /* Size of the request in bytes */
+    off_t sector;           /* First sector the event applies to */
+    uint64_t sector_count;  /* Number of sectors the event applies to */
+    enum event_op op;
+    enum event_kind kind;
+    int error;              /* errno value returned for the request */
+    const char *disk;       /* Name of the disk the event is about, which
+                             * must outlive the event log */
+};
+
+/* Start the thread that writes events out. destination is a file path, "-"
+ * for stdout, "syslog", or "none" to discard events. At most rate events are written per second, the
+ * rest are counted and reported as suppressed. A rate of 0 means no limit */
+/* Returns 0 on success and nonzero on error */
+int event_log_start(const char *destination, unsigned int rate);
+
+/* Write out any events still queued and stop the thread */
+void event_log_stop(void);
+
+/* Queue an event. This never blocks or makes a system call, if the queue is
+ * full the event is dropped and counted */
+void event_log_record(struct event *event);
+
+/* Return CLOCK_MONOTONIC in nanoseconds, for measuring request latency */
+uint64_t event_clock(void);
+
+#endif
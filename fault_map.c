@@ -0,0 +1,1532 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "fault_map.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Minimum number of tombstones before the extent list is compacted */
+#define TOMBSTONE_COMPACT_MIN 64
+
+/* No edit for rebuild_table() to apply, just compact the table */
+#define NO_EDIT ((size_t)-1)
+
+/* A chunk is turned into a bitmap once it holds pieces of more extents than
+ * a bitmap takes the memory of, and back into extents once it has fewer runs
+ * of bad sectors than half that, so chunks near the threshold don't flip on
+ * every update */
+#define DENSE_CHUNK_EXTENTS \
+        (sizeof(struct sector_bitmap) / sizeof(struct sector_extent))
+#define SPARSE_CHUNK_EXTENTS (DENSE_CHUNK_EXTENTS / 2)
+
+/* Number of region bits in the summary, and the most regions a lookup checks
+ * there before it falls back to the table */
+#define SUMMARY_BITS (FAULT_MAP_SUMMARY_WORDS * 64)
+#define SUMMARY_LOOKUP_REGIONS 4
+
+/* Working copy of the dense chunks while they are being changed. Bitmaps are
+ * shared with the active table until they need changing */
+struct chunk_work {
+    struct sector_chunk *chunks;
+    char *owned;        /* Nonzero for bitmaps allocated for this copy */
+    size_t count;
+    size_t capacity;
+};
+
+/* Reader stripe used by this thread, assigned on first use */
+static __thread unsigned int reader_stripe = FAULT_MAP_READER_STRIPES;
+static unsigned int next_reader_stripe = 0;
+
+/* Nonzero if the extent is a tombstone and holds no bad sectors */
+static inline int extent_is_tombstone(off_t first, off_t last)
+{
+    return first > last;
+}
+
+/* Return the reader stripe for the calling thread */
+static unsigned int get_reader_stripe(void)
+{
+    if (FAULT_MAP_READER_STRIPES == reader_stripe)
+        reader_stripe = __atomic_fetch_add(&next_reader_stripe, 1,
+                __ATOMIC_RELAXED) % FAULT_MAP_READER_STRIPES;
+
+    return reader_stripe;
+}
+
+/* Pin the active table so a writer won't reuse it until unpin_table(). This
+ * only retries if a writer switches tables at the same time, it never waits */
+static const struct extent_table *pin_table(struct fault_map *map,
+        unsigned int *pinned)
+{
+    unsigned int stripe = get_reader_stripe();
+
+    for (;;)
+    {
+        unsigned int active = __atomic_load_n(&map->active, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&map->readers[active][stripe].count, 1,
+                __ATOMIC_SEQ_CST);
+
+        /* If a writer switched tables before our counter went up, it may not
+         * have seen us, so move over to the new table */
+        if (__atomic_load_n(&map->active, __ATOMIC_SEQ_CST) == active)
+        {
+            *pinned = active;
+            return map->tables + active;
+        }
+
+        __atomic_fetch_sub(&map->readers[active][stripe].count, 1,
+                __ATOMIC_RELEASE);
+    }
+}
+
+/* Release a table pinned by pin_table() */
+static void unpin_table(struct fault_map *map, unsigned int pinned)
+{
+    __atomic_fetch_sub(&map->readers[pinned][get_reader_stripe()].count, 1,
+            __ATOMIC_RELEASE);
+}
+
+/* Find the first live extent in the table overlapping
+ * [first_sector, last_sector] */
+/* Returns the index of the extent, or the table's count if there is none */
+static size_t table_find(const struct extent_table *table, off_t first_sector,
+        off_t last_sector)
+{
+    const struct sector_extent *extents = table->extents;
+    size_t low = 0;
+    size_t high = table->count;
+
+    /* Find the first extent that ends at or after first_sector */
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (__atomic_load_n(&extents[middle].last, __ATOMIC_RELAXED)
+                < first_sector)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    /* Repaired extents before the first live one don't count */
+    for (; low < table->count; low++)
+    {
+        off_t first = __atomic_load_n(&extents[low].first, __ATOMIC_RELAXED);
+        off_t last = __atomic_load_n(&extents[low].last, __ATOMIC_RELAXED);
+
+        if (!extent_is_tombstone(first, last))
+            return first <= last_sector ? low : table->count;
+    }
+
+    return table->count;
+}
+
+/* Return the first sector of the chunk holding a sector */
+static inline off_t chunk_start(off_t sector)
+{
+    return sector - sector % FAULT_MAP_CHUNK_SECTORS;
+}
+
+/* Return a mask of bits from to to of a word, both inclusive */
+static inline uint64_t bit_range(unsigned int from, unsigned int to)
+{
+    return (~(uint64_t)0 << from) & (~(uint64_t)0 >> (63 - to));
+}
+
+/* Find the first of the sorted chunks that ends at or after sector */
+/* Returns the index of the chunk, or count if there is none */
+static size_t chunk_lower_bound(const struct sector_chunk *chunks,
+        size_t count, off_t sector)
+{
+    size_t low = 0;
+    size_t high = count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (chunks[middle].first + (FAULT_MAP_CHUNK_SECTORS - 1) < sector)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/* Find the lowest bit set from bit from to bit to of a bitmap, scanning a
+ * word at a time */
+/* Returns the bit, or -1 if none is set */
+static long bitmap_find(const struct sector_bitmap *bitmap, unsigned int from,
+        unsigned int to)
+{
+    unsigned int last_word = to / 64;
+
+    for (unsigned int word = from / 64; word <= last_word; word++)
+    {
+        uint64_t bits = __atomic_load_n(&bitmap->words[word],
+                __ATOMIC_RELAXED) & bit_range(
+                word == from / 64 ? from % 64 : 0,
+                word == last_word ? to % 64 : 63);
+
+        if (0 != bits)
+            return (long)word * 64 + __builtin_ctzll(bits);
+    }
+
+    return -1;
+}
+
+/* Set or clear bits from to to of a bitmap that isn't shared with readers */
+static void bitmap_edit(struct sector_bitmap *bitmap, int clear,
+        unsigned int from, unsigned int to)
+{
+    unsigned int last_word = to / 64;
+
+    for (unsigned int word = from / 64; word <= last_word; word++)
+    {
+        uint64_t mask = bit_range(word == from / 64 ? from % 64 : 0,
+                word == last_word ? to % 64 : 63);
+        uint64_t old = bitmap->words[word];
+
+        if (clear)
+        {
+            bitmap->words[word] = old & ~mask;
+            bitmap->bad -= __builtin_popcountll(old & mask);
+        }
+        else
+        {
+            bitmap->words[word] = old | mask;
+            bitmap->bad += __builtin_popcountll(~old & mask);
+        }
+    }
+}
+
+/* Count the runs of set bits in a bitmap */
+static uint64_t bitmap_runs(const struct sector_bitmap *bitmap)
+{
+    uint64_t runs = 0;
+    uint64_t carry = 0;
+
+    /* A run starts at every set bit whose lower neighbour is clear */
+    for (size_t word = 0; word < FAULT_MAP_CHUNK_WORDS; word++)
+    {
+        uint64_t bits = bitmap->words[word];
+        runs += __builtin_popcountll(bits & ~((bits << 1) | carry));
+        carry = bits >> 63;
+    }
+
+    return runs;
+}
+
+/* Append an extent to a list, merging it into the last extent appended from
+ * index start on if the two are adjacent */
+/* Returns 0 on success and nonzero on allocation failure */
+static int append_coalesced(struct extent_list *list, size_t start,
+        off_t first, off_t last)
+{
+    if (list->count > start && list->extents[list->count - 1].last >=
+            first - 1)
+    {
+        list->extents[list->count - 1].last = last;
+        return 0;
+    }
+
+    return extent_list_append(list, first, last);
+}
+
+/* Append the runs of bad sectors in a chunk to a list, merging adjacent ones
+ * from index start on */
+/* Returns 0 on success and nonzero on allocation failure */
+static int append_chunk_runs(struct extent_list *list, size_t start,
+        const struct sector_chunk *chunk)
+{
+    for (size_t word = 0; word < FAULT_MAP_CHUNK_WORDS; word++)
+    {
+        uint64_t bits = __atomic_load_n(&chunk->bitmap->words[word],
+                __ATOMIC_RELAXED);
+
+        while (0 != bits)
+        {
+            unsigned int bit = __builtin_ctzll(bits);
+            uint64_t shifted = bits >> bit;
+            unsigned int length = 0 == ~shifted ? 64 : __builtin_ctzll(~shifted);
+            off_t first = chunk->first + word * 64 + bit;
+
+            if (0 != append_coalesced(list, start, first, first + length - 1))
+                return -1;
+            bits = bit + length >= 64 ? 0 : bits & (~(uint64_t)0 <<
+                    (bit + length));
+        }
+    }
+
+    return 0;
+}
+
+/* Find the lowest bad sector in [first_sector, last_sector] that is held by
+ * a dense chunk of the table */
+/* Returns the index of the chunk and stores the sector in *bad_sector, or
+ * returns the table's chunk count if there is none */
+static size_t table_find_bit(const struct extent_table *table,
+        off_t first_sector, off_t last_sector, off_t *bad_sector)
+{
+    if (last_sector < first_sector)
+        return table->chunk_count;
+
+    for (size_t i = chunk_lower_bound(table->chunks, table->chunk_count,
+            first_sector);
+            i < table->chunk_count && table->chunks[i].first <= last_sector;
+            i++)
+    {
+        const struct sector_chunk *chunk = table->chunks + i;
+        off_t from = first_sector > chunk->first ?
+                first_sector - chunk->first : 0;
+        off_t to = last_sector - chunk->first < FAULT_MAP_CHUNK_SECTORS - 1 ?
+                last_sector - chunk->first : FAULT_MAP_CHUNK_SECTORS - 1;
+        long bit = bitmap_find(chunk->bitmap, from, to);
+
+        if (bit >= 0)
+        {
+            *bad_sector = chunk->first + bit;
+            return i;
+        }
+    }
+
+    return table->chunk_count;
+}
+
+/* Set the summary bits of the regions [first_sector, last_sector] is in */
+static void summary_mark(uint64_t *summary, off_t first_sector,
+        off_t last_sector)
+{
+    off_t first_region = first_sector >> FAULT_MAP_REGION_SHIFT;
+    off_t last_region = last_sector >> FAULT_MAP_REGION_SHIFT;
+
+    if (last_region - first_region >= SUMMARY_BITS)
+    {
+        memset(summary, 0xff, FAULT_MAP_SUMMARY_WORDS * sizeof(uint64_t));
+        return;
+    }
+
+    for (off_t region = first_region; region <= last_region; region++)
+    {
+        unsigned int bit = region % SUMMARY_BITS;
+        summary[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+/* Build the summary of the regions holding bad sectors in a table */
+static void table_summary(const struct extent_table *table,
+        uint64_t *summary)
+{
+    memset(summary, 0, FAULT_MAP_SUMMARY_WORDS * sizeof(uint64_t));
+
+    for (size_t i = 0; i < table->count; i++)
+        if (!extent_is_tombstone(table->extents[i].first,
+                table->extents[i].last))
+            summary_mark(summary, table->extents[i].first,
+                    table->extents[i].last);
+
+    for (size_t i = 0; i < table->chunk_count; i++)
+        if (0 != table->chunks[i].bitmap->bad)
+            summary_mark(summary, table->chunks[i].first,
+                    table->chunks[i].first + (FAULT_MAP_CHUNK_SECTORS - 1));
+}
+
+/* Store a new summary. With widen set the bits already there are kept, for a
+ * summary stored before the table it describes is published. Must be called
+ * with the writer lock held */
+static void publish_summary(struct fault_map *map, const uint64_t *summary,
+        int widen)
+{
+    for (size_t word = 0; word < FAULT_MAP_SUMMARY_WORDS; word++)
+    {
+        if (widen && 0 != summary[word])
+            __atomic_fetch_or(&map->summary[word], summary[word],
+                    __ATOMIC_SEQ_CST);
+        else if (!widen)
+            __atomic_store_n(&map->summary[word], summary[word],
+                    __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Check the summary for a range of sectors */
+/* Returns nonzero if none of the regions the range is in hold bad sectors, and
+ * zero if they may or the range spans too many regions to check quickly */
+static int summary_is_clean(struct fault_map *map, off_t first_sector,
+        off_t last_sector)
+{
+    off_t first_region = first_sector >> FAULT_MAP_REGION_SHIFT;
+    off_t last_region = last_sector >> FAULT_MAP_REGION_SHIFT;
+
+    if (last_region - first_region >= SUMMARY_LOOKUP_REGIONS)
+        return 0;
+
+    for (off_t region = first_region; region <= last_region; region++)
+    {
+        unsigned int bit = region % SUMMARY_BITS;
+        if (0 != (__atomic_load_n(&map->summary[bit / 64], __ATOMIC_ACQUIRE) &
+                ((uint64_t)1 << (bit % 64))))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Make the spare table the active one and wait for readers of the old one to
+ * leave, after which it is the spare. Must be called with the writer lock
+ * held */
+static void switch_tables(struct fault_map *map)
+{
+    unsigned int active = map->active;
+
+    __atomic_store_n(&map->active, !active, __ATOMIC_SEQ_CST);
+    for (unsigned int stripe = 0; stripe < FAULT_MAP_READER_STRIPES; stripe++)
+        while (0 != __atomic_load_n(&map->readers[active][stripe].count,
+                __ATOMIC_SEQ_CST))
+            sched_yield();
+}
+
+/* Build a compacted copy of the active table in the spare table, dropping the
+ * sectors [from, to] from the extent at index edit if edit isn't NO_EDIT, and
+ * make it the active table. Dense chunks are shared with the copy, except for
+ * those with no bad sectors left, which are freed. Must be called with the
+ * writer lock held */
+/* Returns 0 on success and nonzero on allocation failure */
+static int rebuild_table(struct fault_map *map, size_t edit, off_t from,
+        off_t to)
+{
+    unsigned int active = map->active;
+    const struct extent_table *source = map->tables + active;
+    struct extent_table *target = map->tables + !active;
+    size_t needed = source->count - source->tombstones + 1;
+
+    /* Nobody reads the spare table, so it is safe to reallocate */
+    if (target->capacity < needed)
+    {
+        size_t capacity = needed > source->capacity ? needed : source->capacity;
+        struct sector_extent *extents = realloc(target->extents,
+                capacity * sizeof(struct sector_extent));
+        if (NULL == extents)
+            return -1;
+
+        target->extents = extents;
+        target->capacity = capacity;
+    }
+
+    if (target->chunk_capacity < source->chunk_count)
+    {
+        struct sector_chunk *chunks = realloc(target->chunks,
+                source->chunk_count * sizeof(struct sector_chunk));
+        if (NULL == chunks)
+            return -1;
+
+        target->chunks = chunks;
+        target->chunk_capacity = source->chunk_count;
+    }
+
+    size_t chunk_count = 0;
+    for (size_t i = 0; i < source->chunk_count; i++)
+        if (0 != source->chunks[i].bitmap->bad)
+            target->chunks[chunk_count++] = source->chunks[i];
+    target->chunk_count = chunk_count;
+
+    size_t count = 0;
+    for (size_t i = 0; i < source->count; i++)
+    {
+        struct sector_extent extent = source->extents[i];
+
+        if (extent_is_tombstone(extent.first, extent.last))
+            continue;
+
+        if (i == edit)
+        {
+            if (extent.first < from)
+            {
+                target->extents[count].first = extent.first;
+                target->extents[count++].last = from - 1;
+            }
+            if (extent.last > to)
+            {
+                target->extents[count].first = to + 1;
+                target->extents[count++].last = extent.last;
+            }
+            continue;
+        }
+
+        target->extents[count++] = extent;
+    }
+
+    target->count = count;
+    target->tombstones = 0;
+
+    /* The copy only lost bad sectors, so its summary can wait until readers
+     * have moved over to it */
+    uint64_t summary[FAULT_MAP_SUMMARY_WORDS];
+    table_summary(target, summary);
+    switch_tables(map);
+    publish_summary(map, summary, 0);
+
+    /* Nobody can reach the empty chunks any more */
+    if (chunk_count != source->chunk_count)
+        for (size_t i = 0; i < source->chunk_count; i++)
+            if (0 == source->chunks[i].bitmap->bad)
+                free(source->chunks[i].bitmap);
+
+    return 0;
+}
+
+/* Take up to wanted reserve sectors */
+/* Returns the number of reserve sectors taken */
+static uint64_t claim_reserve_sectors(struct fault_map *map, uint64_t wanted)
+{
+    uint64_t available = __atomic_load_n(&map->reserve_sectors,
+            __ATOMIC_RELAXED);
+    uint64_t claimed;
+
+    do
+        claimed = available < wanted ? available : wanted;
+    while (claimed > 0 && !__atomic_compare_exchange_n(&map->reserve_sectors,
+            &available, available - claimed, 0, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED));
+
+    return claimed;
+}
+
+/* qsort() comparison function for sector extents, ordered by first sector */
+static int compare_extents(const void *a, const void *b)
+{
+    off_t first = ((const struct sector_extent *)a)->first;
+    off_t second = ((const struct sector_extent *)b)->first;
+
+    return (first > second) - (first < second);
+}
+
+/* Sort extents and coalesce overlapping or adjacent ones, in place */
+/* Returns the number of extents left */
+static size_t coalesce_extents(struct sector_extent *extents, size_t count)
+{
+    size_t coalesced = 0;
+
+    if (0 == count)
+        return 0;
+
+    qsort(extents, count, sizeof(struct sector_extent), compare_extents);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (coalesced > 0 && extents[coalesced - 1].last >= extents[i].first - 1)
+        {
+            if (extents[i].last > extents[coalesced - 1].last)
+                extents[coalesced - 1].last = extents[i].last;
+            continue;
+        }
+
+        extents[coalesced++] = extents[i];
+    }
+
+    return coalesced;
+}
+
+/* Remove the sectors in the sorted, coalesced extents clear from the sorted,
+ * coalesced extents in source, writing the result to target. target needs
+ * room for source_count + clear_count extents */
+/* Returns the number of extents written to target */
+static size_t subtract_extents(const struct sector_extent *source,
+        size_t source_count, const struct sector_extent *clear,
+        size_t clear_count, struct sector_extent *target)
+{
+    size_t count = 0;
+    size_t j = 0;
+
+    for (size_t i = 0; i < source_count; i++)
+    {
+        off_t first = source[i].first;
+        off_t last = source[i].last;
+
+        while (j < clear_count && clear[j].last < first)
+            j++;
+
+        /* A cleared extent may reach into the next source extent, so don't
+         * move j past the ones overlapping this one */
+        for (size_t k = j; k < clear_count && clear[k].first <= last; k++)
+        {
+            if (clear[k].first > first)
+            {
+                target[count].first = first;
+                target[count++].last = clear[k].first - 1;
+            }
+
+            if (clear[k].last >= last)
+            {
+                first = last + 1;
+                break;
+            }
+            first = clear[k].last + 1;
+        }
+
+        if (first <= last)
+        {
+            target[count].first = first;
+            target[count++].last = last;
+        }
+    }
+
+    return count;
+}
+
+/* Make room for count more chunks in a working copy */
+/* Returns 0 on success and nonzero on allocation failure */
+static int chunk_work_reserve(struct chunk_work *work, size_t count)
+{
+    if (work->count + count <= work->capacity)
+        return 0;
+
+    size_t capacity = work->count + count;
+    struct sector_chunk *chunks = realloc(work->chunks,
+            capacity * sizeof(struct sector_chunk));
+    if (NULL == chunks)
+        return -1;
+    work->chunks = chunks;
+
+    char *owned = realloc(work->owned, capacity);
+    if (NULL == owned)
+        return -1;
+    work->owned = owned;
+    work->capacity = capacity;
+
+    return 0;
+}
+
+/* Free a working copy, along with the bitmaps allocated for it if free_owned
+ * is nonzero */
+static void chunk_work_free(struct chunk_work *work, int free_owned)
+{
+    if (free_owned)
+        for (size_t i = 0; i < work->count; i++)
+            if (work->owned[i])
+                free(work->chunks[i].bitmap);
+
+    free(work->chunks);
+    free(work->owned);
+}
+
+/* Set or clear [first, last], which lie within the chunk at index, in a
+ * working copy. A bitmap still shared with the active table is copied
+ * first */
+/* Returns 0 on success and nonzero on allocation failure */
+static int chunk_work_edit(struct chunk_work *work, size_t index, int clear,
+        off_t first, off_t last)
+{
+    struct sector_chunk *chunk = work->chunks + index;
+
+    if (!work->owned[index])
+    {
+        struct sector_bitmap *bitmap = malloc(sizeof(struct sector_bitmap));
+        if (NULL == bitmap)
+            return -1;
+
+        memcpy(bitmap, chunk->bitmap, sizeof(struct sector_bitmap));
+        chunk->bitmap = bitmap;
+        work->owned[index] = 1;
+    }
+
+    bitmap_edit(chunk->bitmap, clear, first - chunk->first,
+            last - chunk->first);
+    return 0;
+}
+
+/* Apply the sorted, coalesced extents of a change to the dense chunks of a
+ * working copy, and write the parts outside them to outside, which needs
+ * room for count extents plus the number of chunks */
+/* Returns the number of extents written to outside, or -1 on allocation
+ * failure */
+static ssize_t chunk_work_apply(struct chunk_work *work, int clear,
+        const struct sector_extent *extents, size_t count,
+        struct sector_extent *outside)
+{
+    size_t written = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        off_t first = extents[i].first;
+        off_t last = extents[i].last;
+        size_t c = chunk_lower_bound(work->chunks, work->count, first);
+
+        for (; c < work->count && work->chunks[c].first <= last; c++)
+        {
+            off_t chunk_first = work->chunks[c].first;
+            off_t chunk_last = chunk_first + (FAULT_MAP_CHUNK_SECTORS - 1);
+
+            if (first < chunk_first)
+            {
+                outside[written].first = first;
+                outside[written++].last = chunk_first - 1;
+                first = chunk_first;
+            }
+
+            if (0 != chunk_work_edit(work, c, clear, first,
+                    last < chunk_last ? last : chunk_last))
+                return -1;
+
+            if (last <= chunk_last)
+                break;
+            first = chunk_last + 1;
+        }
+
+        if (c == work->count || work->chunks[c].first > last)
+        {
+            outside[written].first = first;
+            outside[written++].last = last;
+        }
+    }
+
+    return written;
+}
+
+/* Turn the chunks of the sorted, coalesced extents that hold pieces of more
+ * than DENSE_CHUNK_EXTENTS extents into bitmaps, added to a working copy in
+ * order, and cut the extents back to what is left outside them, in place.
+ * None of the extents may overlap a chunk of the working copy already */
+/* Returns 0 on success and nonzero on allocation failure, in which case
+ * nothing is changed */
+static int densify(struct sector_extent *extents, size_t *count,
+        struct chunk_work *work)
+{
+    struct sector_chunk *dense = NULL;
+    size_t dense_count = 0;
+    size_t dense_capacity = 0;
+    size_t n = *count;
+
+    /* Count the extents reaching into each chunk. An extent can only reach
+     * past the end of the chunk it starts in once */
+    for (size_t i = 0; i < n;)
+    {
+        off_t start = chunk_start(extents[i].first);
+        size_t pieces = i > 0 && extents[i - 1].last >= start;
+        size_t j = i;
+
+        while (j < n && extents[j].first <= start +
+                (FAULT_MAP_CHUNK_SECTORS - 1))
+            j++;
+
+        pieces += j - i;
+        i = j;
+        if (pieces <= DENSE_CHUNK_EXTENTS)
+            continue;
+
+        if (dense_count == dense_capacity)
+        {
+            size_t capacity = dense_capacity ? dense_capacity * 2 : 16;
+            struct sector_chunk *resized = realloc(dense,
+                    capacity * sizeof(struct sector_chunk));
+            if (NULL == resized)
+                goto fail;
+            dense = resized;
+            dense_capacity = capacity;
+        }
+
+        dense[dense_count].first = start;
+        dense[dense_count].bitmap = calloc(1, sizeof(struct sector_bitmap));
+        if (NULL == dense[dense_count++].bitmap)
+            goto fail;
+    }
+
+    if (0 == dense_count)
+        return 0;
+    if (0 != chunk_work_reserve(work, dense_count))
+        goto fail;
+
+    /* Move the sectors in dense chunks into their bitmaps. An extent can
+     * overlap at most the chunk it starts in and the one it ends in, as a
+     * chunk it covers whole holds just the one piece, so each extent leaves
+     * at most one piece behind */
+    size_t d = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        off_t first = extents[i].first;
+        off_t last = extents[i].last;
+
+        while (d < dense_count && dense[d].first +
+                (FAULT_MAP_CHUNK_SECTORS - 1) < first)
+            d++;
+
+        if (d < dense_count && dense[d].first <= first)
+        {
+            off_t chunk_last = dense[d].first + (FAULT_MAP_CHUNK_SECTORS - 1);
+
+            bitmap_edit(dense[d].bitmap, 0, first - dense[d].first,
+                    (last < chunk_last ? last : chunk_last) - dense[d].first);
+            if (last <= chunk_last)
+                continue;
+            first = chunk_last + 1;
+            d++;
+        }
+
+        if (d < dense_count && dense[d].first <= last)
+        {
+            bitmap_edit(dense[d].bitmap, 0, 0, last - dense[d].first);
+            last = dense[d].first - 1;
+        }
+
+        /* Nothing is left of an extent that ran from one dense chunk
+         * straight into the next */
+        if (first > last)
+            continue;
+
+        extents[kept].first = first;
+        extents[kept++].last = last;
+    }
+    *count = kept;
+
+    /* Merge the new chunks in, from the back so nothing is overwritten */
+    size_t old = work->count;
+    size_t total = old + dense_count;
+    work->count = total;
+    while (dense_count > 0)
+    {
+        if (old > 0 &&
+                work->chunks[old - 1].first > dense[dense_count - 1].first)
+        {
+            work->chunks[total - 1] = work->chunks[old - 1];
+            work->owned[--total] = work->owned[--old];
+        }
+        else
+        {
+            work->chunks[total - 1] = dense[--dense_count];
+            work->owned[--total] = 1;
+        }
+    }
+    free(dense);
+
+    return 0;
+
+fail:
+    for (size_t i = 0; i < dense_count; i++)
+        free(dense[i].bitmap);
+    free(dense);
+    return -1;
+}
+
+/* Make room in a list for room more extents, growing it geometrically */
+/* Returns 0 on success and nonzero on allocation failure */
+static int reserve_extents(struct extent_list *list, size_t room)
+{
+    if (list->capacity - list->count >= room)
+        return 0;
+
+    size_t capacity = list->capacity ? list->capacity * 2 : 64;
+    while (capacity - list->count < room)
+        capacity *= 2;
+
+    struct sector_extent *extents = realloc(list->extents,
+            capacity * sizeof(struct sector_extent));
+    if (NULL == extents)
+        return -1;
+
+    list->extents = extents;
+    list->capacity = capacity;
+    return 0;
+}
+
+int extent_list_append(struct extent_list *list, off_t first, off_t last)
+{
+    if (0 != reserve_extents(list, 1))
+        return -1;
+
+    /* Accept ranges written backwards */
+    if (last < first)
+    {
+        off_t sector = first;
+        first = last;
+        last = sector;
+    }
+
+    list->extents[list->count].first = first;
+    list->extents[list->count].last = last;
+    list->count++;
+
+    return 0;
+}
+
+void extent_list_sort(struct extent_list *list)
+{
+    qsort(list->extents, list->count, sizeof(struct sector_extent),
+            compare_extents);
+}
+
+/* Free the extent tables of a map and the bitmaps of their dense chunks */
+static void free_tables(struct fault_map *map)
+{
+    /* The spare table shares its bitmaps with the active one, or refers to
+     * freed ones */
+    const struct extent_table *active = map->tables + map->active;
+    for (size_t i = 0; i < active->chunk_count; i++)
+        free(active->chunks[i].bitmap);
+
+    free(map->tables[0].chunks);
+    free(map->tables[1].chunks);
+    free(map->tables[0].extents);
+    free(map->tables[1].extents);
+    memset(map->tables, 0, sizeof(map->tables));
+}
+
+int fault_map_init(struct fault_map *map, struct extent_list *list,
+        uint64_t reserve_sectors)
+{
+    struct sector_extent *extents = list->extents;
+    size_t count = coalesce_extents(extents, list->count);
+    struct chunk_work work = {NULL, NULL, 0, 0};
+
+    memset(map, 0, sizeof(struct fault_map));
+    map->reserve_sectors = reserve_sectors;
+
+    /* The list is taken over whether this succeeds or not */
+    list->extents = NULL;
+    list->count = list->capacity = 0;
+
+    if (0 != densify(extents, &count, &work))
+    {
+        free(extents);
+        return -1;
+    }
+    map->tables[0].chunks = work.chunks;
+    map->tables[0].chunk_count = work.count;
+    map->tables[0].chunk_capacity = work.capacity;
+    free(work.owned);
+
+    /* Each split of an extent during repair takes one more entry and uses up
+     * a reserve sector, so keep room for as many splits as there are reserve
+     * sectors (within reason) to avoid allocating in the write path */
+    uint64_t slack = reserve_sectors < count ? reserve_sectors : count;
+    size_t capacity = count + slack;
+
+    if (capacity > 0)
+    {
+        struct sector_extent *resized = realloc(extents,
+                capacity * sizeof(struct sector_extent));
+        struct sector_extent *spare = malloc(
+                capacity * sizeof(struct sector_extent));
+        if (NULL == resized || NULL == spare)
+        {
+            free(NULL == resized ? extents : resized);
+            free(spare);
+            free_tables(map);
+            return -1;
+        }
+        extents = resized;
+        map->tables[1].extents = spare;
+    }
+    else
+    {
+        free(extents);
+        extents = NULL;
+    }
+
+    map->tables[0].extents = extents;
+    map->tables[0].count = count;
+    map->tables[0].capacity = capacity;
+    map->tables[1].capacity = capacity;
+    table_summary(map->tables, map->summary);
+
+    /* The lock is only destroyed once it has been set up */
+    if (0 != pthread_mutex_init(&map->lock, NULL))
+    {
+        free_tables(map);
+        return -1;
+    }
+
+    return 0;
+}
+
+void fault_map_set_observer(struct fault_map *map, fault_map_observer observer,
+        void *context)
+{
+    map->observer = observer;
+    map->observer_context = context;
+}
+
+void fault_map_destroy(struct fault_map *map)
+{
+    free_tables(map);
+    pthread_mutex_destroy(&map->lock);
+}
+
+int fault_map_find(struct fault_map *map, off_t first_sector,
+        off_t last_sector, off_t *bad_sector)
+{
+    if (summary_is_clean(map, first_sector, last_sector))
+        return 0;
+
+    unsigned int pinned;
+    const struct extent_table *table = pin_table(map, &pinned);
+    size_t i = table_find(table, first_sector, last_sector);
+    int found = i < table->count;
+    off_t sector = last_sector;
+
+    if (found)
+    {
+        off_t first = __atomic_load_n(&table->extents[i].first,
+                __ATOMIC_RELAXED);
+        sector = first > first_sector ? first : first_sector;
+    }
+
+    /* Only a bad sector in a dense chunk below the extent comes first */
+    off_t bit;
+    if (table_find_bit(table, first_sector, found ? sector - 1 : last_sector,
+            &bit) < table->chunk_count)
+    {
+        sector = bit;
+        found = 1;
+    }
+
+    unpin_table(map, pinned);
+
+    if (found && NULL != bad_sector)
+        *bad_sector = sector;
+
+    return found;
+}
+
+/* Repair the bad sectors from bit from to bit to of a dense chunk, lowest
+ * first, using up one reserve sector for each. The number of sectors
+ * repaired is added to *total and the runs repaired are appended to list if
+ * that is not NULL. Must be called with the writer lock held */
+/* Returns 0 on success and nonzero if the reserve sectors ran out first or
+ * list couldn't grow */
+static int repair_chunk(struct fault_map *map, const struct sector_chunk *chunk,
+        unsigned int from, unsigned int to, uint64_t *total,
+        struct extent_list *list)
+{
+    struct sector_bitmap *bitmap = chunk->bitmap;
+    unsigned int last_word = to / 64;
+
+    for (unsigned int word = from / 64; word <= last_word; word++)
+    {
+        uint64_t bits = bitmap->words[word] & bit_range(
+                word == from / 64 ? from % 64 : 0,
+                word == last_word ? to % 64 : 63);
+        if (0 == bits)
+            continue;
+
+        /* A word holds at most 32 runs */
+        if (NULL != list && 0 != reserve_extents(list, 32))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        uint64_t wanted = __builtin_popcountll(bits);
+        uint64_t claimed = claim_reserve_sectors(map, wanted);
+
+        /* Keep the lowest bits that there are reserve sectors for */
+        if (claimed < wanted)
+        {
+            uint64_t kept = 0;
+            for (uint64_t i = 0; i < claimed; i++)
+            {
+                kept |= bits & -bits;
+                bits &= bits - 1;
+            }
+            bits = kept;
+        }
+
+        if (0 != bits)
+        {
+            __atomic_fetch_and(&bitmap->words[word], ~bits, __ATOMIC_RELEASE);
+            bitmap->bad -= claimed;
+            *total += claimed;
+        }
+
+        /* Report each run of repaired sectors */
+        if (0 != bits && (NULL != map->observer || NULL != list))
+        {
+            struct sector_extent runs[32];
+            size_t run_count = 0;
+
+            while (0 != bits)
+            {
+                unsigned int bit = __builtin_ctzll(bits);
+                uint64_t shifted = bits >> bit;
+                unsigned int length = 0 == ~shifted ? 64 :
+                        __builtin_ctzll(~shifted);
+
+                runs[run_count].first = chunk->first + word * 64 + bit;
+                runs[run_count].last = runs[run_count].first + length - 1;
+                run_count++;
+                bits = bit + length >= 64 ? 0 : bits & (~(uint64_t)0 <<
+                        (bit + length));
+            }
+
+            if (NULL != map->observer)
+                map->observer(map->observer_context, FAULT_MAP_REPAIR, runs,
+                        run_count);
+            if (NULL != list)
+            {
+                memcpy(list->extents + list->count, runs,
+                        run_count * sizeof(struct sector_extent));
+                list->count += run_count;
+            }
+        }
+
+        if (claimed < wanted)
+            return -1;
+    }
+
+    return 0;
+}
+
+int fault_map_repair(struct fault_map *map, off_t first_sector,
+        off_t last_sector, uint64_t *repaired, struct extent_list *list)
+{
+    int ret = 0;
+    int emptied = 0;
+    uint64_t total = 0;
+
+    pthread_mutex_lock(&map->lock);
+
+    for (;;)
+    {
+        struct extent_table *table = map->tables + map->active;
+        size_t i = table_find(table, first_sector, last_sector);
+        off_t below = last_sector;
+        off_t bit;
+
+        if (i < table->count)
+            below = (table->extents[i].first > first_sector ?
+                    table->extents[i].first : first_sector) - 1;
+
+        /* Repair the dense chunk below the extent first, if there is one.
+         * Extents don't overlap dense chunks, so the whole chunk can go */
+        size_t c = table_find_bit(table, first_sector, below, &bit);
+        if (c < table->chunk_count)
+        {
+            const struct sector_chunk *chunk = table->chunks + c;
+            off_t to = last_sector - chunk->first <
+                    FAULT_MAP_CHUNK_SECTORS - 1 ?
+                    last_sector - chunk->first : FAULT_MAP_CHUNK_SECTORS - 1;
+
+            int short_of_reserves = repair_chunk(map, chunk,
+                    bit - chunk->first, to, &total, list);
+            emptied |= 0 == chunk->bitmap->bad;
+            if (short_of_reserves)
+            {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (i == table->count)
+            break;
+
+        /* Repair as much of the overlap with this extent as the reserve
+         * sectors allow, lowest sector first */
+        struct sector_extent *extent = table->extents + i;
+        off_t from = extent->first > first_sector ?
+                extent->first : first_sector;
+        off_t to = extent->last < last_sector ? extent->last : last_sector;
+        uint64_t wanted = to - from + 1;
+
+        if (NULL != list && 0 != reserve_extents(list, 1))
+        {
+            errno = ENOMEM;
+            ret = -1;
+            break;
+        }
+
+        uint64_t claimed = claim_reserve_sectors(map, wanted);
+
+        if (0 == claimed)
+        {
+            ret = -1;
+            break;
+        }
+        to = from + claimed - 1;
+
+        if (extent->first == from)
+        {
+            /* Repairing the whole extent turns it into a tombstone */
+            __atomic_store_n(&extent->first, to + 1, __ATOMIC_RELEASE);
+            if (extent_is_tombstone(extent->first, extent->last))
+                table->tombstones++;
+        }
+        else if (extent->last == to)
+            __atomic_store_n(&extent->last, from - 1, __ATOMIC_RELEASE);
+        else if (0 != rebuild_table(map, i, from, to))
+        {
+            /* Repairing the middle of an extent splits it in two, which needs
+             * a new table. Give the reserve sectors back if that failed */
+            __atomic_fetch_add(&map->reserve_sectors, claimed,
+                    __ATOMIC_RELAXED);
+            ret = -1;
+            break;
+        }
+
+        if (NULL != map->observer)
+        {
+            struct sector_extent repaired_extent = {from, to};
+            map->observer(map->observer_context, FAULT_MAP_REPAIR,
+                    &repaired_extent, 1);
+        }
+        if (NULL != list)
+        {
+            list->extents[list->count].first = from;
+            list->extents[list->count].last = to;
+            list->count++;
+        }
+
+        total += claimed;
+        if (claimed < wanted)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    /* Lookups skip over tombstones, so compact the list once they make up
+     * more than half of it. Chunks with no bad sectors left are dropped
+     * the same way */
+    const struct extent_table *table = map->tables + map->active;
+    if (emptied || (table->tombstones >= TOMBSTONE_COMPACT_MIN &&
+            table->tombstones > table->count / 2))
+        rebuild_table(map, NO_EDIT, 0, 0);
+
+    pthread_mutex_unlock(&map->lock);
+
+    if (NULL != repaired)
+        *repaired = total;
+
+    return ret;
+}
+
+int fault_map_update(struct fault_map *map,
+        const struct fault_map_change *changes, size_t change_count)
+{
+    struct sector_extent *work = NULL;
+    struct chunk_work chunks = {NULL, NULL, 0, 0};
+    size_t count = 0;
+    int ret = -1;
+
+    pthread_mutex_lock(&map->lock);
+
+    /* Apply the changes in order to a private copy of the live extents and
+     * of the dense chunks, whose bitmaps are copied as they are changed */
+    struct extent_table *table = map->tables + map->active;
+    work = malloc((table->count - table->tombstones + 1) *
+            sizeof(struct sector_extent));
+    if (NULL == work || 0 != chunk_work_reserve(&chunks, table->chunk_count))
+        goto out;
+
+    for (size_t i = 0; i < table->count; i++)
+        if (!extent_is_tombstone(table->extents[i].first,
+                table->extents[i].last))
+            work[count++] = table->extents[i];
+
+    if (0 != table->chunk_count)
+    {
+        memcpy(chunks.chunks, table->chunks,
+                table->chunk_count * sizeof(struct sector_chunk));
+        memset(chunks.owned, 0, table->chunk_count);
+    }
+    chunks.count = table->chunk_count;
+
+    for (size_t i = 0; i < change_count; i++)
+    {
+        const struct extent_list *extents = &changes[i].extents;
+        if (0 == extents->count)
+            continue;
+
+        /* Sectors in dense chunks go straight to their bitmaps */
+        struct sector_extent *sorted = malloc((extents->count + 1) *
+                sizeof(struct sector_extent));
+        struct sector_extent *outside = malloc(
+                (extents->count + chunks.count + 1) *
+                sizeof(struct sector_extent));
+        if (NULL == sorted || NULL == outside)
+        {
+            free(sorted);
+            free(outside);
+            goto out;
+        }
+
+        memcpy(sorted, extents->extents,
+                extents->count * sizeof(struct sector_extent));
+        size_t sorted_count = coalesce_extents(sorted, extents->count);
+        ssize_t outside_count = chunk_work_apply(&chunks, changes[i].clear,
+                sorted, sorted_count, outside);
+        free(sorted);
+
+        struct sector_extent *next = outside_count < 0 ? NULL :
+                malloc((count + outside_count + 1) *
+                sizeof(struct sector_extent));
+        if (NULL == next)
+        {
+            free(outside);
+            goto out;
+        }
+
+        if (changes[i].clear)
+            count = subtract_extents(work, count, outside, outside_count,
+                    next);
+        else
+        {
+            memcpy(next, work, count * sizeof(struct sector_extent));
+            memcpy(next + count, outside,
+                    outside_count * sizeof(struct sector_extent));
+            count = coalesce_extents(next, count + outside_count);
+        }
+
+        free(outside);
+        free(work);
+        work = next;
+    }
+
+    /* Changed chunks left with few runs of bad sectors go back to being
+     * extents, and those left with none are dropped */
+    struct extent_list list = {work, count, count};
+    size_t converted = 0;
+    for (size_t i = 0; i < chunks.count; i++)
+    {
+        if (!chunks.owned[i] || (0 != chunks.chunks[i].bitmap->bad &&
+                bitmap_runs(chunks.chunks[i].bitmap) >= SPARSE_CHUNK_EXTENTS))
+            continue;
+
+        if (0 != append_chunk_runs(&list, list.count, chunks.chunks + i))
+        {
+            work = list.extents;
+            goto out;
+        }
+        free(chunks.chunks[i].bitmap);
+        chunks.chunks[i].bitmap = NULL;
+        converted++;
+    }
+    work = list.extents;
+    count = list.count;
+
+    if (0 != converted)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < chunks.count; i++)
+        {
+            if (NULL == chunks.chunks[i].bitmap)
+                continue;
+            chunks.chunks[kept] = chunks.chunks[i];
+            chunks.owned[kept++] = chunks.owned[i];
+        }
+        chunks.count = kept;
+        count = coalesce_extents(work, count);
+    }
+
+    /* And chunks that got crowded with extents become bitmaps */
+    if (0 != densify(work, &count, &chunks))
+        goto out;
+
+    /* Publish the result through the spare table, keeping room for splits as
+     * fault_map_init() does */
+    struct extent_table *target = map->tables + !map->active;
+    uint64_t reserve_sectors = fault_map_reserve_sectors(map);
+    size_t capacity = count + (reserve_sectors < count ? reserve_sectors :
+            count);
+    if (target->capacity < capacity)
+    {
+        struct sector_extent *extents = realloc(target->extents,
+                capacity * sizeof(struct sector_extent));
+        if (NULL == extents)
+            goto out;
+
+        target->extents = extents;
+        target->capacity = capacity;
+    }
+
+    if (target->chunk_capacity < chunks.count)
+    {
+        struct sector_chunk *resized = realloc(target->chunks,
+                chunks.count * sizeof(struct sector_chunk));
+        if (NULL == resized)
+            goto out;
+
+        target->chunks = resized;
+        target->chunk_capacity = chunks.count;
+    }
+
+    /* Either list may be empty and never allocated */
+    if (0 != count)
+        memcpy(target->extents, work, count * sizeof(struct sector_extent));
+    target->count = count;
+    target->tombstones = 0;
+    if (0 != chunks.count)
+        memcpy(target->chunks, chunks.chunks,
+                chunks.count * sizeof(struct sector_chunk));
+    target->chunk_count = chunks.count;
+
+    /* Readers of either table must see the regions with bad sectors in
+     * them, so add the new ones first and drop the cleared ones after */
+    uint64_t summary[FAULT_MAP_SUMMARY_WORDS];
+    table_summary(target, summary);
+    publish_summary(map, summary, 1);
+    switch_tables(map);
+    publish_summary(map, summary, 0);
+    ret = 0;
+
+    /* Free the bitmaps of the old table that were copied or dropped. Both
+     * chunk lists are sorted */
+    size_t j = 0;
+    for (size_t i = 0; i < table->chunk_count; i++)
+    {
+        while (j < target->chunk_count &&
+                target->chunks[j].first < table->chunks[i].first)
+            j++;
+        if (j == target->chunk_count ||
+                target->chunks[j].bitmap != table->chunks[i].bitmap)
+            free(table->chunks[i].bitmap);
+    }
+    table->chunk_count = 0;
+
+    if (NULL != map->observer)
+        for (size_t i = 0; i < change_count; i++)
+            map->observer(map->observer_context, changes[i].clear ?
+                    FAULT_MAP_CLEAR : FAULT_MAP_INJECT,
+                    changes[i].extents.extents, changes[i].extents.count);
+
+out:
+    pthread_mutex_unlock(&map->lock);
+    chunk_work_free(&chunks, 0 != ret);
+    free(work);
+
+    return ret;
+}
+
+int fault_map_pick(struct fault_map *map, uint64_t choice,
+        struct sector_extent *extent)
+{
+    unsigned int pinned;
+    const struct extent_table *table = pin_table(map, &pinned);
+    size_t total = table->count + table->chunk_count;
+    int found = 0;
+
+    /* Take the first live extent or dense chunk from a random index on,
+     * wrapping around. Extents after runs of tombstones are a little more
+     * likely to be picked, which doesn't matter for our purposes. From a
+     * dense chunk the first bad sector from a random bit on is picked */
+    for (size_t i = 0; i < total && !found; i++)
+    {
+        size_t index = (choice + i) % total;
+
+        if (index >= table->count)
+        {
+            const struct sector_chunk *chunk = table->chunks +
+                    (index - table->count);
+            unsigned int from = (choice / total) % FAULT_MAP_CHUNK_SECTORS;
+            long bit = bitmap_find(chunk->bitmap, from,
+                    FAULT_MAP_CHUNK_SECTORS - 1);
+
+            if (bit < 0)
+                bit = bitmap_find(chunk->bitmap, 0, from);
+            if (bit >= 0)
+            {
+                extent->first = extent->last = chunk->first + bit;
+                found = 1;
+            }
+            continue;
+        }
+
+        const struct sector_extent *candidate = table->extents + index;
+        off_t first = __atomic_load_n(&candidate->first, __ATOMIC_RELAXED);
+        off_t last = __atomic_load_n(&candidate->last, __ATOMIC_RELAXED);
+
+        if (!extent_is_tombstone(first, last))
+        {
+            extent->first = first;
+            extent->last = last;
+            found = 1;
+        }
+    }
+
+    unpin_table(map, pinned);
+
+    return found;
+}
+
+int fault_map_snapshot(struct fault_map *map, struct extent_list *list)
+{
+    size_t start = list->count;
+    size_t c = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&map->lock);
+
+    /* Merge the extents and the runs in dense chunks, which don't overlap
+     * but may touch */
+    const struct extent_table *table = map->tables + map->active;
+    for (size_t i = 0; i <= table->count && 0 == ret; i++)
+    {
+        off_t first = SECTOR_MAX;
+
+        if (i < table->count)
+        {
+            if (extent_is_tombstone(table->extents[i].first,
+                    table->extents[i].last))
+                continue;
+            first = table->extents[i].first;
+        }
+
+        for (; c < table->chunk_count && table->chunks[c].first < first &&
+                0 == ret; c++)
+            ret = append_chunk_runs(list, start, table->chunks + c);
+
+        if (i < table->count && 0 == ret)
+            ret = append_coalesced(list, start, first,
+                    table->extents[i].last);
+    }
+
+    for (; c < table->chunk_count && 0 == ret; c++)
+        ret = append_chunk_runs(list, start, table->chunks + c);
+
+    pthread_mutex_unlock(&map->lock);
+
+    return ret;
+}
+
+uint64_t fault_map_reserve_sectors(struct fault_map *map)
+{
+    return __atomic_load_n(&map->reserve_sectors, __ATOMIC_RELAXED);
+}
+
+void fault_map_set_reserve_sectors(struct fault_map *map,
+        uint64_t reserve_sectors)
+{
+    pthread_mutex_lock(&map->lock);
+    __atomic_store_n(&map->reserve_sectors, reserve_sectors, __ATOMIC_RELAXED);
+    if (NULL != map->observer)
+        map->observer(map->observer_context, FAULT_MAP_RESERVE_SET, NULL,
+                reserve_sectors);
+    pthread_mutex_unlock(&map->lock);
+}
+
+void fault_map_add_reserve_sectors(struct fault_map *map,
+        uint64_t reserve_sectors)
+{
+    pthread_mutex_lock(&map->lock);
+    __atomic_fetch_add(&map->reserve_sectors, reserve_sectors,
+            __ATOMIC_RELAXED);
+    if (NULL != map->observer)
+        map->observer(map->observer_context, FAULT_MAP_RESERVE_ADD, NULL,
+                reserve_sectors);
+    pthread_mutex_unlock(&map->lock);
+}
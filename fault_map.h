@@ -0,0 +1,218 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef FAULT_MAP_H
+#define FAULT_MAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Largest sector number that fits in an off_t, which is 64 bits wide as we
+ * build with _FILE_OFFSET_BITS=64 */
+#define SECTOR_MAX INT64_MAX
+
+/* Contiguous run of bad sectors, both ends inclusive. Once every sector of an
+ * extent has been repaired it is left in place as a tombstone with first set to
+ * last + 1, which keeps the list sorted without moving its neighbours */
+struct sector_extent {
+    off_t first;
+    off_t last;
+};
+
+/* Growable list of sector extents, used to collect extents before they are
+ * loaded into a fault map */
+struct extent_list {
+    struct sector_extent *extents;
+    size_t count;
+    size_t capacity;
+};
+
+/* Kinds of change made to the bad sectors, as reported to an observer */
+enum fault_map_change_kind {
+    FAULT_MAP_INJECT,       /* Sectors became bad */
+    FAULT_MAP_CLEAR,        /* Sectors were cleared without reserves */
+    FAULT_MAP_REPAIR,       /* Sectors were repaired using one reserve
+                             * sector each */
+    FAULT_MAP_RESERVE_SET,  /* The reserve sectors were set to count */
+    FAULT_MAP_RESERVE_ADD   /* count reserve sectors were added */
+};
+
+/* Function told about every change to a fault map, with the writer lock held
+ * so that changes are reported in the order they were made. Extents passed
+ * for FAULT_MAP_INJECT and FAULT_MAP_CLEAR are as given to
+ * fault_map_update(), unsorted and possibly overlapping. Changes to the
+ * reserve sectors pass no extents */
+typedef void (*fault_map_observer)(void *context,
+        enum fault_map_change_kind kind, const struct sector_extent *extents,
+        size_t count);
+
+/* One step of a batched update to a fault map, which either adds the extents
+ * to the bad sectors or clears them without using reserve sectors */
+struct fault_map_change {
+    int clear;
+    struct extent_list extents;
+};
+
+/* Number of striped reader counters per table. Readers pick a stripe per
+ * thread so they don't all bounce the same cache line */
+#define FAULT_MAP_READER_STRIPES 16
+
+/* Reader counter, padded out to its own cache line */
+struct fault_map_reader {
+    unsigned long count;
+    char padding[64 - sizeof(unsigned long)];
+};
+
+/* Sectors per chunk. The sectors of each chunk are kept either as extents or,
+ * once they would take more memory as extents than as a bitmap, as a bitmap
+ * with a bit per sector. That bounds the memory and lookup cost of dense
+ * defect patterns such as every 7th sector of a disk */
+#define FAULT_MAP_CHUNK_SECTORS 65536
+#define FAULT_MAP_CHUNK_WORDS (FAULT_MAP_CHUNK_SECTORS / 64)
+
+/* Bitmap of the bad sectors of a dense chunk. Bits are only ever cleared in
+ * place, with atomic stores, so readers never see a sector that was never
+ * bad. Tables share bitmaps, and a bitmap that has to gain bits is copied */
+struct sector_bitmap {
+    uint64_t bad;       /* Number of bits set, kept up to date by writers */
+    uint64_t words[FAULT_MAP_CHUNK_WORDS];
+};
+
+/* A chunk held as a bitmap */
+struct sector_chunk {
+    off_t first;                    /* First sector of the chunk */
+    struct sector_bitmap *bitmap;
+};
+
+/* Sectors per summary region, 1 GiB of 512-byte sectors, and the number of
+ * 64-bit words of region bits in the summary. Regions past the last bit fold
+ * back onto the first ones, so disks of over 4096 regions share bits */
+#define FAULT_MAP_REGION_SHIFT 21
+#define FAULT_MAP_SUMMARY_WORDS 64
+
+/* One version of the bad sectors: a sorted, coalesced extent list and the
+ * sorted dense chunks. No extent overlaps a dense chunk */
+struct extent_table {
+    struct sector_extent *extents;
+    size_t count;       /* Number of extents, including tombstones */
+    size_t capacity;    /* Number of extents allocated */
+    size_t tombstones;  /* Number of fully repaired extents still listed */
+    struct sector_chunk *chunks;
+    size_t chunk_count;
+    size_t chunk_capacity;
+};
+
+/* Set of bad sectors and the reserve sectors available to reallocate them.
+ *
+ * Lookups never block. Readers pin the active table by bumping a reader
+ * counter and read it without taking any lock. Writers are serialized by a
+ * mutex. Repairs that only trim an extent or turn it into a tombstone update
+ * the active table in place with single atomic stores, which readers can
+ * observe in any order without seeing a sector that was never bad. Anything
+ * that reshapes the list (splitting an extent, compaction) is built in the
+ * spare table, published by switching the active index, and the old table is
+ * only reused once its readers have drained. Repairs in a dense chunk clear
+ * its bits in place.
+ *
+ * A summary with a bit per region that may hold bad sectors lets lookups in
+ * clean regions return without pinning a table. Bits are added before a
+ * table with new bad sectors is published and only dropped once a table
+ * without them is, so the summary never misses a bad sector */
+struct fault_map {
+    struct extent_table tables[2];
+    unsigned int active;            /* Index of the table readers use */
+    struct fault_map_reader readers[2][FAULT_MAP_READER_STRIPES];
+    pthread_mutex_t lock;           /* Serializes writers */
+    uint64_t reserve_sectors;       /* Reserve sectors left, updated
+                                     * atomically */
+    fault_map_observer observer;    /* Told about changes, may be NULL */
+    void *observer_context;
+    uint64_t summary[FAULT_MAP_SUMMARY_WORDS];
+};
+
+/* Append an extent to the list, growing it geometrically as needed */
+/* Returns 0 on success and nonzero on allocation failure */
+int extent_list_append(struct extent_list *list, off_t first, off_t last);
+
+/* Sort the extents of a list by first sector */
+void extent_list_sort(struct extent_list *list);
+
+/* Initialize a fault map from a list of extents, which may be unsorted and
+ * overlapping. The fault map takes over the list's memory, and leaves the
+ * list empty even on failure */
+/* Returns 0 on success and nonzero on allocation failure */
+int fault_map_init(struct fault_map *map, struct extent_list *list,
+        uint64_t reserve_sectors);
+
+/* Set the function told about changes to the fault map. Must be called before
+ * the fault map is shared between threads */
+void fault_map_set_observer(struct fault_map *map, fault_map_observer observer,
+        void *context);
+
+/* Free the memory held by a fault map. No readers may be active */
+void fault_map_destroy(struct fault_map *map);
+
+/* Check whether [first_sector, last_sector] overlaps any bad sector */
+/* Returns nonzero if it does and stores the lowest bad sector in the range in
+ * *bad_sector if that is not NULL */
+int fault_map_find(struct fault_map *map, off_t first_sector,
+        off_t last_sector, off_t *bad_sector);
+
+/* Repair every bad sector in [first_sector, last_sector], lowest first, using
+ * up one reserve sector for each. The number of sectors repaired is stored in
+ * *repaired if that is not NULL, and the extents repaired are appended to
+ * list if that is not NULL */
+/* Returns 0 on success and nonzero if the reserve sectors ran out first, or
+ * if list couldn't grow, with errno set to ENOMEM. The sectors repaired
+ * before that stay repaired */
+int fault_map_repair(struct fault_map *map, off_t first_sector,
+        off_t last_sector, uint64_t *repaired, struct extent_list *list);
+
+/* Apply a batch of changes in order and publish the result as a whole, so
+ * lookups see either none of the changes or all of them. Lookups carry on
+ * while the new extent list is built */
+/* Returns 0 on success and nonzero on allocation failure, in which case none
+ * of the changes are applied */
+int fault_map_update(struct fault_map *map,
+        const struct fault_map_change *changes, size_t change_count);
+
+/* Pick one of the bad sector extents, using choice as a random number. Each
+ * extent is about as likely to be picked as any other */
+/* Returns nonzero if there are any bad sectors and stores the extent in
+ * *extent */
+int fault_map_pick(struct fault_map *map, uint64_t choice,
+        struct sector_extent *extent);
+
+/* Append the bad sector extents, sorted and coalesced, to a list */
+/* Returns 0 on success and nonzero on allocation failure */
+int fault_map_snapshot(struct fault_map *map, struct extent_list *list);
+
+/* Return the number of reserve sectors left */
+uint64_t fault_map_reserve_sectors(struct fault_map *map);
+
+/* Set the number of reserve sectors left, telling the observer in order
+ * with the other changes */
+void fault_map_set_reserve_sectors(struct fault_map *map,
+        uint64_t reserve_sectors);
+
+/* Add to the number of reserve sectors left, telling the observer in order
+ * with the other changes */
+void fault_map_add_reserve_sectors(struct fault_map *map,
+        uint64_t reserve_sectors);
+
+#endif
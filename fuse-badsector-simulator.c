@@ -14,304 +14,2980 @@
 # limitations under the License.
 */
 
+#ifdef USE_FUSE3_LOWLEVEL
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#else
 #define FUSE_USE_VERSION 26
-
 #include <fuse.h>
+#endif
+
+/* libfuse 2.9 added fuse_bufvec and the read_buf() and write_buf() callbacks */
+#if defined(USE_FUSE3_LOWLEVEL) || FUSE_VERSION >= 29
+#define HAVE_FUSE_BUFVEC
+#endif
+
+#include "badsector.h"
+#include "cache.h"
+#include "degrade.h"
+#include "event_log.h"
+#include "fault_map.h"
+#include "group_sync.h"
+#include "latency.h"
+#include "overlay.h"
+#include "remap.h"
+#include "sector_list.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "uring.h"
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+/* Names of the virtual files next to the image that hold the statistics and
+ * take control commands. Disks from a config file put their own name in
+ * front */
+#define STATS_FILE_NAME ".stats"
+#define CONTROL_FILE_NAME ".control"
+
+/* Largest read and write request to negotiate with the kernel, which is also
+ * the largest request libfuse 3 will buffer and the size of the buffers
+ * registered with the io_uring */
+#define MAX_REQUEST_SIZE (1024 * 1024)
+
+/* Alignment of the buffers, offsets and sizes of direct I/O to the image */
+#define DIRECT_IO_ALIGNMENT 4096
+
+/* Options describing one disk, from the command line or from a section of
+ * the config file */
+struct disk_options {
+    char *disk_image;       /* Path to the image file */
+    char *bad_sector_list;  /* List of bad sectors in the format x-y,z,... */
+    char *bad_sector_file;  /* File containing a list of bad sectors */
+    char *reserve_sectors;  /* Number of reserve sectors for reallocation */
+    char *disk_size;        /* Size of the image, overriding its file size */
+    char *degrade;          /* How new bad sectors appear, key=value,... */
+    char *latency;          /* How long requests take, key=value,... */
+    char *slow_sectors;     /* Slow sectors in the format x-y@TIME,... */
+    char *journal;          /* Journal file keeping the bad sector state */
+    int partial_reads;      /* Nonzero to return the sectors before a bad
+                             * sector instead of failing the whole read */
+    char *sector_size;      /* Logical sector size in bytes */
+    char *physical_sector_size;
+                            /* Physical sector size in bytes */
+    char *overlay;          /* Copy-on-write overlay file taking the writes,
+                             * leaving the image read-only */
+    char *sync;             /* How flush and fsync reach the image: none,
+                             * data or full */
+    char *spare;            /* Spare file reallocated sectors move to */
+    char *cache;            /* How the page cache takes writes: through or
+                             * back, or none for no cache */
+    char *cache_size;       /* Size of the page cache in bytes */
+    char *trace;            /* Trace file recording the requests checked
+                             * and the changes to the bad sectors */
+};
+
+/* How flush and fsync requests reach the image of a disk */
+enum sync_mode {
+    SYNC_NONE,              /* Not at all, for throwaway images */
+    SYNC_DATA,              /* As fdatasync() */
+    SYNC_FULL               /* As fsync(), or fdatasync() for an fsync
+                             * asking only for the data */
+};
+
+/* Files each disk shows under the mount point */
+enum disk_file {
+    DISK_IMAGE,             /* Mirror of the image file */
+    DISK_STATS,             /* Request statistics */
+    DISK_CONTROL,           /* Takes control commands */
+    DISK_FILES
+};
+
+/* Simulated disk. Each disk has its own image, bad sectors, reserve sectors,
+ * statistics and models, so one mount can serve many of them */
+struct disk {
+    struct disk_options options;
+    char *names[DISK_FILES];        /* Names of the files of the disk under
+                                     * the mount point */
+
+    int fd;                         /* File descriptor to the image file */
+    int direct_fd;                  /* File descriptor to the image file
+                                     * for direct I/O from the io_uring, or
+                                     * -1 */
+    struct stat stat;               /* Attributes of the image file, taken
+                                     * once when it is opened */
+    size_t size;                    /* Size of the disk in bytes */
+
+    /* Logical sector size, which sector numbers count in, and physical
+     * sector size, a power of two multiple of it. Sectors go bad and are
+     * reallocated a physical sector at a time */
+    size_t sector_size;
+    size_t physical_sector_size;
+
+    struct badsector faults;        /* Bad sectors, reserve sectors for
+                                     * reallocation on write, their journal
+                                     * and the request statistics */
+    struct degrade_model degrade_model;
+    struct degrade degrade;         /* Grows new bad sectors over time */
+    struct latency_model latency_model;
+    struct latency latency;         /* Delays injected into requests */
+    enum sync_mode sync_mode;
+    enum cache_mode cache_mode;
+    size_t cache_size;
+    struct cache cache;             /* Pages of the disk kept in memory */
+    struct group_sync group_sync;   /* Shares syncs of the image between
+                                     * concurrent requests */
+    struct overlay overlay;         /* Holds the chunks written when the
+                                     * image is shared read-only, and refers
+                                     * every request to the image otherwise */
+    struct remap remap;             /* Spare area reallocated sectors move
+                                     * to, or none to reallocate them in
+                                     * place */
+    pthread_mutex_t passthrough_lock;
+                                    /* Serializes passthrough opens with
+                                     * injected bad sectors */
+    unsigned int passthrough_opens; /* Image files open with kernel
+                                     * passthrough, which never see bad
+                                     * sectors */
+
+    /* With --lazy the bad sectors are loaded into the map by a thread of
+     * their own after mounting, lowest first. Requests to sectors below
+     * indexed_sectors go ahead, and the rest wait for index_ready */
+    off_t indexed_sectors;          /* Updated atomically, SECTOR_MAX once
+                                     * every bad sector is in the map */
+    int index_failed;               /* Nonzero if the bad sectors couldn't
+                                     * be loaded, failing every request */
+    int index_started;              /* Nonzero while index_thread is
+                                     * there to join */
+    int index_stopping;             /* Set to make the thread give up */
+    pthread_t index_thread;
+    pthread_mutex_t index_lock;
+    pthread_cond_t index_ready;     /* Broadcast as indexed_sectors grows */
+};
+
+/* Disks served by the mount, set up in init_callback() */
+static struct disk *disks = NULL;
+static size_t disk_count = 0;
 
-/* Logical sector size for disk images */
-const static size_t sector_size = 512;
+static double attr_timeout = 1.0;    /* Seconds the kernel may cache the
+                                      * image attributes for */
+static double entry_timeout = 1.0;   /* Seconds the kernel may cache
+                                      * directory entries for */
+static unsigned int log_rate = 100;  /* Events logged per second at most */
 
-/* Global variables populated in init_callback() from command-line arguments */
-static char *filepath = NULL;        /* Path to the actual image file */
-static char *filename = NULL;        /* Disk image file name from path */
-static size_t bad_sector_count = 0;  /* Number of bad sectors */
-static off_t *bad_sectors = NULL;    /* List of bad sectors */
-static size_t reserve_sectors = 0;   /* Number of reserve sectors for
-                                      * reallocation on write */
+/* io_uring settings, from --uring */
+static int use_uring = 0;
+static unsigned int uring_depth = 128;      /* Submissions the ring holds */
+static unsigned int uring_buffers = 0;      /* Buffers registered with the
+                                             * ring */
+static int uring_direct = 0;                /* Nonzero to bypass the page
+                                             * cache where requests allow */
 
-static int disk_image_fd = -1;       /* File descriptor to the image file */
-static size_t disk_size = 0;         /* Size of the image file in bytes */
+/* Nonzero to let the kernel serve the image of a disk without bad sectors on
+ * its own, from --passthrough and once the kernel agreed to it */
+static int use_passthrough = 0;
+
+/* Nonzero to load the bad sectors of the disks after mounting, from
+ * --lazy */
+static int lazy_index = 0;
 
 /* Command-line arguments, populated by filter_disk_opt_proc() */
 struct filter_disk_options {
-    char *disk_image;       /* Path to the image file */
-    char *bad_sector_list;  /* List of bad sectors in the format x-y,z,... */
-    char *reserve_sectors;  /* Number of reserve sectors for reallocation */
+    struct disk_options disk;   /* The disk given on the command line, and
+                                 * defaults for the disks in a config file */
+    char *config;           /* Config file listing the disks */
+    char *attr_timeout;     /* Attribute cache timeout in seconds */
+    char *entry_timeout;    /* Directory entry cache timeout in seconds */
+    char *log_destination;  /* Event log file, "-", "syslog" or "none" */
+    char *log_rate;         /* Events logged per second at most, 0 for all */
+    int uring;              /* Nonzero to serve image I/O through io_uring */
+    char *uring_options;    /* io_uring settings, key=value,... */
+    int passthrough;        /* Nonzero to pass image I/O to the kernel */
+    int lazy;               /* Nonzero to load the bad sectors after
+                             * mounting */
 };
 
-static struct filter_disk_options filter_disk_options = {NULL, NULL, NULL};
+static struct filter_disk_options filter_disk_options;
 
-/* Get and return the size of the image file in bytes. Populate disk_size on the
- * first call and then simply return that on additional calls */
-size_t get_disk_size()
+/* Parse a cache timeout in seconds */
+/* Returns 0 on success and nonzero if the timeout is invalid */
+static int parse_timeout(const char *text, double *timeout)
 {
-    if (0 == disk_size)
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || '\0' != *end || value < 0)
+        return -1;
+
+    *timeout = value;
+    return 0;
+}
+
+/* Parse a degradation model in the format key=value,... with the keys
+ *
+ *   rate=N/UNIT    N defects per s, m, h or d on average
+ *   write=N/SIZE   N defects per SIZE bytes written on average, where SIZE
+ *                  takes the same suffixes as --size
+ *   cluster=P      chance from 0 to 1 that a defect grows next to an existing
+ *                  bad extent
+ *   spread=N       largest gap in sectors between a clustered defect and its
+ *                  neighbour
+ *   size=N[-M]     size of a defect in sectors, or a range to pick from
+ *   seed=N         seed for the random number generators
+ *
+ * Keys that aren't given keep their value in *model */
+/* Returns 0 on success and nonzero if the model is invalid */
+static int parse_degrade_model(const char *text, struct degrade_model *model)
+{
+    char *copy = strdup(text);
+    char *saved;
+    int ret = 0;
+
+    if (NULL == copy)
+        return -1;
+
+    for (char *item = strtok_r(copy, ",", &saved); NULL != item && 0 == ret;
+            item = strtok_r(NULL, ",", &saved))
     {
-        struct stat st;
-        stat(filter_disk_options.disk_image, &st);
-        disk_size = st.st_size;
+        char *value = strchr(item, '=');
+        char *end;
+
+        if (NULL == value)
+        {
+            ret = -1;
+            break;
+        }
+        *value++ = '\0';
+        errno = 0;
+
+        if (0 == strcmp(item, "rate") || 0 == strcmp(item, "write"))
+        {
+            double count = strtod(value, &end);
+            size_t per = 1;
+
+            if (end == value || '/' != *end || count < 0)
+            {
+                ret = -1;
+                break;
+            }
+            end++;
+
+            if (0 == strcmp(item, "write"))
+            {
+                if (0 != parse_disk_size(end, &per) || 0 == per)
+                    ret = -1;
+                else
+                    model->bytes_per_defect = 0 == count ? 0 : per / count;
+                continue;
+            }
+
+            switch (*end)
+            {
+            case 'd': per *= 24; /* fall through */
+            case 'h': per *= 60; /* fall through */
+            case 'm': per *= 60; /* fall through */
+            case 's': break;
+            default: ret = -1; break;
+            }
+            if (0 != ret || '\0' != end[1])
+                ret = -1;
+            else
+                model->defects_per_second = count / per;
+        }
+        else if (0 == strcmp(item, "cluster"))
+        {
+            model->cluster = strtod(value, &end);
+            if (end == value || '\0' != *end || model->cluster < 0 ||
+                    model->cluster > 1)
+                ret = -1;
+        }
+        else if (0 == strcmp(item, "spread") || 0 == strcmp(item, "seed"))
+        {
+            unsigned long long number = strtoull(value, &end, 10);
+
+            if (end == value || '\0' != *end || 0 != errno ||
+                    (0 == number && 0 == strcmp(item, "spread")))
+                ret = -1;
+            else if (0 == strcmp(item, "spread"))
+                model->spread = number;
+            else
+                model->seed = number;
+        }
+        else if (0 == strcmp(item, "size"))
+        {
+            const char *cursor = value;
+            off_t first;
+            off_t last;
+
+            if (0 != parse_sector(&cursor, value + strlen(value), &first))
+                ret = -1;
+            last = first;
+            if (0 == ret && '-' == *cursor)
+            {
+                cursor++;
+                if (0 != parse_sector(&cursor, value + strlen(value), &last))
+                    ret = -1;
+            }
+            if (0 == ret && ('\0' != *cursor || 0 == first || last < first))
+                ret = -1;
+
+            model->min_sectors = first;
+            model->max_sectors = last;
+        }
+        else
+            ret = -1;
+    }
+
+    free(copy);
+    return ret;
+}
+
+/* Parse a duration with an optional ns, us, ms or s suffix, milliseconds if
+ * there is none, at *text and advance *text past it */
+/* Returns 0 on success and nonzero if the duration is invalid */
+static int parse_duration(const char **text, uint64_t *duration)
+{
+    char *end;
+    double value = strtod(*text, &end);
+    double unit = 1e6;
+
+    if (end == *text || value < 0)
+        return -1;
+
+    if (0 == strncmp(end, "ns", 2))
+    {
+        unit = 1;
+        end += 2;
+    }
+    else if (0 == strncmp(end, "us", 2))
+    {
+        unit = 1e3;
+        end += 2;
+    }
+    else if (0 == strncmp(end, "ms", 2))
+        end += 2;
+    else if ('s' == *end)
+    {
+        unit = 1e9;
+        end++;
     }
 
-    return disk_size;
+    *duration = value * unit;
+    *text = end;
+    return 0;
 }
 
-/* Count the number of bad sectors by parsing the sector list argument */
-size_t get_sector_count(const char *sector_list)
+/* Parse a latency model in the format key=value,... with the keys
+ *
+ *   fixed=TIME             delay added to every request
+ *   random=uniform:LOW-HIGH
+ *   random=exp:MEAN
+ *   random=normal:MEAN/DEVIATION
+ *                          random delay added to every request
+ *   seek=TIME              time of a full-stroke seek
+ *   rpm=N                  spindle speed, for rotational delay after seeks
+ *   error=TIME             time spent retrying a bad sector before failing
+ *
+ * Times are in milliseconds unless given with an ns, us, ms or s suffix */
+/* Returns 0 on success and nonzero if the model is invalid */
+static int parse_latency_model(const char *text, struct latency_model *model)
 {
-    size_t sector_count = 0;
-    char *sector_end;
-    /* Get the first sector */
-    off_t first_sector = strtoul(sector_list, &sector_end, 10);
+    char *copy = strdup(text);
+    char *saved;
+    int ret = 0;
 
-    /* If there are more sectors in the list and this isn't a range, recurse */
-    if (*sector_end == ',')
-        sector_count = 1 + get_sector_count(sector_end + 1);
-    /* If this is a range, add the number in the range */
-    else if (*sector_end == '-')
+    if (NULL == copy)
+        return -1;
+
+    for (char *item = strtok_r(copy, ",", &saved); NULL != item && 0 == ret;
+            item = strtok_r(NULL, ",", &saved))
     {
-        char *real_end;
-        off_t last_sector = strtoul(sector_end + 1, &real_end, 10);
+        char *equals = strchr(item, '=');
+        const char *value;
+
+        if (NULL == equals)
+        {
+            ret = -1;
+            break;
+        }
+        *equals = '\0';
+        value = equals + 1;
+
+        if (0 == strcmp(item, "fixed"))
+            ret = parse_duration(&value, &model->fixed);
+        else if (0 == strcmp(item, "seek"))
+            ret = parse_duration(&value, &model->seek);
+        else if (0 == strcmp(item, "error"))
+            ret = parse_duration(&value, &model->error);
+        else if (0 == strcmp(item, "rpm"))
+        {
+            char *end;
+            unsigned long rpm;
+
+            errno = 0;
+            rpm = strtoul(value, &end, 10);
+            if (end == value || 0 != errno || 0 == rpm || rpm > UINT_MAX)
+                ret = -1;
+            model->rpm = rpm;
+            value = end;
+        }
+        else if (0 == strcmp(item, "random"))
+        {
+            char separator = '\0';
+
+            if (0 == strncmp(value, "uniform:", 8))
+            {
+                model->distribution = LATENCY_UNIFORM;
+                separator = '-';
+                value += 8;
+            }
+            else if (0 == strncmp(value, "exp:", 4))
+            {
+                model->distribution = LATENCY_EXPONENTIAL;
+                value += 4;
+            }
+            else if (0 == strncmp(value, "normal:", 7))
+            {
+                model->distribution = LATENCY_NORMAL;
+                separator = '/';
+                value += 7;
+            }
+            else
+                ret = -1;
 
-        sector_count = last_sector - first_sector + 1;
+            if (0 == ret)
+                ret = parse_duration(&value, &model->low);
+            model->high = model->low;
+            if (0 == ret && '\0' != separator)
+            {
+                if (separator != *value++ ||
+                        0 != parse_duration(&value, &model->high))
+                    ret = -1;
+                else if (LATENCY_UNIFORM == model->distribution &&
+                        model->high < model->low)
+                    ret = -1;
+            }
+        }
+        else
+            ret = -1;
 
-        /* If there are more sectors in the list, recurse */
-        if (*real_end == ',')
-            sector_count += get_sector_count(real_end + 1);
+        if (0 == ret && '\0' != *value)
+            ret = -1;
     }
-    /* This is the end of the list */
-    else
-        sector_count = 1;
 
-    return sector_count;
+    free(copy);
+    return ret;
 }
 
-/* Create a list of bad sectors by parsing the sector list argument */
-void add_bad_sectors(const char *sector_list, off_t *sector_array)
+/* Parse a list of slow sectors in the format x-y@TIME,z@TIME,... where TIME
+ * is the delay added to requests touching them, as for parse_latency_model(),
+ * and append them to the model */
+/* Returns 0 on success and nonzero on a syntax or allocation error */
+static int parse_slow_sectors(const char *text, struct latency_model *model)
 {
-    char *sector_end;
-    /* Get the first sector and add it to the list */
-    off_t first_sector = strtoul(sector_list, &sector_end, 10);
-    sector_array[0] = first_sector;
+    const char *end = text + strlen(text);
 
-    /* If there are more sectors in the list and this isn't a range, recurse */
-    if (*sector_end == ',')
-        add_bad_sectors(sector_end + 1, sector_array + 1);
-    /* If this is a range, add the range to the list of bad sectors */
-    else if (*sector_end == '-')
+    while (text < end)
     {
-        char *real_end;
-        off_t last_sector = strtoul(sector_end + 1, &real_end, 10);
+        struct latency_extent extent;
+
+        if (',' == *text)
+        {
+            text++;
+            continue;
+        }
+
+        if (0 != parse_sector(&text, end, &extent.first))
+            return -1;
+
+        extent.last = extent.first;
+        if ('-' == *text)
+        {
+            text++;
+            if (0 != parse_sector(&text, end, &extent.last))
+                return -1;
+        }
 
-        for (off_t i = first_sector + 1; i <= last_sector; i++)
-            sector_array[i - first_sector] = i;
+        if ('@' != *text++ || 0 != parse_duration(&text, &extent.delay) ||
+                (',' != *text && '\0' != *text))
+            return -1;
+
+        if (extent.last < extent.first)
+        {
+            off_t sector = extent.first;
+            extent.first = extent.last;
+            extent.last = sector;
+        }
 
-        /* If there are more sectors in the list, recurse */
-        if (*real_end == ',')
-            add_bad_sectors(real_end + 1, 
-                    sector_array + last_sector - first_sector + 1);
+        struct latency_extent *slow = realloc(model->slow,
+                (model->slow_count + 1) * sizeof(struct latency_extent));
+        if (NULL == slow)
+            return -1;
+        model->slow = slow;
+        model->slow[model->slow_count++] = extent;
     }
+
+    return 0;
+}
+
+/* Bad sectors loaded into the map at a time with --lazy, as a share of them
+ * all. Every batch copies the map, so there are only a few */
+#define INDEX_BATCHES 16
+
+/* Return the number of sectors of a disk, counting a partial last one */
+static off_t disk_sectors(const struct disk *disk)
+{
+    return (disk->size + disk->sector_size - 1) / disk->sector_size;
+}
+
+/* Find an extent of a list that reaches past the end of a disk */
+/* Returns nonzero if there is one, storing its last sector in *sector */
+static int find_past_end(const struct disk *disk,
+        const struct extent_list *list, off_t *sector)
+{
+    off_t sectors = disk_sectors(disk);
+
+    for (size_t i = 0; i < list->count; i++)
+        if (list->extents[i].last >= sectors)
+        {
+            *sector = list->extents[i].last;
+            return 1;
+        }
+
+    return 0;
 }
 
-/* Build the list of bad sectors using the recursive helper functions above */
-void build_bad_sector_list(const char *sector_list)
+/* Load the bad sectors of a disk from its sector list and sector list file
+ * options, either of which may be NULL, into list. Every bad sector must lie
+ * within the disk */
+/* Returns 0 on success and nonzero on error, in which case list is freed */
+static int load_bad_sector_list(const struct disk *disk,
+        struct extent_list *list)
 {
-    /* If we don't have a bad sector list argument, nothing to do */
-    if (NULL != sector_list)
+    const char *sector_list = disk->options.bad_sector_list;
+    const char *sector_file = disk->options.bad_sector_file;
+    off_t sector;
+
+    if (NULL != sector_list &&
+            0 != parse_sector_list(sector_list, strlen(sector_list), list))
+    {
+        fprintf(stderr, "Invalid bad sector list: %s\n", sector_list);
+        goto fail;
+    }
+
+    if (NULL != sector_file && 0 != load_sector_file(sector_file, list))
+    {
+        fprintf(stderr, "Failed to load bad sector file %s\n", sector_file);
+        goto fail;
+    }
+
+    if (find_past_end(disk, list, &sector))
     {
-        bad_sector_count = get_sector_count(sector_list);
-        bad_sectors = malloc(bad_sector_count * sizeof(off_t));
-        add_bad_sectors(sector_list, bad_sectors);
+        fprintf(stderr, "Bad sector %lld is past the end of %s, which has "
+                "%lld sectors\n", (long long)sector, disk->names[DISK_IMAGE],
+                (long long)disk_sectors(disk));
+        goto fail;
     }
+
+    return 0;
+
+fail:
+    free(list->extents);
+    memset(list, 0, sizeof(struct extent_list));
+    return -1;
 }
 
-/* Repair a bad sector at the specified offset */
-/* Returns 0 on success and nonzero on error (if there are no reserve sectors
- * available) */
-int repair_bad_sector(off_t sector)
+/* Build the bad sector map of a disk from its sector list and sector list
+ * file options. If the disk has a journal that holds a state already, the
+ * map is loaded from it instead. With --lazy a disk without a journal starts
+ * with no bad sectors, which index_main() loads once the disk is served */
+/* Returns 0 on success and nonzero on error */
+int build_bad_sector_list(struct disk *disk, uint64_t reserve_sectors)
 {
-    int ret = -1;
+    const char *journal_path = disk->options.journal;
+    struct extent_list list = {NULL, 0, 0};
+    int lazy = lazy_index && NULL == journal_path;
+    off_t sector;
+
+    if (!lazy && 0 != load_bad_sector_list(disk, &list))
+        return -1;
 
-    if (reserve_sectors > 0)
+    if (0 != badsector_init(&disk->faults, disk->sector_size,
+            disk->physical_sector_size, &list, reserve_sectors, journal_path))
     {
-        /* Make sure the sector provided is in the bad sector list */
-        for (off_t i = 0; i < bad_sector_count; i++)
-            if (bad_sectors[i] == sector)
-            {
-                /* Decrement the number of bad sectors, remove the sector from
-                 * the bad sector list, and decrement the number of reserve
-                 * sectors */
-                bad_sector_count--;
-                off_t *old_bad_sectors = bad_sectors;
-                bad_sectors = malloc(bad_sector_count * sizeof(off_t));
-                memcpy(bad_sectors, old_bad_sectors, i * sizeof(off_t));
-                memcpy(bad_sectors + i,
-                        old_bad_sectors + i + 1,
-                        (bad_sector_count - i) * sizeof(off_t));
-                free(old_bad_sectors);
-                reserve_sectors--;
-                ret = 0;
-                break;
-            }
+        if (NULL != journal_path)
+            fprintf(stderr, "Failed to open journal %s: %s\n", journal_path,
+                    strerror(errno));
+        else
+            fprintf(stderr, "Failed to allocate bad sector map\n");
+        return -1;
     }
+    disk->faults.partial_reads = disk->options.partial_reads;
 
-    return ret;
+    /* The journal may have been kept for a larger disk */
+    if (NULL != journal_path && badsector_find(&disk->faults,
+            disk_sectors(disk), SECTOR_MAX, &sector))
+    {
+        fprintf(stderr, "Bad sector %lld in journal %s is past the end of "
+                "%s\n", (long long)sector, journal_path,
+                disk->names[DISK_IMAGE]);
+        return -1;
+    }
+
+    if (!lazy)
+        disk->indexed_sectors = SECTOR_MAX;
+
+    return 0;
 }
 
-/* getattr() FUSE callback */
-static int getattr_callback(const char *path, struct stat *stbuf)
+/* Let requests to a disk up to indexed_sectors go ahead */
+static void publish_index(struct disk *disk, off_t indexed_sectors)
 {
-    memset(stbuf, 0, sizeof(struct stat));
+    pthread_mutex_lock(&disk->index_lock);
+    __atomic_store_n(&disk->indexed_sectors, indexed_sectors,
+            __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&disk->index_ready);
+    pthread_mutex_unlock(&disk->index_lock);
+}
 
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
+/* Wait until the bad sectors of a disk up to last_sector are in its map */
+/* Returns 0 once they are and nonzero if they couldn't be loaded */
+static int wait_for_index(struct disk *disk, off_t last_sector)
+{
+    if (__atomic_load_n(&disk->indexed_sectors, __ATOMIC_ACQUIRE) <=
+            last_sector)
+    {
+        pthread_mutex_lock(&disk->index_lock);
+        while (disk->indexed_sectors <= last_sector)
+            pthread_cond_wait(&disk->index_ready, &disk->index_lock);
+        pthread_mutex_unlock(&disk->index_lock);
+    }
+
+    return disk->index_failed ? -1 : 0;
+}
+
+/* Thread loading the bad sectors of a disk with --lazy. They are sorted and
+ * added to the map in INDEX_BATCHES batches, lowest first, and each batch
+ * lets the requests up to the next one go ahead. If the bad sectors can't be
+ * loaded every request to the disk fails */
+static void *index_main(void *data)
+{
+    struct disk *disk = data;
+    struct extent_list list = {NULL, 0, 0};
+    off_t sectors_per_physical = disk->faults.sectors_per_physical;
+    int ret = load_bad_sector_list(disk, &list);
+
+    if (0 == ret)
+        extent_list_sort(&list);
+
+    size_t batch = list.count / INDEX_BATCHES + 1;
+    for (size_t i = 0; 0 == ret && i < list.count; i += batch)
+    {
+        size_t count = list.count - i < batch ? list.count - i : batch;
+        struct fault_map_change change = {0, {list.extents + i, count, count}};
+
+        /* Unmounting doesn't wait for the rest */
+        if (__atomic_load_n(&disk->index_stopping, __ATOMIC_RELAXED))
+            break;
+
+        if (0 != badsector_update(&disk->faults, &change, 1))
+        {
+            fprintf(stderr, "Failed to allocate bad sector map\n");
+            ret = -1;
+        }
+        else if (i + count < list.count)
+            publish_index(disk, list.extents[i + count].first /
+                    sectors_per_physical * sectors_per_physical);
+    }
+    free(list.extents);
+
+    if (0 != ret)
+    {
+        fprintf(stderr, "Failed to load the bad sectors of %s, failing its "
+                "requests\n", disk->names[DISK_IMAGE]);
+        disk->index_failed = 1;
+    }
+    publish_index(disk, SECTOR_MAX);
+
+    return NULL;
+}
+
+/* Queue an event about a request to a disk for the event log */
+static void log_request_event(const struct disk *disk, enum event_kind kind,
+        enum event_op op, off_t offset, size_t size, off_t sector,
+        uint64_t sector_count, int error, uint64_t start)
+{
+    struct event event;
+
+    memset(&event, 0, sizeof(struct event));
+    event.kind = kind;
+    event.op = op;
+    event.offset = offset;
+    event.size = size;
+    event.sector = sector;
+    event.sector_count = sector_count;
+    event.error = error;
+    event.latency = event_clock() - start;
+    event.disk = NULL != disk ? disk->names[DISK_IMAGE] : NULL;
+
+    event_log_record(&event);
+}
+
+/* Count a finished request in the statistics of a disk. result is the number
+ * of bytes transferred or a negative errno value */
+static void count_request(struct disk *disk, enum stats_op op, ssize_t result,
+        uint64_t start)
+{
+    stats_record(&disk->faults.stats, op, result < 0 ? 0 : result,
+            event_clock() - start, result < 0 ? -result : 0);
+
+    if (STATS_OP_WRITE == op && result > 0)
+        degrade_count_written(&disk->degrade, result);
+}
+
+/* Work out how long the head of a disk takes to go out to the spare area
+ * and back for each run of a request that has been remapped there. The spare
+ * area lies past the last sector of the disk */
+/* Returns the delay in nanoseconds */
+static uint64_t spare_delay(struct disk *disk, size_t size, off_t offset)
+{
+    uint64_t delay = 0;
+    size_t length;
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        off_t position;
+        if (-1 == remap_lookup(&disk->remap, offset + done, size - done,
+                &position, &length))
+            continue;
+
+        off_t first_sector = (offset + done) / disk->sector_size;
+        off_t last_sector = (offset + done + length - 1) / disk->sector_size;
+        off_t spare = disk->latency.sector_count +
+                position / disk->sector_size;
+        delay += latency_seek(&disk->latency, first_sector, spare) +
+                latency_seek(&disk->latency,
+                spare + (last_sector - first_sector) + 1, last_sector + 1);
+    }
+
+    return delay;
+}
+
+/* Work out how long a disk takes to serve a request, according to its
+ * latency model. failed is nonzero if the request hits a bad sector */
+/* Returns the delay in nanoseconds */
+static uint64_t request_delay(struct disk *disk, size_t size, off_t offset,
+        int failed)
+{
+    if (!disk->latency.enabled || 0 == size)
+        return 0;
+
+    uint64_t delay = latency_delay(&disk->latency, offset / disk->sector_size,
+            (offset + size - 1) / disk->sector_size, failed);
+    if (-1 != disk->remap.fd)
+        delay += spare_delay(disk, size, offset);
+
+    return delay;
+}
+
+/* Truncate a request at the end of a disk */
+/* Returns the number of bytes of the request that are within the disk */
+static size_t clamp_to_disk(const struct disk *disk, enum event_op op,
+        size_t size, off_t offset, uint64_t start)
+{
+    if (offset >= disk->size)
+    {
+        log_request_event(disk, EVENT_PAST_END, op, offset, size, 0, 0, 0,
+                start);
+        return 0;
+    }
+
+    if (offset + size > disk->size)
+    {
+        log_request_event(disk, EVENT_TRUNCATED, op, offset, size, 0, 0, 0,
+                start);
+        size = disk->size - offset;
+    }
+
+    return size;
+}
+
+/* Check the sectors covered by a request against the bad sectors of a disk
+ * and log what happened. Bad sectors are reallocated for writes if there are
+ * reserve sectors left, and with partial reads enabled a read that hits a bad
+ * sector after its first sector is cut short before the bad sector. If
+ * reallocated is not NULL the extents of sectors a write reallocated are
+ * appended to it */
+/* Returns 0 if *size bytes of the request may be passed through to the image
+ * and nonzero if it has to fail with an I/O error */
+static int check_request(struct disk *disk, enum event_op op, size_t *size,
+        off_t offset, uint64_t start, struct extent_list *reallocated)
+{
+    size_t requested = *size;
+    struct badsector_result result;
+
+    if (0 != *size && 0 != wait_for_index(disk,
+            (offset + *size - 1) / disk->sector_size))
+        return -1;
+
+    enum badsector_verdict verdict;
+    if (NULL != reallocated)
+        verdict = badsector_check_write(&disk->faults, offset, size, &result,
+                reallocated);
+    else
+        verdict = badsector_check(&disk->faults,
+                EVENT_OP_WRITE == op ? STATS_OP_WRITE : STATS_OP_READ,
+                offset, size, &result);
+
+    if (0 != result.reallocated)
+        log_request_event(disk, EVENT_REALLOCATED, op, offset, requested,
+                result.reallocated_sector, result.reallocated, 0, start);
+
+    if (BADSECTOR_PASS == verdict)
         return 0;
+
+    log_request_event(disk,
+            BADSECTOR_SHORT == verdict ? EVENT_SHORT_READ : EVENT_IO_ERROR,
+            op, offset, requested, result.bad_sector,
+            disk->faults.sectors_per_physical, EIO, start);
+
+    return BADSECTOR_FAIL == verdict ? -1 : 0;
+}
+
+/* Find the file that holds the data of a disk at offset. Sectors that have
+ * been remapped are in the spare file, and the rest are in the overlay or
+ * the image for a read, or in fd for a write if fd isn't -1. *length is set
+ * to the number of bytes from offset, at most size, that follow on in the
+ * same file */
+/* Returns the file descriptor, storing the offset of the data in it in
+ * *position */
+static int disk_lookup(struct disk *disk, int fd, off_t offset, size_t size,
+        off_t *position, size_t *length)
+{
+    int spare_fd = remap_lookup(&disk->remap, offset, size, position, length);
+
+    if (-1 != spare_fd)
+        return spare_fd;
+
+    *position = offset;
+    if (-1 != fd)
+        return fd;
+    return overlay_lookup(&disk->overlay, offset, *length, length);
+}
+
+/* Read from a disk, taking each part from the file that holds it */
+/* Returns the number of bytes read, or -1 with errno set */
+static ssize_t disk_pread(struct disk *disk, void *buf, size_t size,
+        off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        off_t position;
+        size_t length;
+        ssize_t res;
+        int fd = remap_lookup(&disk->remap, offset + done, size - done,
+                &position, &length);
+
+        if (-1 != fd)
+            res = pread(fd, (char *)buf + done, length, position);
+        else
+            res = overlay_pread(&disk->overlay, (char *)buf + done, length,
+                    offset + done);
+        if (res < 0)
+            return 0 != done ? (ssize_t)done : -1;
+
+        done += res;
+        if ((size_t)res < length)
+            break;
+    }
+
+    return done;
+}
+
+/* Write to a disk, sending the sectors that have been remapped to the spare
+ * file and the rest to fd */
+/* Returns the number of bytes written, or -1 with errno set */
+static ssize_t disk_pwrite(struct disk *disk, int fd, const void *buf,
+        size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        off_t position;
+        size_t length;
+        int part_fd = disk_lookup(disk, fd, offset + done, size - done,
+                &position, &length);
+        ssize_t res = pwrite(part_fd, (const char *)buf + done, length,
+                position);
+
+        if (res < 0)
+            return 0 != done ? (ssize_t)done : -1;
+
+        done += res;
+        if ((size_t)res < length)
+            break;
+    }
+
+    return done;
+}
+
+/* Read count buffers that follow on from each other at offset of a disk,
+ * for its page cache */
+/* Returns the number of bytes read, or -1 with errno set */
+static ssize_t disk_preadv(void *context, const struct iovec *iov, int count,
+        off_t offset)
+{
+    struct disk *disk = context;
+    size_t size = 0;
+    off_t position;
+    size_t length;
+
+    for (int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+
+    int fd = disk_lookup(disk, -1, offset, size, &position, &length);
+    if (length == size)
+        return preadv(fd, iov, count, position);
+
+    size_t done = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ssize_t res = disk_pread(disk, iov[i].iov_base, iov[i].iov_len,
+                offset + done);
+        if (res < 0)
+            return 0 != done ? (ssize_t)done : -1;
+
+        done += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+
+    return done;
+}
+
+/* Write count buffers that follow on from each other at offset of a disk,
+ * for its page cache */
+/* Returns the number of bytes written, or -1 with errno set */
+static ssize_t disk_pwritev(void *context, const struct iovec *iov,
+        int count, off_t offset)
+{
+    struct disk *disk = context;
+    size_t size = 0;
+    off_t position;
+    size_t length;
+    ssize_t res;
+    int locked;
+
+    for (int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+
+    int fd = overlay_begin_write(&disk->overlay, offset, size, &locked);
+    if (-1 == fd)
+        return -1;
+
+    int part_fd = disk_lookup(disk, fd, offset, size, &position, &length);
+    if (length == size)
+        res = pwritev(part_fd, iov, count, position);
+    else
+    {
+        res = 0;
+        for (int i = 0; i < count; i++)
+        {
+            ssize_t written = disk_pwrite(disk, fd, iov[i].iov_base,
+                    iov[i].iov_len, offset + res);
+            if (written < 0 && 0 == res)
+                res = -1;
+            if (written < 0)
+                break;
+
+            res += written;
+            if ((size_t)written < iov[i].iov_len)
+                break;
+        }
+    }
+
+    overlay_end_write(&disk->overlay, offset, size, res, locked);
+    return res;
+}
+
+/* Read from a disk through its page cache, if it has one */
+/* Returns the number of bytes read, or -1 with errno set */
+static ssize_t disk_read(struct disk *disk, void *buf, size_t size,
+        off_t offset)
+{
+    if (CACHE_NONE != disk->cache.mode)
+        return cache_read(&disk->cache, buf, size, offset);
+    return disk_pread(disk, buf, size, offset);
+}
+
+/* Check a write against the bad sectors of a disk as check_request() does.
+ * With a spare file the physical sectors the write reallocates are remapped
+ * to the spare area, taking the data they held along */
+/* Returns 0 if *size bytes of the write may go ahead and nonzero if it has to
+ * fail with an I/O error */
+static int check_write(struct disk *disk, size_t *size, off_t offset,
+        uint64_t start)
+{
+    size_t sectors_per_physical = disk->faults.sectors_per_physical;
+    size_t physical_size = disk->physical_sector_size;
+    struct extent_list list = {NULL, 0, 0};
+
+    if (-1 == disk->remap.fd)
+        return check_request(disk, EVENT_OP_WRITE, size, offset, start,
+                NULL);
+
+    /* Only what the engine reports took part in this write, whatever other
+     * writers and the control file do meanwhile */
+    int failed = check_request(disk, EVENT_OP_WRITE, size, offset, start,
+            &list);
+
+    size_t count = 0;
+    for (size_t i = 0; i < list.count; i++)
+        count += (list.extents[i].last - list.extents[i].first + 1) /
+                sectors_per_physical;
+    if (0 == count)
+    {
+        free(list.extents);
+        return failed;
+    }
+
+    /* Until the write lands, a slot holds what its sector held before */
+    off_t *sectors = malloc(count * sizeof(off_t));
+    char *data = calloc(count, physical_size);
+    if (NULL == sectors || NULL == data)
+        failed = -1;
+
+    size_t reallocated = 0;
+    for (size_t i = 0; i < list.count && 0 == failed; i++)
+        for (off_t sector = list.extents[i].first;
+                sector <= list.extents[i].last && 0 == failed;
+                sector += sectors_per_physical)
+        {
+            if (disk_pread(disk, data + reallocated * physical_size,
+                    physical_size, sector * disk->sector_size) < 0)
+                failed = -1;
+            sectors[reallocated++] = sector / sectors_per_physical;
+        }
+    if (0 == failed &&
+            0 != remap_sectors(&disk->remap, sectors, data, reallocated))
+        failed = -1;
+
+    free(data);
+    free(sectors);
+    free(list.extents);
+    return failed;
+}
+
+/* Open the image of a disk and build its bad sector map from its options */
+/* Returns 0 on success and nonzero on error */
+static int setup_disk(struct disk *disk)
+{
+    const struct disk_options *options = &disk->options;
+
+    if (0 != group_sync_init(&disk->group_sync) ||
+            0 != pthread_mutex_init(&disk->passthrough_lock, NULL) ||
+            0 != pthread_mutex_init(&disk->index_lock, NULL) ||
+            0 != pthread_cond_init(&disk->index_ready, NULL))
+    {
+        fprintf(stderr, "Failed to set up image syncs\n");
+        return -1;
+    }
+
+    /* With an overlay the image is never written, so many mounts can share
+     * it */
+    disk->fd = open(options->disk_image,
+            NULL != options->overlay ? O_RDONLY : O_RDWR);
+    if (-1 == disk->fd || 0 != fstat(disk->fd, &disk->stat))
+    {
+        fprintf(stderr, "Failed to open disk image %s: %s\n",
+                options->disk_image, strerror(errno));
+        return -1;
+    }
+
+    /* Requests in the ring that are aligned for it bypass the page cache
+     * through a second descriptor */
+    if (uring_direct)
+    {
+        disk->direct_fd = uring_open_direct(options->disk_image,
+                NULL != options->overlay ? O_RDONLY : O_RDWR);
+        if (-1 == disk->direct_fd)
+            fprintf(stderr, "No direct I/O to %s, using the page cache: %s\n",
+                    options->disk_image, strerror(errno));
+    }
+
+    /* The image size comes from the size option if given. Block devices
+     * report a st_size of 0, so ask the device itself */
+    if (NULL != options->disk_size)
+    {
+        if (0 != parse_disk_size(options->disk_size, &disk->size))
+        {
+            fprintf(stderr, "Invalid disk size: %s\n", options->disk_size);
+            return -1;
+        }
+    }
+#ifdef BLKGETSIZE64
+    else if (S_ISBLK(disk->stat.st_mode))
+    {
+        uint64_t size;
+        if (0 != ioctl(disk->fd, BLKGETSIZE64, &size))
+        {
+            fprintf(stderr, "Failed to get the size of %s: %s\n",
+                    options->disk_image, strerror(errno));
+            return -1;
+        }
+        disk->size = size;
+    }
+#endif
+    else
+        disk->size = disk->stat.st_size;
+
+    if (0 != overlay_open(&disk->overlay, options->overlay, disk->fd,
+            disk->size))
+    {
+        fprintf(stderr, "Failed to open overlay %s: %s\n", options->overlay,
+                strerror(errno));
+        return -1;
+    }
+
+    if (0 != remap_open(&disk->remap, options->spare,
+            disk->physical_sector_size))
+    {
+        fprintf(stderr, "Failed to open spare file %s: %s\n", options->spare,
+                strerror(errno));
+        return -1;
+    }
+
+    if (0 != cache_init(&disk->cache, disk->cache_mode, disk->cache_size,
+            disk->size, disk_preadv, disk_pwritev, disk))
+    {
+        fprintf(stderr, "Failed to allocate page cache\n");
+        return -1;
+    }
+
+    uint64_t reserve_sectors = 0;
+    if (NULL != options->reserve_sectors)
+    {
+        const char *value = options->reserve_sectors;
+        char *end;
+
+        /* strtoull() would take a sign and wrap a negative number around */
+        errno = 0;
+        reserve_sectors = strtoull(value, &end, 10);
+        if (0 != errno || '0' > *value || '9' < *value || '\0' != *end)
+        {
+            fprintf(stderr, "Invalid number of reserve sectors for %s: %s\n",
+                    disk->names[DISK_IMAGE], value);
+            return -1;
+        }
+    }
+
+    if (0 != build_bad_sector_list(disk, reserve_sectors))
+        return -1;
+
+    if (NULL != options->trace &&
+            0 != badsector_trace(&disk->faults, options->trace))
+    {
+        fprintf(stderr, "Failed to open trace file %s: %s\n", options->trace,
+                strerror(errno));
+        return -1;
+    }
+
+    if (0 != degrade_start(&disk->degrade, &disk->degrade_model,
+            &disk->faults.map, disk->size / disk->physical_sector_size,
+            disk->faults.sectors_per_physical, disk->names[DISK_IMAGE]))
+    {
+        fprintf(stderr, "Failed to start growing bad sectors\n");
+        return -1;
+    }
+
+    /* latency_init() takes over the list of slow sectors */
+    int ret = latency_init(&disk->latency, &disk->latency_model,
+            disk->size / disk->sector_size);
+    disk->latency_model.slow = NULL;
+    disk->latency_model.slow_count = 0;
+    if (0 != ret)
+    {
+        fprintf(stderr, "Failed to allocate latency model\n");
+        return -1;
+    }
+
+    if (SECTOR_MAX != disk->indexed_sectors)
+    {
+        if (0 != pthread_create(&disk->index_thread, NULL, index_main, disk))
+        {
+            fprintf(stderr, "Failed to start loading bad sectors\n");
+            return -1;
+        }
+        disk->index_started = 1;
+    }
+
+    return 0;
+}
+
+/* Start the event log and set up every disk. Called from the init() FUSE
+ * callback */
+/* Returns 0 on success and nonzero on error */
+static int setup_disk_images(void)
+{
+    int delayed = 0;
+
+    if (0 != event_log_start(filter_disk_options.log_destination,
+            log_rate))
+    {
+        fprintf(stderr, "Failed to open event log %s: %s\n",
+                filter_disk_options.log_destination, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < disk_count; i++)
+    {
+        if (0 != setup_disk(disks + i))
+        {
+            fprintf(stderr, "Failed to set up disk %s\n",
+                    disks[i].names[DISK_IMAGE]);
+            return -1;
+        }
+        delayed |= disks[i].latency.enabled;
+    }
+
+#ifdef USE_FUSE3_LOWLEVEL
+    /* Delayed requests are answered from the timer thread */
+    if (delayed && 0 != timer_wheel_start())
+    {
+        fprintf(stderr, "Failed to start timer thread\n");
+        return -1;
+    }
+
+    if (use_uring && 0 != uring_start(uring_depth, uring_buffers,
+            MAX_REQUEST_SIZE))
+    {
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* Release everything set up by setup_disk_images(). Called from the destroy()
+ * FUSE callback */
+static void teardown_disk_images(void)
+{
+    struct event event;
+
+    memset(&event, 0, sizeof(struct event));
+    event.kind = EVENT_UNMOUNT;
+    event_log_record(&event);
+
+    /* Flush the requests in the ring and the delayed replies before the
+     * disks they count against go. Completions can still add delayed
+     * replies, so the ring goes first */
+    uring_stop();
+    timer_wheel_stop();
+
+    for (size_t i = 0; i < disk_count; i++)
+    {
+        struct disk *disk = disks + i;
+
+        if (disk->index_started)
+        {
+            __atomic_store_n(&disk->index_stopping, 1, __ATOMIC_RELAXED);
+            pthread_join(disk->index_thread, NULL);
+            disk->index_started = 0;
+        }
+        latency_destroy(&disk->latency);
+        degrade_stop(&disk->degrade);
+        badsector_destroy(&disk->faults);
+        if (0 != disk->faults.trace.dropped || disk->faults.trace.failed)
+            fprintf(stderr, "Trace file %s of %s is incomplete, %llu records "
+                    "were dropped%s\n", disk->options.trace,
+                    disk->names[DISK_IMAGE],
+                    (unsigned long long)disk->faults.trace.dropped,
+                    disk->faults.trace.failed ? " and writing it failed" : "");
+        cache_destroy(&disk->cache);
+        remap_close(&disk->remap);
+        overlay_close(&disk->overlay);
+        group_sync_destroy(&disk->group_sync);
+        pthread_mutex_destroy(&disk->passthrough_lock);
+        pthread_cond_destroy(&disk->index_ready);
+        pthread_mutex_destroy(&disk->index_lock);
+
+        if (-1 != disk->direct_fd)
+        {
+            close(disk->direct_fd);
+            disk->direct_fd = -1;
+        }
+        if (-1 != disk->fd)
+        {
+            fsync(disk->fd);
+            close(disk->fd);
+            disk->fd = -1;
+        }
+    }
+
+    event_log_stop();
+}
+
+/* Write back the page cache of a disk and sync its image and spare file for
+ * a group of sync requests */
+static int sync_disk_files(void *context, int datasync)
+{
+    struct disk *disk = context;
+
+    if (0 != cache_flush(&disk->cache) ||
+            0 != overlay_sync(&disk->overlay, datasync))
+        return -1;
+    return remap_sync(&disk->remap, datasync);
+}
+
+/* Serve a flush or fsync request on a file of a disk, as its sync mode asks.
+ * Only the image has anything to sync, and concurrent requests share one
+ * sync of it */
+/* Returns 0 on success and -1 with errno set on error */
+static int sync_image(struct disk *disk, enum disk_file kind, int datasync)
+{
+    if (DISK_IMAGE != kind || SYNC_NONE == disk->sync_mode)
+        return 0;
+
+    return group_sync(&disk->group_sync,
+            datasync || SYNC_DATA == disk->sync_mode, sync_disk_files, disk);
+}
+
+#ifdef HAVE_FUSE_BUFVEC
+/* Point a buffer at a range of a file, so libfuse can splice it instead of
+ * copying it through memory */
+static void init_fd_buf(struct fuse_buf *buf, int fd, size_t size,
+        off_t offset)
+{
+    memset(buf, 0, sizeof(struct fuse_buf));
+    buf->size = size;
+    buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf->fd = fd;
+    buf->pos = offset;
+}
+
+/* Describe a range of a disk as a bufvec referring to the files that hold
+ * it, to read from or, if fd isn't -1, to write to with fd taking what
+ * hasn't been remapped. With an overlay or a spare file the range can take
+ * several buffers, alternating between the files, in which case the bufvec
+ * is allocated. Otherwise bufv is filled in, and if bufv is NULL a
+ * single-buffer bufvec is allocated */
+/* Returns the bufvec, to be freed if it isn't bufv, or NULL on allocation
+ * failure */
+static struct fuse_bufvec *image_bufvec(struct disk *disk,
+        struct fuse_bufvec *bufv, size_t size, off_t offset, int fd)
+{
+    off_t position;
+    size_t length;
+    int part_fd = disk_lookup(disk, fd, offset, size, &position, &length);
+
+    /* Chunks can come into the overlay and sectors into the spare area
+     * while the range is being looked up, so make room for a buffer per
+     * chunk and per sector */
+    size_t capacity = length == size ? 1 :
+            (size + OVERLAY_CHUNK_SIZE - 1) / OVERLAY_CHUNK_SIZE + 1;
+    if (1 != capacity && -1 != disk->remap.fd)
+        capacity += size / disk->physical_sector_size + 1;
+    if (1 != capacity || NULL == bufv)
+    {
+        bufv = malloc(sizeof(struct fuse_bufvec) +
+                (capacity - 1) * sizeof(struct fuse_buf));
+        if (NULL == bufv)
+            return NULL;
+    }
+
+    *bufv = FUSE_BUFVEC_INIT(size);
+    init_fd_buf(bufv->buf, part_fd, length, position);
+    for (size_t done = length; done < size; done += length)
+    {
+        part_fd = disk_lookup(disk, fd, offset + done, size - done,
+                &position, &length);
+        init_fd_buf(bufv->buf + bufv->count++, part_fd, length, position);
+    }
+
+    return bufv;
+}
+
+/* Write the data of a request to a disk through its page cache, copying it
+ * out of the request first unless it is in memory already */
+/* Returns the number of bytes written or a negative errno value */
+static ssize_t write_cached(struct disk *disk, struct fuse_bufvec *buf,
+        size_t size, off_t offset)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    ssize_t res;
+
+    if (1 == buf->count && !(buf->buf[0].flags & FUSE_BUF_IS_FD) &&
+            buf->buf[0].size >= size)
+    {
+        res = cache_write(&disk->cache, buf->buf[0].mem, size, offset);
+        return res < 0 ? -errno : res;
+    }
+
+    char *data = malloc(size);
+    if (NULL == data)
+        return -ENOMEM;
+
+    dst.buf[0].mem = data;
+    res = fuse_buf_copy(&dst, buf, 0);
+    if (res > 0 && (res = cache_write(&disk->cache, data, res, offset)) < 0)
+        res = -errno;
+
+    free(data);
+    return res;
+}
+#endif
+
+/* Open file of a disk, kept in the file handle so requests go straight to the
+ * disk. The contents of a virtual file are generated when it is opened, so
+ * that every read through the same open file sees the same snapshot */
+struct open_file {
+    struct disk *disk;
+    enum disk_file kind;
+    char *data;             /* Contents of a virtual file */
+    size_t length;
+    int backing_id;         /* Backing file the kernel passes image I/O to,
+                             * or 0 */
+};
+
+/* Open one of the files of a disk. A stats file gets a snapshot of the
+ * statistics, and a control file is filled in by refresh_control_file() */
+/* Returns the file, to be released with close_disk_file(), or NULL on
+ * allocation failure */
+static struct open_file *open_disk_file(struct disk *disk,
+        enum disk_file kind)
+{
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    if (NULL == file)
+        return NULL;
+
+    file->disk = disk;
+    file->kind = kind;
+    if (DISK_STATS == kind)
+    {
+        file->data = badsector_stats_json(&disk->faults, &file->length);
+        if (NULL == file->data)
+        {
+            free(file);
+            return NULL;
+        }
+    }
+
+    return file;
+}
+
+/* Write the current bad sectors and reserve sectors of its disk to a control
+ * file, as commands that recreate them */
+/* Returns 0 on success and nonzero on allocation failure */
+static int refresh_control_file(struct open_file *file)
+{
+    struct disk *disk = file->disk;
+    struct extent_list list = {NULL, 0, 0};
+    char *text = NULL;
+    size_t length;
+    FILE *out;
+
+    /* List every bad sector, not just the ones loaded so far */
+    wait_for_index(disk, SECTOR_MAX - 1);
+
+    if (0 != badsector_snapshot(&disk->faults, &list))
+    {
+        free(list.extents);
+        return -1;
+    }
+
+    out = open_memstream(&text, &length);
+    if (NULL == out)
+    {
+        free(list.extents);
+        return -1;
+    }
+
+    fprintf(out, "reserve %llu\n",
+            (unsigned long long)badsector_reserve_sectors(&disk->faults));
+    for (size_t i = 0; i < list.count; i++)
+    {
+        off_t first = list.extents[i].first;
+        off_t last = list.extents[i].last;
+
+        fprintf(out, "%s%lld", 0 == i ? "inject " : ",", (long long)first);
+        if (last != first)
+            fprintf(out, "-%lld", (long long)last);
+    }
+    if (0 != list.count)
+        fputc('\n', out);
+
+    free(list.extents);
+    if (0 != fclose(out))
+    {
+        free(text);
+        return -1;
+    }
+
+    free(file->data);
+    file->data = text;
+    file->length = length;
+
+    return 0;
+}
+
+/* Drop everything written to a disk since its overlay was created, so that it
+ * reads as its image again */
+/* Returns 0 on success and -1 with errno set on error */
+static int reset_disk(struct disk *disk)
+{
+    cache_invalidate(&disk->cache);
+    if (0 != overlay_reset(&disk->overlay))
+        return -1;
+    return remap_reset(&disk->remap);
+}
+
+/* Apply the control commands written to the control file of a disk in one
+ * write. Each line holds one command:
+ *
+ *   inject LIST    mark the sectors in LIST bad
+ *   clear LIST     mark the sectors in LIST good without using reserves
+ *   clear all      mark every sector good
+ *   reserve N      set the number of reserve sectors left to N
+ *   reserve +N     add N reserve sectors
+ *   reset          drop everything written to the overlay and the spare
+ *                  file
+ *
+ * LIST uses the same format as --badsectors. A reset is applied first. The
+ * bad sector changes are applied in order but published together, so
+ * requests see all of them or none, and reserve changes are applied after
+ * them */
+/* Returns 0 on success or an errno value, EBUSY for an inject while the image
+ * is open with passthrough. Nothing is applied if any command is invalid */
+static int apply_control_commands(struct disk *disk, const char *text,
+        size_t length)
+{
+    const char *end = text + length;
+    struct fault_map_change *changes = NULL;
+    size_t change_count = 0;
+    int set_reserve = 0;
+    uint64_t reserve_sectors = 0;
+    uint64_t added_reserve_sectors = 0;
+    int reset = 0;
+    int injected = 0;
+    int ret = EINVAL;
+    off_t sector;
+
+    while (text < end)
+    {
+        const char *line_end = memchr(text, '\n', end - text);
+        if (NULL == line_end)
+            line_end = end;
+
+        const char *word = text;
+        while (word < line_end && (' ' == *word || '\t' == *word))
+            word++;
+        const char *argument = word;
+        while (argument < line_end && ' ' != *argument && '\t' != *argument &&
+                '\r' != *argument)
+            argument++;
+        size_t word_length = argument - word;
+        while (argument < line_end && (' ' == *argument || '\t' == *argument))
+            argument++;
+        size_t argument_length = line_end - argument;
+        while (argument_length > 0 && ('\r' == argument[argument_length - 1] ||
+                ' ' == argument[argument_length - 1] ||
+                '\t' == argument[argument_length - 1]))
+            argument_length--;
+
+        text = line_end + 1;
+
+        /* Skip blank lines and comments */
+        if (0 == word_length || '#' == *word)
+            continue;
+
+        if ((6 == word_length && 0 == strncmp(word, "inject", 6)) ||
+                (5 == word_length && 0 == strncmp(word, "clear", 5)))
+        {
+            struct fault_map_change *resized = realloc(changes,
+                    (change_count + 1) * sizeof(struct fault_map_change));
+            if (NULL == resized)
+            {
+                ret = ENOMEM;
+                goto out;
+            }
+            changes = resized;
+
+            struct fault_map_change *change = changes + change_count++;
+            memset(change, 0, sizeof(struct fault_map_change));
+            change->clear = 5 == word_length;
+            injected |= !change->clear;
+
+            if (change->clear && 3 == argument_length &&
+                    0 == strncmp(argument, "all", 3))
+            {
+                if (0 != extent_list_append(&change->extents, 0, SECTOR_MAX))
+                {
+                    ret = ENOMEM;
+                    goto out;
+                }
+            }
+            else if (0 == argument_length || 0 != parse_sector_list(argument,
+                    argument_length, &change->extents) ||
+                    (!change->clear &&
+                    find_past_end(disk, &change->extents, &sector)))
+                goto out;
+        }
+        else if (7 == word_length && 0 == strncmp(word, "reserve", 7))
+        {
+            int add = argument_length > 0 && '+' == *argument;
+            char number[32];
+            char *number_end;
+            unsigned long long value;
+
+            if (add)
+            {
+                argument++;
+                argument_length--;
+            }
+            if (0 == argument_length || argument_length >= sizeof(number) ||
+                    *argument < '0' || *argument > '9')
+                goto out;
+
+            memcpy(number, argument, argument_length);
+            number[argument_length] = '\0';
+            errno = 0;
+            value = strtoull(number, &number_end, 10);
+            if (0 != errno || '\0' != *number_end)
+                goto out;
+
+            if (add)
+                added_reserve_sectors += value;
+            else
+            {
+                set_reserve = 1;
+                reserve_sectors = value;
+                added_reserve_sectors = 0;
+            }
+        }
+        else if (5 == word_length && 0 == strncmp(word, "reset", 5) &&
+                0 == argument_length && -1 != disk->overlay.fd)
+            reset = 1;
+        else
+            goto out;
+    }
+
+    /* The bad sectors still being loaded would undo clears */
+    if (0 != wait_for_index(disk, SECTOR_MAX - 1))
+    {
+        ret = EIO;
+        goto out;
+    }
+
+    /* Image files opened with passthrough would never see new bad sectors,
+     * so none can be injected until they are closed */
+    pthread_mutex_lock(&disk->passthrough_lock);
+    if (injected && 0 != disk->passthrough_opens)
+        ret = EBUSY;
+    else if (reset && 0 != reset_disk(disk))
+        ret = errno;
+    else if (0 != change_count &&
+            0 != badsector_update(&disk->faults, changes, change_count))
+        ret = ENOMEM;
+    else
+        ret = 0;
+    pthread_mutex_unlock(&disk->passthrough_lock);
+
+    if (0 != ret)
+        goto out;
+
+    if (set_reserve)
+        badsector_change_reserve(&disk->faults, 1,
+                reserve_sectors + added_reserve_sectors);
+    else if (0 != added_reserve_sectors)
+        badsector_change_reserve(&disk->faults, 0, added_reserve_sectors);
+
+    /* Report success only once the changes will survive a remount */
+    ret = 0 == badsector_sync(&disk->faults) ? 0 : EIO;
+
+out:
+    for (size_t i = 0; i < change_count; i++)
+        free(changes[i].extents.extents);
+    free(changes);
+
+    return ret;
+}
+
+/* Find the part of an open virtual file covered by a read. Reading a control
+ * file from the start shows the current state */
+/* Returns the number of bytes to read, pointing *data at them, or a negative
+ * errno value */
+static int read_virtual_file(struct open_file *file, size_t size,
+        off_t offset, const char **data)
+{
+    if (DISK_CONTROL == file->kind && 0 == offset &&
+            0 != refresh_control_file(file))
+        return -ENOMEM;
+
+    if (offset >= file->length)
+        return 0;
+
+    if (size > file->length - offset)
+        size = file->length - offset;
+
+    *data = file->data + offset;
+    return size;
+}
+
+/* Close an open file */
+static void close_disk_file(struct open_file *file)
+{
+    if (NULL != file)
+        free(file->data);
+    free(file);
+}
+
+/* Find the disk and file a name under the mount point refers to */
+/* Returns the disk, storing the kind of file in *kind, or NULL if there is no
+ * such file */
+static struct disk *find_disk_file(const char *name, enum disk_file *kind)
+{
+    for (size_t i = 0; i < disk_count; i++)
+        for (int k = 0; k < DISK_FILES; k++)
+            if (strcmp(name, disks[i].names[k]) == 0)
+            {
+                *kind = k;
+                return disks + i;
+            }
+
+    return NULL;
+}
+
+#ifdef USE_FUSE3_LOWLEVEL
+/* Inode number of the first file of the first disk. Each disk takes
+ * DISK_FILES inode numbers in a row, in the order of enum disk_file */
+#define FIRST_DISK_INO 2
+
+/* FUSE session, created in main() */
+static struct fuse_session *session = NULL;
+
+/* Find the disk and file an inode number refers to */
+/* Returns the disk, storing the kind of file in *kind, or NULL if the inode
+ * isn't a file of a disk */
+static struct disk *find_disk_ino(fuse_ino_t ino, enum disk_file *kind)
+{
+    if (ino < FIRST_DISK_INO)
+        return NULL;
+
+    ino -= FIRST_DISK_INO;
+    if (ino / DISK_FILES >= disk_count)
+        return NULL;
+
+    *kind = ino % DISK_FILES;
+    return disks + ino / DISK_FILES;
+}
+
+/* Return the inode number of a file of a disk */
+static fuse_ino_t disk_ino(const struct disk *disk, enum disk_file kind)
+{
+    return FIRST_DISK_INO + (disk - disks) * DISK_FILES + kind;
+}
+
+/* Return the open file stored in a file handle */
+static struct open_file *get_open_file(const struct fuse_file_info *fi)
+{
+    return (struct open_file *)(uintptr_t)fi->fh;
+}
+
+/* Reply to a request held back by the latency model or carried out through
+ * the io_uring. A delayed request has already been carried out, only the
+ * reply waits on the timer wheel, so the worker thread is free to serve other
+ * requests in the meantime. A request in the ring is replied to from the
+ * completion thread, after its delay if it has one */
+struct delayed_reply {
+    struct timer timer;
+    struct uring_op io;     /* Read or write in the ring */
+    fuse_req_t req;
+    struct disk *disk;
+    enum stats_op op;
+    uint64_t start;         /* When the request came in */
+    uint64_t delay;         /* Delay to add once the ring is done with the
+                             * request */
+    ssize_t result;         /* Bytes transferred or a negative errno value */
+    char *data;             /* Data read or to write */
+    int buffer_index;       /* Registered buffer data is in, or -1 */
+    char storage[];         /* Data, unless in a separate buffer */
+};
+
+/* Allocate a reply, with room for size bytes of data. Requests in the ring
+ * take a registered buffer if one is free, and otherwise get their data
+ * aligned for direct I/O */
+/* Returns the reply, or NULL on allocation failure */
+static struct delayed_reply *alloc_reply(fuse_req_t req, struct disk *disk,
+        enum stats_op op, uint64_t start, size_t size, int ring)
+{
+    struct delayed_reply *reply = malloc(sizeof(struct delayed_reply) +
+            (ring ? 0 : size));
+    void *data = NULL;
+
+    if (NULL == reply)
+        return NULL;
+
+    memset(reply, 0, sizeof(struct delayed_reply));
+    reply->req = req;
+    reply->disk = disk;
+    reply->op = op;
+    reply->start = start;
+    reply->data = reply->storage;
+    reply->buffer_index = -1;
+
+    if (ring)
+    {
+        if (size <= MAX_REQUEST_SIZE)
+            reply->data = uring_get_buffer(&reply->buffer_index);
+        if (-1 == reply->buffer_index)
+        {
+            if (0 != posix_memalign(&data, DIRECT_IO_ALIGNMENT,
+                    size ? size : 1))
+            {
+                free(reply);
+                return NULL;
+            }
+            reply->data = data;
+        }
+    }
+
+    return reply;
+}
+
+/* Free a reply and its data */
+static void free_reply(struct delayed_reply *reply)
+{
+    if (-1 != reply->buffer_index)
+        uring_put_buffer(reply->buffer_index);
+    else if (reply->storage != reply->data)
+        free(reply->data);
+    free(reply);
+}
+
+/* Send a delayed reply, from the timer thread or the completion thread */
+static void send_delayed_reply(struct timer *timer)
+{
+    struct delayed_reply *reply = (struct delayed_reply *)timer;
+
+    if (reply->result < 0)
+        fuse_reply_err(reply->req, -reply->result);
+    else if (STATS_OP_READ == reply->op)
+        fuse_reply_buf(reply->req, reply->data, reply->result);
+    else
+        fuse_reply_write(reply->req, reply->result);
+
+    count_request(reply->disk, reply->op, reply->result, reply->start);
+    free_reply(reply);
+}
+
+/* Read a request into memory now and reply with it after a delay, or right
+ * away if there is none. failed is nonzero if the request hit a bad
+ * sector */
+static void delay_read(fuse_req_t req, struct disk *disk, size_t size,
+        off_t offset, int failed, uint64_t start, uint64_t delay)
+{
+    struct delayed_reply *reply = alloc_reply(req, disk, STATS_OP_READ, start,
+            failed ? 0 : size, 0);
+
+    if (NULL == reply)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    reply->timer.fire = send_delayed_reply;
+    reply->result = -EIO;
+    if (!failed)
+    {
+        reply->result = disk_read(disk, reply->data, size, offset);
+        if (reply->result < 0)
+            reply->result = -errno;
+    }
+
+    if (0 != delay)
+        timer_wheel_add(&reply->timer, delay);
+    else
+        send_delayed_reply(&reply->timer);
+}
+
+/* Reply to a write that has been carried out after a delay */
+static void delay_write(fuse_req_t req, struct disk *disk, ssize_t result,
+        uint64_t start, uint64_t delay)
+{
+    struct delayed_reply *reply = alloc_reply(req, disk, STATS_OP_WRITE,
+            start, 0, 0);
+
+    if (NULL == reply)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    reply->timer.fire = send_delayed_reply;
+    reply->result = result;
+
+    timer_wheel_add(&reply->timer, delay);
+}
+
+/* Called from the completion thread once the ring is done with a request.
+ * The reply goes out now or after the delay of the request */
+static void complete_ring_request(struct uring_op *io)
+{
+    struct delayed_reply *reply = (struct delayed_reply *)((char *)io -
+            offsetof(struct delayed_reply, io));
+
+    reply->result = io->result;
+    reply->timer.fire = send_delayed_reply;
+    if (0 != reply->delay)
+        timer_wheel_add(&reply->timer, reply->delay);
+    else
+        send_delayed_reply(&reply->timer);
+}
+
+/* Check whether a transfer can bypass the page cache */
+static int direct_io_aligned(const void *buffer, size_t size, off_t offset)
+{
+    return 0 == ((uintptr_t)buffer | size | (uint64_t)offset) %
+            DIRECT_IO_ALIGNMENT;
+}
+
+/* Pick the file descriptor a part of a request in the ring goes to. Parts
+ * that go to the image use its direct I/O descriptor where they can */
+static int ring_fd_for(const struct disk *disk, int fd, const void *buffer,
+        size_t size, off_t offset)
+{
+    if (fd == disk->fd && -1 != disk->direct_fd &&
+            direct_io_aligned(buffer, size, offset))
+        return disk->direct_fd;
+    return fd;
+}
+
+/* Read a healthy request through the ring, one part per run of chunks in the
+ * image, the overlay or the spare file, and reply from the completion
+ * thread */
+/* Returns 0 if the request was queued and nonzero if the caller has to serve
+ * it, having replied to nothing */
+static int ring_read(fuse_req_t req, struct disk *disk, size_t size,
+        off_t offset, uint64_t start, uint64_t delay)
+{
+    struct uring_part parts[MAX_REQUEST_SIZE / OVERLAY_CHUNK_SIZE + 1];
+    struct delayed_reply *reply = alloc_reply(req, disk, STATS_OP_READ, start,
+            size, 1);
+    unsigned int count = 0;
+    size_t length;
+
+    if (NULL == reply)
+        return -1;
+
+    reply->io.complete = complete_ring_request;
+    reply->delay = delay;
+
+    for (size_t done = 0; done < size; done += length)
+    {
+        struct uring_part *part = parts + count++;
+        off_t position;
+        int fd = disk_lookup(disk, -1, offset + done, size - done, &position,
+                &length);
+
+        /* Too fragmented by the overlay and the spare area to fit */
+        if (count == sizeof(parts) / sizeof(parts[0]) && done + length < size)
+        {
+            free_reply(reply);
+            return -1;
+        }
+
+        part->buffer = reply->data + done;
+        part->size = length;
+        part->offset = position;
+        part->buffer_index = reply->buffer_index;
+        part->fd = ring_fd_for(disk, fd, part->buffer, length, part->offset);
+    }
+
+    if (0 != uring_submit(&reply->io, 0, parts, count))
+    {
+        free_reply(reply);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write a healthy request through the ring to fd and reply from the
+ * completion thread. The data is copied out of the request first, as the
+ * kernel may have handed it over in a pipe */
+/* Returns 0 if the request was queued. Otherwise the request is left for the
+ * caller to reply to, with *res set to the number of bytes written in place
+ * of the ring or a negative errno value */
+static int ring_write(fuse_req_t req, struct disk *disk, int fd,
+        struct fuse_bufvec *buf, size_t size, off_t offset, uint64_t start,
+        uint64_t delay, ssize_t *res)
+{
+    struct delayed_reply *reply = alloc_reply(req, disk, STATS_OP_WRITE,
+            start, size, 1);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    struct uring_part part;
+
+    if (NULL == reply)
+    {
+        *res = -ENOMEM;
+        return -1;
+    }
+
+    dst.buf[0].mem = reply->data;
+    *res = fuse_buf_copy(&dst, buf, 0);
+    if (*res <= 0)
+    {
+        free_reply(reply);
+        return -1;
+    }
+
+    reply->io.complete = complete_ring_request;
+    reply->delay = delay;
+    part.buffer = reply->data;
+    part.size = *res;
+    part.offset = offset;
+    part.buffer_index = reply->buffer_index;
+    part.fd = ring_fd_for(disk, fd, part.buffer, part.size, offset);
+
+    if (0 != uring_submit(&reply->io, 1, &part, 1))
+    {
+        /* The data has been taken out of the request, so write it from
+         * here */
+        *res = pwrite(fd, reply->data, part.size, offset);
+        if (*res < 0)
+            *res = -errno;
+        free_reply(reply);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Fill in the attributes of an inode */
+/* Returns 0 on success and an errno value if there is no such inode */
+static int fill_attr(fuse_ino_t ino, struct stat *stbuf)
+{
+    enum disk_file kind;
+    struct disk *disk;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+
+    if (FUSE_ROOT_ID == ino)
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+
+    disk = find_disk_ino(ino, &kind);
+    if (NULL == disk)
+        return ENOENT;
+
+    stbuf->st_nlink = 1;
+    if (DISK_IMAGE == kind)
+    {
+        stbuf->st_mode = S_IFREG | 0777;
+        stbuf->st_size = disk->size;
+        stbuf->st_blksize = disk->physical_sector_size;
+        stbuf->st_atim = disk->stat.st_atim;
+        stbuf->st_mtim = disk->stat.st_mtim;
+        stbuf->st_ctim = disk->stat.st_ctim;
+    }
+    /* The virtual files are opened with direct I/O, so their size doesn't
+     * limit reads */
+    else
+        stbuf->st_mode = S_IFREG | (DISK_STATS == kind ? 0444 : 0666);
+
+    return 0;
+}
+
+/* init() FUSE callback */
+static void init_callback(void *userdata, struct fuse_conn_info *conn)
+{
+    if (0 != setup_disk_images())
+        fuse_session_exit(session);
+
+    /* Serve reads in parallel and splice data between the kernel and the image
+     * file instead of copying it through our buffers */
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ |
+            FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    /* Ask for large requests so a guest's big sequential I/O isn't chopped
+     * into many small ones */
+    conn->max_write = MAX_REQUEST_SIZE;
+    conn->max_readahead = MAX_REQUEST_SIZE;
+
+    /* Let the kernel serve the images of disks without bad sectors on its
+     * own */
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (use_passthrough && 0 != (conn->capable & FUSE_CAP_PASSTHROUGH))
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+    else if (use_passthrough)
+    {
+        fprintf(stderr, "No kernel passthrough, serving every request\n");
+        use_passthrough = 0;
+    }
+#endif
+}
+
+/* destroy() FUSE callback */
+static void destroy_callback(void *userdata)
+{
+    teardown_disk_images();
+}
+
+/* lookup() FUSE callback */
+static void lookup_callback(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param entry;
+    enum disk_file kind;
+    struct disk *disk = NULL;
+
+    if (FUSE_ROOT_ID == parent)
+        disk = find_disk_file(name, &kind);
+    if (NULL == disk)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    memset(&entry, 0, sizeof(struct fuse_entry_param));
+    entry.ino = disk_ino(disk, kind);
+    entry.attr_timeout = attr_timeout;
+    entry.entry_timeout = entry_timeout;
+    fill_attr(entry.ino, &entry.attr);
+
+    fuse_reply_entry(req, &entry);
+}
+
+/* getattr() FUSE callback */
+static void getattr_callback(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+    struct stat st;
+    int err = fill_attr(ino, &st);
+
+    if (0 != err)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_attr(req, &st, attr_timeout);
+}
+
+/* setattr() FUSE callback. Only the control files accept it, and ignore it,
+ * so that shells can open them with O_TRUNC */
+static void setattr_callback(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+    int to_set, struct fuse_file_info *fi)
+{
+    enum disk_file kind;
+    struct stat st;
+
+    if (NULL == find_disk_ino(ino, &kind) || DISK_CONTROL != kind)
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    fill_attr(ino, &st);
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+/* readdir() FUSE callback. The offset of an entry is the index of the entry
+ * after it, where entries 0 and 1 are . and .. and the files of the disks
+ * follow in inode order */
+static void readdir_callback(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+    const off_t entry_count = 2 + disk_count * DISK_FILES;
+    size_t used = 0;
+    char *buf;
+
+    if (FUSE_ROOT_ID != ino)
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    buf = malloc(size);
+    if (NULL == buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (off_t i = offset; i < entry_count; i++)
+    {
+        const char *name = 0 == i ? "." : "..";
+        struct stat st;
+
+        memset(&st, 0, sizeof(struct stat));
+        st.st_ino = FUSE_ROOT_ID;
+        st.st_mode = S_IFDIR;
+        if (i >= 2)
+        {
+            st.st_ino = FIRST_DISK_INO + i - 2;
+            st.st_mode = S_IFREG;
+            name = disks[(i - 2) / DISK_FILES].names[(i - 2) % DISK_FILES];
+        }
+
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name,
+                &st, i + 1);
+        if (len > size - used)
+            break;
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+/* Check whether the kernel may serve the image of a disk on its own, which
+ * takes a disk with no bad sectors, nothing else that has to see its
+ * requests and the size of the image file. Must be called with the
+ * passthrough lock held */
+static int disk_allows_passthrough(struct disk *disk)
+{
+    const struct disk_options *options = &disk->options;
+
+    return -1 == disk->overlay.fd && -1 == disk->remap.fd &&
+            CACHE_NONE == disk->cache.mode &&
+            NULL == options->disk_size &&
+            NULL == options->degrade && NULL == options->trace &&
+            !disk->latency.enabled &&
+            SECTOR_MAX == __atomic_load_n(&disk->indexed_sectors,
+            __ATOMIC_ACQUIRE) && !disk->index_failed &&
+            !badsector_find(&disk->faults, 0, SECTOR_MAX, NULL);
+}
+
+/* Hand the reads and writes of an open image file to the kernel if its disk
+ * allows it. Otherwise, or if the kernel refuses, they come to us as usual */
+static void open_passthrough(fuse_req_t req, struct open_file *file)
+{
+    struct disk *disk = file->disk;
+
+    pthread_mutex_lock(&disk->passthrough_lock);
+    if (disk_allows_passthrough(disk))
+    {
+        int backing_id = fuse_passthrough_open(req, disk->fd);
+        if (backing_id > 0)
+        {
+            file->backing_id = backing_id;
+            disk->passthrough_opens++;
+        }
+    }
+    pthread_mutex_unlock(&disk->passthrough_lock);
+}
+
+/* Release the backing file of an open file opened with passthrough */
+static void close_passthrough(fuse_req_t req, struct open_file *file)
+{
+    struct disk *disk = file->disk;
+
+    if (0 == file->backing_id)
+        return;
+
+    fuse_passthrough_close(req, file->backing_id);
+    pthread_mutex_lock(&disk->passthrough_lock);
+    disk->passthrough_opens--;
+    pthread_mutex_unlock(&disk->passthrough_lock);
+}
+#endif
+
+/* open() FUSE callback. The open file is kept in the file handle, so the
+ * requests that follow don't need to look the inode up again. With
+ * passthrough the kernel serves the image of a disk without bad sectors
+ * itself */
+static void open_callback(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+    enum disk_file kind;
+    struct disk *disk = find_disk_ino(ino, &kind);
+    struct open_file *file;
+
+    if (NULL == disk)
+    {
+        fuse_reply_err(req, FUSE_ROOT_ID == ino ? EISDIR : ENOENT);
+        return;
+    }
+
+    if (DISK_STATS == kind && O_RDONLY != (fi->flags & O_ACCMODE))
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    file = open_disk_file(disk, kind);
+    if (NULL == file)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (DISK_IMAGE == kind && use_passthrough)
+        open_passthrough(req, file);
+    fi->backing_id = file->backing_id;
+#endif
+
+    fi->fh = (uintptr_t)file;
+    fi->direct_io = DISK_IMAGE != kind;
+    if (0 != fuse_reply_open(req, fi))
+    {
+#ifdef FUSE_CAP_PASSTHROUGH
+        close_passthrough(req, file);
+#endif
+        close_disk_file(file);
+    }
+}
+
+/* read() FUSE callback. The data is spliced from the image file to the kernel
+ * when the kernel supports it */
+static void read_callback(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    struct fuse_bufvec bufv;
+    uint64_t start = event_clock();
+
+    if (DISK_IMAGE != file->kind)
+    {
+        const char *data = NULL;
+        int res = read_virtual_file(file, size, offset, &data);
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_buf(req, data, res);
+        return;
+    }
+
+    size = clamp_to_disk(disk, EVENT_OP_READ, size, offset, start);
+    size_t requested = size;
+    int failed = check_request(disk, EVENT_OP_READ, &size, offset, start,
+            NULL);
+
+    /* A short read spends as long on the bad sector as a failed one */
+    uint64_t delay = request_delay(disk, requested, offset,
+            failed || size != requested);
+
+    /* Healthy reads go through the ring when it is running, and wait out
+     * their delay once they complete */
+    if (!failed && 0 != size && CACHE_NONE == disk->cache.mode &&
+            uring_running() &&
+            0 == ring_read(req, disk, size, offset, start, delay))
+        return;
+
+    /* Reads from the page cache come out of memory as delayed ones do */
+    if (0 != delay || CACHE_NONE != disk->cache.mode)
+    {
+        delay_read(req, disk, size, offset, failed, start, delay);
+        return;
+    }
+
+    if (failed)
+    {
+        fuse_reply_err(req, EIO);
+        count_request(disk, STATS_OP_READ, -EIO, start);
+        return;
+    }
+
+    struct fuse_bufvec *src = image_bufvec(disk, &bufv, size, offset, -1);
+    if (NULL == src)
+    {
+        fuse_reply_err(req, ENOMEM);
+        count_request(disk, STATS_OP_READ, -ENOMEM, start);
+        return;
+    }
+
+    fuse_reply_data(req, src, FUSE_BUF_SPLICE_MOVE);
+    if (&bufv != src)
+        free(src);
+    count_request(disk, STATS_OP_READ, size, start);
+}
+
+/* write_buf() FUSE callback. The data is spliced from the request into the
+ * image file when the kernel supports it */
+static void write_buf_callback(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    struct fuse_bufvec dst;
+    struct fuse_bufvec *dstv;
+    ssize_t res;
+    int err;
+    int fd;
+    int locked;
+    uint64_t start = event_clock();
+    size_t size;
+
+    /* Each write to the control file is one batch of commands */
+    if (DISK_CONTROL == file->kind)
+    {
+        size = fuse_buf_size(buf);
+        char *text = malloc(size ? size : 1);
+        if (NULL == text)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+
+        dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = text;
+        res = fuse_buf_copy(&dst, buf, 0);
+        if (res >= 0 && 0 != (err = apply_control_commands(disk, text, res)))
+            res = -err;
+
+        if (res < 0)
+            fuse_reply_err(req, -res);
+        else
+            fuse_reply_write(req, res);
+        free(text);
+        return;
+    }
+
+    if (DISK_IMAGE != file->kind)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    size = clamp_to_disk(disk, EVENT_OP_WRITE, fuse_buf_size(buf), offset,
+            start);
+    if (0 == size)
+    {
+        fuse_reply_write(req, 0);
+        count_request(disk, STATS_OP_WRITE, 0, start);
+        return;
+    }
+
+    int failed = check_write(disk, &size, offset, start);
+    uint64_t delay = request_delay(disk, size, offset, failed);
+
+    /* Writes that bring chunks into the overlay hold its lock until they are
+     * done, and writes that go partly to the spare area take several parts,
+     * so they are carried out here rather than through the ring */
+    if (0 != failed)
+        res = -EIO;
+    else if (CACHE_NONE != disk->cache.mode)
+        res = write_cached(disk, buf, size, offset);
+    else if (-1 == (fd = overlay_begin_write(&disk->overlay, offset, size,
+            &locked)))
+        res = -errno;
+    else if (NULL == (dstv = image_bufvec(disk, &dst, size, offset, fd)))
+    {
+        res = -ENOMEM;
+        overlay_end_write(&disk->overlay, offset, size, res, locked);
+    }
+    else if (!locked && &dst == dstv && fd == dst.buf[0].fd &&
+            uring_running())
+    {
+        if (0 == ring_write(req, disk, fd, buf, size, offset, start, delay,
+                &res))
+            return;
+    }
+    else
+    {
+        res = fuse_buf_copy(dstv, buf, FUSE_BUF_SPLICE_NONBLOCK);
+        overlay_end_write(&disk->overlay, offset, size, res, locked);
+        if (&dst != dstv)
+            free(dstv);
+    }
+
+    /* The data has been written, only the reply is held back */
+    if (0 != delay)
+    {
+        delay_write(req, disk, res, start, delay);
+        return;
+    }
+
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+    count_request(disk, STATS_OP_WRITE, res, start);
+}
+
+/* access() FUSE callback. The files of a disk have the access of its image
+ * file */
+static void access_callback(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    enum disk_file kind;
+    struct disk *disk = find_disk_ino(ino, &kind);
+
+    /* Writes to an image with an overlay go to the overlay */
+    if (NULL != disk && -1 != disk->overlay.fd)
+        mask &= ~W_OK;
+    if (NULL != disk && 0 != access(disk->options.disk_image, mask))
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_err(req, 0);
+}
+
+/* flush() FUSE callback */
+static void flush_callback(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+
+    fuse_reply_err(req, 0 == sync_image(file->disk, file->kind, 0) ? 0 :
+            errno);
+}
+
+/* release() FUSE callback */
+static void release_callback(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    close_passthrough(req, get_open_file(fi));
+#endif
+    close_disk_file(get_open_file(fi));
+    fuse_reply_err(req, 0);
+}
+
+/* fsync() FUSE callback */
+static void fsync_callback(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+
+    fuse_reply_err(req, 0 == sync_image(file->disk, file->kind, datasync) ?
+            0 : errno);
+}
+
+/* FUSE callback function pointers */
+static const struct fuse_lowlevel_ops filter_disk_operations = {
+    .access = access_callback,
+    .destroy = destroy_callback,
+    .flush = flush_callback,
+    .fsync = fsync_callback,
+    .getattr = getattr_callback,
+    .init = init_callback,
+    .lookup = lookup_callback,
+    .open = open_callback,
+    .read = read_callback,
+    .readdir = readdir_callback,
+    .release = release_callback,
+    .setattr = setattr_callback,
+    .write_buf = write_buf_callback,
+};
+#else
+/* Block the calling thread for a delay in nanoseconds. The high-level API
+ * has no way to reply later, so delayed requests hold on to a worker thread */
+static void sleep_for(uint64_t delay)
+{
+    struct timespec duration = {delay / 1000000000, delay % 1000000000};
+
+    if (0 == delay)
+        return;
+
+    while (0 != nanosleep(&duration, &duration) && EINTR == errno)
+        ;
+}
+
+/* Find the disk and file a path refers to. The files of the disks are all in
+ * the root directory */
+/* Returns the disk, storing the kind of file in *kind, or NULL if there is no
+ * such file */
+static struct disk *find_disk_path(const char *path, enum disk_file *kind)
+{
+    return '/' == path[0] ? find_disk_file(path + 1, kind) : NULL;
+}
+
+/* Return the open file stored in a file handle */
+static struct open_file *get_open_file(const struct fuse_file_info *fi)
+{
+    return (struct open_file *)(uintptr_t)fi->fh;
+}
+
+/* getattr() FUSE callback */
+static int getattr_callback(const char *path, struct stat *stbuf)
+{
+    enum disk_file kind;
+    struct disk *disk;
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+
+    disk = find_disk_path(path, &kind);
+    if (NULL == disk)
+        return -ENOENT;
+
+    stbuf->st_nlink = 1;
+    if (DISK_IMAGE == kind) {
+        stbuf->st_mode = S_IFREG | 0777;
+        stbuf->st_size = disk->size;
+        stbuf->st_blksize = disk->physical_sector_size;
+        stbuf->st_atim = disk->stat.st_atim;
+        stbuf->st_mtim = disk->stat.st_mtim;
+        stbuf->st_ctim = disk->stat.st_ctim;
+    }
+    /* The virtual files are opened with direct I/O, so their size doesn't
+     * limit reads */
+    else
+        stbuf->st_mode = S_IFREG | (DISK_STATS == kind ? 0444 : 0666);
+
+    return 0;
+}
+
+/* readdir() FUSE callback */
+static int readdir_callback(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi) {
+  (void) offset;
+  (void) fi;
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+
+  for (size_t i = 0; i < disk_count; i++)
+    for (int kind = 0; kind < DISK_FILES; kind++)
+      filler(buf, disks[i].names[kind], NULL, 0);
+
+  return 0;
+}
+
+/* open() FUSE callback. The open file is kept in the file handle, so the
+ * requests that follow don't need to look the path up again */
+static int open_callback(const char *path, struct fuse_file_info *fi) {
+  enum disk_file kind;
+  struct disk *disk = find_disk_path(path, &kind);
+  struct open_file *file;
+
+  if (NULL == disk) {
+    log_request_event(NULL, EVENT_UNKNOWN_FILE, EVENT_OP_NONE, 0, 0, 0, 0,
+            ENOENT, event_clock());
+    return -ENOENT;
+  }
+
+  if (DISK_STATS == kind && O_RDONLY != (fi->flags & O_ACCMODE))
+    return -EACCES;
+
+  file = open_disk_file(disk, kind);
+  if (NULL == file)
+    return -ENOMEM;
+
+  fi->fh = (uintptr_t)file;
+  fi->direct_io = DISK_IMAGE != kind;
+
+  return 0;
+}
+
+/* truncate() FUSE callback. Only the control files accept it, and ignore it,
+ * so that shells can open them with O_TRUNC */
+static int truncate_callback(const char *path, off_t size)
+{
+    enum disk_file kind;
+
+    if (NULL == find_disk_path(path, &kind) || DISK_CONTROL != kind)
+        return -EPERM;
+    return 0;
+}
+
+/* ftruncate() FUSE callback */
+static int ftruncate_callback(const char *path, off_t size,
+    struct fuse_file_info *fi)
+{
+    return DISK_CONTROL == get_open_file(fi)->kind ? 0 : -EPERM;
+}
+
+/* read() FUSE callback */
+static int read_callback(const char *path, char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    uint64_t start = event_clock();
+
+    if (DISK_IMAGE != file->kind)
+    {
+        const char *data = NULL;
+        int res = read_virtual_file(file, size, offset, &data);
+        if (res > 0)
+            memcpy(buf, data, res);
+        return res;
+    }
+
+    size = clamp_to_disk(disk, EVENT_OP_READ, size, offset, start);
+    if (0 == size)
+    {
+        count_request(disk, STATS_OP_READ, 0, start);
+        return 0;
+    }
+
+    size_t requested = size;
+    int failed = check_request(disk, EVENT_OP_READ, &size, offset, start,
+            NULL);
+    sleep_for(request_delay(disk, requested, offset,
+            failed || size != requested));
+    if (0 != failed)
+    {
+        count_request(disk, STATS_OP_READ, -EIO, start);
+        return -EIO;
+    }
+
+    ssize_t res = disk_read(disk, buf, size, offset);
+    if (res < 0)
+        res = -errno;
+    count_request(disk, STATS_OP_READ, res, start);
+    return res;
+}
+
+/* write() FUSE callback */
+static int write_callback(const char *path, const char *buf, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    uint64_t start = event_clock();
+
+    /* Each write to the control file is one batch of commands */
+    if (DISK_CONTROL == file->kind)
+    {
+        int err = apply_control_commands(disk, buf, size);
+        return 0 != err ? -err : size;
+    }
+
+    if (DISK_IMAGE != file->kind)
+        return -EBADF;
+
+    size = clamp_to_disk(disk, EVENT_OP_WRITE, size, offset, start);
+    if (0 == size)
+    {
+        count_request(disk, STATS_OP_WRITE, 0, start);
+        return 0;
+    }
+
+    int failed = check_write(disk, &size, offset, start);
+    sleep_for(request_delay(disk, size, offset, failed));
+    if (0 != failed)
+    {
+        count_request(disk, STATS_OP_WRITE, -EIO, start);
+        return -EIO;
     }
 
-    if (strcmp(path, filepath) == 0) {
-        struct stat st;
-        stat(filter_disk_options.disk_image, &st);
-        stbuf->st_mode = S_IFREG | 0777;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = st.st_size;
-        return 0;
+    if (CACHE_NONE != disk->cache.mode)
+    {
+        ssize_t res = cache_write(&disk->cache, buf, size, offset);
+        if (res < 0)
+            res = -errno;
+        count_request(disk, STATS_OP_WRITE, res, start);
+        return res;
     }
 
-    return -ENOENT;
+    int locked;
+    int fd = overlay_begin_write(&disk->overlay, offset, size, &locked);
+    ssize_t res = -1 == fd ? -1 : disk_pwrite(disk, fd, buf, size, offset);
+    if (res < 0)
+        res = -errno;
+    if (-1 != fd)
+        overlay_end_write(&disk->overlay, offset, size, res, locked);
+    count_request(disk, STATS_OP_WRITE, res, start);
+    return res;
 }
 
-/* readdir() FUSE callback */
-static int readdir_callback(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi) {
-  (void) offset;
-  (void) fi;
+#ifdef HAVE_FUSE_BUFVEC
+/* read_buf() FUSE callback. Instead of copying the data, hand libfuse a buffer
+ * that refers to the image file so it can be spliced straight to the kernel */
+static int read_buf_callback(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    struct fuse_bufvec *src;
+    uint64_t start = event_clock();
+
+    /* libfuse frees the memory buffer once it has been sent, so hand it a
+     * copy of the snapshot */
+    if (DISK_IMAGE != file->kind)
+    {
+        const char *data = NULL;
+        char *copy;
+        int res = read_virtual_file(file, size, offset, &data);
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+        if (res < 0)
+            return res;
 
-  filler(buf, filename, NULL, 0);
+        size = res;
+        src = malloc(sizeof(struct fuse_bufvec));
+        copy = malloc(size ? size : 1);
+        if (NULL == src || NULL == copy)
+        {
+            free(src);
+            free(copy);
+            return -ENOMEM;
+        }
 
-  return 0;
-}
+        memcpy(copy, data, size);
+        *src = FUSE_BUFVEC_INIT(size);
+        src->buf[0].mem = copy;
+        *bufp = src;
 
-/* open() FUSE callback */
-static int open_callback(const char *path, struct fuse_file_info *fi) {
-  return 0;
-}
+        return 0;
+    }
 
-/* read() FUSE callback */
-static int read_callback(const char *path, char *buf, size_t size, off_t offset,
-    struct fuse_file_info *fi)
-{
-    if (strcmp(path, filepath) == 0)
+    size = clamp_to_disk(disk, EVENT_OP_READ, size, offset, start);
+    size_t requested = size;
+    int failed = check_request(disk, EVENT_OP_READ, &size, offset, start,
+            NULL);
+    sleep_for(request_delay(disk, requested, offset,
+            failed || size != requested));
+    if (failed)
     {
-        size_t len = get_disk_size();
-        if (offset >= len)
-        {
-            printf("Tried to read after the end of the disk at offset %li\n", offset);
-            return 0;
-        }
+        count_request(disk, STATS_OP_READ, -EIO, start);
+        return -EIO;
+    }
 
-        if (offset + size > len)
+    /* Reads from the page cache come out of memory */
+    if (CACHE_NONE != disk->cache.mode)
+    {
+        src = malloc(sizeof(struct fuse_bufvec));
+        char *data = malloc(size ? size : 1);
+        ssize_t res = NULL == src || NULL == data ? -ENOMEM :
+                disk_read(disk, data, size, offset);
+        if (-1 == res)
+            res = -errno;
+        if (res < 0)
         {
-            printf("Tried to read past the end of the disk, truncating size from %lu to %lu\n", size, len - offset);
-            size = len - offset;
+            free(src);
+            free(data);
+            count_request(disk, STATS_OP_READ, res, start);
+            return res;
         }
 
-        off_t first_sector = offset / sector_size;
-        off_t last_sector = (offset + size + sector_size - 1) / sector_size;
-
-        for (off_t sector = first_sector; sector <= last_sector; sector++)
-            for (size_t i = 0; i < bad_sector_count; i++)
-                if (sector == bad_sectors[i])
-                {
-                    errno = EIO;
-                    return -1;
-                }
+        *src = FUSE_BUFVEC_INIT(res);
+        src->buf[0].mem = data;
+        *bufp = src;
+        count_request(disk, STATS_OP_READ, res, start);
+        return 0;
+    }
 
-        return pread(disk_image_fd, buf, size, offset);
+    src = image_bufvec(disk, NULL, size, offset, -1);
+    if (NULL == src)
+    {
+        count_request(disk, STATS_OP_READ, -ENOMEM, start);
+        return -ENOMEM;
     }
+    *bufp = src;
 
-    printf("Trying to read from %s!\n", path);
-    return -ENOENT;
+    count_request(disk, STATS_OP_READ, size, start);
+    return 0;
 }
 
-/* write() FUSE callback */
-static int write_callback(const char *path, const char *buf, size_t size,
+/* write_buf() FUSE callback. The data is spliced from the request into the
+ * image file when the kernel supports it */
+static int write_buf_callback(const char *path, struct fuse_bufvec *buf,
     off_t offset, struct fuse_file_info *fi)
 {
-    if (strcmp(path, filepath) == 0)
+    struct open_file *file = get_open_file(fi);
+    struct disk *disk = file->disk;
+    uint64_t start = event_clock();
+
+    /* Each write to the control file is one batch of commands */
+    if (DISK_CONTROL == file->kind)
     {
-        size_t len = get_disk_size();
-        if (offset >= len)
-        {
-            printf("Tried to write after the end of the disk at offset %li\n", offset);
-            return 0;
-        }
+        size_t size = fuse_buf_size(buf);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        char *text = malloc(size ? size : 1);
+        ssize_t res;
+
+        if (NULL == text)
+            return -ENOMEM;
 
-        if (offset + size > len)
+        dst.buf[0].mem = text;
+        res = fuse_buf_copy(&dst, buf, 0);
+        if (res >= 0)
         {
-            printf("Tried to write past the end of the disk, truncating size from %lu to %lu\n", size, len - offset);
-            size = len - offset;
+            int err = apply_control_commands(disk, text, res);
+            if (0 != err)
+                res = -err;
         }
 
-        off_t first_sector = offset / sector_size;
-        off_t last_sector = (offset + size + sector_size - 1) / sector_size;
-
-        for (off_t sector = first_sector; sector <= last_sector; sector++)
-            for (size_t i = 0; i < bad_sector_count; i++)
-                if (sector == bad_sectors[i])
-                    if (0 == repair_bad_sector(sector))
-                        break;
-                    else
-                    {
-                        errno = EIO;
-                        return -1;
-                    }
-
-        return pwrite(disk_image_fd, buf, size, offset);
+        free(text);
+        return res;
     }
 
-    printf("Trying to write to %s!\n", path);
-    return -ENOENT;
-}
+    if (DISK_IMAGE != file->kind)
+        return -EBADF;
 
-/* init() FUSE callback */
-static void *init_callback(struct fuse_conn_info *conn)
-{
-    filepath = filter_disk_options.disk_image
-            + strlen(filter_disk_options.disk_image)
-            - 1;
+    size_t size = clamp_to_disk(disk, EVENT_OP_WRITE, fuse_buf_size(buf),
+            offset, start);
+    if (0 == size)
+    {
+        count_request(disk, STATS_OP_WRITE, 0, start);
+        return 0;
+    }
 
-    while ((filepath > filter_disk_options.disk_image) && (*filepath != '/'))
-        filepath--;
+    int failed = check_write(disk, &size, offset, start);
+    sleep_for(request_delay(disk, size, offset, failed));
+    if (0 != failed)
+    {
+        count_request(disk, STATS_OP_WRITE, -EIO, start);
+        return -EIO;
+    }
 
-    if (*filepath != '/')
+    if (CACHE_NONE != disk->cache.mode)
     {
-        filepath = malloc(strlen(filter_disk_options.disk_image) + 1);
-        strcpy(filepath, "/");
-        strcpy(filepath + 1, filter_disk_options.disk_image);
-        filename = filter_disk_options.disk_image;
+        ssize_t res = write_cached(disk, buf, size, offset);
+        count_request(disk, STATS_OP_WRITE, res, start);
+        return res;
     }
-    else
+
+    int locked;
+    int fd = overlay_begin_write(&disk->overlay, offset, size, &locked);
+    if (-1 == fd)
     {
-        filename = filepath + 1;
+        int err = errno;
+        count_request(disk, STATS_OP_WRITE, -err, start);
+        return -err;
     }
 
-    disk_image_fd = open(filter_disk_options.disk_image, O_RDWR);
+    struct fuse_bufvec dst;
+    struct fuse_bufvec *dstv = image_bufvec(disk, &dst, size, offset, fd);
+    ssize_t res = -ENOMEM;
+
+    if (NULL != dstv)
+        res = fuse_buf_copy(dstv, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    overlay_end_write(&disk->overlay, offset, size, res, locked);
+    if (&dst != dstv)
+        free(dstv);
+    count_request(disk, STATS_OP_WRITE, res, start);
+    return res;
+}
+#endif
 
-    if (NULL == filter_disk_options.reserve_sectors)
-        reserve_sectors = 0;
-    else
-        reserve_sectors = strtoul(filter_disk_options.reserve_sectors, NULL, 10);
+/* init() FUSE callback */
+static void *init_callback(struct fuse_conn_info *conn)
+{
+    if (0 != setup_disk_images())
+        fuse_exit(fuse_get_context()->fuse);
 
-    build_bad_sector_list(filter_disk_options.bad_sector_list);
+#ifdef HAVE_FUSE_BUFVEC
+    /* Let read_buf() and write_buf() splice data between the kernel and the
+     * image file instead of copying it through our buffers */
+    conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
 
     return NULL;
 }
@@ -319,33 +2995,36 @@ static void *init_callback(struct fuse_conn_info *conn)
 /* destroy() FUSE callback */
 static void destroy_callback(void *private_data)
 {
-    printf("Entering destroy_callback()\n");
-    if (NULL != bad_sectors)
-        free(bad_sectors);
-
-    if (-1 != disk_image_fd)
-    {
-        fsync(disk_image_fd);
-        close(disk_image_fd);
-        disk_image_fd = -1;
-    }
+    teardown_disk_images();
 }
 
-/* acess() FUSE callback */
+/* acess() FUSE callback. The files of a disk have the access of its image
+ * file */
 static int access_callback(const char *path, int permissions)
 {
-    return access(filter_disk_options.disk_image, permissions);
+    enum disk_file kind;
+    struct disk *disk = find_disk_path(path, &kind);
+
+    /* Writes to an image with an overlay go to the overlay */
+    if (NULL != disk && -1 != disk->overlay.fd)
+        permissions &= ~W_OK;
+    if (NULL != disk && 0 != access(disk->options.disk_image, permissions))
+        return -errno;
+    return 0;
 }
 
 /* flush() FUSE callback */
 static int flush_callback(const char *path, struct fuse_file_info *fi)
 {
-    return fsync(disk_image_fd);
+    struct open_file *file = get_open_file(fi);
+
+    return 0 == sync_image(file->disk, file->kind, 0) ? 0 : -errno;
 }
 
 /* release() FUSE callback */
 static int release_callback(const char *path, struct fuse_file_info *fi)
 {
+    close_disk_file(get_open_file(fi));
     return 0;
 }
 
@@ -353,7 +3032,9 @@ static int release_callback(const char *path, struct fuse_file_info *fi)
 static int fsync_callback(const char *path, int datasync,
     struct fuse_file_info *fi)
 {
-    return fsync(disk_image_fd);
+    struct open_file *file = get_open_file(fi);
+
+    return 0 == sync_image(file->disk, file->kind, datasync) ? 0 : -errno;
 }
 
 /* fgetattr() FUSE callback */
@@ -369,14 +3050,21 @@ static struct fuse_operations filter_disk_operations = {
     .fgetattr = fgetattr_callback,
     .flush = flush_callback,
     .fsync = fsync_callback,
+    .ftruncate = ftruncate_callback,
     .getattr = getattr_callback,
     .init = init_callback,
     .open = open_callback,
     .read = read_callback,
+#ifdef HAVE_FUSE_BUFVEC
+    .read_buf = read_buf_callback,
+    .write_buf = write_buf_callback,
+#endif
     .readdir = readdir_callback,
     .release = release_callback,
+    .truncate = truncate_callback,
     .write = write_callback,
 };
+#endif
 
 /* Keys for command-line arguments */
 enum {
@@ -386,8 +3074,29 @@ enum {
     KEY_DISK_IMAGE_LONG,
     KEY_BAD_SECTOR_LIST,
     KEY_BAD_SECTOR_LIST_LONG,
+    KEY_BAD_SECTOR_FILE_LONG,
     KEY_RESERVE_SECTORS,
-    KEY_RESERVE_SECTORS_LONG
+    KEY_RESERVE_SECTORS_LONG,
+    KEY_DISK_SIZE_LONG,
+    KEY_ATTR_TIMEOUT_LONG,
+    KEY_ENTRY_TIMEOUT_LONG,
+    KEY_LOG_LONG,
+    KEY_LOG_RATE_LONG,
+    KEY_DEGRADE_LONG,
+    KEY_LATENCY_LONG,
+    KEY_SLOW_SECTORS_LONG,
+    KEY_JOURNAL_LONG,
+    KEY_PARTIAL_READS_LONG,
+    KEY_SECTOR_SIZE_LONG,
+    KEY_PHYSICAL_SECTOR_SIZE_LONG,
+    KEY_CONFIG_LONG,
+    KEY_OVERLAY_LONG,
+    KEY_URING_LONG,
+    KEY_SYNC_LONG,
+    KEY_SPARE_LONG,
+    KEY_CACHE_LONG,
+    KEY_CACHE_SIZE_LONG,
+    KEY_TRACE_LONG
 };
 
 /* FUSE command-line arguments */
@@ -396,17 +3105,63 @@ static struct fuse_opt filter_disk_opts[] = {
     FUSE_OPT_KEY("--help", KEY_HELP),
     FUSE_OPT_KEY("-V", KEY_VERSION),
     FUSE_OPT_KEY("--version", KEY_VERSION),
-    {"-i %s", offsetof(struct filter_disk_options, disk_image), KEY_DISK_IMAGE},
-    {"--diskimage=%s", offsetof(struct filter_disk_options, disk_image),
+    {"-i %s", offsetof(struct filter_disk_options, disk.disk_image), KEY_DISK_IMAGE},
+    {"--diskimage=%s", offsetof(struct filter_disk_options, disk.disk_image),
      KEY_DISK_IMAGE_LONG},
-    {"-s %s", offsetof(struct filter_disk_options, bad_sector_list),
+    {"-s %s", offsetof(struct filter_disk_options, disk.bad_sector_list),
      KEY_BAD_SECTOR_LIST},
-    {"--badsectors=%s", offsetof(struct filter_disk_options, bad_sector_list),
+    {"--badsectors=%s", offsetof(struct filter_disk_options, disk.bad_sector_list),
      KEY_BAD_SECTOR_LIST_LONG},
-    {"-r %s", offsetof(struct filter_disk_options, reserve_sectors),
+    {"--badsectors-file=%s", offsetof(struct filter_disk_options, disk.bad_sector_file),
+     KEY_BAD_SECTOR_FILE_LONG},
+    {"-r %s", offsetof(struct filter_disk_options, disk.reserve_sectors),
      KEY_RESERVE_SECTORS},
-    {"--reservesectors=%s", offsetof(struct filter_disk_options, reserve_sectors),
+    {"--reservesectors=%s", offsetof(struct filter_disk_options, disk.reserve_sectors),
      KEY_RESERVE_SECTORS_LONG},
+    {"--size=%s", offsetof(struct filter_disk_options, disk.disk_size),
+     KEY_DISK_SIZE_LONG},
+    {"--attr-timeout=%s", offsetof(struct filter_disk_options, attr_timeout),
+     KEY_ATTR_TIMEOUT_LONG},
+    {"--entry-timeout=%s", offsetof(struct filter_disk_options, entry_timeout),
+     KEY_ENTRY_TIMEOUT_LONG},
+    {"--log=%s", offsetof(struct filter_disk_options, log_destination),
+     KEY_LOG_LONG},
+    {"--log-rate=%s", offsetof(struct filter_disk_options, log_rate),
+     KEY_LOG_RATE_LONG},
+    {"--degrade=%s", offsetof(struct filter_disk_options, disk.degrade),
+     KEY_DEGRADE_LONG},
+    {"--latency=%s", offsetof(struct filter_disk_options, disk.latency),
+     KEY_LATENCY_LONG},
+    {"--slowsectors=%s", offsetof(struct filter_disk_options, disk.slow_sectors),
+     KEY_SLOW_SECTORS_LONG},
+    {"--journal=%s", offsetof(struct filter_disk_options, disk.journal),
+     KEY_JOURNAL_LONG},
+    {"--partial-reads", offsetof(struct filter_disk_options, disk.partial_reads),
+     1},
+    {"--sector-size=%s", offsetof(struct filter_disk_options, disk.sector_size),
+     KEY_SECTOR_SIZE_LONG},
+    {"--physical-sector-size=%s",
+     offsetof(struct filter_disk_options, disk.physical_sector_size),
+     KEY_PHYSICAL_SECTOR_SIZE_LONG},
+    {"--overlay=%s", offsetof(struct filter_disk_options, disk.overlay),
+     KEY_OVERLAY_LONG},
+    {"--sync=%s", offsetof(struct filter_disk_options, disk.sync),
+     KEY_SYNC_LONG},
+    {"--spare=%s", offsetof(struct filter_disk_options, disk.spare),
+     KEY_SPARE_LONG},
+    {"--cache=%s", offsetof(struct filter_disk_options, disk.cache),
+     KEY_CACHE_LONG},
+    {"--cache-size=%s", offsetof(struct filter_disk_options, disk.cache_size),
+     KEY_CACHE_SIZE_LONG},
+    {"--trace=%s", offsetof(struct filter_disk_options, disk.trace),
+     KEY_TRACE_LONG},
+    {"--config=%s", offsetof(struct filter_disk_options, config),
+     KEY_CONFIG_LONG},
+    {"--uring", offsetof(struct filter_disk_options, uring), 1},
+    {"--uring=%s", offsetof(struct filter_disk_options, uring_options),
+     KEY_URING_LONG},
+    {"--passthrough", offsetof(struct filter_disk_options, passthrough), 1},
+    {"--lazy", offsetof(struct filter_disk_options, lazy), 1},
     FUSE_OPT_END
 };
 
@@ -421,8 +3176,75 @@ static void usage(const char *progname)
 "    -V   --version         print version\n"
 "    -i   --diskimage       path to disk image to filter\n"
 "    -s   --badsectors      list of bad sectors, use , to delimit and - for ranges []\n"
+"         --badsectors-file file with a list of bad sectors, as text or binary []\n"
 "    -r   --reservesectors  number of reserve sectors for reallocation [0]\n"
-"\n", progname);
+"         --size            size of the image in bytes, K/M/G/T suffixes allowed\n"
+"                           [size of the image file or block device]\n"
+"         --attr-timeout    seconds the kernel may cache attributes for [1.0]\n"
+"         --entry-timeout   seconds the kernel may cache file names for [1.0]\n"
+"         --log             where to log events to, a file, - for stdout,\n"
+"                           syslog or none [-]\n"
+"         --log-rate        events logged per second at most, 0 for no limit [100]\n"
+"         --degrade         grow new bad sectors, as key=value,... with the keys\n"
+"                           rate=N/UNIT   N defects per s, m, h or d\n"
+"                           write=N/SIZE  N defects per SIZE bytes written\n"
+"                           cluster=P     chance of growing next to a bad\n"
+"                                         extent [0]\n"
+"                           spread=N      largest gap to that extent [64]\n"
+"                           size=N[-M]    sectors per defect [1]\n"
+"                           seed=N        random seed [1]\n"
+"         --latency         delay requests, as key=value,... with the keys\n"
+"                           fixed=TIME    delay added to every request\n"
+"                           random=uniform:LOW-HIGH, random=exp:MEAN or\n"
+"                           random=normal:MEAN/DEVIATION\n"
+"                                         random delay added to every request\n"
+"                           seek=TIME     full-stroke seek time\n"
+"                           rpm=N         spindle speed, for rotational delay\n"
+"                           error=TIME    retry time before a bad sector fails\n"
+"                           TIME is in ms unless suffixed with ns, us, ms or s\n"
+"         --slowsectors     slow sectors that still work, in the format\n"
+"                           x-y@TIME,z@TIME,... []\n"
+"         --journal         file keeping the bad sectors and reserve sectors\n"
+"                           across remounts []\n"
+"         --partial-reads   return the sectors before a bad sector instead of\n"
+"                           failing the whole read\n"
+"         --sector-size     logical sector size in bytes [512]\n"
+"         --physical-sector-size\n"
+"                           physical sector size in bytes, the unit in which\n"
+"                           sectors go bad [logical sector size]\n"
+"         --overlay         copy-on-write file taking the writes, so the disk\n"
+"                           image is only read and can be shared []\n"
+"         --sync            what flush and fsync do to the image: none, data\n"
+"                           for fdatasync, or full for fsync [full]\n",
+    progname);
+	fprintf(stderr,
+"         --spare           spare file that sectors reallocated on write move\n"
+"                           to, instead of being reallocated in place []\n"
+"         --cache           keep pages of the image in memory, with writes\n"
+"                           going through to the image or written back on\n"
+"                           flush and eviction: none, through or back [none]\n"
+"         --cache-size      size of the page cache in bytes, with an optional\n"
+"                           K, M, G or T suffix [64M]\n"
+"         --trace           file recording every request checked against the\n"
+"                           bad sectors and every change to them, for\n"
+"                           badsector-replay []\n"
+"         --config          file listing several disks to serve, in sections\n"
+"                           of key = value lines named like the options\n"
+"                           above; the disk options given here are defaults\n"
+"                           for every disk []\n"
+"         --uring           serve image reads and writes through io_uring,\n"
+"                           optionally as key=value,... with the keys\n"
+"                           depth=N       submissions in flight at most [128]\n"
+"                           buffers=N     1 MiB buffers to register [0]\n"
+"                           direct=yes    bypass the page cache for requests\n"
+"                                         aligned to 4 KiB [no]\n"
+"                           (libfuse 3 only)\n"
+"         --passthrough     let the kernel serve the image itself while a disk\n"
+"                           has no bad sectors (libfuse 3.16 and Linux 6.9)\n"
+"         --lazy            mount before the bad sectors are loaded, loading\n"
+"                           them in the background; requests wait for the\n"
+"                           sectors they cover to be loaded\n"
+"\n");
 }
 
 /* Process command-line arguments and populate the filter_disk_options struct */
@@ -432,52 +3254,576 @@ static int filter_disk_opt_proc(void *data, const char *arg, int key,
     if (key == KEY_HELP)
     {
         usage(outargs->argv[0]);
+#ifdef USE_FUSE3_LOWLEVEL
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+#else
         fuse_opt_add_arg(outargs, "-ho");
         fuse_main(outargs->argc, outargs->argv, &filter_disk_operations, NULL);
+#endif
         exit(1);
     }
 
     if (key == KEY_VERSION)
     {
+#ifdef USE_FUSE3_LOWLEVEL
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+#else
         fuse_opt_add_arg(outargs, "--version");
         fuse_main(outargs->argc, outargs->argv, &filter_disk_operations, NULL);
+#endif
         exit(0);
     }
 
     if (key == KEY_DISK_IMAGE)
     {
-        if (filter_disk_options.disk_image != NULL) {
-            free(filter_disk_options.disk_image);
-            filter_disk_options.disk_image = NULL;
+        if (filter_disk_options.disk.disk_image != NULL) {
+            free(filter_disk_options.disk.disk_image);
+            filter_disk_options.disk.disk_image = NULL;
         }
-        filter_disk_options.disk_image = strdup(arg + 2);
+        filter_disk_options.disk.disk_image = strdup(arg + 2);
         return 0;
     }
 
     if (key == KEY_BAD_SECTOR_LIST)
     {
-        if (filter_disk_options.bad_sector_list != NULL) {
-            free(filter_disk_options.bad_sector_list);
-            filter_disk_options.bad_sector_list = NULL;
+        if (filter_disk_options.disk.bad_sector_list != NULL) {
+            free(filter_disk_options.disk.bad_sector_list);
+            filter_disk_options.disk.bad_sector_list = NULL;
         }
-        filter_disk_options.bad_sector_list = strdup(arg + 2);
+        filter_disk_options.disk.bad_sector_list = strdup(arg + 2);
         return 0;
     }
 
     if (key == KEY_RESERVE_SECTORS)
     {
-        if (filter_disk_options.reserve_sectors != NULL) {
-            free(filter_disk_options.reserve_sectors);
-            filter_disk_options.reserve_sectors = NULL;
+        if (filter_disk_options.disk.reserve_sectors != NULL) {
+            free(filter_disk_options.disk.reserve_sectors);
+            filter_disk_options.disk.reserve_sectors = NULL;
         }
-        filter_disk_options.reserve_sectors = strdup(arg + 2);
+        filter_disk_options.disk.reserve_sectors = strdup(arg + 2);
         return 0;
     }
 
     return 1;
 }
 
+/* Parse the cache timeout options */
+/* Returns 0 on success and nonzero if a timeout is invalid */
+static int parse_timeout_options(void)
+{
+    if (NULL != filter_disk_options.attr_timeout &&
+            0 != parse_timeout(filter_disk_options.attr_timeout, &attr_timeout))
+    {
+        fprintf(stderr, "Invalid attribute timeout: %s\n",
+                filter_disk_options.attr_timeout);
+        return -1;
+    }
+
+    if (NULL != filter_disk_options.entry_timeout &&
+            0 != parse_timeout(filter_disk_options.entry_timeout, &entry_timeout))
+    {
+        fprintf(stderr, "Invalid entry timeout: %s\n",
+                filter_disk_options.entry_timeout);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse the event log options */
+/* Returns 0 on success and nonzero if an option is invalid */
+static int parse_log_options(void)
+{
+    if (NULL == filter_disk_options.log_destination)
+        filter_disk_options.log_destination = strdup("-");
+
+    if (NULL != filter_disk_options.log_rate)
+    {
+        char *end;
+        unsigned long rate;
+
+        errno = 0;
+        rate = strtoul(filter_disk_options.log_rate, &end, 10);
+        if (0 != errno || end == filter_disk_options.log_rate ||
+                '\0' != *end || rate > UINT_MAX)
+        {
+            fprintf(stderr, "Invalid log rate: %s\n",
+                    filter_disk_options.log_rate);
+            return -1;
+        }
+        log_rate = rate;
+    }
+
+    return 0;
+}
+
+/* Parse the io_uring options, given as key=value,... with the keys
+ *
+ *   depth=N        number of submissions in flight at most
+ *   buffers=N      number of buffers to register with the ring
+ *   direct=yes|no  whether to bypass the page cache where requests allow
+ */
+/* Returns 0 on success and nonzero if an option is invalid */
+static int parse_uring_options(void)
+{
+    const char *text = filter_disk_options.uring_options;
+    char *copy;
+    char *saved;
+    int ret = 0;
+
+    use_uring = filter_disk_options.uring || NULL != text;
+    if (NULL == text)
+        return 0;
+
+    copy = strdup(text);
+    if (NULL == copy)
+        return -1;
+
+    for (char *item = strtok_r(copy, ",", &saved); NULL != item && 0 == ret;
+            item = strtok_r(NULL, ",", &saved))
+    {
+        char *value = strchr(item, '=');
+        char *end;
+
+        if (NULL == value)
+        {
+            ret = -1;
+            break;
+        }
+        *value++ = '\0';
+        errno = 0;
+
+        if (0 == strcmp(item, "depth") || 0 == strcmp(item, "buffers"))
+        {
+            unsigned long number = strtoul(value, &end, 10);
+
+            if (end == value || '\0' != *end || 0 != errno ||
+                    number > 65536 || (0 == number &&
+                    0 == strcmp(item, "depth")))
+                ret = -1;
+            else if (0 == strcmp(item, "depth"))
+                uring_depth = number;
+            else
+                uring_buffers = number;
+        }
+        else if (0 == strcmp(item, "direct"))
+        {
+            if (0 == strcmp(value, "yes"))
+                uring_direct = 1;
+            else if (0 == strcmp(value, "no"))
+                uring_direct = 0;
+            else
+                ret = -1;
+        }
+        else
+            ret = -1;
+    }
+
+    if (0 != ret)
+        fprintf(stderr, "Invalid io_uring options: %s\n", text);
+    free(copy);
+    return ret;
+}
+
+/* Check the options of a disk and fill in its sector sizes and models */
+/* Returns 0 on success and nonzero if an option is invalid */
+static int configure_disk(struct disk *disk)
+{
+    const struct disk_options *options = &disk->options;
+    const char *name = disk->names[DISK_IMAGE];
+
+    if (NULL != options->sector_size &&
+            0 != parse_sector_size(options->sector_size, 512,
+            &disk->sector_size))
+    {
+        fprintf(stderr, "%s: Invalid sector size: %s\n", name,
+                options->sector_size);
+        return -1;
+    }
+
+    disk->physical_sector_size = disk->sector_size;
+    if (NULL != options->physical_sector_size &&
+            0 != parse_sector_size(options->physical_sector_size,
+            disk->sector_size, &disk->physical_sector_size))
+    {
+        fprintf(stderr, "%s: Invalid physical sector size: %s\n", name,
+                options->physical_sector_size);
+        return -1;
+    }
+
+    if (NULL != options->degrade &&
+            0 != parse_degrade_model(options->degrade, &disk->degrade_model))
+    {
+        fprintf(stderr, "%s: Invalid degradation model: %s\n", name,
+                options->degrade);
+        return -1;
+    }
+
+    if (NULL != options->latency &&
+            0 != parse_latency_model(options->latency, &disk->latency_model))
+    {
+        fprintf(stderr, "%s: Invalid latency model: %s\n", name,
+                options->latency);
+        return -1;
+    }
+
+    if (NULL != options->slow_sectors &&
+            0 != parse_slow_sectors(options->slow_sectors,
+            &disk->latency_model))
+    {
+        fprintf(stderr, "%s: Invalid slow sector list: %s\n", name,
+                options->slow_sectors);
+        return -1;
+    }
+
+    disk->sync_mode = SYNC_FULL;
+    if (NULL == options->sync || 0 == strcmp(options->sync, "full"))
+        ;
+    else if (0 == strcmp(options->sync, "data"))
+        disk->sync_mode = SYNC_DATA;
+    else if (0 == strcmp(options->sync, "none"))
+        disk->sync_mode = SYNC_NONE;
+    else
+    {
+        fprintf(stderr, "%s: Invalid sync mode: %s\n", name, options->sync);
+        return -1;
+    }
+
+    disk->cache_mode = CACHE_NONE;
+    if (NULL == options->cache || 0 == strcmp(options->cache, "none"))
+        ;
+    else if (0 == strcmp(options->cache, "through"))
+        disk->cache_mode = CACHE_WRITE_THROUGH;
+    else if (0 == strcmp(options->cache, "back"))
+        disk->cache_mode = CACHE_WRITE_BACK;
+    else
+    {
+        fprintf(stderr, "%s: Invalid cache mode: %s\n", name, options->cache);
+        return -1;
+    }
+
+    disk->cache_size = 64 * 1024 * 1024;
+    if (NULL != options->cache_size &&
+            (0 != parse_disk_size(options->cache_size, &disk->cache_size) ||
+            0 == disk->cache_size))
+    {
+        fprintf(stderr, "%s: Invalid cache size: %s\n", name,
+                options->cache_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Add a disk with the options given on the command line. Disks from a config
+ * file have their name in front of the names of their virtual files, the
+ * disk from the command line has the virtual files to itself */
+/* Returns the disk, or NULL on allocation failure */
+static struct disk *add_disk(const char *name, int prefixed)
+{
+    const struct degrade_model degrade_model = {0, 0, 0, 64, 1, 1, 1};
+    struct disk *resized = realloc(disks,
+            (disk_count + 1) * sizeof(struct disk));
+    if (NULL == resized)
+        return NULL;
+    disks = resized;
+
+    struct disk *disk = disks + disk_count;
+    memset(disk, 0, sizeof(struct disk));
+    disk->options = filter_disk_options.disk;
+    disk->fd = -1;
+    disk->direct_fd = -1;
+    disk->faults.journal.fd = -1;
+    disk->faults.trace.fd = -1;
+    disk->overlay.fd = -1;
+    disk->remap.fd = -1;
+    disk->sector_size = 512;
+    disk->degrade_model = degrade_model;
+
+    const char *suffixes[DISK_FILES] = {"", STATS_FILE_NAME,
+            CONTROL_FILE_NAME};
+    for (int kind = 0; kind < DISK_FILES; kind++)
+    {
+        const char *prefix = prefixed || DISK_IMAGE == kind ? name : "";
+
+        disk->names[kind] = malloc(strlen(prefix) + strlen(suffixes[kind]) + 1);
+        if (NULL == disk->names[kind])
+            return NULL;
+        strcpy(disk->names[kind], prefix);
+        strcat(disk->names[kind], suffixes[kind]);
+    }
+
+    disk_count++;
+    return disk;
+}
+
+/* Keys of the disk sections in the config file, named like the long
+ * command-line options */
+static const struct {
+    const char *key;
+    size_t offset;
+} disk_option_keys[] = {
+    {"diskimage", offsetof(struct disk_options, disk_image)},
+    {"badsectors", offsetof(struct disk_options, bad_sector_list)},
+    {"badsectors-file", offsetof(struct disk_options, bad_sector_file)},
+    {"reservesectors", offsetof(struct disk_options, reserve_sectors)},
+    {"size", offsetof(struct disk_options, disk_size)},
+    {"degrade", offsetof(struct disk_options, degrade)},
+    {"latency", offsetof(struct disk_options, latency)},
+    {"slowsectors", offsetof(struct disk_options, slow_sectors)},
+    {"journal", offsetof(struct disk_options, journal)},
+    {"sector-size", offsetof(struct disk_options, sector_size)},
+    {"physical-sector-size",
+     offsetof(struct disk_options, physical_sector_size)},
+    {"overlay", offsetof(struct disk_options, overlay)},
+    {"sync", offsetof(struct disk_options, sync)},
+    {"spare", offsetof(struct disk_options, spare)},
+    {"cache", offsetof(struct disk_options, cache)},
+    {"cache-size", offsetof(struct disk_options, cache_size)},
+    {"trace", offsetof(struct disk_options, trace)},
+};
+
+/* Set an option of a disk from a key and value in the config file */
+/* Returns 0 on success and nonzero if the key or value is invalid */
+static int set_disk_option(struct disk_options *options, const char *key,
+        const char *value)
+{
+    if (strcmp(key, "partial-reads") == 0)
+    {
+        if (strcmp(value, "yes") == 0)
+            options->partial_reads = 1;
+        else if (strcmp(value, "no") == 0)
+            options->partial_reads = 0;
+        else
+            return -1;
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(disk_option_keys) /
+            sizeof(disk_option_keys[0]); i++)
+        if (strcmp(key, disk_option_keys[i].key) == 0)
+        {
+            char *copy = strdup(value);
+            if (NULL == copy)
+                return -1;
+            *(char **)((char *)options + disk_option_keys[i].offset) = copy;
+            return 0;
+        }
+
+    return -1;
+}
+
+/* Strip leading and trailing whitespace from a string, in place */
+/* Returns the start of the stripped string */
+static char *strip(char *text)
+{
+    size_t length;
+
+    while (' ' == *text || '\t' == *text)
+        text++;
+
+    length = strlen(text);
+    while (length > 0 && (' ' == text[length - 1] ||
+            '\t' == text[length - 1] || '\n' == text[length - 1] ||
+            '\r' == text[length - 1]))
+        text[--length] = '\0';
+
+    return text;
+}
+
+/* Load the disks from a config file. Each disk starts with a [name] line,
+ * followed by key = value lines with its options, and # starts a comment */
+/* Returns 0 on success and nonzero on error */
+static int load_config(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    struct disk *disk = NULL;
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned int line_number = 0;
+    int ret = 0;
+
+    if (NULL == in)
+    {
+        fprintf(stderr, "Failed to open config file %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    while (0 == ret && getline(&line, &capacity, in) >= 0)
+    {
+        char *comment = strchr(line, '#');
+        char *text;
+
+        line_number++;
+        if (NULL != comment)
+            *comment = '\0';
+        text = strip(line);
+
+        if ('\0' == *text)
+            continue;
+
+        if ('[' == *text)
+        {
+            size_t length = strlen(text);
+            if (length > 2 && ']' == text[length - 1])
+            {
+                text[length - 1] = '\0';
+                disk = add_disk(strip(text + 1), 1);
+                if (NULL != disk)
+                    continue;
+            }
+        }
+        else
+        {
+            char *value = strchr(text, '=');
+            if (NULL != disk && NULL != value)
+            {
+                *value++ = '\0';
+                if (0 == set_disk_option(&disk->options, strip(text),
+                        strip(value)))
+                    continue;
+            }
+        }
+
+        fprintf(stderr, "%s:%u: Invalid line\n", path, line_number);
+        ret = -1;
+    }
+
+    free(line);
+    fclose(in);
+
+    return ret;
+}
+
+/* Create the disks, from the config file if there is one and otherwise from
+ * the command line, and check their options */
+/* Returns 0 on success and nonzero on error */
+static int create_disks(void)
+{
+    if (NULL != filter_disk_options.config)
+    {
+        if (0 != load_config(filter_disk_options.config))
+            return -1;
+    }
+    else if (NULL != filter_disk_options.disk.disk_image)
+    {
+        const char *image = filter_disk_options.disk.disk_image;
+        const char *slash = strrchr(image, '/');
+
+        if (NULL == add_disk(NULL != slash ? slash + 1 : image, 0))
+            return -1;
+    }
+
+    for (size_t i = 0; i < disk_count; i++)
+    {
+        const char *name = disks[i].names[DISK_IMAGE];
+        enum disk_file kind;
+
+        if (NULL == disks[i].options.disk_image)
+        {
+            fprintf(stderr, "%s: No disk image given\n", name);
+            return -1;
+        }
+
+        if ('\0' == *name || NULL != strchr(name, '/') ||
+                strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            fprintf(stderr, "Invalid disk name: %s\n", name);
+            return -1;
+        }
+
+        /* Every file under the mount point needs a name of its own */
+        for (int k = 0; k < DISK_FILES; k++)
+            if (find_disk_file(disks[i].names[k], &kind) != disks + i ||
+                    kind != k)
+            {
+                fprintf(stderr, "Duplicate file name: %s\n",
+                        disks[i].names[k]);
+                return -1;
+            }
+
+        if (0 != configure_disk(disks + i))
+            return -1;
+    }
+
+    return 0;
+}
+
 /* Main */
+#ifdef USE_FUSE3_LOWLEVEL
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config config;
+    int ret = 1;
+
+    /* Use fuse_opt_parse() to parse our options and leave the rest for
+     * fuse_parse_cmdline() and fuse_session_new() */
+    if (fuse_opt_parse(&args, &filter_disk_options, filter_disk_opts,
+        filter_disk_opt_proc) == -1)
+        exit(1);
+
+    if (fuse_parse_cmdline(&args, &opts) != 0 ||
+            0 != parse_timeout_options() || 0 != parse_log_options() ||
+            0 != parse_uring_options() || 0 != create_disks())
+        exit(1);
+
+    if (NULL == opts.mountpoint || 0 == disk_count)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    use_passthrough = filter_disk_options.passthrough;
+    lazy_index = filter_disk_options.lazy;
+#ifndef FUSE_CAP_PASSTHROUGH
+    if (use_passthrough)
+    {
+        fprintf(stderr, "--passthrough needs libfuse 3.16 or later\n");
+        exit(1);
+    }
+#endif
+
+    session = fuse_session_new(&args, &filter_disk_operations,
+            sizeof(filter_disk_operations), NULL);
+    if (NULL == session)
+        goto out_args;
+
+    if (fuse_set_signal_handlers(session) != 0)
+        goto out_session;
+
+    if (fuse_session_mount(session, opts.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+
+    /* Each worker thread gets its own cloned /dev/fuse descriptor so requests
+     * are spread across threads by the kernel instead of one shared queue */
+    if (opts.singlethread)
+        ret = fuse_session_loop(session);
+    else
+    {
+        config.clone_fd = 1;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(session, &config);
+    }
+
+    fuse_session_unmount(session);
+out_signals:
+    fuse_remove_signal_handlers(session);
+out_session:
+    fuse_session_destroy(session);
+out_args:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? 1 : 0;
+}
+#else
 int main(int argc, char *argv[])
 {
     /* Use fuse_opt_parse() to parse the command line and call fuse_main() */
@@ -486,5 +3832,36 @@ int main(int argc, char *argv[])
         filter_disk_opt_proc) == -1)
         exit(1);
 
+    /* The high-level API caches attributes and entries itself and takes its
+     * timeouts as mount options */
+    if (0 != parse_timeout_options() || 0 != parse_log_options() ||
+            0 != parse_uring_options() || 0 != create_disks())
+        exit(1);
+
+    /* Replies can only be sent from another thread with the low-level API */
+    use_passthrough = filter_disk_options.passthrough;
+    lazy_index = filter_disk_options.lazy;
+    if (use_uring || use_passthrough)
+    {
+        fprintf(stderr, "--%s needs a libfuse 3 build\n",
+                use_uring ? "uring" : "passthrough");
+        exit(1);
+    }
+
+    if (0 == disk_count)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    char timeout_option[64];
+    snprintf(timeout_option, sizeof(timeout_option), "-oattr_timeout=%f",
+            attr_timeout);
+    fuse_opt_add_arg(&args, timeout_option);
+    snprintf(timeout_option, sizeof(timeout_option), "-oentry_timeout=%f",
+            entry_timeout);
+    fuse_opt_add_arg(&args, timeout_option);
+
     return fuse_main(args.argc, args.argv, &filter_disk_operations, NULL);
 }
+#endif
@@ -0,0 +1,98 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#include "group_sync.h"
+
+#include <errno.h>
+
+int group_sync_init(struct group_sync *sync)
+{
+    sync->completed = sync->failed = 0;
+    sync->failed_errno = 0;
+    sync->running = 0;
+    sync->full = 0;
+
+    if (0 != pthread_mutex_init(&sync->lock, NULL))
+        return -1;
+    if (0 != pthread_cond_init(&sync->done, NULL))
+    {
+        pthread_mutex_destroy(&sync->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+void group_sync_destroy(struct group_sync *sync)
+{
+    pthread_cond_destroy(&sync->done);
+    pthread_mutex_destroy(&sync->lock);
+}
+
+int group_sync(struct group_sync *sync, int datasync, group_sync_fn fn,
+        void *context)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&sync->lock);
+
+    /* The round running now may have started before our writes finished,
+     * so only the one after it covers us */
+    uint64_t round = sync->completed + 1 + sync->running;
+    if (!datasync)
+        sync->full = 1;
+
+    while (sync->completed < round)
+    {
+        if (sync->running)
+        {
+            pthread_cond_wait(&sync->done, &sync->lock);
+            continue;
+        }
+
+        /* Nobody is syncing, so run the round for everyone waiting */
+        uint64_t current = sync->completed + 1;
+        int full = sync->full;
+
+        sync->full = 0;
+        sync->running = 1;
+        pthread_mutex_unlock(&sync->lock);
+        int result = fn(context, !full);
+        int saved_errno = errno;
+        pthread_mutex_lock(&sync->lock);
+        sync->running = 0;
+
+        sync->completed = current;
+        if (0 != result)
+        {
+            sync->failed = current;
+            sync->failed_errno = saved_errno;
+        }
+        pthread_cond_broadcast(&sync->done);
+    }
+
+    /* Only our own round decides, a later one may have failed without
+     * having anything to do with us */
+    if (sync->failed == round)
+    {
+        errno = sync->failed_errno;
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&sync->lock);
+    return ret;
+}
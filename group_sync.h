@@ -0,0 +1,59 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#ifndef GROUP_SYNC_H
+#define GROUP_SYNC_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Function that makes a file durable, syncing only its data if datasync is
+ * nonzero */
+/* Returns 0 on success and -1 with errno set on error */
+typedef int (*group_sync_fn)(void *context, int datasync);
+
+/* Group commit barrier. Threads that ask for a sync while one is running
+ * wait for it to finish and then share the next one, so any number of
+ * concurrent fsync requests cost at most two calls into the kernel. A round
+ * syncs everything if any thread in it asked for more than the data */
+struct group_sync {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* Broadcast when a round finishes */
+    uint64_t completed;         /* Number of the last round finished */
+    uint64_t failed;            /* Number of the last round that failed, or
+                                 * 0 if none has */
+    int failed_errno;           /* Error of that round */
+    int running;                /* Nonzero while a round is in the kernel */
+    int full;                   /* Nonzero if the next round must sync
+                                 * more than the data */
+};
+
+/* Initialize a barrier */
+/* Returns 0 on success and nonzero on error */
+int group_sync_init(struct group_sync *sync);
+
+/* Free the resources of a barrier. No thread may be using it */
+void group_sync_destroy(struct group_sync *sync);
+
+/* Wait until a call to fn started after this one was made has finished,
+ * making that call if no other thread is */
+/* Returns 0 on success and -1 with errno set if the call that covered this
+ * one failed */
+int group_sync(struct group_sync *sync, int datasync, group_sync_fn fn,
+        void *context);
+
+#endif
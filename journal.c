@@ -0,0 +1,526 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Identifies a journal file and the version of its format */
+static const char journal_magic[8] = {'F', 'B', 'S', 'J', 'R', 'N', 'L', '1'};
+
+/* Start of a journal file, followed by the records */
+struct journal_header {
+    char magic[8];
+    uint64_t sector_size;       /* Size of the sectors the records count */
+};
+
+/* Record types */
+enum {
+    RECORD_INJECT = 1,          /* Extents became bad */
+    RECORD_CLEAR,               /* Extents were cleared */
+    RECORD_REPAIR,              /* Extents were repaired with reserves */
+    RECORD_RESERVE_SET,         /* Reserve sectors were set to count */
+    RECORD_RESERVE_ADD          /* count reserve sectors were added */
+};
+
+/* Header of a record, followed by count extents for the extent records. The
+ * checksum covers everything after it up to the end of the record */
+struct record_header {
+    uint32_t checksum;
+    uint32_t type;
+    uint64_t count;
+};
+
+/* Extent as stored in a record */
+struct record_extent {
+    int64_t first;
+    int64_t last;
+};
+
+/* CRC-32 lookup table, built by journal_open() */
+static uint32_t crc_table[256];
+
+/* Build the CRC-32 lookup table for the reflected polynomial 0xedb88320 */
+static void build_crc_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        crc_table[i] = crc;
+    }
+}
+
+/* Continue a CRC-32 over more data. Start from 0 */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Return the size of a record's payload in bytes */
+static size_t payload_size(uint32_t type, uint64_t count)
+{
+    if (RECORD_RESERVE_SET == type || RECORD_RESERVE_ADD == type)
+        return 0;
+    return count * sizeof(struct record_extent);
+}
+
+/* Write a record into a buffer, which needs room for the header and payload */
+static void encode_record(char *buffer, uint32_t type, uint64_t count,
+        const struct sector_extent *extents)
+{
+    struct record_header header = {0, type, count};
+    char *payload = buffer + sizeof(struct record_header);
+
+    for (size_t i = 0; i < payload_size(type, count) /
+            sizeof(struct record_extent); i++)
+    {
+        struct record_extent extent = {extents[i].first, extents[i].last};
+        memcpy(payload + i * sizeof(struct record_extent), &extent,
+                sizeof(struct record_extent));
+    }
+
+    header.checksum = crc32_update(0, &header.type,
+            sizeof(struct record_header) - sizeof(uint32_t));
+    header.checksum = crc32_update(header.checksum, payload,
+            payload_size(type, count));
+    memcpy(buffer, &header, sizeof(struct record_header));
+}
+
+/* Queue a record to be written by the journal thread */
+static void append_record(struct journal *journal, uint32_t type,
+        uint64_t count, const struct sector_extent *extents)
+{
+    size_t size = sizeof(struct record_header) + payload_size(type, count);
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (journal->queued + size > journal->capacity)
+    {
+        size_t capacity = journal->capacity ? journal->capacity : 4096;
+        while (capacity < journal->queued + size)
+            capacity *= 2;
+
+        char *queue = realloc(journal->queue, capacity);
+        if (NULL == queue)
+        {
+            /* Losing a record would leave the journal out of step with the
+             * fault map, so stop trusting it */
+            journal->failed = 1;
+            pthread_mutex_unlock(&journal->lock);
+            return;
+        }
+        journal->queue = queue;
+        journal->capacity = capacity;
+    }
+
+    encode_record(journal->queue + journal->queued, type, count, extents);
+    journal->queued += size;
+    journal->appended++;
+    pthread_cond_signal(&journal->wake);
+
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/* Fault map observer that queues a record for each change */
+static void journal_observe(void *context, enum fault_map_change_kind kind,
+        const struct sector_extent *extents, size_t count)
+{
+    static const uint32_t types[] = {
+        [FAULT_MAP_INJECT] = RECORD_INJECT,
+        [FAULT_MAP_CLEAR] = RECORD_CLEAR,
+        [FAULT_MAP_REPAIR] = RECORD_REPAIR,
+        [FAULT_MAP_RESERVE_SET] = RECORD_RESERVE_SET,
+        [FAULT_MAP_RESERVE_ADD] = RECORD_RESERVE_ADD
+    };
+
+    /* Setting the reserve sectors to none is still a change */
+    if (0 != count || FAULT_MAP_RESERVE_SET == kind)
+        append_record(context, types[kind], count, extents);
+}
+
+/* Write a whole buffer to a file descriptor */
+/* Returns 0 on success and nonzero on error */
+static int write_all(int fd, const char *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0 && EINTR == errno)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        buffer += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/* Apply the extents collected for one kind of record to the fault map */
+/* Returns 0 on success and nonzero on allocation failure */
+static int flush_replayed(struct fault_map *map, struct fault_map_change *change)
+{
+    int ret = 0;
+
+    if (0 != change->extents.count)
+        ret = fault_map_update(map, change, 1);
+
+    free(change->extents.extents);
+    memset(&change->extents, 0, sizeof(struct extent_list));
+
+    return ret;
+}
+
+/* Load the state in a journal into an initialized, empty fault map. Runs of
+ * records of the same kind are applied as one update. Replay stops at the
+ * first record that is incomplete or fails its checksum, which is where a
+ * crash cut the journal off */
+/* Returns 0 on success and nonzero on allocation failure */
+static int replay(const char *data, size_t size, struct fault_map *map)
+{
+    struct fault_map_change change;
+    uint64_t reserve_sectors = 0;
+    size_t offset = sizeof(struct journal_header);
+
+    memset(&change, 0, sizeof(struct fault_map_change));
+
+    while (size - offset >= sizeof(struct record_header))
+    {
+        struct record_header header;
+        memcpy(&header, data + offset, sizeof(struct record_header));
+
+        const char *payload = data + offset + sizeof(struct record_header);
+        size_t available = size - offset - sizeof(struct record_header);
+        if (header.type < RECORD_INJECT || header.type > RECORD_RESERVE_ADD ||
+                (0 != payload_size(header.type, 1) &&
+                header.count > available / sizeof(struct record_extent)))
+            break;
+
+        uint32_t checksum = crc32_update(0, &header.type,
+                sizeof(struct record_header) - sizeof(uint32_t));
+        checksum = crc32_update(checksum, payload,
+                payload_size(header.type, header.count));
+        if (checksum != header.checksum)
+            break;
+
+        if (RECORD_RESERVE_SET == header.type)
+            reserve_sectors = header.count;
+        else if (RECORD_RESERVE_ADD == header.type)
+            reserve_sectors += header.count;
+        else
+        {
+            int clear = RECORD_INJECT != header.type;
+
+            /* Injects and clears don't commute, so apply what has been
+             * collected when the kind changes */
+            if (0 != change.extents.count && change.clear != clear)
+            {
+                fault_map_set_reserve_sectors(map, reserve_sectors);
+                if (0 != flush_replayed(map, &change))
+                    return -1;
+            }
+            change.clear = clear;
+
+            for (uint64_t i = 0; i < header.count; i++)
+            {
+                struct record_extent extent;
+                memcpy(&extent, payload + i * sizeof(struct record_extent),
+                        sizeof(struct record_extent));
+
+                if (extent.first < 0 || extent.last < 0 ||
+                        0 != extent_list_append(&change.extents, extent.first,
+                        extent.last))
+                {
+                    free(change.extents.extents);
+                    return -1;
+                }
+
+                /* Each repaired sector used up a reserve sector */
+                if (RECORD_REPAIR == header.type)
+                {
+                    uint64_t used = extent.last - extent.first + 1;
+                    reserve_sectors = reserve_sectors > used ?
+                            reserve_sectors - used : 0;
+                }
+            }
+        }
+
+        offset += sizeof(struct record_header) +
+                payload_size(header.type, header.count);
+    }
+
+    fault_map_set_reserve_sectors(map, reserve_sectors);
+    return flush_replayed(map, &change);
+}
+
+/* Replace the journal file with a single snapshot of the fault map. The
+ * snapshot is written to a temporary file that is renamed over the journal,
+ * so a crash leaves either the old journal or the new one */
+/* Returns 0 on success and nonzero on error */
+static int write_snapshot(const char *path, uint64_t sector_size,
+        struct fault_map *map)
+{
+    struct journal_header header;
+    struct extent_list list = {NULL, 0, 0};
+    size_t path_length = strlen(path);
+    char *temporary = malloc(path_length + 5);
+    char *directory = strdup(path);
+    char *buffer = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (NULL == temporary || NULL == directory ||
+            0 != fault_map_snapshot(map, &list))
+        goto out;
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", 5);
+
+    size_t size = sizeof(struct journal_header) +
+            2 * sizeof(struct record_header) +
+            list.count * sizeof(struct record_extent);
+    buffer = malloc(size);
+    if (NULL == buffer)
+        goto out;
+
+    memcpy(header.magic, journal_magic, sizeof(journal_magic));
+    header.sector_size = sector_size;
+    memcpy(buffer, &header, sizeof(struct journal_header));
+    encode_record(buffer + sizeof(struct journal_header), RECORD_RESERVE_SET,
+            fault_map_reserve_sectors(map), NULL);
+    encode_record(buffer + sizeof(struct journal_header) +
+            sizeof(struct record_header), RECORD_INJECT, list.count,
+            list.extents);
+
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd || 0 != write_all(fd, buffer, size) || 0 != fdatasync(fd))
+        goto out;
+    close(fd);
+    fd = -1;
+
+    if (0 != rename(temporary, path))
+        goto out;
+
+    /* Make the rename itself durable */
+    fd = open(dirname(directory), O_RDONLY | O_DIRECTORY);
+    if (-1 == fd || 0 != fsync(fd))
+        goto out;
+
+    ret = 0;
+
+out:
+    if (-1 != fd)
+        close(fd);
+    if (0 != ret && NULL != temporary)
+        unlink(temporary);
+    free(list.extents);
+    free(buffer);
+    free(directory);
+    free(temporary);
+
+    return ret;
+}
+
+/* Journal thread. Writes out whatever has been queued since the last batch
+ * and syncs it, so everything queued while a sync is in progress goes to disk
+ * together in the next one */
+static void *journal_main(void *data)
+{
+    struct journal *journal = data;
+
+    pthread_mutex_lock(&journal->lock);
+    for (;;)
+    {
+        while (journal->running && 0 == journal->queued)
+            pthread_cond_wait(&journal->wake, &journal->lock);
+        if (0 == journal->queued)
+            break;
+
+        char *batch = journal->queue;
+        size_t size = journal->queued;
+        uint64_t last = journal->appended;
+        journal->queue = NULL;
+        journal->queued = journal->capacity = 0;
+        pthread_mutex_unlock(&journal->lock);
+
+        int ret = write_all(journal->fd, batch, size);
+        if (0 == ret)
+            ret = fdatasync(journal->fd);
+        free(batch);
+
+        pthread_mutex_lock(&journal->lock);
+        if (0 != ret)
+            journal->failed = 1;
+        journal->durable = last;
+        pthread_cond_broadcast(&journal->synced);
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    return NULL;
+}
+
+int journal_open(struct journal *journal, const char *path,
+        uint64_t sector_size, struct fault_map *map, struct extent_list *list,
+        uint64_t reserve_sectors, int *replayed)
+{
+    struct journal_header header;
+    struct extent_list empty = {NULL, 0, 0};
+    struct stat st;
+    int fd;
+
+    memset(journal, 0, sizeof(struct journal));
+    journal->fd = -1;
+    *replayed = 0;
+    build_crc_table();
+
+    journal->path = strdup(path);
+    if (NULL == journal->path)
+        return -1;
+
+    /* Load an existing journal, or start from the list if there is none */
+    fd = open(path, O_RDONLY);
+    if (-1 == fd && ENOENT != errno)
+        goto fail;
+
+    if (-1 != fd)
+    {
+        if (0 != fstat(fd, &st) ||
+                st.st_size < (off_t)sizeof(struct journal_header))
+        {
+            close(fd);
+            errno = EINVAL;
+            goto fail;
+        }
+
+        const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                0);
+        close(fd);
+        if (MAP_FAILED == data)
+            goto fail;
+
+        int ret = -1;
+        memcpy(&header, data, sizeof(struct journal_header));
+        if (0 == memcmp(header.magic, journal_magic, sizeof(journal_magic)) &&
+                sector_size == header.sector_size &&
+                0 == fault_map_init(map, &empty, 0))
+        {
+            ret = replay(data, st.st_size, map);
+            if (0 != ret)
+                fault_map_destroy(map);
+        }
+        munmap((void *)data, st.st_size);
+        if (0 != ret)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        *replayed = 1;
+    }
+    else if (0 != fault_map_init(map, list, reserve_sectors))
+        goto fail;
+
+    /* Start over from a snapshot so the next replay is quick */
+    if (0 != write_snapshot(path, sector_size, map))
+        goto fail_map;
+
+    journal->fd = open(path, O_WRONLY | O_APPEND);
+    if (-1 == journal->fd)
+        goto fail_map;
+
+    if (0 != pthread_mutex_init(&journal->lock, NULL))
+        goto fail_fd;
+    if (0 != pthread_cond_init(&journal->wake, NULL))
+        goto fail_lock;
+    if (0 != pthread_cond_init(&journal->synced, NULL))
+        goto fail_wake;
+
+    journal->running = 1;
+    if (0 != pthread_create(&journal->thread, NULL, journal_main, journal))
+        goto fail_synced;
+
+    fault_map_set_observer(map, journal_observe, journal);
+    return 0;
+
+fail_synced:
+    pthread_cond_destroy(&journal->synced);
+fail_wake:
+    pthread_cond_destroy(&journal->wake);
+fail_lock:
+    pthread_mutex_destroy(&journal->lock);
+fail_fd:
+    close(journal->fd);
+    journal->fd = -1;
+fail_map:
+    fault_map_destroy(map);
+fail:
+    free(journal->path);
+    journal->path = NULL;
+    journal->running = 0;
+    return -1;
+}
+
+void journal_close(struct journal *journal)
+{
+    if (-1 == journal->fd)
+        return;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->running = 0;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+
+    pthread_cond_destroy(&journal->synced);
+    pthread_cond_destroy(&journal->wake);
+    pthread_mutex_destroy(&journal->lock);
+    close(journal->fd);
+    journal->fd = -1;
+    free(journal->queue);
+    free(journal->path);
+    journal->path = NULL;
+}
+
+int journal_sync(struct journal *journal)
+{
+    int ret;
+
+    if (-1 == journal->fd)
+        return 0;
+
+    pthread_mutex_lock(&journal->lock);
+    uint64_t target = journal->appended;
+    while (journal->durable < target && !journal->failed)
+        pthread_cond_wait(&journal->synced, &journal->lock);
+    ret = journal->failed ? -1 : 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    return ret;
+}
@@ -0,0 +1,73 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "fault_map.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only journal of the changes made to a fault map, so that the bad
+ * sectors and reserve sectors survive remounts.
+ *
+ * The journal starts with a snapshot of the state and is followed by one
+ * checksummed record per change. Records are queued in memory and written out
+ * by a background thread, which syncs them to disk in batches: a thread that
+ * needs its changes to be durable waits for the batch they are in instead of
+ * syncing on its own. A crash can only lose records that nobody waited for,
+ * and a record torn by a crash is dropped when the journal is replayed */
+struct journal {
+    char *path;
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* Signalled when records are queued */
+    pthread_cond_t synced;      /* Broadcast when a batch is on disk */
+    char *queue;                /* Records waiting to be written */
+    size_t queued;
+    size_t capacity;
+    uint64_t appended;          /* Number of records queued so far */
+    uint64_t durable;           /* Number of records known to be on disk */
+    int failed;                 /* Nonzero once a write or sync failed */
+
+    pthread_t thread;
+    int running;
+};
+
+/* Open the journal at path and load the state it holds into map, which must
+ * not be initialized yet. sector_size is the size in bytes of the sectors
+ * the map counts, and a journal written with another size is refused. A
+ * journal that doesn't exist yet is created from the extents in list and
+ * reserve_sectors. Either way the journal is then
+ * rewritten as a single snapshot and records every change to map from now
+ * on. *replayed is set to nonzero if the state came from the journal, in
+ * which case list is left alone */
+/* Returns 0 on success and nonzero on error */
+int journal_open(struct journal *journal, const char *path,
+        uint64_t sector_size, struct fault_map *map, struct extent_list *list,
+        uint64_t reserve_sectors, int *replayed);
+
+/* Write out the records still queued and close the journal */
+void journal_close(struct journal *journal);
+
+/* Wait until every record queued so far is on disk */
+/* Returns 0 on success and nonzero if the journal couldn't be written */
+int journal_sync(struct journal *journal);
+
+#endif
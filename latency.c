@@ -0,0 +1,182 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "latency.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Random stream for this thread, seeded on first use */
+static __thread uint64_t random_state = 0;
+static uint64_t next_random_seed = 0;
+
+/* Return the next number from this thread's splitmix64 random stream */
+static uint64_t next_random(void)
+{
+    if (0 == random_state)
+        random_state = __atomic_add_fetch(&next_random_seed,
+                0x632be59bd9b4e019ULL, __ATOMIC_RELAXED);
+
+    uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Return a random number in [0, 1) */
+static double random_fraction(void)
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* qsort() comparison function for slow extents, ordered by first sector */
+static int compare_slow_extents(const void *a, const void *b)
+{
+    off_t first = ((const struct latency_extent *)a)->first;
+    off_t second = ((const struct latency_extent *)b)->first;
+
+    return (first > second) - (first < second);
+}
+
+int latency_init(struct latency *latency, const struct latency_model *model,
+        off_t sector_count)
+{
+    memset(latency, 0, sizeof(struct latency));
+    latency->model = *model;
+    latency->sector_count = sector_count;
+    latency->enabled = 0 != model->fixed ||
+            LATENCY_NONE != model->distribution || 0 != model->seek ||
+            0 != model->rpm || 0 != model->error || 0 != model->slow_count;
+
+    if (0 == model->slow_count)
+        return 0;
+
+    latency->reach = malloc(model->slow_count * sizeof(off_t));
+    if (NULL == latency->reach)
+        return -1;
+
+    /* Slow extents may overlap, so keep the furthest any of them reach to be
+     * able to binary search for the first one overlapping a request */
+    qsort(latency->model.slow, model->slow_count,
+            sizeof(struct latency_extent), compare_slow_extents);
+    for (size_t i = 0; i < model->slow_count; i++)
+    {
+        off_t last = latency->model.slow[i].last;
+        latency->reach[i] = 0 == i || last > latency->reach[i - 1] ?
+                last : latency->reach[i - 1];
+    }
+
+    return 0;
+}
+
+void latency_destroy(struct latency *latency)
+{
+    free(latency->model.slow);
+    free(latency->reach);
+    memset(latency, 0, sizeof(struct latency));
+}
+
+/* Return the random part of a delay */
+static uint64_t random_delay(const struct latency_model *model)
+{
+    double delay;
+
+    switch (model->distribution)
+    {
+    case LATENCY_UNIFORM:
+        return model->low + (model->high - model->low) * random_fraction();
+
+    case LATENCY_EXPONENTIAL:
+        return -log(1.0 - random_fraction()) * model->low;
+
+    case LATENCY_NORMAL:
+        /* Box-Muller transform */
+        delay = model->low + model->high *
+                sqrt(-2.0 * log(1.0 - random_fraction())) *
+                cos(2.0 * M_PI * random_fraction());
+        return delay > 0 ? delay : 0;
+
+    default:
+        return 0;
+    }
+}
+
+/* Return the delay of the slowest slow extent overlapping a request */
+static uint64_t slow_delay(const struct latency *latency, off_t first_sector,
+        off_t last_sector)
+{
+    const struct latency_extent *slow = latency->model.slow;
+    size_t low = 0;
+    size_t high = latency->model.slow_count;
+    uint64_t delay = 0;
+
+    /* Find the first extent from which on some extent reaches the request */
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (latency->reach[middle] < first_sector)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    for (; low < latency->model.slow_count && slow[low].first <= last_sector;
+            low++)
+        if (slow[low].last >= first_sector && slow[low].delay > delay)
+            delay = slow[low].delay;
+
+    return delay;
+}
+
+uint64_t latency_seek(const struct latency *latency, off_t from, off_t to)
+{
+    const struct latency_model *model = &latency->model;
+    off_t distance = from > to ? from - to : to - from;
+    uint64_t delay = 0;
+
+    /* Sequential requests don't seek or wait for the platter */
+    if (0 != distance)
+    {
+        if (0 != latency->sector_count)
+            delay += model->seek * sqrt((double)distance /
+                    latency->sector_count);
+        if (0 != model->rpm)
+            delay += 60e9 / model->rpm * random_fraction();
+    }
+
+    return delay;
+}
+
+uint64_t latency_delay(struct latency *latency, off_t first_sector,
+        off_t last_sector, int failed)
+{
+    const struct latency_model *model = &latency->model;
+    uint64_t delay = model->fixed + random_delay(model);
+
+    if (0 != model->seek || 0 != model->rpm)
+        delay += latency_seek(latency, __atomic_exchange_n(&latency->head,
+                last_sector + 1, __ATOMIC_RELAXED), first_sector);
+
+    if (0 != model->slow_count)
+        delay += slow_delay(latency, first_sector, last_sector);
+
+    if (failed)
+        delay += model->error;
+
+    return delay;
+}
@@ -0,0 +1,89 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Distribution of the random part of a request's delay */
+enum latency_distribution {
+    LATENCY_NONE,
+    LATENCY_UNIFORM,        /* Between low and high */
+    LATENCY_EXPONENTIAL,    /* With a mean of low */
+    LATENCY_NORMAL          /* With a mean of low and a deviation of high,
+                             * never below 0 */
+};
+
+/* Extent of sectors that are slow to access but still work */
+struct latency_extent {
+    off_t first;
+    off_t last;
+    uint64_t delay;         /* Nanoseconds added to requests touching it */
+};
+
+/* How long requests take. All times are in nanoseconds, and each part is
+ * disabled by leaving it 0 */
+struct latency_model {
+    uint64_t fixed;         /* Added to every request */
+    enum latency_distribution distribution;
+    uint64_t low;           /* Parameters of the distribution */
+    uint64_t high;
+    uint64_t seek;          /* Full-stroke seek time. Shorter seeks take
+                             * time in proportion to the square root of the
+                             * distance from the end of the last request */
+    unsigned int rpm;       /* Spindle speed, adding a random rotational
+                             * delay of up to one turn to each seek */
+    uint64_t error;         /* Time a disk spends retrying a bad sector
+                             * before it gives up */
+    struct latency_extent *slow;    /* Slow sectors */
+    size_t slow_count;
+};
+
+/* Latency state for a disk */
+struct latency {
+    struct latency_model model;
+    off_t sector_count;     /* Number of sectors on the disk */
+    off_t *reach;           /* Highest last sector of the slow extents up to
+                             * each index, for searching overlapping ones */
+    off_t head;             /* Sector after the end of the last request,
+                             * updated atomically */
+    int enabled;            /* Nonzero if the model adds any delay */
+};
+
+/* Set up latency state for a disk of sector_count sectors. The model's slow
+ * extents are sorted in place and taken over */
+/* Returns 0 on success and nonzero on allocation failure */
+int latency_init(struct latency *latency, const struct latency_model *model,
+        off_t sector_count);
+
+/* Free the memory held by latency state */
+void latency_destroy(struct latency *latency);
+
+/* Work out how long the head takes to move from sector from to sector to and
+ * wait for the platter, without moving it */
+/* Returns the delay in nanoseconds, 0 if the model has no seeks */
+uint64_t latency_seek(const struct latency *latency, off_t from, off_t to);
+
+/* Work out how long a request for [first_sector, last_sector] takes, and move
+ * the head to its end. failed is nonzero if the request hits a bad sector */
+/* Returns the delay in nanoseconds */
+uint64_t latency_delay(struct latency *latency, off_t first_sector,
+        off_t last_sector, int failed);
+
+#endif
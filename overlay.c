@@ -0,0 +1,348 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+/* For fallocate() */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "overlay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Identifies an overlay file and the version of its format */
+static const char overlay_magic[8] = {'F', 'B', 'S', 'O', 'V', 'R', 'L', '1'};
+
+/* Start of the map after the chunks in an overlay file, followed by the
+ * bitmap */
+struct overlay_header {
+    char magic[8];
+    uint64_t size;              /* Size of the disk the overlay is for */
+    uint64_t chunk_size;
+};
+
+/* Check whether a chunk is in the overlay */
+static int chunk_present(const struct overlay *overlay, uint64_t chunk)
+{
+    return __atomic_load_n(overlay->bitmap + chunk / 64, __ATOMIC_ACQUIRE) >>
+            (chunk % 64) & 1;
+}
+
+int overlay_open(struct overlay *overlay, const char *path, int base_fd,
+        size_t size)
+{
+    struct overlay_header *header;
+    struct stat stat;
+    int fresh;
+    int saved_errno;
+
+    memset(overlay, 0, sizeof(struct overlay));
+    overlay->base_fd = base_fd;
+    overlay->fd = -1;
+    overlay->size = size;
+    if (NULL == path)
+        return 0;
+
+    overlay->chunk_count = (size + OVERLAY_CHUNK_SIZE - 1) /
+            OVERLAY_CHUNK_SIZE;
+    overlay->map_offset = overlay->chunk_count * OVERLAY_CHUNK_SIZE;
+    overlay->map_length = sizeof(struct overlay_header) +
+            (overlay->chunk_count + 63) / 64 * sizeof(uint64_t);
+
+    overlay->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == overlay->fd || 0 != fstat(overlay->fd, &stat))
+        goto fail;
+
+    /* An empty file is a new overlay. Size it up front so the map can be
+     * mapped, the chunks stay holes until they are written */
+    fresh = 0 == stat.st_size;
+    if (fresh)
+    {
+        if (0 != ftruncate(overlay->fd,
+                overlay->map_offset + overlay->map_length))
+            goto fail;
+    }
+    else if (stat.st_size < overlay->map_offset + (off_t)overlay->map_length)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    overlay->mapping = mmap(NULL, overlay->map_length,
+            PROT_READ | PROT_WRITE, MAP_SHARED, overlay->fd,
+            overlay->map_offset);
+    if (MAP_FAILED == overlay->mapping)
+    {
+        overlay->mapping = NULL;
+        goto fail;
+    }
+    header = overlay->mapping;
+    overlay->bitmap = (uint64_t *)(header + 1);
+
+    if (fresh)
+    {
+        memcpy(header->magic, overlay_magic, sizeof(overlay_magic));
+        header->size = size;
+        header->chunk_size = OVERLAY_CHUNK_SIZE;
+    }
+    else if (0 != memcmp(header->magic, overlay_magic, sizeof(overlay_magic))
+            || size != header->size || OVERLAY_CHUNK_SIZE != header->chunk_size)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    if (0 != pthread_mutex_init(&overlay->lock, NULL))
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    saved_errno = errno;
+    if (NULL != overlay->mapping)
+        munmap(overlay->mapping, overlay->map_length);
+    if (-1 != overlay->fd)
+        close(overlay->fd);
+    overlay->mapping = NULL;
+    overlay->bitmap = NULL;
+    overlay->fd = -1;
+    errno = saved_errno;
+    return -1;
+}
+
+void overlay_close(struct overlay *overlay)
+{
+    if (-1 == overlay->fd)
+        return;
+
+    msync(overlay->mapping, overlay->map_length, MS_SYNC);
+    munmap(overlay->mapping, overlay->map_length);
+    fsync(overlay->fd);
+    close(overlay->fd);
+    pthread_mutex_destroy(&overlay->lock);
+
+    overlay->mapping = NULL;
+    overlay->bitmap = NULL;
+    overlay->fd = -1;
+}
+
+int overlay_lookup(struct overlay *overlay, off_t offset, size_t size,
+        size_t *length)
+{
+    if (-1 == overlay->fd || 0 == size)
+    {
+        *length = size;
+        return overlay->base_fd;
+    }
+
+    uint64_t chunk = offset / OVERLAY_CHUNK_SIZE;
+    int present = chunk_present(overlay, chunk);
+    off_t end = (off_t)(chunk + 1) * OVERLAY_CHUNK_SIZE;
+
+    while (end - offset < (off_t)size &&
+            chunk_present(overlay, end / OVERLAY_CHUNK_SIZE) == present)
+        end += OVERLAY_CHUNK_SIZE;
+
+    *length = end - offset < (off_t)size ? (size_t)(end - offset) : size;
+    return present ? overlay->fd : overlay->base_fd;
+}
+
+ssize_t overlay_pread(struct overlay *overlay, void *buf, size_t size,
+        off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t length;
+        int fd = overlay_lookup(overlay, offset + done, size - done, &length);
+        ssize_t res = pread(fd, (char *)buf + done, length, offset + done);
+
+        if (res < 0)
+            return 0 == done ? -1 : (ssize_t)done;
+        if (0 == res)
+            break;
+        done += res;
+    }
+
+    return done;
+}
+
+/* Copy a chunk from the base image to the overlay if a write covers only
+ * part of it and it isn't in the overlay yet. Past the end of the base image
+ * the chunk reads as zeros. Called with the lock held */
+/* Returns 0 on success and -1 with errno set on error */
+static int copy_up(struct overlay *overlay, uint64_t chunk, off_t offset,
+        size_t size)
+{
+    off_t start = (off_t)chunk * OVERLAY_CHUNK_SIZE;
+    size_t length = overlay->size - start < OVERLAY_CHUNK_SIZE ?
+            overlay->size - start : OVERLAY_CHUNK_SIZE;
+    size_t done = 0;
+    char *buffer;
+
+    if (chunk_present(overlay, chunk) ||
+            (offset <= start && offset + size >= start + length))
+        return 0;
+
+    buffer = malloc(length);
+    if (NULL == buffer)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (done < length)
+    {
+        ssize_t res = pread(overlay->base_fd, buffer + done, length - done,
+                start + done);
+        if (res < 0)
+            goto fail;
+        if (0 == res)
+        {
+            memset(buffer + done, 0, length - done);
+            break;
+        }
+        done += res;
+    }
+
+    for (done = 0; done < length;)
+    {
+        ssize_t res = pwrite(overlay->fd, buffer + done, length - done,
+                start + done);
+        if (res < 0)
+            goto fail;
+        done += res;
+    }
+
+    free(buffer);
+    return 0;
+
+fail:
+    free(buffer);
+    return -1;
+}
+
+int overlay_begin_write(struct overlay *overlay, off_t offset, size_t size,
+        int *locked)
+{
+    uint64_t first = offset / OVERLAY_CHUNK_SIZE;
+    uint64_t last = (offset + size - 1) / OVERLAY_CHUNK_SIZE;
+    uint64_t chunk;
+
+    *locked = 0;
+    if (-1 == overlay->fd)
+        return overlay->base_fd;
+
+    /* Writes that stay within chunks already in the overlay need no lock */
+    for (chunk = first; chunk <= last; chunk++)
+        if (!chunk_present(overlay, chunk))
+            break;
+    if (chunk > last)
+        return overlay->fd;
+
+    /* Only the first and last chunks can be partly covered */
+    pthread_mutex_lock(&overlay->lock);
+    if (0 != copy_up(overlay, first, offset, size) ||
+            (last != first && 0 != copy_up(overlay, last, offset, size)))
+    {
+        int saved_errno = errno;
+        pthread_mutex_unlock(&overlay->lock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    *locked = 1;
+    return overlay->fd;
+}
+
+void overlay_end_write(struct overlay *overlay, off_t offset, size_t size,
+        ssize_t written, int locked)
+{
+    if (!locked)
+        return;
+
+    /* A chunk the write fully covers is only in place if all of it was
+     * written. A partly covered one was copied up first */
+    for (uint64_t chunk = offset / OVERLAY_CHUNK_SIZE; written > 0 &&
+            (off_t)chunk * OVERLAY_CHUNK_SIZE < offset + written; chunk++)
+    {
+        off_t start = (off_t)chunk * OVERLAY_CHUNK_SIZE;
+        off_t end = start + OVERLAY_CHUNK_SIZE;
+
+        if (end > (off_t)overlay->size)
+            end = overlay->size;
+        if (offset <= start && offset + (off_t)size >= end &&
+                offset + written < end)
+            break;
+
+        __atomic_fetch_or(overlay->bitmap + chunk / 64,
+                (uint64_t)1 << (chunk % 64), __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+}
+
+int overlay_sync(struct overlay *overlay, int datasync)
+{
+    int fd = -1 == overlay->fd ? overlay->base_fd : overlay->fd;
+
+    if (-1 != overlay->fd &&
+            0 != msync(overlay->mapping, overlay->map_length, MS_SYNC))
+        return -1;
+    return datasync ? fdatasync(fd) : fsync(fd);
+}
+
+int overlay_reset(struct overlay *overlay)
+{
+    int ret = 0;
+
+    if (-1 == overlay->fd)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&overlay->lock);
+
+    /* Clearing the bits is what drops the chunks, so it is instant however
+     * much has been written. Requests already in flight may still see the
+     * old data, or zeros once it has been punched out */
+    for (uint64_t i = 0; i < (overlay->chunk_count + 63) / 64; i++)
+        __atomic_store_n(overlay->bitmap + i, 0, __ATOMIC_RELEASE);
+    ret = msync(overlay->mapping, overlay->map_length, MS_SYNC);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /* Give the space back, keeping the map where it is */
+    if (0 == ret && 0 != fallocate(overlay->fd,
+            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+            overlay->map_offset) && EOPNOTSUPP != errno)
+        ret = -1;
+#endif
+
+    pthread_mutex_unlock(&overlay->lock);
+    return ret;
+}
@@ -0,0 +1,108 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Size in bytes of the chunks the overlay tracks. Also the alignment of the
+ * allocation bitmap in the overlay file, so it is a multiple of the page size
+ * on every common platform */
+#define OVERLAY_CHUNK_SIZE (64 * 1024)
+
+/* Copy-on-write overlay on top of a base image, which is then never written
+ * to. The overlay file is sparse and holds the chunks written so far at their
+ * offsets in the disk, followed by a bitmap of which chunks it holds. Reads
+ * take each chunk from the overlay or the base image by its bit, so many
+ * mounts can share one read-only base image, each with its own overlay.
+ *
+ * Writes to chunks already in the overlay go straight to it. A write that
+ * brings in new chunks first copies up the parts of them it doesn't cover
+ * from the base image, and is serialized with other such writes by a mutex so
+ * that a copy up never overwrites newer data. Bits are only set once the data
+ * is in place, so readers never need the lock.
+ *
+ * Without an overlay file every request goes to the base image */
+struct overlay {
+    int base_fd;                /* File descriptor to the base image */
+    int fd;                     /* File descriptor to the overlay file, or
+                                 * -1 if there is none */
+    size_t size;                /* Size of the disk in bytes */
+    uint64_t chunk_count;
+    off_t map_offset;           /* Offset of the header and bitmap in the
+                                 * overlay file */
+    size_t map_length;
+    void *mapping;              /* Header and bitmap, mapped shared */
+    uint64_t *bitmap;           /* One bit per chunk, set once the chunk is
+                                 * in the overlay, updated atomically */
+    pthread_mutex_t lock;       /* Serializes writes that bring in new chunks
+                                 * and resets */
+};
+
+/* Set up an overlay for a disk of size bytes whose base image is open as
+ * base_fd. The overlay file at path is created if it doesn't exist or is
+ * empty, and otherwise must have been created for a disk of the same size.
+ * If path is NULL there is no overlay and requests go to the base image */
+/* Returns 0 on success and nonzero on error, with errno set */
+int overlay_open(struct overlay *overlay, const char *path, int base_fd,
+        size_t size);
+
+/* Write out the bitmap and close the overlay file. The base image is left
+ * open */
+void overlay_close(struct overlay *overlay);
+
+/* Find the file that holds the data at offset. *length is set to the number
+ * of bytes from offset, at most size, that are in the same file */
+/* Returns the file descriptor */
+int overlay_lookup(struct overlay *overlay, off_t offset, size_t size,
+        size_t *length);
+
+/* Read from the disk, taking each chunk from the file that holds it */
+/* Returns the number of bytes read, or -1 with errno set */
+ssize_t overlay_pread(struct overlay *overlay, void *buf, size_t size,
+        off_t offset);
+
+/* Get ready to write size bytes at offset, copying up the chunks the write
+ * only partly covers if they aren't in the overlay yet. Must be followed by
+ * overlay_end_write() with the same range and *locked once the data has been
+ * written */
+/* Returns the file descriptor to write the data to, or -1 with errno set */
+int overlay_begin_write(struct overlay *overlay, off_t offset, size_t size,
+        int *locked);
+
+/* Finish a write started by overlay_begin_write(), of which written bytes
+ * made it out, or none if written is negative */
+void overlay_end_write(struct overlay *overlay, off_t offset, size_t size,
+        ssize_t written, int locked);
+
+/* Flush the data written so far and the bitmap to disk, leaving out the
+ * file metadata that isn't needed to read the data back if datasync is
+ * nonzero */
+/* Returns 0 on success and -1 with errno set on error */
+int overlay_sync(struct overlay *overlay, int datasync);
+
+/* Drop every chunk from the overlay, so the disk reads as the base image
+ * again, and give the space back to the file system where it supports
+ * punching holes */
+/* Returns 0 on success and -1 with errno set on error */
+int overlay_reset(struct overlay *overlay);
+
+#endif
@@ -0,0 +1,490 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "remap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Slots per group in the spare file, and the size of the index in front of
+ * them and of the header at the start of the file */
+#define REMAP_GROUP_SLOTS 512
+#define REMAP_INDEX_SIZE (REMAP_GROUP_SLOTS * sizeof(uint64_t))
+#define REMAP_HEADER_SIZE 4096
+
+/* log2 of the number of entries of a new remap table */
+#define REMAP_TABLE_MIN_BITS 6
+
+/* Identifies a spare file and the version of its format */
+static const char remap_magic[8] = {'F', 'B', 'S', 'S', 'P', 'A', 'R', '1'};
+
+/* Start of a spare file */
+struct remap_header {
+    char magic[8];
+    uint64_t sector_size;
+};
+
+/* Return the offset of a group of slots in the spare file */
+static off_t group_offset(const struct remap *remap, uint64_t group)
+{
+    return REMAP_HEADER_SIZE + group * (REMAP_INDEX_SIZE +
+            REMAP_GROUP_SLOTS * remap->sector_size);
+}
+
+/* Return the offset of the data of a slot in the spare file */
+static off_t slot_offset(const struct remap *remap, uint64_t slot)
+{
+    return group_offset(remap, slot / REMAP_GROUP_SLOTS) + REMAP_INDEX_SIZE +
+            slot % REMAP_GROUP_SLOTS * remap->sector_size;
+}
+
+/* Return the offset of the index entry of a slot in the spare file */
+static off_t index_offset(const struct remap *remap, uint64_t slot)
+{
+    return group_offset(remap, slot / REMAP_GROUP_SLOTS) +
+            slot % REMAP_GROUP_SLOTS * sizeof(uint64_t);
+}
+
+/* Write all of a buffer to a file at offset */
+/* Returns 0 on success and -1 with errno set on error */
+static int write_fully(int fd, const void *buf, size_t size, off_t offset)
+{
+    ssize_t res = pwrite(fd, buf, size, offset);
+
+    if (res >= 0 && size != (size_t)res)
+        errno = EIO;
+    return size == (size_t)res ? 0 : -1;
+}
+
+/* Allocate an empty remap table of 2^bits entries */
+/* Returns the table, or NULL on allocation failure */
+static struct remap_table *table_alloc(unsigned int bits)
+{
+    struct remap_table *table = calloc(1, sizeof(struct remap_table) +
+            ((size_t)1 << bits) * sizeof(struct remap_entry));
+
+    if (NULL != table)
+        table->bits = bits;
+
+    return table;
+}
+
+/* Free a remap table and the tables it replaced */
+static void table_free(struct remap_table *table)
+{
+    while (NULL != table)
+    {
+        struct remap_table *retired = table->retired;
+        free(table);
+        table = retired;
+    }
+}
+
+/* Return the entry a sector's probe sequence starts at */
+static size_t entry_start(const struct remap_table *table, off_t sector)
+{
+    return ((uint64_t)sector * 0x9e3779b97f4a7c15ULL) >> (64 - table->bits);
+}
+
+/* Look up the slot a sector went to */
+/* Returns nonzero if it was found and stores the slot in *slot */
+static int table_find(const struct remap_table *table, off_t sector,
+        uint64_t *slot)
+{
+    size_t mask = ((size_t)1 << table->bits) - 1;
+
+    for (size_t i = entry_start(table, sector); ; i = (i + 1) & mask)
+    {
+        uint64_t key = __atomic_load_n(&table->entries[i].sector,
+                __ATOMIC_ACQUIRE);
+
+        if (0 == key)
+            return 0;
+        if ((uint64_t)sector + 1 == key)
+        {
+            *slot = __atomic_load_n(&table->entries[i].slot,
+                    __ATOMIC_ACQUIRE);
+            return 1;
+        }
+    }
+}
+
+/* Point a sector at a slot in a table with room for it. The slot is stored
+ * before the sector, so lookups that find the sector see its slot */
+static void table_insert(struct remap_table *table, off_t sector,
+        uint64_t slot)
+{
+    size_t mask = ((size_t)1 << table->bits) - 1;
+    size_t i = entry_start(table, sector);
+
+    for (;;)
+    {
+        uint64_t key = table->entries[i].sector;
+
+        if ((uint64_t)sector + 1 == key)
+        {
+            __atomic_store_n(&table->entries[i].slot, slot, __ATOMIC_RELEASE);
+            return;
+        }
+        if (0 == key)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    table->entries[i].slot = slot;
+    __atomic_store_n(&table->entries[i].sector, (uint64_t)sector + 1,
+            __ATOMIC_RELEASE);
+    table->used++;
+}
+
+/* Make room for count more sectors in the remap table, moving to a bigger
+ * table if the current one would be more than half full. Must be called with
+ * the lock held, or before the spare area is shared */
+/* Returns 0 on success and nonzero on allocation failure */
+static int reserve_table(struct remap *remap, size_t count)
+{
+    struct remap_table *table = remap->table;
+    unsigned int bits = table->bits;
+
+    while ((table->used + count) * 2 > (size_t)1 << bits)
+        bits++;
+    if (bits == table->bits)
+        return 0;
+
+    struct remap_table *bigger = table_alloc(bits);
+    if (NULL == bigger)
+        return -1;
+
+    for (size_t i = 0; i < (size_t)1 << table->bits; i++)
+        if (0 != table->entries[i].sector)
+            table_insert(bigger, table->entries[i].sector - 1,
+                    table->entries[i].slot);
+
+    bigger->retired = table;
+    __atomic_store_n(&remap->table, bigger, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Point a sector at a slot, moving to a bigger table once the current one is
+ * half full. Must be called with the lock held, or before the spare area is
+ * shared */
+/* Returns 0 on success and nonzero on allocation failure */
+static int remap_insert(struct remap *remap, off_t sector, uint64_t slot)
+{
+    if (0 != reserve_table(remap, 1))
+        return -1;
+
+    table_insert(remap->table, sector, slot);
+    return 0;
+}
+
+int remap_open(struct remap *remap, const char *path, size_t sector_size)
+{
+    struct remap_header header;
+    struct extent_list list = {NULL, 0, 0};
+    uint64_t *index = NULL;
+    struct stat stat;
+    int saved_errno;
+
+    memset(remap, 0, sizeof(struct remap));
+    remap->fd = -1;
+    remap->sector_size = sector_size;
+    if (NULL == path)
+        return 0;
+
+    remap->table = table_alloc(REMAP_TABLE_MIN_BITS);
+    index = malloc(REMAP_INDEX_SIZE);
+    if (NULL == remap->table || NULL == index)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    remap->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == remap->fd || 0 != fstat(remap->fd, &stat))
+        goto fail;
+
+    /* An empty file is a new spare area */
+    if (0 == stat.st_size)
+    {
+        memset(&header, 0, sizeof(struct remap_header));
+        memcpy(header.magic, remap_magic, sizeof(remap_magic));
+        header.sector_size = sector_size;
+        if (0 != write_fully(remap->fd, &header, sizeof(struct remap_header),
+                0))
+            goto fail;
+    }
+    else if ((ssize_t)sizeof(struct remap_header) != pread(remap->fd,
+            &header, sizeof(struct remap_header), 0) ||
+            0 != memcmp(header.magic, remap_magic, sizeof(remap_magic)) ||
+            sector_size != header.sector_size)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    /* Rebuild the table from the index of each group. Slots are appended, so
+     * a sector found again has moved on to the later slot */
+    for (uint64_t group = 0; group_offset(remap, group) < stat.st_size;
+            group++)
+    {
+        ssize_t res = pread(remap->fd, index, REMAP_INDEX_SIZE,
+                group_offset(remap, group));
+        if (res < 0)
+            goto fail;
+        memset((char *)index + res, 0, REMAP_INDEX_SIZE - res);
+
+        for (uint64_t i = 0; i < REMAP_GROUP_SLOTS; i++)
+        {
+            if (0 == index[i])
+                continue;
+
+            off_t sector = index[i] - 1;
+            uint64_t slot = group * REMAP_GROUP_SLOTS + i;
+            if (0 != remap_insert(remap, sector, slot) ||
+                    0 != extent_list_append(&list, sector, sector))
+            {
+                errno = ENOMEM;
+                goto fail;
+            }
+            remap->slot_count = slot + 1;
+        }
+    }
+
+    /* fault_map_init() takes over the list either way */
+    int ret = fault_map_init(&remap->sectors, &list, 0);
+    list.extents = NULL;
+    if (0 != ret)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    if (0 != pthread_mutex_init(&remap->lock, NULL))
+    {
+        fault_map_destroy(&remap->sectors);
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    free(index);
+    return 0;
+
+fail:
+    saved_errno = errno;
+    free(index);
+    free(list.extents);
+    table_free(remap->table);
+    if (-1 != remap->fd)
+        close(remap->fd);
+    remap->table = NULL;
+    remap->fd = -1;
+    errno = saved_errno;
+    return -1;
+}
+
+void remap_close(struct remap *remap)
+{
+    if (-1 == remap->fd)
+        return;
+
+    fault_map_destroy(&remap->sectors);
+    table_free(remap->table);
+    fsync(remap->fd);
+    close(remap->fd);
+    pthread_mutex_destroy(&remap->lock);
+
+    remap->table = NULL;
+    remap->fd = -1;
+}
+
+int remap_lookup(struct remap *remap, off_t offset, size_t size,
+        off_t *position, size_t *length)
+{
+    size_t sector_size = remap->sector_size;
+    off_t sector;
+    uint64_t slot;
+
+    *length = size;
+    if (-1 == remap->fd || 0 == size)
+        return -1;
+
+    off_t first_sector = offset / sector_size;
+    if (!fault_map_find(&remap->sectors, first_sector,
+            (offset + size - 1) / sector_size, &sector))
+        return -1;
+
+    if (sector > first_sector)
+    {
+        *length = sector * sector_size - offset;
+        return -1;
+    }
+
+    /* A reset can drop the sector in the meantime */
+    const struct remap_table *table = __atomic_load_n(&remap->table,
+            __ATOMIC_ACQUIRE);
+    if (!table_find(table, sector, &slot))
+        return -1;
+
+    *position = slot_offset(remap, slot) + offset % sector_size;
+
+    /* Take in the sectors after it that went to the next slots of the same
+     * group, which follow on in the spare file */
+    size_t done = sector_size - offset % sector_size;
+    uint64_t next;
+    while (done < size && 0 != (slot + 1) % REMAP_GROUP_SLOTS &&
+            table_find(table, ++sector, &next) && next == slot + 1)
+    {
+        done += sector_size;
+        slot = next;
+    }
+
+    *length = done < size ? done : size;
+    return remap->fd;
+}
+
+int remap_sectors(struct remap *remap, const off_t *sectors,
+        const char *data, size_t count)
+{
+    size_t sector_size = remap->sector_size;
+    struct fault_map_change change = {0, {NULL, 0, 0}};
+    uint64_t *old_slots = malloc((count ? count : 1) * sizeof(uint64_t));
+    const uint64_t zero = 0;
+    size_t indexed = 0;
+    int saved_errno;
+    int ret = -1;
+
+    pthread_mutex_lock(&remap->lock);
+    uint64_t first_slot = remap->slot_count;
+
+    /* Take all the memory the batch needs up front, so that past the writes
+     * only publishing it can fail */
+    if (NULL == old_slots || 0 != reserve_table(remap, count))
+    {
+        errno = ENOMEM;
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+        if (0 != extent_list_append(&change.extents, sectors[i], sectors[i]))
+        {
+            errno = ENOMEM;
+            goto out;
+        }
+
+    /* The index entries only go out once the data is in every slot */
+    for (size_t i = 0; i < count; i++)
+        if (0 != write_fully(remap->fd, data + i * sector_size, sector_size,
+                slot_offset(remap, first_slot + i)))
+            goto out;
+    for (; indexed < count; indexed++)
+    {
+        uint64_t entry = sectors[indexed] + 1;
+        if (0 != write_fully(remap->fd, &entry, sizeof(uint64_t),
+                index_offset(remap, first_slot + indexed)))
+            goto unindex;
+    }
+
+    /* Lookups go by the map, so the table can point at the new slots before
+     * the sectors are published */
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!table_find(remap->table, sectors[i], old_slots + i))
+            old_slots[i] = UINT64_MAX;
+        table_insert(remap->table, sectors[i], first_slot + i);
+    }
+
+    if (0 != fault_map_update(&remap->sectors, &change, 1))
+    {
+        /* Sectors remapped before go back to their slots, and the others
+         * can't be reached without the map */
+        for (size_t i = 0; i < count; i++)
+            if (UINT64_MAX != old_slots[i])
+                table_insert(remap->table, sectors[i], old_slots[i]);
+        errno = ENOMEM;
+        goto unindex;
+    }
+
+    remap->slot_count += count;
+    ret = 0;
+    goto out;
+
+unindex:
+    /* Take the index entries back, so that opening the spare file again
+     * doesn't bring back sectors that were never remapped */
+    saved_errno = errno;
+    while (indexed-- > 0)
+        write_fully(remap->fd, &zero, sizeof(uint64_t),
+                index_offset(remap, first_slot + indexed));
+    errno = saved_errno;
+
+out:
+    pthread_mutex_unlock(&remap->lock);
+    free(change.extents.extents);
+    free(old_slots);
+
+    return ret;
+}
+
+int remap_sync(struct remap *remap, int datasync)
+{
+    if (-1 == remap->fd)
+        return 0;
+
+    return datasync ? fdatasync(remap->fd) : fsync(remap->fd);
+}
+
+int remap_reset(struct remap *remap)
+{
+    struct fault_map_change change = {1, {NULL, 0, 0}};
+    int ret = -1;
+
+    if (-1 == remap->fd)
+        return 0;
+
+    struct remap_table *table = table_alloc(REMAP_TABLE_MIN_BITS);
+    if (NULL == table ||
+            0 != extent_list_append(&change.extents, 0, SECTOR_MAX))
+    {
+        free(table);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&remap->lock);
+
+    /* Send lookups back to the sectors in place before the slots go */
+    if (0 != fault_map_update(&remap->sectors, &change, 1))
+    {
+        free(table);
+        errno = ENOMEM;
+    }
+    else
+    {
+        table->retired = remap->table;
+        __atomic_store_n(&remap->table, table, __ATOMIC_RELEASE);
+        remap->slot_count = 0;
+        ret = ftruncate(remap->fd, REMAP_HEADER_SIZE);
+    }
+
+    pthread_mutex_unlock(&remap->lock);
+    free(change.extents.extents);
+
+    return ret;
+}
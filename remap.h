@@ -0,0 +1,100 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef REMAP_H
+#define REMAP_H
+
+#include "fault_map.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Open-addressing hash table from remapped sector to its slot in the spare
+ * file. Tables only ever gain entries, and a table that fills up is replaced
+ * by one twice its size and kept until the spare area is closed, since
+ * lookups may still be reading it */
+struct remap_table {
+    unsigned int bits;              /* log2 of the number of entries */
+    size_t used;
+    struct remap_table *retired;    /* Table this one replaced, or NULL */
+    struct remap_entry {
+        uint64_t sector;            /* Sector + 1, or 0 if the entry is
+                                     * free, updated atomically */
+        uint64_t slot;              /* Updated atomically */
+    } entries[];
+};
+
+/* Spare area that sectors are moved to when they are reallocated, the way a
+ * disk remaps them to a spare zone, which makes reading them slower and
+ * splits up sequential requests over them.
+ *
+ * The spare file holds a header followed by groups of slots, each slot one
+ * sector. Every group starts with an index of the sectors its slots hold, so
+ * the remap table can be rebuilt when the file is opened again. Slots are
+ * only ever appended, and a sector that is remapped again moves to a new
+ * slot. A slot is written before its index entry, and both before the sector
+ * is published as remapped, so lookups never need a lock.
+ *
+ * Without a spare file sectors are reallocated in place */
+struct remap {
+    int fd;                         /* File descriptor to the spare file, or
+                                     * -1 if there is none */
+    size_t sector_size;             /* Size in bytes of the sectors moved */
+    struct fault_map sectors;       /* Sectors that have been remapped */
+    struct remap_table *table;      /* Where they went, swapped atomically */
+    uint64_t slot_count;            /* Slots used in the spare file */
+    pthread_mutex_t lock;           /* Serializes remapping and resets */
+};
+
+/* Set up the spare area in the file at path for sectors of sector_size
+ * bytes. The file is created if it doesn't exist or is empty, and otherwise
+ * must have been created for the same sector size. If path is NULL there is
+ * no spare area */
+/* Returns 0 on success and nonzero on error, with errno set */
+int remap_open(struct remap *remap, const char *path, size_t sector_size);
+
+/* Close the spare file and free the remap table */
+void remap_close(struct remap *remap);
+
+/* Find whether the data of the disk at offset has been remapped. *length is
+ * set to the number of bytes from offset, at most size, that are either all
+ * in place or all in consecutive slots */
+/* Returns the file descriptor of the spare file, storing the offset of the
+ * data in it in *position, or -1 if the data is in place */
+int remap_lookup(struct remap *remap, off_t offset, size_t size,
+        off_t *position, size_t *length);
+
+/* Move sectors to new slots in the spare area, filling each slot with a
+ * sector's worth of data, count sectors in all. The sectors are published
+ * together once every slot and index entry is written */
+/* Returns 0 on success and -1 with errno set on error, in which case none of
+ * the sectors move and their index entries are taken back */
+int remap_sectors(struct remap *remap, const off_t *sectors,
+        const char *data, size_t count);
+
+/* Flush the slots written so far to disk, leaving out the file metadata
+ * that isn't needed to read them back if datasync is nonzero */
+/* Returns 0 on success and -1 with errno set on error */
+int remap_sync(struct remap *remap, int datasync);
+
+/* Drop every remapped sector, so the disk reads from its own sectors again,
+ * and empty the spare file */
+/* Returns 0 on success and -1 with errno set on error */
+int remap_reset(struct remap *remap);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#include "sector_list.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int parse_sector(const char **text, const char *end, off_t *sector)
+{
+    const char *cursor = *text;
+    off_t value = 0;
+
+    if (cursor == end || *cursor < '0' || *cursor > '9')
+        return -1;
+
+    for (; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++)
+    {
+        off_t digit = *cursor - '0';
+        if (value > (SECTOR_MAX - digit) / 10)
+            return -1;
+        value = value * 10 + digit;
+    }
+
+    *text = cursor;
+    *sector = value;
+
+    return 0;
+}
+
+int parse_sector_list(const char *text, size_t length,
+        struct extent_list *list)
+{
+    const char *end = text + length;
+
+    while (text < end)
+    {
+        off_t first_sector;
+        off_t last_sector;
+
+        if (*text == ',' || *text == ' ' || *text == '\t' ||
+                *text == '\n' || *text == '\r')
+        {
+            text++;
+            continue;
+        }
+
+        if (*text == '#')
+        {
+            while (text < end && *text != '\n')
+                text++;
+            continue;
+        }
+
+        if (0 != parse_sector(&text, end, &first_sector))
+            return -1;
+
+        last_sector = first_sector;
+        if (text < end && *text == '-')
+        {
+            text++;
+            if (0 != parse_sector(&text, end, &last_sector))
+                return -1;
+        }
+
+        if (0 != extent_list_append(list, first_sector, last_sector))
+            return -1;
+    }
+
+    return 0;
+}
+
+int load_sector_file(const char *path, struct extent_list *list)
+{
+    int ret = -1;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (-1 == fd)
+        return -1;
+
+    if (0 != fstat(fd, &st))
+        goto out;
+
+    /* An empty file is an empty list, and mmap() refuses zero lengths */
+    if (0 == st.st_size)
+    {
+        ret = 0;
+        goto out;
+    }
+
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == data)
+        goto out;
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t probe = st.st_size < 4096 ? st.st_size : 4096;
+    if (NULL == memchr(data, '\0', probe))
+        ret = parse_sector_list(data, st.st_size, list);
+    else if (0 == st.st_size % (2 * sizeof(uint64_t)))
+    {
+        const uint64_t *pairs = (const uint64_t *)data;
+        size_t pair_count = st.st_size / (2 * sizeof(uint64_t));
+
+        ret = 0;
+        for (size_t i = 0; i < pair_count && 0 == ret; i++)
+        {
+            if (pairs[2 * i] > SECTOR_MAX || pairs[2 * i + 1] > SECTOR_MAX)
+                ret = -1;
+            else
+                ret = extent_list_append(list, pairs[2 * i], pairs[2 * i + 1]);
+        }
+    }
+
+    munmap((void *)data, st.st_size);
+
+out:
+    close(fd);
+    return ret;
+}
+
+int parse_disk_size(const char *text, size_t *size)
+{
+    char *end;
+    unsigned long long value;
+    unsigned int shift = 0;
+
+    errno = 0;
+    value = strtoull(text, &end, 10);
+    if (0 != errno || end == text)
+        return -1;
+
+    switch (*end)
+    {
+    case 'T': case 't': shift += 10; /* fall through */
+    case 'G': case 'g': shift += 10; /* fall through */
+    case 'M': case 'm': shift += 10; /* fall through */
+    case 'K': case 'k': shift += 10; end++; break;
+    }
+
+    if ('\0' != *end || value > (SECTOR_MAX >> shift))
+        return -1;
+
+    *size = value << shift;
+    return 0;
+}
+
+int parse_sector_size(const char *text, size_t low, size_t *size)
+{
+    size_t value;
+
+    if (0 != parse_disk_size(text, &value) || value < low || value > 65536 ||
+            0 != (value & (value - 1)))
+        return -1;
+
+    *size = value;
+    return 0;
+}
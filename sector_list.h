@@ -0,0 +1,55 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#ifndef SECTOR_LIST_H
+#define SECTOR_LIST_H
+
+#include "fault_map.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Parse a sector number at *text, advancing *text past it */
+/* Returns 0 on success and nonzero if there is no valid number */
+int parse_sector(const char **text, const char *end, off_t *sector);
+
+/* Parse a sector list in the format x-y,z,... in a single pass and append the
+ * extents to the list. Entries may also be separated by whitespace, and a #
+ * starts a comment that runs to the end of the line, so generated lists can
+ * be kept in a text file with one entry per line. The text does not need to
+ * be NUL-terminated */
+/* Returns 0 on success and nonzero on a syntax or allocation error */
+int parse_sector_list(const char *text, size_t length,
+        struct extent_list *list);
+
+/* Load bad sector extents from a file and append them to the list. A text
+ * file uses the same format as the --badsectors argument. A binary file is a
+ * packed array of (first, last) pairs of 64-bit sector numbers in host byte
+ * order. Binary files are told apart by the NUL bytes that the upper bytes of
+ * every 64-bit sector number contain, which never appear in a text file */
+/* Returns 0 on success and nonzero on error */
+int load_sector_file(const char *path, struct extent_list *list);
+
+/* Parse a size in bytes with an optional K, M, G or T (binary) suffix */
+/* Returns 0 on success and nonzero if the size is invalid */
+int parse_disk_size(const char *text, size_t *size);
+
+/* Parse a sector size, which must be a power of two from low to 64 KiB */
+/* Returns 0 on success and nonzero if the size is invalid */
+int parse_sector_size(const char *text, size_t low, size_t *size);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Shard used by this thread, assigned on first use */
+static __thread unsigned int stats_shard = STATS_SHARDS;
+static unsigned int next_stats_shard = 0;
+
+static const char *const op_names[] = {"read", "write"};
+
+/* Percentiles reported for each latency histogram */
+static const struct {
+    const char *name;
+    double fraction;
+} percentiles[] = {
+    {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+};
+
+/* Return the shard for the calling thread */
+static struct stats_shard *get_shard(struct stats *stats)
+{
+    if (STATS_SHARDS == stats_shard)
+        stats_shard = __atomic_fetch_add(&next_stats_shard, 1,
+                __ATOMIC_RELAXED) % STATS_SHARDS;
+
+    return stats->shards + stats_shard;
+}
+
+/* Return the histogram bucket for a latency */
+static unsigned int latency_bucket(uint64_t latency)
+{
+    if (latency < (1 << STATS_SUB_BITS))
+        return latency;
+
+    unsigned int exponent = 63 - __builtin_clzll(latency);
+    if (exponent >= STATS_MAX_EXPONENT)
+        return STATS_BUCKETS - 1;
+
+    unsigned int sub = (latency >> (exponent - STATS_SUB_BITS)) &
+            ((1 << STATS_SUB_BITS) - 1);
+
+    return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+/* Return the highest latency that falls in a histogram bucket */
+static uint64_t bucket_limit(unsigned int bucket)
+{
+    if (bucket < (1 << STATS_SUB_BITS))
+        return bucket;
+
+    unsigned int exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+
+    return (((1 << STATS_SUB_BITS) + sub + 1) <<
+            (exponent - STATS_SUB_BITS)) - 1;
+}
+
+int stats_init(struct stats *stats)
+{
+    errno = posix_memalign((void **)&stats->shards, 64,
+            STATS_SHARDS * sizeof(struct stats_shard));
+    if (0 != errno)
+        return -1;
+
+    memset(stats->shards, 0, STATS_SHARDS * sizeof(struct stats_shard));
+    return 0;
+}
+
+void stats_destroy(struct stats *stats)
+{
+    free(stats->shards);
+    stats->shards = NULL;
+}
+
+void stats_record(struct stats *stats, enum stats_op op, uint64_t bytes,
+        uint64_t latency, int error)
+{
+    struct stats_counters *counters = get_shard(stats)->ops + op;
+    uint64_t max = __atomic_load_n(&counters->latency_max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&counters->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->bytes, bytes, __ATOMIC_RELAXED);
+    if (EIO == error)
+        __atomic_fetch_add(&counters->io_errors, 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&counters->latency_sum, latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->histogram[latency_bucket(latency)], 1,
+            __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(
+            &counters->latency_max, &max, latency, 1, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_record_reallocated(struct stats *stats, uint64_t sectors)
+{
+    __atomic_fetch_add(&get_shard(stats)->reallocated, sectors,
+            __ATOMIC_RELAXED);
+}
+
+/* Add up the counters for an operation across all shards */
+static void sum_counters(struct stats *stats, enum stats_op op,
+        struct stats_counters *total)
+{
+    memset(total, 0, sizeof(struct stats_counters));
+
+    for (unsigned int i = 0; i < STATS_SHARDS; i++)
+    {
+        struct stats_counters *counters = stats->shards[i].ops + op;
+        uint64_t max = __atomic_load_n(&counters->latency_max,
+                __ATOMIC_RELAXED);
+
+        total->requests += __atomic_load_n(&counters->requests,
+                __ATOMIC_RELAXED);
+        total->bytes += __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED);
+        total->io_errors += __atomic_load_n(&counters->io_errors,
+                __ATOMIC_RELAXED);
+        total->latency_sum += __atomic_load_n(&counters->latency_sum,
+                __ATOMIC_RELAXED);
+        if (max > total->latency_max)
+            total->latency_max = max;
+
+        for (unsigned int j = 0; j < STATS_BUCKETS; j++)
+            total->histogram[j] += __atomic_load_n(&counters->histogram[j],
+                    __ATOMIC_RELAXED);
+    }
+}
+
+/* Write the counters for an operation as a JSON object */
+static void write_counters(FILE *out, const struct stats_counters *counters)
+{
+    uint64_t count = 0;
+
+    /* The shards are read one by one while requests carry on, so count the
+     * histogram itself rather than trusting it to match requests */
+    for (unsigned int i = 0; i < STATS_BUCKETS; i++)
+        count += counters->histogram[i];
+
+    fprintf(out, "{\n"
+            "      \"requests\": %llu,\n"
+            "      \"bytes\": %llu,\n"
+            "      \"io_errors\": %llu,\n"
+            "      \"latency_ns\": {\n"
+            "        \"mean\": %llu,\n"
+            "        \"max\": %llu",
+            (unsigned long long)counters->requests,
+            (unsigned long long)counters->bytes,
+            (unsigned long long)counters->io_errors,
+            (unsigned long long)(0 == counters->requests ? 0 :
+                    counters->latency_sum / counters->requests),
+            (unsigned long long)counters->latency_max);
+
+    /* Each percentile is reported as the top of the bucket it falls in */
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+    {
+        uint64_t rank = (uint64_t)(percentiles[p].fraction * count + 0.999999);
+        uint64_t seen = 0;
+        uint64_t value = 0;
+
+        for (unsigned int i = 0; i < STATS_BUCKETS && 0 != rank; i++)
+        {
+            seen += counters->histogram[i];
+            if (seen >= rank)
+            {
+                value = STATS_BUCKETS - 1 == i ? counters->latency_max :
+                        bucket_limit(i);
+                break;
+            }
+        }
+        if (value > counters->latency_max)
+            value = counters->latency_max;
+
+        fprintf(out, ",\n        \"%s\": %llu", percentiles[p].name,
+                (unsigned long long)value);
+    }
+
+    /* The non-empty buckets, as [highest latency, count] pairs */
+    const char *separator = "";
+    fprintf(out, ",\n        \"histogram\": [");
+    for (unsigned int i = 0; i < STATS_BUCKETS; i++)
+    {
+        if (0 == counters->histogram[i])
+            continue;
+
+        fprintf(out, "%s[%llu, %llu]", separator,
+                (unsigned long long)bucket_limit(i),
+                (unsigned long long)counters->histogram[i]);
+        separator = ", ";
+    }
+    fprintf(out, "]\n      }\n    }");
+}
+
+char *stats_to_json(struct stats *stats, uint64_t reserve_sectors,
+        size_t *length)
+{
+    struct stats_counters *totals;
+    uint64_t reallocated = 0;
+    char *text = NULL;
+    FILE *out;
+
+    totals = malloc(STATS_OPS * sizeof(struct stats_counters));
+    if (NULL == totals)
+        return NULL;
+
+    out = open_memstream(&text, length);
+    if (NULL == out)
+    {
+        free(totals);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < STATS_SHARDS; i++)
+        reallocated += __atomic_load_n(&stats->shards[i].reallocated,
+                __ATOMIC_RELAXED);
+
+    fprintf(out, "{\n"
+            "  \"reserve_sectors\": %llu,\n"
+            "  \"reallocated_sectors\": %llu,\n"
+            "  \"ops\": {",
+            (unsigned long long)reserve_sectors,
+            (unsigned long long)reallocated);
+
+    for (unsigned int op = 0; op < STATS_OPS; op++)
+    {
+        sum_counters(stats, op, totals + op);
+        fprintf(out, "%s\n    \"%s\": ", 0 == op ? "" : ",", op_names[op]);
+        write_counters(out, totals + op);
+    }
+    fprintf(out, "\n  }\n}\n");
+
+    free(totals);
+    if (0 != fclose(out))
+    {
+        free(text);
+        return NULL;
+    }
+
+    return text;
+}
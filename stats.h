@@ -0,0 +1,87 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of counter shards. Threads pick a shard each so they don't all bounce
+ * the same cache lines */
+#define STATS_SHARDS 16
+
+/* Latency histogram layout. Values below 2^STATS_SUB_BITS nanoseconds get a
+ * bucket each, and every power of two above that is split into
+ * 2^STATS_SUB_BITS buckets, which keeps each bucket within about 6% of the
+ * values it holds. Latencies of 2^STATS_MAX_EXPONENT nanoseconds (about 68
+ * seconds) and up all land in the last bucket */
+#define STATS_SUB_BITS 4
+#define STATS_MAX_EXPONENT 36
+#define STATS_BUCKETS (((STATS_MAX_EXPONENT - STATS_SUB_BITS) + 1) << \
+        STATS_SUB_BITS)
+
+/* Operations statistics are kept for */
+enum stats_op {
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OPS
+};
+
+/* Counters for one operation */
+struct stats_counters {
+    uint64_t requests;      /* Requests completed */
+    uint64_t bytes;         /* Bytes transferred */
+    uint64_t io_errors;     /* Requests that failed with EIO */
+    uint64_t latency_sum;   /* Total latency in nanoseconds */
+    uint64_t latency_max;   /* Highest latency in nanoseconds */
+    uint64_t histogram[STATS_BUCKETS];
+};
+
+/* One shard of the statistics, aligned to its own cache lines */
+struct stats_shard {
+    struct stats_counters ops[STATS_OPS];
+    uint64_t reallocated;   /* Bad sectors reallocated by writes */
+} __attribute__((aligned(64)));
+
+/* Request statistics. Updates are lock-free relaxed atomic additions to the
+ * calling thread's shard, and readers add the shards up */
+struct stats {
+    struct stats_shard *shards;
+};
+
+/* Initialize zeroed statistics */
+/* Returns 0 on success and nonzero on allocation failure */
+int stats_init(struct stats *stats);
+
+/* Free the memory held by the statistics */
+void stats_destroy(struct stats *stats);
+
+/* Count a completed request. error is the errno value it failed with, or 0 */
+void stats_record(struct stats *stats, enum stats_op op, uint64_t bytes,
+        uint64_t latency, int error);
+
+/* Count reallocated bad sectors */
+void stats_record_reallocated(struct stats *stats, uint64_t sectors);
+
+/* Format the statistics as a JSON object, along with the number of reserve
+ * sectors left */
+/* Returns a string to be freed by the caller, with its length in *length, or
+ * NULL on allocation failure */
+char *stats_to_json(struct stats *stats, uint64_t reserve_sectors,
+        size_t *length);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "timer_wheel.h"
+#include "event_log.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Number of slots in the wheel, must be a power of two. Timers further out
+ * than one turn of the wheel stay in their slot until the turn they are due */
+#define TIMER_SLOTS 1024
+
+/* Hashed timer wheel. Each slot holds the timers due on ticks that map to it,
+ * unsorted. Adding a timer takes the lock only long enough to push it */
+static struct timer *slots[TIMER_SLOTS];
+static uint64_t current_tick = 0;       /* Last tick processed */
+static uint64_t pending = 0;            /* Number of timers in the wheel */
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_wake;
+static pthread_t wheel_thread;
+static int wheel_running = 0;
+
+/* Return the current tick */
+static uint64_t now_tick(void)
+{
+    return event_clock() / TIMER_TICK_NS;
+}
+
+/* Unlink the timers due by tick from the wheel. Must be called with the lock
+ * held */
+/* Returns a list of the timers */
+static struct timer *collect_due(uint64_t tick, struct timer *due)
+{
+    for (; current_tick < tick; current_tick++)
+    {
+        struct timer **link = slots + ((current_tick + 1) & (TIMER_SLOTS - 1));
+
+        while (NULL != *link)
+        {
+            struct timer *timer = *link;
+
+            if (timer->deadline > current_tick + 1)
+            {
+                link = &timer->next;
+                continue;
+            }
+
+            *link = timer->next;
+            timer->next = due;
+            due = timer;
+            pending--;
+        }
+
+        /* Skip whole turns of the wheel when it is empty */
+        if (0 == pending)
+        {
+            current_tick = tick;
+            break;
+        }
+    }
+
+    return due;
+}
+
+/* Fire a list of timers */
+static void fire_timers(struct timer *due)
+{
+    while (NULL != due)
+    {
+        struct timer *timer = due;
+        due = timer->next;
+        timer->fire(timer);
+    }
+}
+
+/* Timer thread. Fires the timers due on each tick, and sleeps until a timer is
+ * added while the wheel is empty */
+static void *wheel_main(void *data)
+{
+    pthread_mutex_lock(&wheel_lock);
+    while (wheel_running)
+    {
+        if (0 == pending)
+        {
+            pthread_cond_wait(&wheel_wake, &wheel_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&wheel_lock);
+
+        uint64_t next = (current_tick + 1) * TIMER_TICK_NS;
+        struct timespec deadline = {next / 1000000000, next % 1000000000};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+
+        pthread_mutex_lock(&wheel_lock);
+        struct timer *due = collect_due(now_tick(), NULL);
+        pthread_mutex_unlock(&wheel_lock);
+
+        fire_timers(due);
+
+        pthread_mutex_lock(&wheel_lock);
+    }
+
+    /* Don't leave anyone waiting on a timer that will never fire */
+    struct timer *due = collect_due(UINT64_MAX, NULL);
+    pthread_mutex_unlock(&wheel_lock);
+    fire_timers(due);
+
+    return NULL;
+}
+
+int timer_wheel_start(void)
+{
+    pthread_condattr_t attr;
+
+    if (0 != pthread_condattr_init(&attr))
+        return -1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&wheel_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (0 != ret)
+        return -1;
+
+    current_tick = now_tick();
+    wheel_running = 1;
+    if (0 != pthread_create(&wheel_thread, NULL, wheel_main, NULL))
+    {
+        wheel_running = 0;
+        pthread_cond_destroy(&wheel_wake);
+        return -1;
+    }
+
+    return 0;
+}
+
+void timer_wheel_stop(void)
+{
+    pthread_mutex_lock(&wheel_lock);
+    if (!wheel_running)
+    {
+        pthread_mutex_unlock(&wheel_lock);
+        return;
+    }
+    wheel_running = 0;
+    pthread_cond_signal(&wheel_wake);
+    pthread_mutex_unlock(&wheel_lock);
+
+    pthread_join(wheel_thread, NULL);
+    pthread_cond_destroy(&wheel_wake);
+}
+
+void timer_wheel_add(struct timer *timer, uint64_t delay)
+{
+    pthread_mutex_lock(&wheel_lock);
+    if (!wheel_running)
+    {
+        pthread_mutex_unlock(&wheel_lock);
+        timer->fire(timer);
+        return;
+    }
+
+    /* The wheel doesn't turn while it is empty, so catch up first */
+    if (0 == pending)
+        current_tick = now_tick();
+
+    /* Round up to the next tick that hasn't been processed yet */
+    timer->deadline = (event_clock() + delay + TIMER_TICK_NS - 1) /
+            TIMER_TICK_NS;
+    if (timer->deadline <= current_tick)
+        timer->deadline = current_tick + 1;
+
+    struct timer **slot = slots + (timer->deadline & (TIMER_SLOTS - 1));
+    timer->next = *slot;
+    *slot = timer;
+    if (0 == pending++)
+        pthread_cond_signal(&wheel_wake);
+    pthread_mutex_unlock(&wheel_lock);
+}
@@ -0,0 +1,44 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/* Length of a timer wheel tick in nanoseconds. Timers fire on the first tick
+ * at or after their deadline */
+#define TIMER_TICK_NS 1000000
+
+/* A pending timer, embedded in whatever the callback needs to find */
+struct timer {
+    struct timer *next;
+    uint64_t deadline;              /* Tick the timer is due on */
+    void (*fire)(struct timer *timer);
+};
+
+/* Start the thread that fires timers */
+/* Returns 0 on success and nonzero on error */
+int timer_wheel_start(void);
+
+/* Fire every pending timer right away and stop the thread */
+void timer_wheel_stop(void);
+
+/* Fire a timer after delay nanoseconds, from the timer thread. If the thread
+ * isn't running the timer fires right away from the calling thread */
+void timer_wheel_add(struct timer *timer, uint64_t delay);
+
+#endif
@@ -0,0 +1,753 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Identifies a trace file and the version of its format */
+static const char trace_magic[8] = {'F', 'B', 'S', 'T', 'R', 'A', 'C', '1'};
+
+/* Longest varint, for a 64-bit value */
+#define VARINT_MAX 10
+
+/* Most extents in one record, so that a record always fits in a buffer */
+#define TRACE_EXTENTS_PER_RECORD 1024
+
+/* Milliseconds after which the writer thread writes out buffers that
+ * aren't full yet */
+#define TRACE_FLUSH_INTERVAL_MS 1000
+
+/* Stripe used by this thread, assigned on first use */
+static __thread unsigned int trace_stripe = TRACE_STRIPES;
+static unsigned int next_trace_stripe = 0;
+
+/* Return the stripe for the calling thread */
+static unsigned int get_trace_stripe(void)
+{
+    if (TRACE_STRIPES == trace_stripe)
+        trace_stripe = __atomic_fetch_add(&next_trace_stripe, 1,
+                __ATOMIC_RELAXED) % TRACE_STRIPES;
+
+    return trace_stripe;
+}
+
+uint64_t trace_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Encode a value as a varint, seven bits a byte with the low bits first */
+/* Returns the end of the encoded value */
+static unsigned char *put_varint(unsigned char *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (unsigned char)value | 0x80;
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+
+    return p;
+}
+
+/* Encode a signed value as a zigzag varint, so small negative values stay
+ * short */
+/* Returns the end of the encoded value */
+static unsigned char *put_signed(unsigned char *p, int64_t value)
+{
+    return put_varint(p, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/* Decode a varint from [*p, end), advancing *p past it */
+/* Returns 0 on success and nonzero if the varint is cut off or too long */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+        uint64_t *value)
+{
+    *value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        if (*p == end)
+            return -1;
+
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (0 == (byte & 0x80))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Decode a zigzag varint from [*p, end), advancing *p past it */
+/* Returns 0 on success and nonzero if the varint is cut off or too long */
+static int get_signed(const unsigned char **p, const unsigned char *end,
+        int64_t *value)
+{
+    uint64_t encoded;
+
+    if (0 != get_varint(p, end, &encoded))
+        return -1;
+
+    *value = (int64_t)(encoded >> 1) ^ -(int64_t)(encoded & 1);
+    return 0;
+}
+
+/* Write a whole buffer to a file descriptor */
+/* Returns 0 on success and nonzero on error */
+static int write_all(int fd, const void *buffer, size_t size)
+{
+    const char *data = buffer;
+
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && EINTR == errno)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        data += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/* Queue a buffer for the writer thread. The trace lock must be held */
+static void queue_buffer(struct trace *trace, struct trace_buffer *buffer)
+{
+    buffer->next = NULL;
+    *trace->queue_tail = buffer;
+    trace->queue_tail = &buffer->next;
+}
+
+/* Take a buffer to fill, a spare one or a new one while there may be more.
+ * The trace lock must be held */
+/* Returns the buffer, or NULL if there is none */
+static struct trace_buffer *take_buffer(struct trace *trace)
+{
+    struct trace_buffer *buffer = trace->spare;
+
+    if (NULL != buffer)
+        trace->spare = buffer->next;
+    else if (trace->buffers < TRACE_MAX_BUFFERS &&
+            NULL != (buffer = malloc(sizeof(struct trace_buffer))))
+        trace->buffers++;
+
+    return buffer;
+}
+
+/* Claim room for a record of at most size bytes in the buffer of the
+ * calling thread's stripe and encode its kind and time. If there is no
+ * buffer free the record is dropped, unless wait is nonzero, in which case
+ * this waits for the writer thread to free one. The stripe is left locked,
+ * and end_record() finishes the record */
+/* Returns where to encode the fields of the record, or NULL if the record
+ * was dropped */
+static unsigned char *begin_record(struct trace *trace,
+        struct trace_stripe **stripe, size_t size, enum trace_kind kind,
+        uint64_t time, int wait)
+{
+    struct trace_stripe *owner = trace->stripes + get_trace_stripe();
+    struct trace_buffer *buffer;
+
+    size += 1 + VARINT_MAX;
+    pthread_mutex_lock(&owner->lock);
+
+    for (;;)
+    {
+        buffer = owner->buffer;
+        if (NULL != buffer && TRACE_BUFFER_SIZE - buffer->used >= size)
+            break;
+
+        pthread_mutex_lock(&trace->lock);
+        if (NULL != buffer)
+        {
+            queue_buffer(trace, buffer);
+            pthread_cond_signal(&trace->wake);
+            owner->buffer = NULL;
+        }
+
+        buffer = take_buffer(trace);
+        if (NULL == buffer && (!wait || 0 == trace->buffers))
+        {
+            trace->dropped++;
+            pthread_mutex_unlock(&trace->lock);
+            pthread_mutex_unlock(&owner->lock);
+            return NULL;
+        }
+
+        /* Wait without holding up the other threads of the stripe */
+        if (NULL == buffer)
+        {
+            pthread_mutex_unlock(&owner->lock);
+            while (NULL == (buffer = take_buffer(trace)))
+                pthread_cond_wait(&trace->freed, &trace->lock);
+            pthread_mutex_unlock(&trace->lock);
+            pthread_mutex_lock(&owner->lock);
+
+            /* Another thread may have given the stripe a buffer meanwhile */
+            if (NULL != owner->buffer)
+            {
+                pthread_mutex_lock(&trace->lock);
+                buffer->next = trace->spare;
+                trace->spare = buffer;
+                pthread_cond_broadcast(&trace->freed);
+                pthread_mutex_unlock(&trace->lock);
+                continue;
+            }
+        }
+        else
+            pthread_mutex_unlock(&trace->lock);
+
+        buffer->used = 0;
+        buffer->last_time = 0;
+        owner->buffer = buffer;
+    }
+
+    unsigned char *p = buffer->data + buffer->used;
+    *p++ = kind;
+    p = put_signed(p, (int64_t)(time - buffer->last_time));
+    buffer->last_time = time;
+
+    *stripe = owner;
+    return p;
+}
+
+/* Finish a record begun by begin_record() that ends at end */
+static void end_record(struct trace_stripe *stripe, unsigned char *end)
+{
+    stripe->buffer->used = end - stripe->buffer->data;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/* Record extents of physical sectors, split over as many records as it
+ * takes. Changes to the map are never dropped while the writer thread can
+ * free a buffer, since a replay needs every one of them */
+static void record_extents(struct trace *trace, enum trace_kind kind,
+        const struct sector_extent *extents, size_t count, uint64_t time)
+{
+    while (0 != count)
+    {
+        size_t batch = count < TRACE_EXTENTS_PER_RECORD ? count :
+                TRACE_EXTENTS_PER_RECORD;
+        struct trace_stripe *stripe;
+        unsigned char *p = begin_record(trace, &stripe,
+                VARINT_MAX * (1 + 2 * batch), kind, time, 1);
+
+        if (NULL != p)
+        {
+            p = put_varint(p, batch);
+            for (size_t i = 0; i < batch; i++)
+            {
+                p = put_varint(p, extents[i].first);
+                p = put_varint(p, extents[i].last - extents[i].first);
+            }
+            end_record(stripe, p);
+        }
+
+        extents += batch;
+        count -= batch;
+    }
+}
+
+/* Record a change to the reserve sectors */
+static void record_reserve(struct trace *trace, int set, uint64_t value,
+        uint64_t time)
+{
+    struct trace_stripe *stripe;
+    unsigned char *p = begin_record(trace, &stripe, VARINT_MAX,
+            set ? TRACE_RESERVE_SET : TRACE_RESERVE_ADD, time, 1);
+
+    if (NULL != p)
+        end_record(stripe, put_varint(p, value));
+}
+
+/* Fault map observer that passes each change on to the observer the map
+ * had before and records it. Repairs made by writes are left out, since
+ * replaying the writes makes them again */
+static void trace_observe(void *context, enum fault_map_change_kind kind,
+        const struct sector_extent *extents, size_t count)
+{
+    struct trace *trace = context;
+
+    if (NULL != trace->observer)
+        trace->observer(trace->observer_context, kind, extents, count);
+
+    if (FAULT_MAP_RESERVE_SET == kind || FAULT_MAP_RESERVE_ADD == kind)
+        record_reserve(trace, FAULT_MAP_RESERVE_SET == kind, count,
+                trace_clock() - trace->start);
+    else if (FAULT_MAP_REPAIR != kind)
+        record_extents(trace, FAULT_MAP_INJECT == kind ? TRACE_INJECT :
+                TRACE_CLEAR, extents, count, trace_clock() - trace->start);
+}
+
+/* Write out the queued buffers and hand them back as spares. The trace lock
+ * must be held, and is dropped while writing */
+static void write_queue(struct trace *trace)
+{
+    while (NULL != trace->queue)
+    {
+        struct trace_buffer *batch = trace->queue;
+        trace->queue = NULL;
+        trace->queue_tail = &trace->queue;
+        int failed = trace->failed;
+        pthread_mutex_unlock(&trace->lock);
+
+        struct trace_buffer *last = batch;
+        for (struct trace_buffer *buffer = batch; NULL != buffer;
+                buffer = buffer->next)
+        {
+            unsigned char length[VARINT_MAX];
+            size_t length_size = put_varint(length, buffer->used) - length;
+
+            if (!failed && (0 != write_all(trace->fd, length, length_size) ||
+                    0 != write_all(trace->fd, buffer->data, buffer->used)))
+                failed = 1;
+            last = buffer;
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        trace->failed = failed;
+        last->next = trace->spare;
+        trace->spare = batch;
+        pthread_cond_broadcast(&trace->freed);
+    }
+}
+
+/* Move the buffers of the stripes that hold records to the queue */
+static void collect_stripes(struct trace *trace)
+{
+    for (unsigned int i = 0; i < TRACE_STRIPES; i++)
+    {
+        struct trace_stripe *stripe = trace->stripes + i;
+
+        pthread_mutex_lock(&stripe->lock);
+        struct trace_buffer *buffer = stripe->buffer;
+        if (NULL != buffer && 0 != buffer->used)
+        {
+            stripe->buffer = NULL;
+            pthread_mutex_lock(&trace->lock);
+            queue_buffer(trace, buffer);
+            pthread_mutex_unlock(&trace->lock);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+/* Writer thread. Writes out buffers as they fill up, and every
+ * TRACE_FLUSH_INTERVAL_MS the ones that haven't, so a trace of a quiet disk
+ * is still up to date */
+static void *trace_main(void *data)
+{
+    struct trace *trace = data;
+    int running;
+
+    pthread_mutex_lock(&trace->lock);
+    do
+    {
+        struct timespec deadline;
+        int ret = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TRACE_FLUSH_INTERVAL_MS / 1000;
+        deadline.tv_nsec += TRACE_FLUSH_INTERVAL_MS % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (trace->running && NULL == trace->queue && ETIMEDOUT != ret)
+            ret = pthread_cond_timedwait(&trace->wake, &trace->lock,
+                    &deadline);
+        running = trace->running;
+
+        if (ETIMEDOUT == ret || !running)
+        {
+            pthread_mutex_unlock(&trace->lock);
+            collect_stripes(trace);
+            pthread_mutex_lock(&trace->lock);
+        }
+
+        write_queue(trace);
+    } while (running);
+    pthread_mutex_unlock(&trace->lock);
+
+    return NULL;
+}
+
+/* Free the buffers of a trace, whether spare, queued or in a stripe */
+static void free_buffers(struct trace *trace)
+{
+    struct trace_buffer *lists[] = {trace->spare, trace->queue};
+
+    for (unsigned int i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+        while (NULL != lists[i])
+        {
+            struct trace_buffer *buffer = lists[i];
+            lists[i] = buffer->next;
+            free(buffer);
+        }
+
+    for (unsigned int i = 0; i < TRACE_STRIPES; i++)
+        free(trace->stripes[i].buffer);
+}
+
+int trace_open(struct trace *trace, const char *path, struct fault_map *map,
+        uint64_t sector_size, uint64_t physical_sector_size,
+        int partial_reads)
+{
+    unsigned char header[sizeof(trace_magic) + 4 * VARINT_MAX];
+    struct extent_list list = {NULL, 0, 0};
+    struct timespec now;
+    unsigned int stripes = 0;
+    unsigned char *p;
+    int error;
+
+    memset(trace, 0, sizeof(struct trace));
+    trace->queue_tail = &trace->queue;
+    trace->map = map;
+
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (-1 == trace->fd)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    trace->start = trace_clock();
+
+    memcpy(header, trace_magic, sizeof(trace_magic));
+    p = put_varint(header + sizeof(trace_magic), sector_size);
+    p = put_varint(p, physical_sector_size);
+    p = put_varint(p, 0 != partial_reads);
+    p = put_varint(p, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+    if (0 != write_all(trace->fd, header, p - header))
+        goto fail_fd;
+
+    if (0 != pthread_mutex_init(&trace->lock, NULL))
+        goto fail_fd;
+    if (0 != pthread_cond_init(&trace->wake, NULL))
+        goto fail_lock;
+    if (0 != pthread_cond_init(&trace->freed, NULL))
+        goto fail_wake;
+    for (; stripes < TRACE_STRIPES; stripes++)
+        if (0 != pthread_mutex_init(&trace->stripes[stripes].lock, NULL))
+            goto fail_stripes;
+
+    /* Replays start from an empty fault map, so begin with its state. The
+     * writer thread has to be running to take a large state */
+    if (0 != fault_map_snapshot(map, &list))
+    {
+        free(list.extents);
+        errno = ENOMEM;
+        goto fail_stripes;
+    }
+
+    trace->running = 1;
+    error = pthread_create(&trace->thread, NULL, trace_main, trace);
+    if (0 != error)
+    {
+        free(list.extents);
+        errno = error;
+        goto fail_stripes;
+    }
+
+    record_extents(trace, TRACE_INJECT, list.extents, list.count, 0);
+    record_reserve(trace, 1, fault_map_reserve_sectors(map), 0);
+    free(list.extents);
+
+    trace->observer = map->observer;
+    trace->observer_context = map->observer_context;
+    fault_map_set_observer(map, trace_observe, trace);
+    return 0;
+
+fail_stripes:
+    error = errno;
+    free_buffers(trace);
+    while (stripes-- > 0)
+        pthread_mutex_destroy(&trace->stripes[stripes].lock);
+    pthread_cond_destroy(&trace->freed);
+    errno = error;
+fail_wake:
+    pthread_cond_destroy(&trace->wake);
+fail_lock:
+    pthread_mutex_destroy(&trace->lock);
+fail_fd:
+    error = errno;
+    close(trace->fd);
+    trace->fd = -1;
+    errno = error;
+    return -1;
+}
+
+void trace_close(struct trace *trace)
+{
+    if (-1 == trace->fd)
+        return;
+
+    fault_map_set_observer(trace->map, trace->observer,
+            trace->observer_context);
+
+    pthread_mutex_lock(&trace->lock);
+    trace->running = 0;
+    pthread_cond_signal(&trace->wake);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+
+    free_buffers(trace);
+    for (unsigned int i = 0; i < TRACE_STRIPES; i++)
+        pthread_mutex_destroy(&trace->stripes[i].lock);
+    pthread_cond_destroy(&trace->freed);
+    pthread_cond_destroy(&trace->wake);
+    pthread_mutex_destroy(&trace->lock);
+
+    if (0 != fsync(trace->fd))
+        trace->failed = 1;
+    close(trace->fd);
+    trace->fd = -1;
+}
+
+void trace_request(struct trace *trace, int write, off_t offset, size_t size,
+        int64_t result, uint64_t start)
+{
+    struct trace_stripe *stripe;
+    unsigned char *p;
+
+    if (-1 == trace->fd)
+        return;
+
+    p = begin_record(trace, &stripe, 3 * VARINT_MAX,
+            write ? TRACE_WRITE : TRACE_READ, start - trace->start, 0);
+    if (NULL == p)
+        return;
+
+    p = put_varint(p, offset);
+    p = put_varint(p, size);
+    end_record(stripe, put_signed(p, result));
+}
+
+void trace_repair(struct trace *trace, const struct sector_extent *extents,
+        size_t count)
+{
+    if (-1 != trace->fd && 0 != count)
+        record_extents(trace, TRACE_REPAIR, extents, count,
+                trace_clock() - trace->start);
+}
+
+/* Order records by time, and records at the same time as in the file */
+static int compare_records(const void *a, const void *b)
+{
+    const struct trace_record *left = a;
+    const struct trace_record *right = b;
+
+    if (left->time != right->time)
+        return left->time < right->time ? -1 : 1;
+    if (left->sequence != right->sequence)
+        return left->sequence < right->sequence ? -1 : 1;
+    return 0;
+}
+
+/* Append a record to a loaded trace, growing it geometrically */
+/* Returns the record, or NULL on allocation failure */
+static struct trace_record *append_record(struct trace_log *log,
+        size_t *capacity)
+{
+    if (log->count == *capacity)
+    {
+        size_t grown = 0 == *capacity ? 1024 : 2 * *capacity;
+        struct trace_record *records = realloc(log->records,
+                grown * sizeof(struct trace_record));
+        if (NULL == records)
+            return NULL;
+
+        log->records = records;
+        *capacity = grown;
+    }
+
+    struct trace_record *record = log->records + log->count;
+    record->sequence = log->count++;
+    return record;
+}
+
+/* Decode the records of one block into log */
+/* Returns 0 on success, -1 with errno set to ENOMEM on allocation failure
+ * and to EINVAL if the block is malformed */
+static int load_block(const unsigned char *p, const unsigned char *end,
+        struct trace_log *log, size_t *record_capacity,
+        struct extent_list *extents)
+{
+    int64_t time = 0;
+
+    while (p != end)
+    {
+        struct trace_record *record = append_record(log, record_capacity);
+        int64_t delta;
+
+        if (NULL == record)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        record->kind = *p++;
+        if (0 != get_signed(&p, end, &delta) || time + delta < 0)
+            goto invalid;
+        time += delta;
+        record->time = time;
+        record->offset = 0;
+        record->result = 0;
+
+        switch (record->kind)
+        {
+        case TRACE_READ:
+        case TRACE_WRITE:
+            if (0 != get_varint(&p, end, &record->offset) ||
+                    0 != get_varint(&p, end, &record->size) ||
+                    0 != get_signed(&p, end, &record->result))
+                goto invalid;
+            break;
+        case TRACE_INJECT:
+        case TRACE_CLEAR:
+        case TRACE_REPAIR:
+            if (0 != get_varint(&p, end, &record->size))
+                goto invalid;
+            record->offset = extents->count;
+            for (uint64_t i = 0; i < record->size; i++)
+            {
+                uint64_t first;
+                uint64_t length;
+
+                if (0 != get_varint(&p, end, &first) ||
+                        0 != get_varint(&p, end, &length) ||
+                        first > INT64_MAX || length > INT64_MAX - first)
+                    goto invalid;
+
+                if (0 != extent_list_append(extents, first, first + length))
+                {
+                    errno = ENOMEM;
+                    return -1;
+                }
+            }
+            break;
+        case TRACE_RESERVE_SET:
+        case TRACE_RESERVE_ADD:
+            if (0 != get_varint(&p, end, &record->size))
+                goto invalid;
+            break;
+        default:
+            goto invalid;
+        }
+    }
+
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+int trace_load(const char *path, struct trace_log *log)
+{
+    struct extent_list extents = {NULL, 0, 0};
+    size_t record_capacity = 0;
+    struct stat st;
+    int ret = -1;
+    int fd;
+
+    memset(log, 0, sizeof(struct trace_log));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+        return -1;
+    if (0 != fstat(fd, &st) || st.st_size < (off_t)sizeof(trace_magic))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const unsigned char *data = mmap(NULL, st.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data)
+        return -1;
+
+    const unsigned char *end = data + st.st_size;
+    const unsigned char *p = data + sizeof(trace_magic);
+    uint64_t partial_reads;
+
+    if (0 != memcmp(data, trace_magic, sizeof(trace_magic)) ||
+            0 != get_varint(&p, end, &log->sector_size) ||
+            0 != get_varint(&p, end, &log->physical_sector_size) ||
+            0 != get_varint(&p, end, &partial_reads) ||
+            0 != get_varint(&p, end, &log->start))
+    {
+        errno = EINVAL;
+        goto out;
+    }
+    log->partial_reads = 0 != partial_reads;
+
+    /* A crash can leave the last block cut off, which is where the trace
+     * ends */
+    while (p != end)
+    {
+        uint64_t length;
+
+        if (0 != get_varint(&p, end, &length) ||
+                length > (uint64_t)(end - p))
+            break;
+
+        if (0 != load_block(p, p + length, log, &record_capacity, &extents))
+            goto out;
+        p += length;
+    }
+
+    qsort(log->records, log->count, sizeof(struct trace_record),
+            compare_records);
+    log->extents = extents.extents;
+    log->extent_count = extents.count;
+    extents.extents = NULL;
+    ret = 0;
+
+out:
+    munmap((void *)data, st.st_size);
+    free(extents.extents);
+    if (0 != ret)
+    {
+        int error = errno;
+        trace_log_free(log);
+        errno = error;
+    }
+
+    return ret;
+}
+
+void trace_log_free(struct trace_log *log)
+{
+    free(log->records);
+    free(log->extents);
+    memset(log, 0, sizeof(struct trace_log));
+}
@@ -0,0 +1,177 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "fault_map.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Number of buffers records are written to. Threads pick a stripe each so
+ * they rarely wait on one another */
+#define TRACE_STRIPES 16
+
+/* Size in bytes of a buffer of records */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/* Most buffers a trace allocates. Records of requests that find none free
+ * are dropped rather than holding up the request, while changes to the map
+ * wait for one */
+#define TRACE_MAX_BUFFERS 64
+
+/* Kinds of trace record */
+enum trace_kind {
+    TRACE_READ = 1,         /* A read was checked */
+    TRACE_WRITE,            /* A write was checked */
+    TRACE_INJECT,           /* Extents became bad */
+    TRACE_CLEAR,            /* Extents were cleared without reserves */
+    TRACE_REPAIR,           /* Extents were repaired outside a request */
+    TRACE_RESERVE_SET,      /* Reserve sectors were set to a value */
+    TRACE_RESERVE_ADD       /* A value was added to the reserve sectors */
+};
+
+/* Buffer of encoded records, queued for the writer thread once full */
+struct trace_buffer {
+    struct trace_buffer *next;
+    size_t used;
+    uint64_t last_time;             /* Time of the last record, which the
+                                     * next one is stored relative to */
+    unsigned char data[TRACE_BUFFER_SIZE];
+};
+
+/* Buffer that the threads using one stripe fill */
+struct trace_stripe {
+    pthread_mutex_t lock;
+    struct trace_buffer *buffer;    /* May be NULL */
+} __attribute__((aligned(64)));
+
+/* Binary trace of the requests checked against a fault map and of every
+ * change made to it, which can be replayed against a fresh fault map.
+ *
+ * The trace file starts with a header giving the sector sizes and the time
+ * the trace started, followed by blocks of records, each block the length
+ * of its records as a varint and then the records. Every record is a kind
+ * byte, the time since the previous record in the block, as a zigzag varint
+ * of nanoseconds since the trace started, and the fields of its kind, all
+ * varints:
+ *
+ *   TRACE_READ, TRACE_WRITE    offset, size and result in bytes, the result
+ *                              zigzag encoded and -EIO for a failed request
+ *   TRACE_INJECT, TRACE_CLEAR,
+ *   TRACE_REPAIR               count, then count extents of physical sectors
+ *                              as first and last - first
+ *   TRACE_RESERVE_SET,
+ *   TRACE_RESERVE_ADD          value
+ *
+ * Records are encoded into per-stripe buffers and written out by a
+ * background thread, so blocks from different stripes overlap in time and
+ * the records have to be ordered by time to replay them. The trace starts
+ * with the state of the fault map when it was opened */
+struct trace {
+    int fd;                         /* File descriptor to the trace file, or
+                                     * -1 if there is none */
+    uint64_t start;                 /* CLOCK_MONOTONIC time the trace started
+                                     * in nanoseconds */
+    struct trace_stripe stripes[TRACE_STRIPES];
+
+    pthread_mutex_t lock;           /* Protects the rest */
+    pthread_cond_t wake;            /* Signalled when a buffer is queued */
+    pthread_cond_t freed;           /* Broadcast when buffers are spare */
+    struct trace_buffer *queue;     /* Full buffers, oldest first */
+    struct trace_buffer **queue_tail;
+    struct trace_buffer *spare;     /* Buffers that have been written out */
+    unsigned int buffers;           /* Buffers allocated */
+    uint64_t dropped;               /* Records lost to a lack of buffers,
+                                     * each one request or up to 1024
+                                     * extents */
+    int failed;                     /* Nonzero once a write failed */
+
+    pthread_t thread;
+    int running;
+
+    struct fault_map *map;
+    fault_map_observer observer;    /* Observer of the map before the trace
+                                     * was opened, told about every change */
+    void *observer_context;
+};
+
+/* Record of a loaded trace */
+struct trace_record {
+    uint64_t time;                  /* Nanoseconds since the trace started */
+    enum trace_kind kind;
+    uint64_t offset;                /* Offset of a request in bytes, or
+                                     * index of the first extent */
+    uint64_t size;                  /* Size of a request in bytes, number
+                                     * of extents, or the reserve value */
+    int64_t result;                 /* Result of a request */
+    uint64_t sequence;              /* Position of the record in the file,
+                                     * ordering records at the same time */
+};
+
+/* Records of a trace file, sorted by time */
+struct trace_log {
+    uint64_t sector_size;
+    uint64_t physical_sector_size;
+    int partial_reads;
+    uint64_t start;                 /* CLOCK_REALTIME time the trace started
+                                     * in nanoseconds */
+    struct trace_record *records;
+    size_t count;
+    struct sector_extent *extents;  /* Extents of the extent records */
+    size_t extent_count;
+};
+
+/* Return the current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t trace_clock(void);
+
+/* Start tracing the requests checked against map and its changes to a new
+ * trace file at path, beginning with the state map is in now. The sector
+ * sizes and partial_reads describe the disk for replaying. Must be called
+ * before map is shared between threads, and after any other observer of
+ * it has been set */
+/* Returns 0 on success and nonzero on error, with errno set */
+int trace_open(struct trace *trace, const char *path, struct fault_map *map,
+        uint64_t sector_size, uint64_t physical_sector_size,
+        int partial_reads);
+
+/* Write out the records still buffered, close the trace file and give map
+ * back its observer */
+void trace_close(struct trace *trace);
+
+/* Record a request of size bytes at offset that was checked at time start.
+ * result is the number of bytes the request may go on with, or negative if
+ * it failed */
+void trace_request(struct trace *trace, int write, off_t offset, size_t size,
+        int64_t result, uint64_t start);
+
+/* Record a repair of count extents of physical sectors that didn't come from
+ * a request, each of them sectors that were bad and got a reserve sector */
+void trace_repair(struct trace *trace, const struct sector_extent *extents,
+        size_t count);
+
+/* Load the trace file at path into log, sorting the records by time. A
+ * block cut off by a crash is dropped */
+/* Returns 0 on success and nonzero on error, with errno set */
+int trace_load(const char *path, struct trace_log *log);
+
+/* Free the records of a loaded trace */
+void trace_log_free(struct trace_log *log);
+
+#endif
@@ -0,0 +1,493 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+/* For O_DIRECT */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+int uring_open_direct(const char *path, int flags)
+{
+#ifdef O_DIRECT
+    return open(path, flags | O_DIRECT);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Submission and completion rings, mapped from the kernel */
+static int ring_fd = -1;
+static void *sq_ring = NULL;
+static size_t sq_ring_size;
+static void *cq_ring = NULL;
+static size_t cq_ring_size;
+static struct io_uring_sqe *sqes = NULL;
+static size_t sqes_size;
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static unsigned int sq_entries;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* Parts in flight are capped at the number of submission entries, which
+ * keeps both the submission ring and the completion ring, twice its size,
+ * from filling up */
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+static unsigned int in_flight = 0;      /* Parts queued and not completed */
+static unsigned int waiting = 0;        /* Threads waiting for room */
+static int submitting = 0;              /* Nonzero while a thread passes
+                                         * queued parts to the kernel */
+
+/* Registered buffers, and a stack of the free ones */
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *buffers = NULL;
+static size_t buffer_size;
+static unsigned int buffer_count = 0;
+static int *free_buffers = NULL;
+static unsigned int free_count = 0;
+
+static pthread_t completion_thread;
+static int running = 0;
+static int stopping = 0;                /* Set to stop the completion thread
+                                         * once nothing is in flight */
+
+static int ring_enter(unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+/* Unmap the rings and free the buffers */
+static void release_ring(void)
+{
+    if (NULL != sqes)
+        munmap(sqes, sqes_size);
+    if (NULL != cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (NULL != sq_ring)
+        munmap(sq_ring, sq_ring_size);
+    if (-1 != ring_fd)
+        close(ring_fd);
+    free(buffers);
+    free(free_buffers);
+
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+    ring_fd = -1;
+    buffers = NULL;
+    free_buffers = NULL;
+    buffer_count = free_count = 0;
+}
+
+/* Account for a completed part, and complete its operation once it was the
+ * last one */
+static void complete_part(struct uring_span *span, int result)
+{
+    struct uring_op *op = span->op;
+
+    /* Parts end at distinct places, so the lowest one decides */
+    if (result < 0 && span->start < op->transferred)
+    {
+        op->transferred = span->start;
+        op->error = -result;
+    }
+    else if (result >= 0 && (size_t)result < span->size &&
+            span->start + result < op->transferred)
+    {
+        op->transferred = span->start + result;
+        op->error = 0;
+    }
+
+    if (0 == --op->parts)
+    {
+        op->result = 0 == op->transferred && 0 != op->error ? -op->error :
+                (ssize_t)op->transferred;
+        op->complete(op);
+    }
+}
+
+/* Completion thread. Waits for completions and runs their callbacks, until
+ * asked to stop and nothing is in flight */
+static void *completion_main(void *data)
+{
+    for (;;)
+    {
+        unsigned int head = *cq_head;
+        unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned int completed = 0;
+
+        if (head == tail)
+        {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) &&
+                    0 == __atomic_load_n(&in_flight, __ATOMIC_ACQUIRE))
+                break;
+            ring_enter(0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = cqes + (head & *cq_mask);
+            struct uring_span *span =
+                    (struct uring_span *)(uintptr_t)cqe->user_data;
+            int result = cqe->res;
+
+            /* Hand the entry back before the callback, which may take a
+             * while */
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+            /* Entries without a part just wake the thread */
+            if (NULL == span)
+                continue;
+            complete_part(span, result);
+            completed++;
+        }
+
+        if (0 != completed)
+        {
+            pthread_mutex_lock(&submit_lock);
+            in_flight -= completed;
+            if (0 != waiting)
+                pthread_cond_broadcast(&room);
+            pthread_mutex_unlock(&submit_lock);
+        }
+    }
+
+    return NULL;
+}
+
+int uring_start(unsigned int depth, unsigned int count, size_t size)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (-1 == ring_fd)
+        return -1;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries *
+            sizeof(unsigned int);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries *
+            sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ring)
+    {
+        sq_ring = NULL;
+        goto fail;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+    {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ring)
+        {
+            cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == sqes)
+    {
+        sqes = NULL;
+        goto fail;
+    }
+
+    sq_head = (unsigned int *)((char *)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned int *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned int *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned int *)((char *)sq_ring + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    cq_head = (unsigned int *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned int *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned int *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+
+    if (0 != count)
+    {
+        struct iovec *iovecs = calloc(count, sizeof(struct iovec));
+        void *memory = NULL;
+        int ret;
+
+        free_buffers = calloc(count, sizeof(int));
+        if (NULL == iovecs || NULL == free_buffers ||
+                0 != posix_memalign(&memory, 4096, count * size))
+        {
+            free(iovecs);
+            errno = ENOMEM;
+            goto fail;
+        }
+        buffers = memory;
+        buffer_size = size;
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            iovecs[i].iov_base = buffers + i * size;
+            iovecs[i].iov_len = size;
+            free_buffers[i] = count - 1 - i;
+        }
+
+        ret = syscall(__NR_io_uring_register, ring_fd,
+                IORING_REGISTER_BUFFERS, iovecs, count);
+        free(iovecs);
+        if (0 != ret)
+            goto fail;
+        buffer_count = free_count = count;
+    }
+
+    running = 1;
+    if (0 != pthread_create(&completion_thread, NULL, completion_main, NULL))
+    {
+        running = 0;
+        errno = EAGAIN;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        release_ring();
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+int uring_running(void)
+{
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+void *uring_get_buffer(int *index)
+{
+    void *buffer = NULL;
+
+    pthread_mutex_lock(&buffer_lock);
+    if (0 != free_count)
+    {
+        *index = free_buffers[--free_count];
+        buffer = buffers + *index * buffer_size;
+    }
+    pthread_mutex_unlock(&buffer_lock);
+
+    return buffer;
+}
+
+void uring_put_buffer(int index)
+{
+    pthread_mutex_lock(&buffer_lock);
+    free_buffers[free_count++] = index;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+/* Fill in the next submission entry. Called with the submit lock held and
+ * room in the ring */
+static void queue_entry(uint8_t opcode, int fd, void *buffer, size_t size,
+        off_t offset, int buffer_index, struct uring_span *span)
+{
+    unsigned int tail = *sq_tail;
+    unsigned int index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = sqes + index;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->buf_index = -1 == buffer_index ? 0 : buffer_index;
+    sqe->user_data = (uintptr_t)span;
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Pass the queued entries to the kernel, along with any other thread queues
+ * meanwhile. Called with the submit lock held, which is dropped while in the
+ * kernel. If another thread is already at it, it picks up ours */
+static void flush_entries(void)
+{
+    if (submitting)
+        return;
+    submitting = 1;
+
+    for (;;)
+    {
+        unsigned int queued = *sq_tail -
+                __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        int ret;
+
+        if (0 == queued)
+            break;
+
+        pthread_mutex_unlock(&submit_lock);
+        ret = ring_enter(queued, 0, 0);
+        pthread_mutex_lock(&submit_lock);
+
+        /* Entries the kernel couldn't take stay queued, so only give up
+         * on errors that retrying won't fix */
+        if (ret < 0 && EINTR != errno && EAGAIN != errno && EBUSY != errno)
+            break;
+    }
+
+    submitting = 0;
+}
+
+int uring_submit(struct uring_op *op, int write,
+        const struct uring_part *parts, unsigned int count)
+{
+    if (!uring_running() || 0 == count || count > sq_entries ||
+            count > URING_MAX_PARTS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    op->parts = count;
+    op->error = 0;
+    op->size = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        op->spans[i].op = op;
+        op->spans[i].start = op->size;
+        op->spans[i].size = parts[i].size;
+        op->size += parts[i].size;
+    }
+    op->transferred = op->size;
+
+    pthread_mutex_lock(&submit_lock);
+
+    /* Wait for completions to make room rather than fail the request */
+    while (in_flight + count > sq_entries)
+    {
+        waiting++;
+        pthread_cond_wait(&room, &submit_lock);
+        waiting--;
+    }
+    in_flight += count;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const struct uring_part *part = parts + i;
+        int fixed = -1 != part->buffer_index;
+        uint8_t opcode = write ?
+                (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) :
+                (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+
+        queue_entry(opcode, part->fd, part->buffer, part->size, part->offset,
+                part->buffer_index, op->spans + i);
+    }
+
+    flush_entries();
+    pthread_mutex_unlock(&submit_lock);
+
+    return 0;
+}
+
+void uring_stop(void)
+{
+    if (!running)
+        return;
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+    /* Wake the completion thread with a no-op, it leaves once the parts in
+     * flight are done */
+    pthread_mutex_lock(&submit_lock);
+    queue_entry(IORING_OP_NOP, -1, NULL, 0, 0, -1, NULL);
+    flush_entries();
+    pthread_mutex_unlock(&submit_lock);
+
+    pthread_join(completion_thread, NULL);
+    release_ring();
+    stopping = 0;
+}
+
+#else
+
+int uring_start(unsigned int depth, unsigned int count, size_t size)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_stop(void)
+{
+}
+
+int uring_running(void)
+{
+    return 0;
+}
+
+void *uring_get_buffer(int *index)
+{
+    return NULL;
+}
+
+void uring_put_buffer(int index)
+{
+}
+
+int uring_submit(struct uring_op *op, int write,
+        const struct uring_part *parts, unsigned int count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+#endif
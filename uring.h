@@ -0,0 +1,103 @@
+/*
+# Copyright 2020 AT&T Intellectual Property.  All other rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+*/
+
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Most parts an operation can have */
+#define URING_MAX_PARTS 32
+
+struct uring_op;
+
+/* Where a part lies in its operation, which the completion of the part is
+ * matched to */
+struct uring_span {
+    struct uring_op *op;
+    size_t start;               /* Bytes of the operation before the part */
+    size_t size;
+};
+
+/* An asynchronous read or write, embedded in whatever the callback needs to
+ * find. It is carried out as one or more parts, each going to its own file,
+ * and complete() is called from the completion thread once all of them are
+ * done. As with a plain read, only the bytes up to the first part that fails
+ * or comes back short count as transferred, since parts complete in any
+ * order and what a later part transferred doesn't follow on */
+struct uring_op {
+    void (*complete)(struct uring_op *op);
+    ssize_t result;             /* Bytes transferred or a negative errno
+                                 * value, set before complete() is called */
+    size_t size;                /* Bytes asked for over all the parts */
+    unsigned int parts;         /* Parts not completed yet */
+    size_t transferred;         /* Bytes before the first part that failed
+                                 * or came back short so far */
+    int error;                  /* Error of the part that transferred ends
+                                 * in, as an errno value, or 0 */
+    struct uring_span spans[URING_MAX_PARTS];
+};
+
+/* One part of an operation */
+struct uring_part {
+    int fd;
+    void *buffer;
+    size_t size;
+    off_t offset;
+    int buffer_index;           /* Index of the registered buffer holding
+                                 * buffer, or -1 */
+};
+
+/* Set up an io_uring with room for depth submissions and start the thread
+ * that completes them. If buffer_count is nonzero that many buffers of
+ * buffer_size bytes, aligned for direct I/O, are registered with the ring */
+/* Returns 0 on success and nonzero on error, with errno set. ENOSYS means
+ * io_uring isn't supported */
+int uring_start(unsigned int depth, unsigned int buffer_count,
+        size_t buffer_size);
+
+/* Wait for the operations in flight and stop the completion thread */
+void uring_stop(void);
+
+/* Check whether the ring is running */
+int uring_running(void);
+
+/* Take one of the registered buffers */
+/* Returns the buffer and stores its index in *index, or returns NULL if they
+ * are all in use or there are none */
+void *uring_get_buffer(int *index);
+
+/* Give back a registered buffer taken with uring_get_buffer() */
+void uring_put_buffer(int index);
+
+/* Open a file for direct I/O, bypassing the page cache, with the access
+ * mode in flags */
+/* Returns the file descriptor, or -1 with errno set */
+int uring_open_direct(const char *path, int flags);
+
+/* Queue the parts of a read, or a write if write is nonzero. Submissions are
+ * batched: a thread that finds another one submitting leaves its parts for
+ * that thread to pass to the kernel along with its own */
+/* Returns 0 on success and nonzero if the ring is full or not running, in
+ * which case nothing was queued and the caller should carry out the
+ * operation itself */
+int uring_submit(struct uring_op *op, int write,
+        const struct uring_part *parts, unsigned int count);
+
+#endif